@@ -330,6 +330,43 @@ class Shell(object):
               % (property, o.__getattribute__(property), value))
         o.__setattr__(property, value)
 
+    def cmd_stats(self, args):
+        """
+        Dump the server's latency statistics (times in ms).
+        stats slow: show the most recent slow calls.
+        stats reset: clear the statistics.
+        stats threshold MS: log operations taking longer than MS.
+        """
+        import dbus
+        stats = dbus.Interface(wc._woodchuck_object,
+                               dbus_interface='org.woodchuck.stats')
+
+        def ms(us):
+            return "%.1f" % (us / 1000.,)
+
+        if not args:
+            print("%-9s %8s %9s %8s %8s %8s %8s  %s"
+                  % ("kind", "count", "total", "p50", "p95", "p99", "max",
+                     "name"))
+            for (kind, name, count, total, p50, p95, p99, max_) \
+                    in sorted(stats.Dump(),
+                              key=lambda s: (s[0], -s[3])):
+                print("%-9s %8d %9s %8s %8s %8s %8s  %s"
+                      % (kind, count, ms(total), ms(p50), ms(p95),
+                         ms(p99), ms(max_), name))
+        elif args[0] == 'slow':
+            for kind, name, when, duration, call_args in stats.SlowCalls():
+                print("%s %s %s: %s ms: %s"
+                      % (time.strftime("%Y-%m-%d %H:%M:%S",
+                                       time.localtime(when / 1000)),
+                         kind, name, ms(duration), call_args))
+        elif args[0] == 'reset':
+            stats.Reset()
+        elif args[0] == 'threshold' and len(args) == 2:
+            stats.SetSlowThreshold(dbus.UInt32(int(args[1])))
+        else:
+            print "Usage: stats [slow|reset|threshold MS]"
+
     def cmd_help(self, args):
         """
         Display an overview of the available commands.
@@ -0,0 +1,171 @@
+/* debug-benchmark.c - A benchmark for the debugging machinery.
+   Copyright (C) 2011 Neal H. Walfield <neal@walfield.org>
+
+   Woodchuck is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3, or (at
+   your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* This program logs a number of messages similar to those that the
+   process tracer logs, first formatting them immediately and then
+   deferring their formatting (see debug_deferred_formatting), and
+   prints the number of messages per second that the callers achieved
+   in each mode as a JSON object.  The messages are logged to a
+   temporary home directory.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <error.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "util.h"
+
+/* Return a monotonic time stamp in microseconds.  */
+static uint64_t
+us_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int messages = 200000;
+static int threads = 1;
+
+static void *
+logger (void *arg)
+{
+  int t = (intptr_t) arg;
+  const char *paths[] = { "/home/user/MyDocs/.images/IMG_0001.jpg",
+			  "/usr/lib/libgtk-x11-2.0.so.0",
+			  "/home/user/.mozilla/microb/cookies.txt" };
+
+  int i;
+  for (i = 0; i < messages / threads; i ++)
+    debug (3, "%d: %s (%d, \"%s\", 0x%x) -> %ld (%.1f ms)",
+	   1000 + t, "openat", -100, paths[i % 3], 0x80000,
+	   (long) i, (double) i / 1000);
+
+  return NULL;
+}
+
+/* Log MESSAGES messages using THREADS threads.  Returns the number of
+   messages per second.  */
+static double
+run (bool deferred)
+{
+  debug_deferred_formatting = deferred;
+
+  pthread_t tids[threads];
+  uint64_t start = us_now ();
+
+  int i;
+  for (i = 0; i < threads; i ++)
+    pthread_create (&tids[i], NULL, logger, (void *) (intptr_t) i);
+  for (i = 0; i < threads; i ++)
+    pthread_join (tids[i], NULL);
+
+  uint64_t duration = us_now () - start;
+  return (double) (messages / threads * threads) * 1000000
+    / MAX (duration, 1);
+}
+
+static int
+remove_file (const char *filename, const struct stat *st, int type,
+	     struct FTW *ftw)
+{
+  return remove (filename);
+}
+
+static void
+usage (const char *program, int status)
+{
+  fprintf (status ? stderr : stdout,
+	   "Usage: %s [OPTION]...\n"
+	   "Benchmark immediate and deferred formatting of debug messages.\n"
+	   "\n"
+	   "  --messages=N          Messages to log per mode "
+	   "(default: 200000)\n"
+	   "  --threads=T           Number of logging threads (default: 1)\n"
+	   "  --keep                Don't remove the temporary directory\n",
+	   program);
+  exit (status);
+}
+
+int
+main (int argc, char *argv[])
+{
+  bool keep = false;
+
+  int i;
+  for (i = 1; i < argc; i ++)
+    if (strncmp (argv[i], "--messages=", 11) == 0)
+      messages = MAX (1, atoi (&argv[i][11]));
+    else if (strncmp (argv[i], "--threads=", 10) == 0)
+      threads = MAX (1, atoi (&argv[i][10]));
+    else if (strcmp (argv[i], "--keep") == 0)
+      keep = true;
+    else if (strcmp (argv[i], "--help") == 0)
+      usage (argv[0], 0);
+    else
+      {
+	fprintf (stderr, "Unknown option: '%s'\n", argv[i]);
+	usage (argv[0], 1);
+      }
+
+  static char home[] = "/tmp/debug-benchmark-XXXXXX";
+  if (! mkdtemp (home))
+    error (1, errno, "Creating temporary directory");
+  setenv ("HOME", home, 1);
+
+  /* Remove the directory after the debugging machinery has converted
+     the remaining messages at exit (atexit handlers run in reverse
+     order of registration).  */
+  void cleanup (void)
+  {
+    nftw (home, remove_file, 10, FTW_DEPTH | FTW_PHYS);
+  }
+  if (! keep)
+    atexit (cleanup);
+
+  debug_level_set (NULL, 3);
+  const char *filename = debug_init_ ();
+
+  /* Warm up (and intern the strings).  */
+  run (true);
+  run (false);
+
+  double immediate = run (false);
+  double deferred = run (true);
+
+  printf ("{\n"
+	  "  \"messages\": %d,\n"
+	  "  \"threads\": %d,\n"
+	  "  \"immediate\": { \"messages_per_second\": %.0f },\n"
+	  "  \"deferred\": { \"messages_per_second\": %.0f },\n"
+	  "  \"speedup\": %.2f,\n"
+	  "  \"log\": \"%s\"\n"
+	  "}\n",
+	  messages, threads, immediate, deferred, deferred / immediate,
+	  filename ?: "");
+
+  return 0;
+}
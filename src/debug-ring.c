@@ -0,0 +1,1321 @@
+/* debug-ring.c - Binary debug log.
+   Copyright (C) 2011 Neal H. Walfield <neal@walfield.org>
+
+   Woodchuck is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3, or (at
+   your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <glib.h>
+
+#include "debug-ring.h"
+
+/* Note: this file must not use debug: it is also used by programs
+   that don't log to a database and it is called from the debugging
+   code.  Errors are printed to stderr.  */
+
+#define DEBUG_RING_MAGIC "WCDRING1"
+
+/* The file consists of a header page, the string table and the
+   ring.  */
+#define HEADER_SIZE 4096
+/* The size of the string table of new rings.  Existing rings keep
+   the size recorded in their header (see debug_ring_open).  */
+#define STRINGS_SIZE (256 * 1024)
+
+struct ring_header
+{
+  char magic[8];
+  /* The size of the ring.  A power of 2.  */
+  uint32_t size;
+  uint32_t strings_size;
+  /* Positions increase monotonically; the offset in the ring is the
+     position modulo the ring's size.  The next position to write
+     to.  */
+  uint64_t write_pos;
+  /* Messages before this position have been converted.  */
+  uint64_t converted_pos;
+  /* If the last conversion stopped because the message at this
+     position had not been committed.  */
+  uint64_t stalled_pos;
+  /* The number of bytes of the string table that have been
+     allocated.  */
+  uint32_t strings_used;
+};
+
+/* A message in the ring.  Messages are 8-byte aligned and never wrap
+   around the end of the ring: if there is not enough space, the
+   writer skips to the start (and fills the gap with a padding entry,
+   if it is large enough).  */
+struct ring_entry
+{
+  /* Written last: the entry is valid if TAG is tag_of (position).  */
+  uint32_t tag;
+  /* The size of the entry, including this header.  */
+  uint32_t len;
+  uint64_t timestamp;
+  uint64_t return_address;
+  /* String table ids (0 if unknown).  */
+  uint32_t file;
+  uint32_t function;
+  int32_t line;
+  int16_t tz;
+  uint8_t level;
+  uint8_t flags;
+  /* The nul-terminated message or, if FLAGS includes ENTRY_DEFERRED,
+     a struct deferred.  */
+  char msg[];
+};
+
+/* The message has not yet been formatted.  */
+#define ENTRY_DEFERRED 1
+
+#define LEVEL_PADDING 0xff
+/* The largest message that we store (longer messages are
+   truncated).  */
+#define MAX_MSG 4000
+/* The longest string that we intern.  */
+#define MAX_STRING 1000
+#define MAX_ENTRY ((sizeof (struct ring_entry) + MAX_MSG + 1 + 7) & ~7)
+
+struct debug_ring
+{
+  int fd;
+  char *map;
+  size_t map_size;
+  struct ring_header *header;
+  /* The string table.  Each string is stored as a uint16_t length
+     (including the terminating nul) followed by the string.  A
+     string's id is its offset plus one.  */
+  char *strings;
+  char *data;
+  uint64_t size;
+
+  /* LOCK protects STRINGS_BY_NAME.  */
+  pthread_mutex_t lock;
+  /* Maps strings (pointers into the string table) to ids.  */
+  GHashTable *strings_by_name;
+
+  /* Serializes conversions in this process (flock serializes them
+     across processes).  */
+  pthread_mutex_t convert_lock;
+};
+
+static inline uint64_t
+atomic_load64 (uint64_t *p)
+{
+  return __sync_fetch_and_add (p, 0);
+}
+
+static inline uint32_t
+tag_of (uint64_t pos)
+{
+  return (uint32_t) (pos >> 3) ^ 0x9e3779b9;
+}
+
+char *
+debug_ring_filename (const char *db_filename)
+{
+  const char *slash = strrchr (db_filename, '/');
+  const char *dot = strrchr (db_filename, '.');
+  int len = strlen (db_filename);
+  if (dot && (! slash || dot > slash))
+    len = dot - db_filename;
+
+  char *filename = NULL;
+  if (asprintf (&filename, "%.*s.ring", len, db_filename) < 0)
+    return NULL;
+  return filename;
+}
+
+/* Add the strings already in RING's string table to the hash.  */
+static void
+strings_load (struct debug_ring *ring)
+{
+  uint32_t used = MIN (ring->header->strings_used,
+		       ring->header->strings_size);
+  uint32_t offset = 0;
+  while (offset + sizeof (uint16_t) < used)
+    {
+      uint16_t len;
+      memcpy (&len, ring->strings + offset, sizeof (len));
+      if (len == 0 || offset + sizeof (len) + len > used)
+	/* Being written or corrupted.  */
+	break;
+
+      char *s = ring->strings + offset + sizeof (len);
+      if (s[len - 1] == 0)
+	g_hash_table_insert (ring->strings_by_name, s,
+			     GUINT_TO_POINTER (offset + 1));
+
+      offset += sizeof (len) + len;
+    }
+}
+
+struct debug_ring *
+debug_ring_open (const char *filename, bool create, int size)
+{
+  int fd = open (filename, create ? O_RDWR | O_CREAT : O_RDWR, 0600);
+  if (fd < 0)
+    {
+      if (create)
+	fprintf (stderr, "open (%s): %m\n", filename);
+      return NULL;
+    }
+
+  /* Serialize initialization.  */
+  flock (fd, LOCK_EX);
+
+  struct ring_header h;
+  struct stat st;
+  bool valid = (fstat (fd, &st) == 0
+		&& pread (fd, &h, sizeof (h), 0) == sizeof (h)
+		&& memcmp (h.magic, DEBUG_RING_MAGIC, sizeof (h.magic)) == 0
+		&& h.size > 0 && (h.size & (h.size - 1)) == 0
+		/* Older versions used a smaller string table.  Accept
+		   them so that their messages are not lost.  */
+		&& h.strings_size > 0 && h.strings_size % 8 == 0
+		&& st.st_size == (off_t) HEADER_SIZE + h.strings_size + h.size);
+  if (valid && create && h.strings_size != STRINGS_SIZE
+      && h.converted_pos == h.write_pos)
+    /* All of the old ring's messages have been converted.  Replace it
+       with one that has a string table of the current size.  */
+    valid = false;
+  if (! valid)
+    {
+      if (! create)
+	{
+	  flock (fd, LOCK_UN);
+	  close (fd);
+	  return NULL;
+	}
+
+      /* Round up to a power of 2.  */
+      h.size = 64 * 1024;
+      while (h.size < size)
+	h.size *= 2;
+      h.strings_size = STRINGS_SIZE;
+
+      if (ftruncate (fd, 0) < 0
+	  || ftruncate (fd, HEADER_SIZE + h.strings_size + h.size) < 0)
+	{
+	  fprintf (stderr, "ftruncate (%s): %m\n", filename);
+	  flock (fd, LOCK_UN);
+	  close (fd);
+	  return NULL;
+	}
+    }
+
+  size_t map_size = HEADER_SIZE + h.strings_size + h.size;
+  char *map = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+  if (map == MAP_FAILED)
+    {
+      fprintf (stderr, "mmap (%s): %m\n", filename);
+      flock (fd, LOCK_UN);
+      close (fd);
+      return NULL;
+    }
+
+  struct ring_header *header = (void *) map;
+  if (! valid)
+    {
+      header->size = h.size;
+      header->strings_size = h.strings_size;
+      __sync_synchronize ();
+      memcpy (header->magic, DEBUG_RING_MAGIC, sizeof (header->magic));
+    }
+
+  flock (fd, LOCK_UN);
+
+  struct debug_ring *ring = calloc (1, sizeof (*ring));
+  ring->fd = fd;
+  ring->map = map;
+  ring->map_size = map_size;
+  ring->header = header;
+  ring->strings = map + HEADER_SIZE;
+  ring->data = map + HEADER_SIZE + h.strings_size;
+  ring->size = header->size;
+  pthread_mutex_init (&ring->lock, NULL);
+  pthread_mutex_init (&ring->convert_lock, NULL);
+  ring->strings_by_name = g_hash_table_new (g_str_hash, g_str_equal);
+
+  strings_load (ring);
+
+  return ring;
+}
+
+void
+debug_ring_close (struct debug_ring *ring)
+{
+  g_hash_table_destroy (ring->strings_by_name);
+  pthread_mutex_destroy (&ring->lock);
+  pthread_mutex_destroy (&ring->convert_lock);
+  munmap (ring->map, ring->map_size);
+  close (ring->fd);
+  free (ring);
+}
+
+/* Return the id of the string S, adding it to the string table if
+   necessary.  Returns 0 if S is NULL or the string table is full.  */
+static uint32_t
+intern (struct debug_ring *ring, const char *s)
+{
+  if (! s)
+    return 0;
+
+  /* S is normally __FILE__ or __func__, i.e., a constant.  Cache the
+     id by address so that the common case doesn't require a lock.  */
+#define INTERN_CACHE 128
+  static __thread struct
+  {
+    struct debug_ring *ring;
+    const char *s;
+    uint32_t id;
+  } cache[INTERN_CACHE];
+  int i = ((uintptr_t) s >> 3) % INTERN_CACHE;
+  if (cache[i].s == s && cache[i].ring == ring)
+    return cache[i].id;
+
+  pthread_mutex_lock (&ring->lock);
+
+  uint32_t id = GPOINTER_TO_UINT (g_hash_table_lookup (ring->strings_by_name,
+							s));
+  if (! id)
+    {
+      uint16_t len = strnlen (s, MAX_STRING - 1) + 1;
+      uint32_t need = sizeof (len) + len;
+
+      /* Other processes may also allocate strings.  Never advance
+	 STRINGS_USED past the end of the table: if it wrapped, we
+	 would overwrite strings that are in use.  */
+      bool reserved = false;
+      uint32_t offset = ring->header->strings_used;
+      while (offset <= ring->header->strings_size
+	     && need <= ring->header->strings_size - offset)
+	{
+	  uint32_t old
+	    = __sync_val_compare_and_swap (&ring->header->strings_used,
+					   offset, offset + need);
+	  if (old == offset)
+	    {
+	      reserved = true;
+	      break;
+	    }
+	  offset = old;
+	}
+
+      if (reserved)
+	{
+	  char *p = ring->strings + offset;
+	  memcpy (p + sizeof (len), s, len - 1);
+	  p[sizeof (len) + len - 1] = 0;
+	  __sync_synchronize ();
+	  memcpy (p, &len, sizeof (len));
+
+	  id = offset + 1;
+	  g_hash_table_insert (ring->strings_by_name, p + sizeof (len),
+			       GUINT_TO_POINTER (id));
+	}
+    }
+
+  pthread_mutex_unlock (&ring->lock);
+
+  /* Also cache failures: once the table is full, it stays full (until
+     the ring is recreated).  */
+  cache[i].ring = ring;
+  cache[i].s = s;
+  cache[i].id = id;
+
+  return id;
+}
+
+/* Return the string with the id ID or NULL.  */
+static const char *
+string_of (struct debug_ring *ring, uint32_t id)
+{
+  if (id == 0 || id - 1 + sizeof (uint16_t) >= ring->header->strings_size)
+    return NULL;
+
+  char *p = ring->strings + id - 1;
+  uint16_t len;
+  memcpy (&len, p, sizeof (len));
+  if (len == 0 || id - 1 + sizeof (len) + len > ring->header->strings_size
+      || p[sizeof (len) + len - 1] != 0)
+    return NULL;
+
+  return p + sizeof (len);
+}
+
+/* Claim space for an entry with a payload of PAYLOAD_LEN bytes and
+   fill in its header.  The caller must fill in the payload and then
+   call entry_commit.  */
+static struct ring_entry *
+entry_reserve (struct debug_ring *ring, int payload_len, uint64_t *startp,
+	       uint64_t timestamp, int tz, int level,
+	       const char *file, const char *function,
+	       int line, void *return_address)
+{
+  uint32_t file_id = intern (ring, file);
+  uint32_t function_id = intern (ring, function);
+
+  uint32_t len = (sizeof (struct ring_entry) + payload_len + 7) & ~7;
+
+  struct ring_header *h = ring->header;
+  uint64_t mask = ring->size - 1;
+
+  /* Claim LEN bytes.  */
+  uint64_t pos;
+  uint64_t start;
+  uint64_t offset;
+  do
+    {
+      pos = atomic_load64 (&h->write_pos);
+      start = pos;
+      offset = pos & mask;
+      if (ring->size - offset < len)
+	/* Not enough space before the end of the ring.  Skip to the
+	   start.  */
+	start = pos + (ring->size - offset);
+    }
+  while (! __sync_bool_compare_and_swap (&h->write_pos, pos, start + len));
+
+  if (start != pos && ring->size - offset >= sizeof (struct ring_entry))
+    /* Mark the gap.  */
+    {
+      struct ring_entry *pad = (void *) (ring->data + offset);
+      pad->tag = 0;
+      __sync_synchronize ();
+      pad->len = ring->size - offset;
+      pad->level = LEVEL_PADDING;
+      __sync_synchronize ();
+      pad->tag = tag_of (pos);
+    }
+
+  struct ring_entry *e = (void *) (ring->data + (start & mask));
+  /* Invalidate any old entry before overwriting it.  */
+  e->tag = 0;
+  __sync_synchronize ();
+
+  e->len = len;
+  e->timestamp = timestamp;
+  e->return_address = (uintptr_t) return_address;
+  e->file = file_id;
+  e->function = function_id;
+  e->line = line;
+  e->tz = tz;
+  e->level = level;
+  e->flags = 0;
+
+  *startp = start;
+  return e;
+}
+
+static void
+entry_commit (struct ring_entry *e, uint64_t start)
+{
+  __sync_synchronize ();
+  e->tag = tag_of (start);
+}
+
+void
+debug_ring_write (struct debug_ring *ring,
+		  uint64_t timestamp, int tz, int level,
+		  const char *file, const char *function,
+		  int line, void *return_address,
+		  const char *msg, int msg_len)
+{
+  if (msg_len > MAX_MSG)
+    msg_len = MAX_MSG;
+
+  uint64_t start;
+  struct ring_entry *e = entry_reserve (ring, msg_len + 1, &start,
+					timestamp, tz, level,
+					file, function, line, return_address);
+  memcpy (e->msg, msg, msg_len);
+  e->msg[msg_len] = 0;
+  entry_commit (e, start);
+}
+
+/* Deferred messages.  The payload of a deferred entry is a struct
+   deferred followed by the arguments, which are encoded according to
+   the format string: integers as 64-bit integers, floating point
+   numbers as long doubles, pointers as 64-bit integers, strings as a
+   uint16_t length followed by the string (without a trailing nul; the
+   length STRING_NULL means a NULL pointer) and %m as the value of
+   errno.  */
+struct deferred
+{
+  uint32_t fmt;
+  uint32_t args_len;
+  char args[];
+};
+
+#define STRING_NULL 0xffff
+
+enum arg_class
+  {
+    ARG_NONE,
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_DOUBLE,
+    ARG_CHAR,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_ERRNO,
+  };
+
+struct conversion
+{
+  enum arg_class class;
+  /* The flags, e.g., "-0".  */
+  const char *flags;
+  int flags_len;
+  /* The literal width and precision, or -1.  */
+  int width;
+  int precision;
+  bool star_width;
+  bool star_precision;
+  /* The length modifier: 'H' for hh, 'h', 'l', 'q' for ll, 'j', 'z',
+     't', 'L' or 0.  */
+  char length;
+  char conv;
+};
+
+/* Parse the conversion specification starting at P, which points just
+   after a '%'.  Returns a pointer to the first character after the
+   specification or NULL if the specification is not supported (e.g.,
+   positional arguments, %n and wide characters).  */
+static const char *
+conversion_parse (const char *p, struct conversion *c)
+{
+  memset (c, 0, sizeof (*c));
+  c->width = -1;
+  c->precision = -1;
+
+  c->flags = p;
+  while (*p && strchr ("-+ #0'I", *p))
+    p ++;
+  c->flags_len = p - c->flags;
+
+  if (*p == '*')
+    {
+      c->star_width = true;
+      p ++;
+    }
+  else if (isdigit (*p))
+    {
+      c->width = strtol (p, (char **) &p, 10);
+      if (*p == '$')
+	return NULL;
+    }
+
+  if (*p == '.')
+    {
+      p ++;
+      if (*p == '*')
+	{
+	  c->star_precision = true;
+	  p ++;
+	}
+      else
+	c->precision = strtol (p, (char **) &p, 10);
+    }
+
+  switch (*p)
+    {
+    case 'h':
+      p ++;
+      c->length = 'h';
+      if (*p == 'h')
+	{
+	  p ++;
+	  c->length = 'H';
+	}
+      break;
+    case 'l':
+      p ++;
+      c->length = 'l';
+      if (*p == 'l')
+	{
+	  p ++;
+	  c->length = 'q';
+	}
+      break;
+    case 'q':
+    case 'j':
+    case 'z':
+    case 't':
+    case 'L':
+      c->length = *p ++;
+      break;
+    }
+
+  c->conv = *p ++;
+  switch (c->conv)
+    {
+    case 'd':
+    case 'i':
+      c->class = ARG_SIGNED;
+      break;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      c->class = ARG_UNSIGNED;
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      c->class = ARG_DOUBLE;
+      break;
+    case 'c':
+      c->class = ARG_CHAR;
+      break;
+    case 's':
+      c->class = ARG_STRING;
+      break;
+    case 'p':
+      c->class = ARG_POINTER;
+      break;
+    case 'm':
+      c->class = ARG_ERRNO;
+      break;
+    case '%':
+      c->class = ARG_NONE;
+      break;
+    default:
+      return NULL;
+    }
+
+  if ((c->class == ARG_CHAR || c->class == ARG_STRING) && c->length)
+    /* Wide characters.  */
+    return NULL;
+
+  return p;
+}
+
+/* Encode the arguments described by FMT into BUFFER, which is SIZE
+   bytes large.  Returns the number of bytes used or -1 if the
+   arguments can't be encoded.  */
+static int
+args_encode (const char *fmt, va_list *ap, int saved_errno,
+	     char *buffer, int size)
+{
+  char *p = buffer;
+  char *end = buffer + size;
+
+#define PUT(type, value)			\
+  ({						\
+    type __v = (value);				\
+    if (end - p < sizeof (__v))			\
+      return -1;				\
+    memcpy (p, &__v, sizeof (__v));		\
+    p += sizeof (__v);				\
+    __v;					\
+  })
+
+  while ((fmt = strchr (fmt, '%')))
+    {
+      struct conversion c;
+      fmt = conversion_parse (fmt + 1, &c);
+      if (! fmt)
+	return -1;
+
+      if (c.star_width)
+	PUT (int32_t, va_arg (*ap, int));
+      int precision = c.precision;
+      if (c.star_precision)
+	precision = PUT (int32_t, va_arg (*ap, int));
+
+      switch (c.class)
+	{
+	case ARG_NONE:
+	  break;
+
+	case ARG_SIGNED:
+	  {
+	    int64_t v;
+	    switch (c.length)
+	      {
+	      case 'H':
+		v = (signed char) va_arg (*ap, int);
+		break;
+	      case 'h':
+		v = (short) va_arg (*ap, int);
+		break;
+	      case 'l':
+		v = va_arg (*ap, long);
+		break;
+	      case 'q':
+		v = va_arg (*ap, long long);
+		break;
+	      case 'j':
+		v = va_arg (*ap, intmax_t);
+		break;
+	      case 'z':
+		v = va_arg (*ap, ssize_t);
+		break;
+	      case 't':
+		v = va_arg (*ap, ptrdiff_t);
+		break;
+	      default:
+		v = va_arg (*ap, int);
+		break;
+	      }
+	    PUT (int64_t, v);
+	    break;
+	  }
+
+	case ARG_UNSIGNED:
+	  {
+	    uint64_t v;
+	    switch (c.length)
+	      {
+	      case 'H':
+		v = (unsigned char) va_arg (*ap, unsigned int);
+		break;
+	      case 'h':
+		v = (unsigned short) va_arg (*ap, unsigned int);
+		break;
+	      case 'l':
+		v = va_arg (*ap, unsigned long);
+		break;
+	      case 'q':
+		v = va_arg (*ap, unsigned long long);
+		break;
+	      case 'j':
+		v = va_arg (*ap, uintmax_t);
+		break;
+	      case 'z':
+		v = va_arg (*ap, size_t);
+		break;
+	      case 't':
+		v = va_arg (*ap, ptrdiff_t);
+		break;
+	      default:
+		v = va_arg (*ap, unsigned int);
+		break;
+	      }
+	    PUT (uint64_t, v);
+	    break;
+	  }
+
+	case ARG_DOUBLE:
+	  if (c.length == 'L')
+	    PUT (long double, va_arg (*ap, long double));
+	  else
+	    PUT (long double, va_arg (*ap, double));
+	  break;
+
+	case ARG_CHAR:
+	  PUT (int32_t, va_arg (*ap, int));
+	  break;
+
+	case ARG_POINTER:
+	  PUT (uint64_t, (uintptr_t) va_arg (*ap, void *));
+	  break;
+
+	case ARG_ERRNO:
+	  PUT (int32_t, saved_errno);
+	  break;
+
+	case ARG_STRING:
+	  {
+	    const char *s = va_arg (*ap, const char *);
+	    if (! s)
+	      {
+		PUT (uint16_t, STRING_NULL);
+		break;
+	      }
+
+	    /* Truncate the string to the precision and to the space
+	       that is left.  */
+	    int max = end - p - sizeof (uint16_t);
+	    if (precision >= 0 && precision < max)
+	      max = precision;
+	    if (max > STRING_NULL - 1)
+	      max = STRING_NULL - 1;
+	    if (max < 0)
+	      return -1;
+	    int len = strnlen (s, max);
+
+	    PUT (uint16_t, len);
+	    memcpy (p, s, len);
+	    p += len;
+	    break;
+	  }
+	}
+    }
+#undef PUT
+
+  return p - buffer;
+}
+
+/* Format the message described by FMT and the encoded arguments ARGS
+   into BUFFER, which is SIZE bytes large.  */
+static void
+args_format (const char *fmt, const char *args, int args_len,
+	     char *buffer, int size)
+{
+  const char *a = args;
+  const char *a_end = args + args_len;
+  char *p = buffer;
+  char *end = buffer + size - 1;
+
+#define GET(type)				\
+  ({						\
+    type __v;					\
+    if (a_end - a < sizeof (__v))		\
+      goto bad;					\
+    memcpy (&__v, a, sizeof (__v));		\
+    a += sizeof (__v);				\
+    __v;					\
+  })
+
+  void append (const char *s, int len)
+  {
+    len = MIN (len, end - p);
+    memcpy (p, s, len);
+    p += len;
+  }
+
+  while (*fmt && p < end)
+    {
+      const char *percent = strchrnul (fmt, '%');
+      append (fmt, percent - fmt);
+      if (! *percent)
+	break;
+
+      struct conversion c;
+      fmt = conversion_parse (percent + 1, &c);
+      if (! fmt)
+	/* Can't happen: the arguments were encoded using the same
+	   format string.  */
+	goto bad;
+
+      int width = c.width;
+      if (c.star_width)
+	width = GET (int32_t);
+      int precision = c.precision;
+      if (c.star_precision)
+	precision = GET (int32_t);
+
+      /* Rebuild the specification using the encoded types.  */
+      char spec[64];
+      int spec_len = snprintf (spec, sizeof (spec), "%%%.*s",
+			       MIN (c.flags_len, 8), c.flags);
+      if (width >= 0)
+	spec_len += snprintf (spec + spec_len, sizeof (spec) - spec_len,
+			      "%d", width);
+      if (precision >= 0 && c.class != ARG_STRING)
+	spec_len += snprintf (spec + spec_len, sizeof (spec) - spec_len,
+			      ".%d", precision);
+
+      int n = 0;
+      switch (c.class)
+	{
+	case ARG_NONE:
+	  append ("%", 1);
+	  continue;
+
+	case ARG_SIGNED:
+	case ARG_UNSIGNED:
+	  {
+	    int64_t v = GET (int64_t);
+	    snprintf (spec + spec_len, sizeof (spec) - spec_len,
+		      "ll%c", c.conv);
+	    n = snprintf (p, end - p + 1, spec, (long long) v);
+	    break;
+	  }
+
+	case ARG_DOUBLE:
+	  {
+	    long double v = GET (long double);
+	    snprintf (spec + spec_len, sizeof (spec) - spec_len,
+		      "L%c", c.conv);
+	    n = snprintf (p, end - p + 1, spec, v);
+	    break;
+	  }
+
+	case ARG_CHAR:
+	  {
+	    int v = GET (int32_t);
+	    snprintf (spec + spec_len, sizeof (spec) - spec_len, "c");
+	    n = snprintf (p, end - p + 1, spec, v);
+	    break;
+	  }
+
+	case ARG_POINTER:
+	  {
+	    uint64_t v = GET (uint64_t);
+	    snprintf (spec + spec_len, sizeof (spec) - spec_len, "p");
+	    n = snprintf (p, end - p + 1, spec, (void *) (uintptr_t) v);
+	    break;
+	  }
+
+	case ARG_ERRNO:
+	  {
+	    int v = GET (int32_t);
+	    char error[128];
+	    const char *s = strerror_r (v, error, sizeof (error));
+	    snprintf (spec + spec_len, sizeof (spec) - spec_len, "s");
+	    n = snprintf (p, end - p + 1, spec, s);
+	    break;
+	  }
+
+	case ARG_STRING:
+	  {
+	    uint16_t len = GET (uint16_t);
+	    const char *s = "(null)";
+	    if (len == STRING_NULL)
+	      len = strlen (s);
+	    else
+	      {
+		if (a_end - a < len)
+		  goto bad;
+		s = a;
+		a += len;
+	      }
+	    /* The string is not nul-terminated: limit it to its
+	       length.  */
+	    snprintf (spec + spec_len, sizeof (spec) - spec_len,
+		      ".%ds", (int) len);
+	    n = snprintf (p, end - p + 1, spec, s);
+	    break;
+	  }
+	}
+
+      if (n > 0)
+	p += MIN (n, end - p);
+    }
+#undef GET
+
+  *p = 0;
+  return;
+
+ bad:
+  {
+    const char *msg = " <bad arguments>";
+    append (msg, strlen (msg));
+    *p = 0;
+  }
+}
+
+bool
+debug_ring_write_deferred (struct debug_ring *ring,
+			   uint64_t timestamp, int tz, int level,
+			   const char *file, const char *function,
+			   int line, void *return_address,
+			   const char *fmt, va_list ap)
+{
+  int saved_errno = errno;
+
+  /* Encode the arguments into a per-thread buffer: we need to know
+     the entry's size before we can reserve it.  */
+  static __thread char buffer[MAX_MSG - sizeof (struct deferred)];
+  va_list aq;
+  va_copy (aq, ap);
+  int args_len = args_encode (fmt, &aq, saved_errno,
+			      buffer, sizeof (buffer));
+  va_end (aq);
+  if (args_len < 0)
+    return false;
+
+  if (strnlen (fmt, MAX_STRING) == MAX_STRING)
+    return false;
+  uint32_t fmt_id = intern (ring, fmt);
+  if (! fmt_id)
+    /* The string table is full.  */
+    return false;
+
+  uint64_t start;
+  struct ring_entry *e
+    = entry_reserve (ring, sizeof (struct deferred) + args_len, &start,
+		     timestamp, tz, level,
+		     file, function, line, return_address);
+  e->flags = ENTRY_DEFERRED;
+
+  struct deferred *d = (void *) e->msg;
+  d->fmt = fmt_id;
+  d->args_len = args_len;
+  memcpy (d->args, buffer, args_len);
+
+  entry_commit (e, start);
+
+  return true;
+}
+
+uint64_t
+debug_ring_pending (struct debug_ring *ring)
+{
+  return atomic_load64 (&ring->header->write_pos)
+    - atomic_load64 (&ring->header->converted_pos);
+}
+
+uint64_t
+debug_ring_size (struct debug_ring *ring)
+{
+  return ring->size;
+}
+
+void
+debug_ring_table_create (sqlite3 *db)
+{
+  char *errmsg = NULL;
+  int err = sqlite3_exec (db,
+			  "create table if not exists log"
+			  " (OID INTEGER PRIMARY KEY AUTOINCREMENT,"
+			  /* TIMESTAMP is MS from the epoch in UTC.  TZ
+			     is the local timezone's number of minutes
+			     from UTC.  */
+			  "  timestamp, tz,"
+			  "  level, function, file, line, return_address,"
+			  "  message);"
+			  /* For time range queries (ssl-tail --since and
+			     --until).  */
+			  "create index if not exists log_timestamp"
+			  "  on log (timestamp);"
+			  /* Keep about 100k records.  At 100 bytes each,
+			     this is about 10MB.  */
+			  "delete from log"
+			  "  where ROWID < (select max(ROWID) from log)"
+			  "  - 100000;",
+			  NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      fprintf (stderr, "%d: %s\n", err, errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+
+  /* A full-text index over the messages (used by ssl-tail --grep).
+     The index refers to the log table's rows (it doesn't store a copy
+     of the text) and is maintained by triggers.  */
+  if (sqlite3_exec (db, "begin immediate transaction;",
+		    NULL, NULL, NULL) != SQLITE_OK)
+    return;
+
+  sqlite3_stmt *stmt = NULL;
+  bool exists = false;
+  if (sqlite3_prepare_v2 (db, "select 1 from sqlite_master"
+			  " where type = 'table' and name = 'log_fts';",
+			  -1, &stmt, NULL) == SQLITE_OK)
+    {
+      exists = sqlite3_step (stmt) == SQLITE_ROW;
+      sqlite3_finalize (stmt);
+    }
+  if (exists)
+    {
+      sqlite3_exec (db, "commit transaction;", NULL, NULL, NULL);
+      return;
+    }
+
+  err = sqlite3_exec
+    (db,
+     "create virtual table log_fts using fts5"
+     "  (message, function, file, content='log', content_rowid='OID');"
+     "create trigger if not exists log_fts_insert after insert on log"
+     "  begin"
+     "    insert into log_fts (rowid, message, function, file)"
+     "      values (new.OID, new.message, new.function, new.file);"
+     "  end;"
+     "create trigger if not exists log_fts_delete after delete on log"
+     "  begin"
+     "    insert into log_fts (log_fts, rowid, message, function, file)"
+     "      values ('delete', old.OID, old.message, old.function,"
+     "              old.file);"
+     "  end;"
+     /* Index the existing rows.  */
+     "insert into log_fts (log_fts) values ('rebuild');"
+     "commit transaction;",
+     NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      /* FTS5 is not available in older versions of sqlite.  Searches
+	 are then not possible, but logging works.  */
+      if (! strstr (errmsg, "no such module"))
+	fprintf (stderr, "Creating log_fts: %d: %s\n", err, errmsg);
+      sqlite3_free (errmsg);
+      sqlite3_exec (db, "rollback;", NULL, NULL, NULL);
+    }
+}
+
+int
+debug_ring_convert (struct debug_ring *ring, sqlite3 *db)
+{
+  pthread_mutex_lock (&ring->convert_lock);
+  flock (ring->fd, LOCK_EX);
+
+  struct ring_header *h = ring->header;
+  uint64_t size = ring->size;
+  uint64_t mask = size - 1;
+
+  /* The start of the first lap that has not been (partially)
+     overwritten.  */
+  uint64_t first_intact_lap (void)
+  {
+    uint64_t w = atomic_load64 (&h->write_pos);
+    return (w - size + mask) & ~mask;
+  }
+
+  uint64_t to = atomic_load64 (&h->write_pos);
+  uint64_t pos = h->converted_pos;
+  uint64_t lost = 0;
+  if (to - pos > size)
+    /* We were too slow.  */
+    {
+      uint64_t lap = first_intact_lap ();
+      lost += lap - pos;
+      pos = lap;
+    }
+
+  int count = -1;
+  sqlite3_stmt *stmt = NULL;
+  int err = sqlite3_prepare_v2
+    (db,
+     "insert into log"
+     "  (timestamp, tz, level, file, function, line, return_address,"
+     "   message)"
+     " values (?, ?, ?, ?, ?, ?, ?, ?);",
+     -1, &stmt, NULL);
+  if (err != SQLITE_OK)
+    {
+      fprintf (stderr, "Preparing log insert: %s\n", sqlite3_errmsg (db));
+      goto out;
+    }
+
+  char *errmsg = NULL;
+  sqlite3_exec (db, "begin transaction", NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      fprintf (stderr, "begin transaction: %s\n", errmsg);
+      sqlite3_free (errmsg);
+      goto out;
+    }
+
+  bool insert (uint64_t timestamp, int tz, int level,
+	       const char *file, const char *function, int line,
+	       uint64_t return_address, const char *msg)
+  {
+    char ra[2 + 2 * sizeof (uint64_t) + 1];
+    snprintf (ra, sizeof (ra), "0x%"PRIx64, return_address);
+
+    sqlite3_bind_int64 (stmt, 1, timestamp);
+    sqlite3_bind_int (stmt, 2, tz);
+    sqlite3_bind_int (stmt, 3, level);
+    sqlite3_bind_text (stmt, 4, file, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 5, function, -1, SQLITE_STATIC);
+    sqlite3_bind_int (stmt, 6, line);
+    sqlite3_bind_text (stmt, 7, ra, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 8, msg, -1, SQLITE_STATIC);
+
+    bool ok = sqlite3_step (stmt) == SQLITE_DONE;
+    if (! ok)
+      fprintf (stderr, "Inserting log entry: %s\n", sqlite3_errmsg (db));
+    sqlite3_reset (stmt);
+    sqlite3_clear_bindings (stmt);
+    return ok;
+  }
+
+  count = 0;
+  bool failed = false;
+  char buffer[MAX_ENTRY];
+  char message[MAX_MSG + 1];
+  while (pos < to)
+    {
+      uint64_t offset = pos & mask;
+      if (size - offset < sizeof (struct ring_entry))
+	/* Too small for an entry: the writer skipped it.  */
+	{
+	  pos += size - offset;
+	  continue;
+	}
+
+      struct ring_entry *e = (void *) (ring->data + offset);
+      uint32_t tag = e->tag;
+      __sync_synchronize ();
+      uint32_t len = e->len;
+
+      if (tag != tag_of (pos)
+	  || len < sizeof (*e) || len > size - offset || len % 8 != 0
+	  || (len > MAX_ENTRY && e->level != LEVEL_PADDING))
+	{
+	  if (atomic_load64 (&h->write_pos) - pos > size)
+	    /* It was overwritten.  */
+	    {
+	      uint64_t lap = first_intact_lap ();
+	      lost += lap - pos;
+	      pos = lap;
+	      continue;
+	    }
+
+	  if (pos == h->stalled_pos)
+	    /* The message was already incomplete the last time.  The
+	       writer probably died.  Skip to the next lap (we can't
+	       find the next message otherwise).  */
+	    {
+	      uint64_t lap = (pos | mask) + 1;
+	      if (lap <= to)
+		{
+		  lost += lap - pos;
+		  pos = lap;
+		  continue;
+		}
+	    }
+
+	  /* Not yet committed.  Try again next time.  */
+	  h->stalled_pos = pos;
+	  break;
+	}
+
+      if (e->level == LEVEL_PADDING)
+	{
+	  pos += len;
+	  continue;
+	}
+
+      memcpy (buffer, e, len);
+      __sync_synchronize ();
+      if (e->tag != tag || atomic_load64 (&h->write_pos) - pos > size)
+	/* It was overwritten while we were copying it.  */
+	continue;
+
+      pos += len;
+
+      struct ring_entry *c = (void *) buffer;
+      const char *msg = c->msg;
+      if ((c->flags & ENTRY_DEFERRED)
+	  && len - sizeof (*c) < sizeof (struct deferred))
+	msg = "<truncated message>";
+      else if ((c->flags & ENTRY_DEFERRED))
+	{
+	  struct deferred *d = (void *) c->msg;
+	  const char *fmt = string_of (ring, d->fmt);
+	  if (! fmt)
+	    msg = "<format string unavailable>";
+	  else
+	    {
+	      args_format (fmt, d->args,
+			   MIN (d->args_len, len - sizeof (*c) - sizeof (*d)),
+			   message, sizeof (message));
+	      msg = message;
+	    }
+	}
+      else
+	c->msg[len - sizeof (*c) - 1] = 0;
+      if (! insert (c->timestamp, c->tz, c->level,
+		    string_of (ring, c->file), string_of (ring, c->function),
+		    c->line, c->return_address, msg))
+	{
+	  failed = true;
+	  break;
+	}
+      count ++;
+    }
+
+  if (lost && ! failed)
+    {
+      char msg[100];
+      snprintf (msg, sizeof (msg),
+		"Lost about %"PRIu64" bytes of debug output: "
+		"the ring wrapped before it was converted.", lost);
+
+      struct timespec ts;
+      clock_gettime (CLOCK_REALTIME, &ts);
+      failed = ! insert ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+			 0, 0, __FILE__, __func__, __LINE__, 0, msg);
+    }
+
+  if (! failed)
+    {
+      sqlite3_exec (db, "end transaction", NULL, NULL, &errmsg);
+      if (errmsg)
+	{
+	  fprintf (stderr, "end transaction: %s\n", errmsg);
+	  sqlite3_free (errmsg);
+	  failed = true;
+	}
+    }
+
+  if (failed)
+    /* Try again next time.  */
+    {
+      sqlite3_exec (db, "rollback", NULL, NULL, NULL);
+      count = -1;
+    }
+  else
+    h->converted_pos = pos;
+
+ out:
+  if (stmt)
+    sqlite3_finalize (stmt);
+
+  flock (ring->fd, LOCK_UN);
+  pthread_mutex_unlock (&ring->convert_lock);
+
+  return count;
+}
+
+int
+debug_ring_convert_file (const char *db_filename)
+{
+  char *filename = debug_ring_filename (db_filename);
+  if (! filename)
+    return -1;
+
+  struct debug_ring *ring = NULL;
+  if (access (filename, F_OK) == 0)
+    ring = debug_ring_open (filename, false, 0);
+  free (filename);
+  if (! ring)
+    return 0;
+
+  int count = -1;
+  sqlite3 *db;
+  if (sqlite3_open (db_filename, &db) == SQLITE_OK)
+    {
+      sqlite3_busy_timeout (db, 60 * 60 * 1000);
+      debug_ring_table_create (db);
+      count = debug_ring_convert (ring, db);
+    }
+  else
+    fprintf (stderr, "sqlite3_open (%s): %s\n",
+	     db_filename, sqlite3_errmsg (db));
+  sqlite3_close (db);
+
+  debug_ring_close (ring);
+
+  return count;
+}
@@ -0,0 +1,99 @@
+/* debug-ring.h - Binary debug log.
+   Copyright (C) 2011 Neal H. Walfield <neal@walfield.org>
+
+   Woodchuck is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3, or (at
+   your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef DEBUG_RING_H
+#define DEBUG_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <sqlite3.h>
+
+/* A debug ring is a memory-mapped file holding the most recent debug
+   messages in a compact binary format: a fixed-size header (time
+   stamp, level, file and function ids, line and return address)
+   followed by the message.  File and function names are stored once,
+   in a string table, and referred to by id.  Writing a message is a
+   memcpy: there is no SQL and no system call.  Because the file is
+   mapped shared, messages survive the process dying.
+
+   The messages are converted to rows in the log table of the
+   corresponding sqlite database lazily: periodically, when the ring
+   fills up, and when the database is queried (ssl-tail) or uploaded.
+   If the ring wraps before the messages are converted, the oldest
+   messages are lost.
+
+   Any number of threads and processes may write to a ring
+   concurrently.  */
+struct debug_ring;
+
+/* Return the name of the ring belonging to the database DB_FILENAME
+   (the extension is replaced by .ring).  The returned string must be
+   freed using free.  */
+extern char *debug_ring_filename (const char *db_filename);
+
+/* Open the ring FILENAME.  If CREATE is true, create it with room for
+   about SIZE bytes of messages if it doesn't exist (or is not a valid
+   ring).  Returns NULL on failure.  */
+extern struct debug_ring *debug_ring_open (const char *filename,
+					   bool create, int size);
+
+extern void debug_ring_close (struct debug_ring *ring);
+
+/* Add a message to RING.  FILE and FUNCTION should be string
+   constants (they are interned by address).  */
+extern void debug_ring_write (struct debug_ring *ring,
+			      uint64_t timestamp, int tz, int level,
+			      const char *file, const char *function,
+			      int line, void *return_address,
+			      const char *msg, int msg_len);
+
+/* Like debug_ring_write, but don't format the message: record FMT and
+   the arguments in AP.  The message is formatted when it is
+   converted.  This is considerably cheaper for the caller.  FMT must
+   be a string constant: it is interned by address.  String arguments
+   are copied.  Returns false if the message can't be deferred (e.g.,
+   FMT uses positional arguments or %n), in which case the caller must
+   format the message itself (AP is not consumed).  */
+extern bool debug_ring_write_deferred (struct debug_ring *ring,
+				       uint64_t timestamp, int tz, int level,
+				       const char *file, const char *function,
+				       int line, void *return_address,
+				       const char *fmt, va_list ap);
+
+/* The number of bytes of messages that have not yet been
+   converted.  */
+extern uint64_t debug_ring_pending (struct debug_ring *ring);
+
+/* The number of bytes that the ring can hold.  */
+extern uint64_t debug_ring_size (struct debug_ring *ring);
+
+/* Create the log table, its index on the time stamp and, if sqlite
+   supports FTS5, the full-text index log_fts over the message,
+   function and file columns in DB, if they don't exist.  */
+extern void debug_ring_table_create (sqlite3 *db);
+
+/* Insert the messages in RING that have not yet been converted into
+   DB's log table.  Returns the number of messages converted or -1 on
+   error.  */
+extern int debug_ring_convert (struct debug_ring *ring, sqlite3 *db);
+
+/* Like debug_ring_convert, but open the ring belonging to the
+   database DB_FILENAME (if it exists) and the database.  */
+extern int debug_ring_convert_file (const char *db_filename);
+
+#endif
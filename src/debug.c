@@ -18,7 +18,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <error.h>
 #include <stdarg.h>
 
@@ -27,21 +30,135 @@
 #ifdef LOG_TO_DB
 #include "util.h"
 #include "files.h"
+#include "debug-ring.h"
 #include <sqlite3.h>
-#include <sqlq.h>
 #include <pthread.h>
+#include <semaphore.h>
 
-static __thread sqlite3 *debug_output_file;
 static char *debug_output_filename;
-static __thread struct sqlq *debug_output_buffer;
+/* All threads (and processes) log to the ring.  The converter thread
+   moves the messages to the database.  */
+static struct debug_ring *debug_output_ring;
+/* The converter's database connection.  */
+static sqlite3 *debug_output_db;
+/* Posted when the ring is half full.  */
+static sem_t debug_output_convert;
+
+/* The size of the ring.  */
+#define DEBUG_RING_SIZE (1024 * 1024)
+/* How often to convert the ring's messages (in seconds).  */
+#define DEBUG_CONVERT_PERIOD 60
 
 #endif
 
+bool debug_deferred_formatting = true;
+
 #if !defined(DEBUG_ELIDE)
+/* The default level.  */
 int output_debug_global = 3;
-__thread int output_debug = 3;
+/* A per-thread minimum level.  This is normally 0; it is raised to
+   temporarily enable more output in a thread.  */
+__thread int output_debug = 0;
+
+int debug_levels[DEBUG_SUBSYSTEMS] = { [0 ... DEBUG_SUBSYSTEMS - 1] = 3 };
+/* The levels that have been set explicitly or -1.  */
+static int debug_levels_set[DEBUG_SUBSYSTEMS]
+  = { [0 ... DEBUG_SUBSYSTEMS - 1] = -1 };
 #endif
 
+static const char *debug_subsystem_names[] =
+  {
+#define X(id, name) name,
+    DEBUG_SUBSYSTEMS_FOREACH (X)
+#undef X
+  };
+
+const char *
+debug_subsystem_name (int i)
+{
+  if (i < 0 || i >= DEBUG_SUBSYSTEMS)
+    return NULL;
+  return debug_subsystem_names[i];
+}
+
+/* Return the index of the subsystem named NAME, DEBUG_SUBSYSTEMS if
+   NAME is NULL or empty (i.e., the default) or -1 if NAME is
+   unknown.  */
+static int
+debug_subsystem_lookup (const char *name)
+{
+  if (! name || ! *name)
+    return DEBUG_SUBSYSTEMS;
+
+  int i;
+  for (i = 0; i < DEBUG_SUBSYSTEMS; i ++)
+    if (strcmp (debug_subsystem_names[i], name) == 0)
+      return i;
+  return -1;
+}
+
+bool
+debug_level_set (const char *subsystem, int level)
+{
+  int s = debug_subsystem_lookup (subsystem);
+  if (s < 0)
+    return false;
+
+#if !defined(DEBUG_ELIDE)
+  if (s == DEBUG_SUBSYSTEMS)
+    {
+      if (level < 0)
+	level = 0;
+      output_debug_global = level;
+    }
+  else
+    debug_levels_set[s] = level;
+
+  int i;
+  for (i = 0; i < DEBUG_SUBSYSTEMS; i ++)
+    debug_levels[i] = debug_levels_set[i] >= 0
+      ? debug_levels_set[i] : output_debug_global;
+#endif
+
+  return true;
+}
+
+int
+debug_level_get (const char *subsystem)
+{
+  int s = debug_subsystem_lookup (subsystem);
+  if (s < 0)
+    return -1;
+
+#if !defined(DEBUG_ELIDE)
+  if (s == DEBUG_SUBSYSTEMS)
+    return output_debug_global;
+  return debug_levels[s];
+#else
+  return 0;
+#endif
+}
+
+void
+debug_level_signal (int signo, int value)
+{
+  const char *subsystem = NULL;
+  if (value > 0 && value <= DEBUG_SUBSYSTEMS)
+    subsystem = debug_subsystem_names[value - 1];
+
+  int level = debug_level_get (subsystem);
+  if (signo == SIGUSR1)
+    level = level < 5 ? level + 1 : 5;
+  else if (signo == SIGUSR2)
+    level = level > 0 ? level - 1 : 0;
+  else
+    return;
+
+  debug_level_set (subsystem, level);
+  debug (0, "Got %s.  Set the %s debug level to %d.",
+	 strsignal (signo), subsystem ?: "default", level);
+}
+
 #define DEBUG_STDERR(function, line, return_address, msg)	\
   ({								\
     time_t __t = time (NULL);					\
@@ -56,24 +173,25 @@ __thread int output_debug = 3;
   })
 
 #ifdef LOG_TO_DB
-static void
-sqlq_error_handler (const char *file, const char *func, int line,
-		    const char *sql, const char *error_message)
+static void *
+debug_output_converter (void *arg)
 {
-  char *msg = NULL;
-  asprintf (&msg, "%s:%s:%d: Executing sql '%s': %s\n",
-	    file, func, line, sql, error_message);
+  sqlite3 *db = arg;
 
-  static __thread bool in;
-  if (! in)
-    /* Try to use debug, but don't end up in an infinite loop.  */
+  for (;;)
     {
-      in = true;
-      debug (0, msg);
-      in = false;
+      struct timespec ts;
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_sec += DEBUG_CONVERT_PERIOD;
+      sem_timedwait (&debug_output_convert, &ts);
+      /* Coalesce wake ups.  */
+      while (sem_trywait (&debug_output_convert) == 0)
+	;
+
+      debug_ring_convert (debug_output_ring, db);
     }
 
-  DEBUG_STDERR (__func__, __LINE__, __builtin_return_address (0), msg);
+  return NULL;
 }
 #endif
 
@@ -82,19 +200,19 @@ debug_ (const char *file, const char *function, int line,
 	void *return_address, int level,
 	bool async, const char *fmt, ...)
 {
+  /* Initializing might change errno, which %m refers to.  */
+  int saved_errno = errno;
   debug_init_ ();
+  errno = saved_errno;
 
   va_list ap;
   va_start (ap, fmt);
 
-  char *msg = NULL;
-  vasprintf (&msg, fmt, ap);
-
 #ifdef LOG_TO_DB
   uint64_t n = now ();
   static uint64_t last_tz_check;
   static int tz;
-  if (last_tz_check - n > 24 * 60 * 60 * 1000)
+  if (n - last_tz_check > 24 * 60 * 60 * 1000)
     {
       time_t t = n / 1000;
       struct tm local;
@@ -106,38 +224,44 @@ debug_ (const char *file, const char *function, int line,
 	local.tm_hour += 24;
       tz = (local.tm_hour * 60 + local.tm_min)
 	- (utc.tm_hour * 60 + utc.tm_min);
+      last_tz_check = n;
     }
 
-  char *sql = sqlite3_mprintf
-    ("insert into log "
-     "  (timestamp, tz, level, file, function, line, return_address, message)"
-     " values (%"PRId64", %d, %d, %Q, %Q, %d, '0x%"PRIxPTR"', %Q);",
-     n, tz, level, file, function, line, return_address, msg);
-
-  /* Only initialize the buffer once we see an async message.  */
-  if (! debug_output_buffer && async)
-    debug_output_buffer = sqlq_new (debug_output_file, 8 * 4096, 30,
-				    &sqlq_error_handler);
-
-  /* If we have a debug buffer, we use it unconditionally to ensure
-     messages are ordered chronologically.  If we don't have a debug
-     buffer, then we haven't seen an async message yet (or we failed
-     to allocate the buffer).  */
-  if (debug_output_buffer)
-    sqlq_append (debug_output_buffer, async ? false : true, sql);
-  else
+  void written (void)
+  {
+    if (debug_ring_pending (debug_output_ring)
+	> debug_ring_size (debug_output_ring) / 2)
+      sem_post (&debug_output_convert);
+  }
+
+  /* Writing to the ring is cheap and, as the ring is a shared
+     mapping, the message survives the process crashing.  The ASYNC
+     flag is therefore irrelevant.  */
+  if (debug_output_ring && debug_deferred_formatting)
     {
-      char *errmsg = NULL;
-      sqlite3_exec (debug_output_file, sql, NULL, NULL, &errmsg);
-      if (errmsg)
+      if (debug_ring_write_deferred (debug_output_ring,
+				     n, tz, level, file, function,
+				     line, return_address, fmt, ap))
 	{
-	  fprintf (stderr, "%s\n", errmsg);
-	  sqlite3_free (errmsg);
-	  errmsg = NULL;
+	  written ();
+	  va_end (ap);
+	  return;
 	}
     }
+#endif
+
+  char *msg = NULL;
+  vasprintf (&msg, fmt, ap);
 
-  sqlite3_free (sql);
+#ifdef LOG_TO_DB
+  if (! debug_output_ring)
+    DEBUG_STDERR (function, line, return_address, msg);
+  else
+    {
+      debug_ring_write (debug_output_ring, n, tz, level, file, function,
+			line, return_address, msg, strlen (msg));
+      written ();
+    }
 #else
   DEBUG_STDERR(function, line, return_address, msg);
 #endif
@@ -150,9 +274,24 @@ const char *
 debug_init_ (void)
 {
 #ifdef LOG_TO_DB
-  if (debug_output_file)
+  if (debug_output_ring)
     return debug_output_filename;
 
+  /* Creating the ring may log a message.  */
+  static __thread bool initializing;
+  if (initializing)
+    return NULL;
+
+  /* Threads may race to initialize the ring.  */
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock (&lock);
+  if (debug_output_ring)
+    {
+      pthread_mutex_unlock (&lock);
+      return debug_output_filename;
+    }
+  initializing = true;
+
   if (! debug_output_filename)
     debug_output_filename = files_logfile (DEBUG_OUTPUT_FILENAME);
 
@@ -162,61 +301,42 @@ debug_init_ (void)
     error (1, 0, "sqlite3_open (%s): %s",
 	   debug_output_filename, sqlite3_errmsg (db));
 
-  debug_output_file = db;
-
   /* Sleep up to an hour if the database is busy...  */
   sqlite3_busy_timeout (db, 60 * 60 * 1000);
 
-  char *errmsg = NULL;
-  err = sqlite3_exec (db,
-		      "create table if not exists log"
-		      " (OID INTEGER PRIMARY KEY AUTOINCREMENT,"
-		      /* TIMESTAMP is MS from the epoch in UTC.  TZ is
-			 the local timezone's number of minutes from
-			 UTC.  */
-		      "  timestamp, tz,"
-		      "  level, function, file, line, return_address,"
-		      "  message);"
-		      /* Keep about 100k records.  At 100 bytes each,
-			 this is about 10MB.  */
-		      "delete from log"
-		      "  where ROWID < (select max(ROWID) from log) - 100000;",
-		      NULL, NULL, &errmsg);
-  if (errmsg)
-    {
-      fprintf (stderr, "%d: %s", err, errmsg);
-      sqlite3_free (errmsg);
-      errmsg = NULL;
-    }
-
-  /* Flush and destroy any buffer when the thread exists and close the
-     database connection.  */
-  void destructor (void *value)
+  debug_ring_table_create (db);
+
+  char *ring_filename = debug_ring_filename (debug_output_filename);
+  struct debug_ring *ring = debug_ring_open (ring_filename, true,
+					     DEBUG_RING_SIZE);
+  if (! ring)
+    error (1, 0, "Failed to open %s.", ring_filename);
+  free (ring_filename);
+
+  /* Convert any messages left over from the last run.  */
+  debug_ring_convert (ring, db);
+
+  sem_init (&debug_output_convert, 0, 0);
+  pthread_t tid;
+  debug_output_db = db;
+  if (pthread_create (&tid, NULL, debug_output_converter, db) != 0)
+    error (1, 0, "Failed to start the debug output thread.");
+  pthread_detach (tid);
+
+  /* Convert the remaining messages when the process exits.  This is
+     not required for correctness (the next process to open the ring
+     will convert them) but makes them visible sooner.  */
+  void convert_at_exit (void)
   {
-    if (debug_output_buffer)
-      {
-	sqlq_flush (debug_output_buffer);
-	sqlq_free (debug_output_buffer);
-	debug_output_buffer = NULL;
-      }
-
-    if (debug_output_file)
-      {
-	sqlite3_close (debug_output_file);
-	debug_output_file = NULL;
-      }
+    debug_ring_convert (debug_output_ring, debug_output_db);
   }
+  atexit (convert_at_exit);
 
-  static pthread_key_t key;
-
-  void set_destructor (void)
-  {
-    pthread_key_create (&key, destructor);
-  }
-  static pthread_once_t set_destructor_once = PTHREAD_ONCE_INIT;
-  pthread_once (&set_destructor_once, set_destructor);
+  __sync_synchronize ();
+  debug_output_ring = ring;
 
-  pthread_setspecific (key, debug_output_file);
+  initializing = false;
+  pthread_mutex_unlock (&lock);
 
   return debug_output_filename;
 #else
@@ -33,6 +33,34 @@
 #define DEBUG_BOLD_END "\033[00m"
 #define DEBUG_BOLD(text) DEBUG_BOLD_BEGIN text DEBUG_BOLD_END
 
+/* The subsystems whose debugging output can be controlled
+   independently.  A file is assigned to a subsystem by defining
+   DEBUG_SUBSYSTEM to the subsystem's identifier (e.g., PTRACE) before
+   including debug.h.  Files that don't are part of MAIN.  */
+#define DEBUG_SUBSYSTEMS_FOREACH(X)		\
+  X (MAIN, "main")				\
+  X (PTRACE, "ptrace")				\
+  X (SERVICE, "service")			\
+  X (NETWORK, "network")			\
+  X (MONITORS, "monitors")			\
+  X (UPLOADER, "uploader")			\
+  X (DBUS, "dbus")				\
+  X (SQLQ, "sqlq")
+
+enum debug_subsystem
+  {
+#define X(id, name) DEBUG_SUBSYSTEM_##id,
+    DEBUG_SUBSYSTEMS_FOREACH (X)
+#undef X
+    DEBUG_SUBSYSTEMS
+  };
+
+#ifndef DEBUG_SUBSYSTEM
+# define DEBUG_SUBSYSTEM MAIN
+#endif
+#define DEBUG_SUBSYSTEM_INDEX_(id) DEBUG_SUBSYSTEM_##id
+#define DEBUG_SUBSYSTEM_INDEX(id) DEBUG_SUBSYSTEM_INDEX_ (id)
+
 #if defined(DEBUG_ELIDE)
 # if DEBUG_ELIDE + 0 == 0
 #  define do_debug(level) if (0)
@@ -54,7 +82,10 @@
 # ifndef DEBUG_COND
 extern int output_debug_global;
 extern __thread int output_debug;
-#  define OUTPUT_DEBUG MAX (output_debug, output_debug_global)
+/* The effective level of each subsystem (see debug_level_set).  */
+extern int debug_levels[];
+#  define OUTPUT_DEBUG \
+  MAX (output_debug, debug_levels[DEBUG_SUBSYSTEM_INDEX (DEBUG_SUBSYSTEM)])
 #  ifdef DEBUG_ELIDE
 /* We elide some code at compile time.  */
 #   define DEBUG_COND(level)				\
@@ -106,6 +137,45 @@ extern void debug_(const char *file, const char *function, int line,
 	     ? false : true,						\
 	     fmt, ##__VA_ARGS__)
 
+/* Set the debug level of the subsystem named SUBSYSTEM to LEVEL.  If
+   SUBSYSTEM is NULL or the empty string, set the default level, which
+   applies to all subsystems whose level has not been set explicitly.
+   If LEVEL is negative, SUBSYSTEM reverts to the default level.
+   Returns false if SUBSYSTEM is unknown.  */
+extern bool debug_level_set (const char *subsystem, int level);
+
+/* Return the effective debug level of SUBSYSTEM (or the default
+   level, if SUBSYSTEM is NULL or empty) or -1 if SUBSYSTEM is
+   unknown.  */
+extern int debug_level_get (const char *subsystem);
+
+/* Return the name of the subsystem with index I or NULL if I is out
+   of range.  */
+extern const char *debug_subsystem_name (int i);
+
+/* Adjust the debug levels in response to the signal SIGNO: SIGUSR1
+   raises the level by one and SIGUSR2 lowers it by one.  If VALUE
+   (the value passed to sigqueue) is between 1 and DEBUG_SUBSYSTEMS,
+   only the level of the subsystem with index VALUE - 1 is changed (in
+   the order of DEBUG_SUBSYSTEMS_FOREACH); otherwise, the default
+   level is changed.  For instance, to increase the verbosity of the
+   process tracer, run 'kill -USR1 -q 2 PID'.
+
+   Each process has its own levels.  Both smart-storage-logger and
+   murmeltier handle SIGUSR1 and SIGUSR2.  murmeltier also exports
+   org.woodchuck.stats.SetDebugLevel.  The ptrace, service and
+   uploader subsystems only run in smart-storage-logger, and the
+   dbus subsystem only in murmeltier.  The other subsystems run in
+   both.  */
+extern void debug_level_signal (int signo, int value);
+
+/* If true (the default), messages logged to a database are not
+   formatted when they are logged: the format string and the arguments
+   are recorded and the message is formatted when it is moved to the
+   database.  String arguments are copied, but the objects that
+   pointers refer to are not.  */
+extern bool debug_deferred_formatting;
+
 /* Returns the absolute filename of the file used for debugging
    output, or NULL if not sending output to a file.  */
 extern const char *debug_init_ ();
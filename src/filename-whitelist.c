@@ -0,0 +1,254 @@
+/* filename-whitelist.c - The files whose accesses are reported.
+   Copyright 2011 Neal H. Walfield <neal@walfield.org>
+
+   This file is part of Woodchuck.
+
+   Woodchuck is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "config.h"
+
+#define DEBUG_SUBSYSTEM SERVICE
+
+#include "debug.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "filename-whitelist.h"
+#include "util.h"
+
+/* A node in the trie.  The children of a node are linked using
+   NEXT_SIBLING.  Node 0 is the root and corresponds to the empty
+   string.  */
+struct node
+{
+  /* The character that leads to this node.  */
+  char c;
+  /* Whether a directory ends at this node.  */
+  bool terminal;
+  /* Indexes of the first child and the next sibling, or -1.  */
+  int first_child;
+  int next_sibling;
+};
+
+struct wc_filename_whitelist
+{
+  int count;
+  struct node nodes[];
+};
+
+/* The current whitelist.  */
+static struct wc_filename_whitelist *current;
+
+/* Whitelists that have been replaced (struct
+   wc_filename_whitelist_retired *s).  Another thread may still be
+   matching against one, so we only free them once they are a minute
+   old.  */
+struct wc_filename_whitelist_retired
+{
+  struct wc_filename_whitelist *whitelist;
+  uint64_t retired;
+};
+static GSList *retired;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Compile SPEC.  Returns NULL if SPEC is invalid.  */
+static struct wc_filename_whitelist *
+compile (const char *spec)
+{
+  /* Each character in SPEC results in at most one node.  */
+  struct wc_filename_whitelist *w
+    = g_malloc (sizeof (*w) + (strlen (spec) + 1) * sizeof (struct node));
+  w->count = 1;
+  w->nodes[0].c = 0;
+  w->nodes[0].terminal = false;
+  w->nodes[0].first_child = w->nodes[0].next_sibling = -1;
+
+  const char *p = spec;
+  while (*p)
+    {
+      const char *end = strchrnul (p, ':');
+      if (end == p)
+	/* Empty component.  */
+	{
+	  p = *end ? end + 1 : end;
+	  continue;
+	}
+
+      if (*p != '/')
+	{
+	  debug (0, "Whitelist: %.*s is not an absolute path.",
+		 (int) (end - p), p);
+	  g_free (w);
+	  return NULL;
+	}
+
+      /* Strip any trailing slashes.  "/" becomes the empty string,
+	 which matches everything.  */
+      const char *e = end;
+      while (e > p && e[-1] == '/')
+	e --;
+
+      int node = 0;
+      for (; p < e; p ++)
+	{
+	  int child;
+	  for (child = w->nodes[node].first_child;
+	       child != -1 && w->nodes[child].c != *p;
+	       child = w->nodes[child].next_sibling)
+	    ;
+	  if (child == -1)
+	    {
+	      child = w->count ++;
+	      w->nodes[child].c = *p;
+	      w->nodes[child].terminal = false;
+	      w->nodes[child].first_child = -1;
+	      w->nodes[child].next_sibling = w->nodes[node].first_child;
+	      w->nodes[node].first_child = child;
+	    }
+	  node = child;
+	}
+      w->nodes[node].terminal = true;
+
+      p = *end ? end + 1 : end;
+    }
+
+  return w;
+}
+
+static struct wc_filename_whitelist *
+whitelist (void)
+{
+  struct wc_filename_whitelist *w = __sync_fetch_and_add (&current, 0);
+  if (! w)
+    {
+      w = compile (WC_FILENAME_WHITELIST_DEFAULT);
+      if (! __sync_bool_compare_and_swap (&current, NULL, w))
+	/* Someone beat us.  */
+	{
+	  g_free (w);
+	  w = __sync_fetch_and_add (&current, 0);
+	}
+    }
+  return w;
+}
+
+bool
+wc_filename_whitelist_set (const char *spec)
+{
+  struct wc_filename_whitelist *w = compile (spec);
+  if (! w)
+    return false;
+
+  debug (1, "Whitelist: %s (%d nodes)", spec, w->count);
+
+  struct wc_filename_whitelist *old;
+  do
+    old = __sync_fetch_and_add (&current, 0);
+  while (! __sync_bool_compare_and_swap (&current, old, w));
+
+  uint64_t n = now ();
+
+  pthread_mutex_lock (&retired_lock);
+  GSList *l;
+  GSList *next;
+  for (l = retired; l; l = next)
+    {
+      next = l->next;
+      struct wc_filename_whitelist_retired *r = l->data;
+      if (n - r->retired > 60 * 1000)
+	{
+	  g_free (r->whitelist);
+	  g_free (r);
+	  retired = g_slist_delete_link (retired, l);
+	}
+    }
+
+  if (old)
+    {
+      struct wc_filename_whitelist_retired *r = g_malloc (sizeof (*r));
+      r->whitelist = old;
+      r->retired = n;
+      retired = g_slist_prepend (retired, r);
+    }
+  pthread_mutex_unlock (&retired_lock);
+
+  return true;
+}
+
+void
+wc_filename_whitelist_match_init (struct wc_filename_whitelist_match *match)
+{
+  match->whitelist = whitelist ();
+  match->node = 0;
+  match->result = WC_FILENAME_WHITELIST_MAYBE;
+}
+
+int
+wc_filename_whitelist_match_feed (struct wc_filename_whitelist_match *match,
+				  const char *bytes, int len)
+{
+  const struct node *nodes = match->whitelist->nodes;
+
+  int i;
+  for (i = 0;
+       i < len && match->result == WC_FILENAME_WHITELIST_MAYBE;
+       i ++)
+    {
+      char c = bytes[i];
+      const struct node *node = &nodes[match->node];
+
+      if (node->terminal && (c == '/' || c == 0))
+	/* The filename is a whitelisted directory or is below one.  */
+	{
+	  match->result = WC_FILENAME_WHITELIST_YES;
+	  break;
+	}
+
+      int child = -1;
+      if (c)
+	for (child = node->first_child;
+	     child != -1 && nodes[child].c != c;
+	     child = nodes[child].next_sibling)
+	  ;
+
+      if (child == -1)
+	match->result = WC_FILENAME_WHITELIST_NO;
+      else
+	match->node = child;
+    }
+
+  return match->result;
+}
+
+bool
+wc_filename_whitelisted (const char *filename)
+{
+  if (! filename || filename[0] != '/')
+    return false;
+
+  struct wc_filename_whitelist_match match;
+  wc_filename_whitelist_match_init (&match);
+  bool ret = (wc_filename_whitelist_match_feed (&match, filename,
+						strlen (filename) + 1)
+	      == WC_FILENAME_WHITELIST_YES);
+
+  debug (5, "File %s is %s.", filename, ret ? "whitelisted" : "blacklisted");
+  return ret;
+}
@@ -0,0 +1,81 @@
+/* filename-whitelist.h - The files whose accesses are reported.
+   Copyright 2011 Neal H. Walfield <neal@walfield.org>
+
+   This file is part of Woodchuck.
+
+   Woodchuck is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef WOODCHUCK_FILENAME_WHITELIST_H
+#define WOODCHUCK_FILENAME_WHITELIST_H
+
+#include <stdbool.h>
+
+/* The whitelist is a set of directories.  A file is whitelisted if
+   it is one of the directories or is below one of them.  The
+   directories are compiled into a trie, which makes it possible to
+   check a filename incrementally, e.g., while it is being copied out
+   of another process's memory: most filenames can be rejected after
+   the first few bytes.
+
+   The whitelist may be changed at any time.  The functions in this
+   file may be called from any thread.  */
+
+/* The default whitelist.  */
+#define WC_FILENAME_WHITELIST_DEFAULT "/home:/media:/mnt"
+
+/* Replace the whitelist with the directories in SPEC, a
+   colon-separated list of absolute paths (e.g., "/home:/media").
+   Returns false (and leaves the whitelist unchanged) if SPEC
+   contains a relative path.  */
+extern bool wc_filename_whitelist_set (const char *spec);
+
+/* Returns whether FILENAME, an absolute and canonical path, is
+   whitelisted.  */
+extern bool wc_filename_whitelisted (const char *filename);
+
+/* Incremental matching.  */
+enum
+  {
+    /* The filename is not whitelisted.  */
+    WC_FILENAME_WHITELIST_NO,
+    /* More of the filename is required.  */
+    WC_FILENAME_WHITELIST_MAYBE,
+    /* The filename is whitelisted.  */
+    WC_FILENAME_WHITELIST_YES,
+  };
+
+struct wc_filename_whitelist_match
+{
+  /* The whitelist as of the start of the match.  */
+  const struct wc_filename_whitelist *whitelist;
+  /* The current node.  */
+  int node;
+  /* The result, if decided.  */
+  int result;
+};
+
+/* Start matching a filename.  */
+extern void wc_filename_whitelist_match_init
+  (struct wc_filename_whitelist_match *match);
+
+/* Feed the next LEN bytes of the filename to MATCH.  A NUL byte ends
+   the filename.  Returns one of WC_FILENAME_WHITELIST_NO,
+   WC_FILENAME_WHITELIST_MAYBE or WC_FILENAME_WHITELIST_YES.  Once
+   the result is not WC_FILENAME_WHITELIST_MAYBE, it does not
+   change.  */
+extern int wc_filename_whitelist_match_feed
+  (struct wc_filename_whitelist_match *match, const char *bytes, int len);
+
+#endif
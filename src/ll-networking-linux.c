@@ -18,6 +18,8 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "config.h"
+
+#define DEBUG_SUBSYSTEM NETWORK
 #include "ll-networking-linux.h"
 
 #include <stdbool.h>
@@ -0,0 +1,710 @@
+/* murmeltier-benchmark.c - An end-to-end benchmark for murmeltier.
+   Copyright (C) 2011 Neal H. Walfield <neal@walfield.org>
+
+   Woodchuck is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3, or (at
+   your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* This program starts a private dbus-daemon and a murmeltier instance
+   that uses a temporary home directory.  It then registers a number
+   of managers, streams and objects using gwoodchuck, reports status
+   updates and reads properties at a fixed rate and forces a number of
+   scheduler passes.  Optionally, it also runs a number of stub clients
+   (see woodchuck-stub.c), which answer upcalls.  The results are
+   printed to stdout as a JSON object.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "woodchuck/gwoodchuck.h"
+#include "util.h"
+
+/* Return a monotonic time stamp in microseconds.  */
+static uint64_t
+us_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* The latencies of a type of operation.  */
+struct op
+{
+  const char *name;
+  /* Array of uint64_t, in microseconds.  */
+  GArray *samples;
+  int failures;
+  /* When the first operation started and the last one finished, in
+     microseconds.  */
+  uint64_t first_start;
+  uint64_t last_end;
+};
+
+enum
+  {
+    OP_MANAGER_REGISTER,
+    OP_STREAM_REGISTER,
+    OP_OBJECT_REGISTER,
+    OP_STREAM_UPDATED,
+    OP_OBJECT_TRANSFERRED,
+    OP_OBJECT_USED,
+    OP_PROPERTY_GET,
+    OP_SCHEDULE,
+    OP_COUNT
+  };
+
+static struct op ops[OP_COUNT] =
+  {
+    [OP_MANAGER_REGISTER] = { "manager_register" },
+    [OP_STREAM_REGISTER] = { "stream_register" },
+    [OP_OBJECT_REGISTER] = { "object_register" },
+    [OP_STREAM_UPDATED] = { "stream_updated" },
+    [OP_OBJECT_TRANSFERRED] = { "object_transferred" },
+    [OP_OBJECT_USED] = { "object_used" },
+    [OP_PROPERTY_GET] = { "property_get" },
+    [OP_SCHEDULE] = { "schedule" },
+  };
+
+static void
+op_record (int op, uint64_t start, gboolean ok, GError **error)
+{
+  uint64_t end = us_now ();
+  uint64_t duration = end - start;
+
+  if (! ops[op].samples)
+    {
+      ops[op].samples = g_array_new (FALSE, FALSE, sizeof (uint64_t));
+      ops[op].first_start = start;
+    }
+  g_array_append_val (ops[op].samples, duration);
+  ops[op].last_end = end;
+
+  if (! ok)
+    {
+      ops[op].failures ++;
+      if (error && *error)
+	{
+	  if (ops[op].failures == 1)
+	    fprintf (stderr, "%s: %s\n", ops[op].name, (*error)->message);
+	  g_error_free (*error);
+	  *error = NULL;
+	}
+    }
+}
+
+static int
+uint64_cmp (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Return the sum of the sizes of the files whose names start with
+   PREFIX (the database and its journal).  */
+static uint64_t
+db_size (const char *prefix)
+{
+  uint64_t size = 0;
+  const char *suffixes[] = { "", "-wal", "-shm", "-journal" };
+  int i;
+  for (i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i ++)
+    {
+      char *filename = g_strdup_printf ("%s%s", prefix, suffixes[i]);
+      struct stat st;
+      if (stat (filename, &st) == 0)
+	size += st.st_size;
+      g_free (filename);
+    }
+
+  return size;
+}
+
+/* Return the value of the field FIELD (in kB) in /proc/PID/status or
+   -1 on error.  */
+static int64_t
+proc_status_kb (pid_t pid, const char *field)
+{
+  char filename[64];
+  snprintf (filename, sizeof (filename), "/proc/%d/status", (int) pid);
+  FILE *f = fopen (filename, "r");
+  if (! f)
+    return -1;
+
+  int64_t value = -1;
+  int len = strlen (field);
+  char line[256];
+  while (fgets (line, sizeof (line), f))
+    if (strncmp (line, field, len) == 0 && line[len] == ':')
+      {
+	value = atoll (&line[len + 1]);
+	break;
+      }
+
+  fclose (f);
+  return value;
+}
+
+/* Call INTERFACE.METHOD on PATH (of the org.woodchuck service).  The
+   arguments are passed as for dbus_message_append_args.  Returns the
+   reply, or NULL on error.  */
+static DBusMessage *
+call (DBusConnection *connection, const char *path,
+      const char *interface, const char *method, GError **error,
+      int first_arg_type, ...)
+{
+  DBusMessage *message
+    = dbus_message_new_method_call ("org.woodchuck", path,
+				    interface, method);
+
+  va_list ap;
+  va_start (ap, first_arg_type);
+  dbus_message_append_args_valist (message, first_arg_type, ap);
+  va_end (ap);
+
+  DBusError dbus_error;
+  dbus_error_init (&dbus_error);
+  DBusMessage *reply = dbus_connection_send_with_reply_and_block
+    (connection, message, -1, &dbus_error);
+  dbus_message_unref (message);
+
+  if (! reply)
+    {
+      g_set_error (error, g_quark_from_static_string ("benchmark"), 0,
+		   "%s.%s on %s: %s", interface, method, path,
+		   dbus_error.message);
+      dbus_error_free (&dbus_error);
+    }
+
+  return reply;
+}
+
+/* Return the first string of each struct in the array returned by
+   INTERFACE.METHOD on PATH as object paths below PATH_PREFIX.  */
+static GPtrArray *
+list_paths (DBusConnection *connection, const char *path,
+	    const char *interface, const char *method,
+	    const char *path_prefix, int first_arg_type, ...)
+{
+  GPtrArray *paths = g_ptr_array_new ();
+
+  DBusMessage *message
+    = dbus_message_new_method_call ("org.woodchuck", path,
+				    interface, method);
+  va_list ap;
+  va_start (ap, first_arg_type);
+  dbus_message_append_args_valist (message, first_arg_type, ap);
+  va_end (ap);
+
+  DBusMessage *reply = dbus_connection_send_with_reply_and_block
+    (connection, message, -1, NULL);
+  dbus_message_unref (message);
+  if (! reply)
+    return paths;
+
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+  if (dbus_message_iter_init (reply, &iter)
+      && dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_ARRAY)
+    {
+      dbus_message_iter_recurse (&iter, &array_iter);
+      while (dbus_message_iter_get_arg_type (&array_iter)
+	     == DBUS_TYPE_STRUCT)
+	{
+	  DBusMessageIter struct_iter;
+	  dbus_message_iter_recurse (&array_iter, &struct_iter);
+
+	  const char *uuid = NULL;
+	  dbus_message_iter_get_basic (&struct_iter, &uuid);
+	  g_ptr_array_add (paths,
+			   g_strdup_printf ("%s/%s", path_prefix, uuid));
+
+	  dbus_message_iter_next (&array_iter);
+	}
+    }
+
+  dbus_message_unref (reply);
+  return paths;
+}
+
+/* Return the number of completed scheduler passes according to
+   org.woodchuck.stats.Dump, or -1 on error.  */
+static int64_t
+scheduler_passes (DBusConnection *connection)
+{
+  DBusMessage *reply = call (connection, "/org/woodchuck",
+			     "org.woodchuck.stats", "Dump", NULL,
+			     DBUS_TYPE_INVALID);
+  if (! reply)
+    return -1;
+
+  int64_t count = 0;
+
+  DBusMessageIter iter;
+  DBusMessageIter array_iter;
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+  while (dbus_message_iter_get_arg_type (&array_iter) == DBUS_TYPE_STRUCT)
+    {
+      DBusMessageIter struct_iter;
+      dbus_message_iter_recurse (&array_iter, &struct_iter);
+
+      const char *kind = NULL;
+      dbus_message_iter_get_basic (&struct_iter, &kind);
+      if (strcmp (kind, "scheduler") == 0)
+	{
+	  dbus_message_iter_next (&struct_iter);
+	  dbus_message_iter_next (&struct_iter);
+	  dbus_uint64_t c = 0;
+	  dbus_message_iter_get_basic (&struct_iter, &c);
+	  count += c;
+	}
+
+      dbus_message_iter_next (&array_iter);
+    }
+
+  dbus_message_unref (reply);
+  return count;
+}
+
+static int
+remove_file (const char *filename, const struct stat *st, int type,
+	     struct FTW *ftw)
+{
+  return remove (filename);
+}
+
+static void
+usage (const char *program, int status)
+{
+  fprintf (status ? stderr : stdout,
+	   "Usage: %s [OPTION]...\n"
+	   "Benchmark murmeltier on a private session bus.\n"
+	   "\n"
+	   "  --murmeltier=PROGRAM  The murmeltier binary (default: ./murmeltier)\n"
+	   "  --managers=N          Number of managers (default: 4)\n"
+	   "  --streams=M           Streams per manager (default: 8)\n"
+	   "  --objects=K           Objects per stream (default: 32)\n"
+	   "  --rate=R              Status reports and property reads\n"
+	   "                        per second (default: 200)\n"
+	   "  --duration=S          Seconds to drive the load (default: 10)\n"
+	   "  --schedule=P          Scheduler passes to force (default: 3)\n"
+	   "  --stubs=C             Run C stub clients (default: 0)\n"
+	   "  --stub=PROGRAM        The stub client binary "
+	   "(default: ./woodchuck-stub)\n"
+	   "  --stub-arg=ARG        Pass ARG to the stub clients\n"
+	   "  --keep                Don't remove the temporary directory\n",
+	   program);
+  exit (status);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *murmeltier = "./murmeltier";
+  int managers = 4;
+  int streams = 8;
+  int objects = 32;
+  int rate = 200;
+  int duration = 10;
+  int schedule_passes = 3;
+  bool keep = false;
+  int stubs = 0;
+  const char *stub = "./woodchuck-stub";
+  GPtrArray *stub_args = g_ptr_array_new ();
+
+  int i;
+  for (i = 1; i < argc; i ++)
+    if (strncmp (argv[i], "--murmeltier=", 13) == 0)
+      murmeltier = &argv[i][13];
+    else if (strncmp (argv[i], "--managers=", 11) == 0)
+      managers = atoi (&argv[i][11]);
+    else if (strncmp (argv[i], "--streams=", 10) == 0)
+      streams = atoi (&argv[i][10]);
+    else if (strncmp (argv[i], "--objects=", 10) == 0)
+      objects = atoi (&argv[i][10]);
+    else if (strncmp (argv[i], "--rate=", 7) == 0)
+      rate = MAX (1, atoi (&argv[i][7]));
+    else if (strncmp (argv[i], "--duration=", 11) == 0)
+      duration = atoi (&argv[i][11]);
+    else if (strncmp (argv[i], "--schedule=", 11) == 0)
+      schedule_passes = atoi (&argv[i][11]);
+    else if (strncmp (argv[i], "--stubs=", 8) == 0)
+      stubs = atoi (&argv[i][8]);
+    else if (strncmp (argv[i], "--stub=", 7) == 0)
+      stub = &argv[i][7];
+    else if (strncmp (argv[i], "--stub-arg=", 11) == 0)
+      g_ptr_array_add (stub_args, &argv[i][11]);
+    else if (strcmp (argv[i], "--keep") == 0)
+      keep = true;
+    else if (strcmp (argv[i], "--help") == 0)
+      usage (argv[0], 0);
+    else
+      {
+	fprintf (stderr, "Unknown option: '%s'\n", argv[i]);
+	usage (argv[0], 1);
+      }
+
+  g_type_init ();
+
+  /* Set up the environment: a temporary home directory (murmeltier
+     stores its state in ~/.murmeltier) and a private session bus.  */
+  char *home = g_strdup ("/tmp/murmeltier-benchmark-XXXXXX");
+  if (! g_mkdtemp (home))
+    error (1, errno, "Creating temporary directory");
+  setenv ("HOME", home, 1);
+
+  GError *gerror = NULL;
+  char *dbus_daemon_argv[] = { "dbus-daemon", "--session", "--nofork",
+			       "--print-address", NULL };
+  GPid dbus_daemon_pid;
+  int dbus_daemon_stdout;
+  if (! g_spawn_async_with_pipes (NULL, dbus_daemon_argv, NULL,
+				  G_SPAWN_SEARCH_PATH
+				  | G_SPAWN_DO_NOT_REAP_CHILD,
+				  NULL, NULL, &dbus_daemon_pid,
+				  NULL, &dbus_daemon_stdout, NULL, &gerror))
+    error (1, 0, "Starting dbus-daemon: %s", gerror->message);
+
+  char address[1024];
+  FILE *f = fdopen (dbus_daemon_stdout, "r");
+  if (! fgets (address, sizeof (address), f))
+    error (1, 0, "Reading dbus-daemon's address failed.");
+  address[strcspn (address, "\n")] = 0;
+  setenv ("DBUS_SESSION_BUS_ADDRESS", address, 1);
+
+  char *murmeltier_argv[] = { (char *) murmeltier, NULL };
+  GPid murmeltier_pid;
+  if (! g_spawn_async (NULL, murmeltier_argv, NULL,
+		       G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+		       &murmeltier_pid, &gerror))
+    error (1, 0, "Starting %s: %s", murmeltier, gerror->message);
+
+  DBusError dbus_error;
+  dbus_error_init (&dbus_error);
+  DBusConnection *connection = dbus_bus_get (DBUS_BUS_SESSION, &dbus_error);
+  if (! connection)
+    error (1, 0, "Connecting to %s: %s", address, dbus_error.message);
+
+  /* Wait (up to 30 seconds) for murmeltier to claim its name.  */
+  uint64_t startup = us_now ();
+  while (! dbus_bus_name_has_owner (connection, "org.woodchuck", NULL))
+    {
+      if (us_now () - startup > 30 * 1000000ULL
+	  || waitpid (murmeltier_pid, NULL, WNOHANG) == murmeltier_pid)
+	error (1, 0, "%s did not start.", murmeltier);
+      g_usleep (10 * 1000);
+    }
+  startup = us_now () - startup;
+
+  /* Start the stub clients.  They run concurrently with the load and
+     force scheduler passes themselves (if so configured using
+     --stub-arg).  Their reports are written to a file in HOME: a
+     pipe would only be read once they exit, and a stub whose report
+     exceeds the pipe's capacity would block forever.  */
+  void stub_child_setup (gpointer user_data)
+  {
+    dup2 (GPOINTER_TO_INT (user_data), STDOUT_FILENO);
+  }
+  GPid stub_pids[stubs];
+  char *stub_output[stubs];
+  for (i = 0; i < stubs; i ++)
+    {
+      stub_output[i] = g_strdup_printf ("%s/stub-%d.out", home, i);
+      int fd = open (stub_output[i], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      if (fd == -1)
+	error (1, errno, "Creating %s", stub_output[i]);
+
+      GPtrArray *args = g_ptr_array_new ();
+      g_ptr_array_add (args, (char *) stub);
+      g_ptr_array_add (args,
+		       g_strdup_printf ("--name=org.woodchuck.stub.s%d", i));
+      g_ptr_array_add (args, g_strdup_printf ("--duration=%d", duration));
+      int j;
+      for (j = 0; j < stub_args->len; j ++)
+	g_ptr_array_add (args, g_ptr_array_index (stub_args, j));
+      g_ptr_array_add (args, NULL);
+
+      if (! g_spawn_async (NULL, (char **) args->pdata, NULL,
+			   G_SPAWN_DO_NOT_REAP_CHILD,
+			   stub_child_setup, GINT_TO_POINTER (fd),
+			   &stub_pids[i], &gerror))
+	error (1, 0, "Starting %s: %s", stub, gerror->message);
+      close (fd);
+
+      g_free (g_ptr_array_index (args, 1));
+      g_free (g_ptr_array_index (args, 2));
+      g_ptr_array_free (args, TRUE);
+    }
+
+  /* Register the managers, streams and objects.  */
+  GWoodchuck *wcs[MAX (managers, 1)];
+  uint64_t registration = us_now ();
+  int m;
+  for (m = 0; m < managers; m ++)
+    {
+      char *name = g_strdup_printf ("Benchmark %d", m);
+      char *service = g_strdup_printf ("org.woodchuck.benchmark.m%d", m);
+
+      uint64_t start = us_now ();
+      wcs[m] = gwoodchuck_new (name, service, NULL, NULL, &gerror);
+      op_record (OP_MANAGER_REGISTER, start, wcs[m] != NULL, &gerror);
+      if (! wcs[m])
+	error (1, 0, "Failed to register manager %d.", m);
+
+      g_free (name);
+      g_free (service);
+
+      int s;
+      for (s = 0; s < streams; s ++)
+	{
+	  char stream[32];
+	  snprintf (stream, sizeof (stream), "stream-%d", s);
+
+	  start = us_now ();
+	  gboolean ok = gwoodchuck_stream_register
+	    (wcs[m], stream, stream, GWOODCHUCK_STREAM_UPDATE_HOURLY, &gerror);
+	  op_record (OP_STREAM_REGISTER, start, ok, &gerror);
+
+	  int o;
+	  for (o = 0; o < objects; o ++)
+	    {
+	      char object[32];
+	      snprintf (object, sizeof (object), "object-%d", o);
+
+	      start = us_now ();
+	      ok = gwoodchuck_object_register
+		(wcs[m], stream, object, object,
+		 100 * 1024, 0, 100 * 1024, 0, &gerror);
+	      op_record (OP_OBJECT_REGISTER, start, ok, &gerror);
+	    }
+	}
+    }
+  registration = us_now () - registration;
+
+  /* Find the streams' object paths for the property reads.  */
+  GPtrArray *manager_paths
+    = list_paths (connection, "/org/woodchuck", "org.woodchuck",
+		  "ListManagers", "/org/woodchuck/manager",
+		  DBUS_TYPE_BOOLEAN, &(dbus_bool_t) { FALSE },
+		  DBUS_TYPE_INVALID);
+  GPtrArray *stream_paths = g_ptr_array_new ();
+  for (i = 0; i < manager_paths->len; i ++)
+    {
+      GPtrArray *p = list_paths (connection,
+				 g_ptr_array_index (manager_paths, i),
+				 "org.woodchuck.manager", "ListStreams",
+				 "/org/woodchuck/stream", DBUS_TYPE_INVALID);
+      int j;
+      for (j = 0; j < p->len; j ++)
+	g_ptr_array_add (stream_paths, g_ptr_array_index (p, j));
+      g_ptr_array_free (p, TRUE);
+    }
+
+  /* Drive the load.  Operations are issued synchronously; if
+     murmeltier can't keep up, the achieved rate is lower than the
+     requested rate.  */
+  GRand *rand = g_rand_new_with_seed (0);
+  uint64_t load = us_now ();
+  uint64_t period = 1000000ULL / rate;
+  uint64_t n;
+  for (n = 0; duration > 0 && managers > 0 && streams > 0; n ++)
+    {
+      uint64_t next = load + n * period;
+      uint64_t t = us_now ();
+      if (t - load >= duration * 1000000ULL)
+	break;
+      if (next > t)
+	g_usleep (next - t);
+
+      GWoodchuck *wc = wcs[g_rand_int_range (rand, 0, managers)];
+      char stream[32];
+      snprintf (stream, sizeof (stream), "stream-%d",
+		g_rand_int_range (rand, 0, streams));
+      char object[32];
+      snprintf (object, sizeof (object), "object-%d",
+		g_rand_int_range (rand, 0, MAX (objects, 1)));
+
+      uint64_t start = us_now ();
+      gboolean ok;
+      switch (g_rand_int_range (rand, objects > 0 ? 0 : 3, 4))
+	{
+	case 0:
+	  /* The file does not exist.  Mark it as precious so that
+	     murmeltier never tries to delete it.  */
+	  ok = gwoodchuck_object_transferred
+	    (wc, stream, object, 0, 100 * 1024, 1, "/dev/null",
+	     WOODCHUCK_DELETION_POLICY_PRECIOUS, &gerror);
+	  op_record (OP_OBJECT_TRANSFERRED, start, ok, &gerror);
+	  break;
+
+	case 1:
+	  ok = gwoodchuck_object_used (wc, stream, object, &gerror);
+	  op_record (OP_OBJECT_USED, start, ok, &gerror);
+	  break;
+
+	case 2:
+	  {
+	    if (! stream_paths->len)
+	      break;
+
+	    const char *path = g_ptr_array_index
+	      (stream_paths, g_rand_int_range (rand, 0, stream_paths->len));
+	    const char *interface = "org.woodchuck.stream";
+	    const char *property = "LastUpdateTime";
+	    DBusMessage *reply
+	      = call (connection, path, "org.freedesktop.DBus.Properties",
+		      "Get", &gerror,
+		      DBUS_TYPE_STRING, &interface,
+		      DBUS_TYPE_STRING, &property,
+		      DBUS_TYPE_INVALID);
+	    op_record (OP_PROPERTY_GET, start, reply != NULL, &gerror);
+	    if (reply)
+	      dbus_message_unref (reply);
+	    break;
+	  }
+
+	default:
+	  ok = gwoodchuck_stream_updated (wc, stream, 10 * 1024, 1,
+					  0, 0, 0, &gerror);
+	  op_record (OP_STREAM_UPDATED, start, ok, &gerror);
+	  break;
+	}
+    }
+  load = us_now () - load;
+
+  /* Force scheduler passes.  A pass is complete when the scheduler
+     pass count reported by org.woodchuck.stats increases.  */
+  for (i = 0; i < schedule_passes; i ++)
+    {
+      int64_t passes = scheduler_passes (connection);
+
+      uint64_t start = us_now ();
+      DBusMessage *reply = call (connection, "/org/woodchuck",
+				 "org.woodchuck.stats", "Schedule", &gerror,
+				 DBUS_TYPE_INVALID);
+      if (! reply)
+	{
+	  op_record (OP_SCHEDULE, start, FALSE, &gerror);
+	  /* The scheduler is likely busy.  Wait a bit.  */
+	  g_usleep (100 * 1000);
+	  continue;
+	}
+      dbus_message_unref (reply);
+
+      while (passes != -1
+	     && scheduler_passes (connection) == passes
+	     && us_now () - start < 5 * 60 * 1000000ULL)
+	g_usleep (5 * 1000);
+      op_record (OP_SCHEDULE, start, TRUE, NULL);
+    }
+
+  /* Report.  */
+  char *db = g_strdup_printf ("%s/.murmeltier/config.db", home);
+
+  printf ("{\n"
+	  "  \"managers\": %d, \"streams\": %d, \"objects\": %d,\n"
+	  "  \"rate\": %d, \"duration\": %d,\n"
+	  "  \"startup_us\": %"PRIu64",\n"
+	  "  \"registration_us\": %"PRIu64",\n"
+	  "  \"load_ops\": %"PRIu64", \"load_us\": %"PRIu64",\n"
+	  "  \"load_ops_per_sec\": %.1f,\n"
+	  "  \"db_bytes\": %"PRIu64",\n"
+	  "  \"rss_kb\": %"PRId64", \"rss_peak_kb\": %"PRId64",\n"
+	  "  \"ops\": {",
+	  managers, streams, objects, rate, duration,
+	  startup, registration, n, load,
+	  load ? (double) n * 1000000 / load : 0.0,
+	  db_size (db),
+	  proc_status_kb (murmeltier_pid, "VmRSS"),
+	  proc_status_kb (murmeltier_pid, "VmHWM"));
+
+  bool first = true;
+  for (i = 0; i < OP_COUNT; i ++)
+    {
+      GArray *a = ops[i].samples;
+      if (! a || a->len == 0)
+	continue;
+
+      qsort (a->data, a->len, sizeof (uint64_t), uint64_cmp);
+      uint64_t *v = (uint64_t *) a->data;
+      uint64_t total = 0;
+      int j;
+      for (j = 0; j < a->len; j ++)
+	total += v[j];
+
+      /* The throughput is measured over the wall-clock time between
+	 the first operation's start and the last one's end (the
+	 operations are interleaved with other types).  */
+      uint64_t elapsed = ops[i].last_end - ops[i].first_start;
+
+#define P(p) v[MIN ((int) a->len - 1, (int) ((a->len * (p)) / 100))]
+      printf ("%s\n    \"%s\": { \"count\": %d, \"failures\": %d, "
+	      "\"ops_per_sec\": %.1f, \"mean_us\": %.1f, "
+	      "\"p50_us\": %"PRIu64", \"p95_us\": %"PRIu64", "
+	      "\"p99_us\": %"PRIu64", \"max_us\": %"PRIu64" }",
+	      first ? "" : ",", ops[i].name, a->len, ops[i].failures,
+	      elapsed ? (double) a->len * 1000000 / elapsed : 0.0,
+	      (double) total / a->len,
+	      P (50), P (95), P (99), v[a->len - 1]);
+#undef P
+      first = false;
+    }
+  printf ("\n  },\n  \"stubs\": [");
+
+  /* Wait for the stub clients and include their reports.  */
+  for (i = 0; i < stubs; i ++)
+    {
+      waitpid (stub_pids[i], NULL, 0);
+
+      char *report = NULL;
+      gsize len = 0;
+      if (! g_file_get_contents (stub_output[i], &report, &len, NULL))
+	len = 0;
+      printf ("%s\n%s", i ? "," : "", len ? report : "null");
+      g_free (report);
+      g_free (stub_output[i]);
+    }
+  printf ("]\n}\n");
+  fflush (stdout);
+
+  /* Clean up.  */
+  kill (murmeltier_pid, SIGTERM);
+  waitpid (murmeltier_pid, NULL, 0);
+  kill (dbus_daemon_pid, SIGTERM);
+  waitpid (dbus_daemon_pid, NULL, 0);
+
+  if (keep)
+    fprintf (stderr, "State left in %s\n", home);
+  else
+    nftw (home, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+
+  return 0;
+}
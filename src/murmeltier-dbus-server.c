@@ -16,6 +16,8 @@
 
 #include "config.h"
 
+#define DEBUG_SUBSYSTEM DBUS
+
 #include <assert.h>
 #include <stdio.h>
 #include <error.h>
@@ -28,6 +30,7 @@
 
 #include "debug.h"
 #include "util.h"
+#include "stats.h"
 
 #include "murmeltier-dbus-server.h"
 
@@ -35,13 +38,99 @@
 #include "org.woodchuck.manager.xml.h"
 #include "org.woodchuck.stream.xml.h"
 #include "org.woodchuck.object.xml.h"
+#include "org.woodchuck.stats.xml.h"
 #include "org.freedesktop.DBus.Introspectable.xml.h"
 #include "org.freedesktop.DBus.Properties.xml.h"
 
+/* Return a string describing MESSAGE's arguments.  The caller must
+   free the returned string using g_free.  */
+static char *
+message_args_to_string (DBusMessage *message)
+{
+  GString *s = g_string_new ("");
+
+  g_string_append_printf (s, "%s (", dbus_message_get_path (message));
+
+  DBusMessageIter iter;
+  dbus_message_iter_init (message, &iter);
+  int arg_type;
+  bool first = true;
+  while ((arg_type = dbus_message_iter_get_arg_type (&iter))
+	 != DBUS_TYPE_INVALID)
+    {
+      if (! first)
+	g_string_append (s, ", ");
+      first = false;
+
+      switch (arg_type)
+	{
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	  {
+	    const char *v = NULL;
+	    dbus_message_iter_get_basic (&iter, &v);
+	    g_string_append_printf (s, "'%s'", v);
+	    break;
+	  }
+	case DBUS_TYPE_BOOLEAN:
+	  {
+	    dbus_bool_t v = 0;
+	    dbus_message_iter_get_basic (&iter, &v);
+	    g_string_append (s, v ? "true" : "false");
+	    break;
+	  }
+	case DBUS_TYPE_INT32:
+	  {
+	    dbus_int32_t v = 0;
+	    dbus_message_iter_get_basic (&iter, &v);
+	    g_string_append_printf (s, "%"PRId32, v);
+	    break;
+	  }
+	case DBUS_TYPE_UINT32:
+	  {
+	    dbus_uint32_t v = 0;
+	    dbus_message_iter_get_basic (&iter, &v);
+	    g_string_append_printf (s, "%"PRIu32, v);
+	    break;
+	  }
+	case DBUS_TYPE_INT64:
+	  {
+	    dbus_int64_t v = 0;
+	    dbus_message_iter_get_basic (&iter, &v);
+	    g_string_append_printf (s, "%"PRId64, (int64_t) v);
+	    break;
+	  }
+	case DBUS_TYPE_UINT64:
+	  {
+	    dbus_uint64_t v = 0;
+	    dbus_message_iter_get_basic (&iter, &v);
+	    g_string_append_printf (s, "%"PRIu64, (uint64_t) v);
+	    break;
+	  }
+	default:
+	  /* Just show the type of containers.  */
+	  {
+	    char *sig = dbus_message_iter_get_signature (&iter);
+	    g_string_append_printf (s, "<%s>", sig);
+	    dbus_free (sig);
+	    break;
+	  }
+	}
+
+      dbus_message_iter_next (&iter);
+    }
+
+  g_string_append (s, ")");
+
+  return g_string_free (s, FALSE);
+}
+
 static DBusHandlerResult
 process_message (DBusConnection *connection, DBusMessage *message,
 		 gpointer user_data)
 {
+  uint64_t start = stats_start ();
+
   DBusMessage *reply = dbus_message_new_method_return (message);
   const char *error_name = NULL;
   /* The error message in ERROR is preferred to ERROR_MESSAGE.  */
@@ -71,6 +160,7 @@ process_message (DBusConnection *connection, DBusMessage *message,
     org_woodchuck_manager,
     org_woodchuck_stream,
     org_woodchuck_object,
+    org_woodchuck_stats,
     org_freedesktop_dbus_introspectable,
     org_freedesktop_dbus_properties
   };
@@ -83,6 +173,8 @@ process_message (DBusConnection *connection, DBusMessage *message,
     interface = org_woodchuck_stream;
   if (strcmp (interface_str, "org.woodchuck.object") == 0)
     interface = org_woodchuck_object;
+  if (strcmp (interface_str, "org.woodchuck.stats") == 0)
+    interface = org_woodchuck_stats;
   if (strcmp (interface_str, "org.freedesktop.DBus.Introspectable") == 0)
     interface = org_freedesktop_dbus_introspectable;
   if (strcmp (interface_str, "org.freedesktop.DBus.Properties") == 0)
@@ -113,7 +205,8 @@ process_message (DBusConnection *connection, DBusMessage *message,
       type = root;
       if (! (interface == org_freedesktop_dbus_introspectable
 	     || interface == org_freedesktop_dbus_properties
-	     || interface == org_woodchuck))
+	     || interface == org_woodchuck
+	     || interface == org_woodchuck_stats))
 	interface = 0;
     }
   else if (*path == '/')
@@ -188,6 +281,7 @@ process_message (DBusConnection *connection, DBusMessage *message,
 	case root:
 	  xml = XML_PREFIX \
 	    ORG_WOODCHUCK_XML \
+	    ORG_WOODCHUCK_STATS_XML \
 	    ORG_FREEDESKTOP_DBUS_INTROSPECTABLE_XML \
 	    ORG_FREEDESKTOP_DBUS_PROPERTIES_XML \
 	    XML_POSTFIX;
@@ -834,100 +928,34 @@ process_message (DBusConnection *connection, DBusMessage *message,
       if (arg_type != DBUS_TYPE_INVALID)
 	goto bad_signature;
 
-      GPtrArray *list = NULL;
-      char *array_signature = NULL;
+      /* The results are appended directly to the reply.  If an
+	 error occurs, the reply is replaced with an error message.  */
+      DBusMessageIter outer_iter;
+      dbus_message_iter_init_append (reply, &outer_iter);
+
       if (type == root && strcmp (method, "ListManagers") == 0)
-	{
-	  ret = woodchuck_list_managers (recurse, &list, &error);
-	  array_signature = "(ssss)";
-	}
+	ret = woodchuck_list_managers (recurse, &outer_iter, &error);
       else if (type == root && strcmp (method, "LookupManagerByCookie") == 0)
-	{
-	  ret = woodchuck_lookup_manager_by_cookie
-	    (cookie, recurse, &list, &error);
-	  array_signature = "(sss)";
-	}
+	ret = woodchuck_lookup_manager_by_cookie
+	  (cookie, recurse, &outer_iter, &error);
       else if (type == manager && strcmp (method, "LookupManagerByCookie") == 0)
-	{
-	  ret = woodchuck_manager_lookup_manager_by_cookie
-	    (path, cookie, recurse, &list, &error);
-	  array_signature = "(sss)";
-	}
+	ret = woodchuck_manager_lookup_manager_by_cookie
+	  (path, cookie, recurse, &outer_iter, &error);
       else if (type == manager && strcmp (method, "ListManagers") == 0)
-	{
-	  ret = woodchuck_manager_list_managers (path, recurse,
-						 &list, &error);
-	  array_signature = "(ssss)";
-	}
+	ret = woodchuck_manager_list_managers (path, recurse,
+					       &outer_iter, &error);
       else if (type == manager && strcmp (method, "ListStreams") == 0)
-	{
-	  ret = woodchuck_manager_list_streams (path, &list, &error);
-	  array_signature = "(sss)";
-	}
+	ret = woodchuck_manager_list_streams (path, &outer_iter, &error);
       else if (type == manager && strcmp (method, "LookupStreamByCookie") == 0)
-	{
-	  ret = woodchuck_manager_lookup_stream_by_cookie
-	    (path, cookie, &list, &error);
-	  array_signature = "(ss)";
-	}
+	ret = woodchuck_manager_lookup_stream_by_cookie
+	  (path, cookie, &outer_iter, &error);
       else if (type == stream && strcmp (method, "ListObjects") == 0)
-	{
-	  ret = woodchuck_stream_list_objects (path, &list, &error);
-	  array_signature = "(sss)";
-	}
+	ret = woodchuck_stream_list_objects (path, &outer_iter, &error);
       else if (type == stream && strcmp (method, "LookupObjectByCookie") == 0)
-	{
-	  ret = woodchuck_stream_lookup_object_by_cookie
-	    (path, cookie, &list, &error);
-	  array_signature = "(ss)";
-	}
-      assert (array_signature);
-
-      if (list)
-	{
-	  DBusMessageIter outer_iter;
-	  dbus_message_iter_init_append (reply, &outer_iter);
-
-	  DBusMessageIter array_iter;
-	  dbus_message_iter_open_container (&outer_iter,
-					    DBUS_TYPE_ARRAY,
-					    array_signature,
-					    &array_iter);
-
-	  int i;
-	  for (i = 0; i < list->len; i ++)
-	    {
-	      GPtrArray *strct = g_ptr_array_index (list, i);
-
-	      DBusMessageIter struct_iter;
-	      dbus_message_iter_open_container (&array_iter,
-						DBUS_TYPE_STRUCT, NULL,
-						&struct_iter);
-
-	      int i;
-	      for (i = 0; i < strct->len; i ++)
-		{
-		  char *value = g_ptr_array_index (strct, i);
-		  if (! value)
-		    value = "";
-
-		  if (ret == 0)
-		    dbus_message_iter_append_basic
-		      (&struct_iter, DBUS_TYPE_STRING, &value);
-		  g_free (g_ptr_array_index (strct, i));
-		}
-
-	      g_ptr_array_free (strct, TRUE);
-
-	      dbus_message_iter_close_container (&array_iter, &struct_iter);
-	    }
-
-	  g_ptr_array_free (list, TRUE);
-
-	  dbus_message_iter_close_container (&outer_iter, &array_iter);
-	}
+	ret = woodchuck_stream_lookup_object_by_cookie
+	  (path, cookie, &outer_iter, &error);
       else
-	assert (ret != 0);
+	assertx (0, "Unhandled list method: %s", method);
     }
   else if ((type == manager && strcmp (method, "Unregister") == 0)
 	   || (type == stream && strcmp (method, "Unregister") == 0))
@@ -1274,6 +1302,199 @@ process_message (DBusConnection *connection, DBusMessage *message,
 
       ret = woodchuck_object_files_deleted (path, update, arg, &error);
     }
+  else if (interface == org_woodchuck_stats && strcmp (method, "Dump") == 0)
+    {
+      expected_sig = "";
+      if (strcmp (expected_sig, actual_sig) != 0)
+	goto bad_signature;
+
+      DBusMessageIter outer_iter;
+      dbus_message_iter_init_append (reply, &outer_iter);
+
+      DBusMessageIter array_iter;
+      dbus_message_iter_open_container (&outer_iter, DBUS_TYPE_ARRAY,
+					"(sstttttt)", &array_iter);
+
+      void add (const struct stats_summary *summary)
+      {
+	DBusMessageIter struct_iter;
+	dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+					  NULL, &struct_iter);
+
+	const char *kind = stats_kind_string (summary->kind);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+					&kind);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+					&summary->name);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&summary->count);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&summary->total);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&summary->p50);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&summary->p95);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&summary->p99);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&summary->max);
+
+	dbus_message_iter_close_container (&array_iter, &struct_iter);
+      }
+      stats_foreach (add);
+
+      dbus_message_iter_close_container (&outer_iter, &array_iter);
+      ret = 0;
+    }
+  else if (interface == org_woodchuck_stats
+	   && strcmp (method, "SlowCalls") == 0)
+    {
+      expected_sig = "";
+      if (strcmp (expected_sig, actual_sig) != 0)
+	goto bad_signature;
+
+      DBusMessageIter outer_iter;
+      dbus_message_iter_init_append (reply, &outer_iter);
+
+      DBusMessageIter array_iter;
+      dbus_message_iter_open_container (&outer_iter, DBUS_TYPE_ARRAY,
+					"(sstts)", &array_iter);
+
+      void add (const struct stats_slow_call *c)
+      {
+	DBusMessageIter struct_iter;
+	dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+					  NULL, &struct_iter);
+
+	const char *kind = stats_kind_string (c->kind);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+					&kind);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+					&c->name);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&c->time);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT64,
+					&c->duration);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+					&c->args);
+
+	dbus_message_iter_close_container (&array_iter, &struct_iter);
+      }
+      stats_slow_calls_foreach (add);
+
+      dbus_message_iter_close_container (&outer_iter, &array_iter);
+      ret = 0;
+    }
+  else if (interface == org_woodchuck_stats && strcmp (method, "Reset") == 0)
+    {
+      expected_sig = "";
+      if (strcmp (expected_sig, actual_sig) != 0)
+	goto bad_signature;
+
+      stats_reset ();
+      ret = 0;
+    }
+  else if (interface == org_woodchuck_stats
+	   && strcmp (method, "SetSlowThreshold") == 0)
+    {
+      /* In.  */
+      uint32_t threshold = 0;
+
+      expected_sig = "u";
+      DBusError dbus_error;
+      dbus_error_init (&dbus_error);
+      if (strcmp (expected_sig, actual_sig) != 0
+	  || ! dbus_message_get_args (message, &dbus_error, 
+				      DBUS_TYPE_UINT32, &threshold,
+				      DBUS_TYPE_INVALID))
+	{
+	  dbus_error_free (&dbus_error);
+	  goto bad_signature;
+	}
+
+      stats_slow_threshold = threshold;
+      ret = 0;
+    }
+  else if (interface == org_woodchuck_stats
+	   && strcmp (method, "DebugLevels") == 0)
+    {
+      expected_sig = "";
+      if (strcmp (expected_sig, actual_sig) != 0)
+	goto bad_signature;
+
+      DBusMessageIter outer_iter;
+      dbus_message_iter_init_append (reply, &outer_iter);
+
+      DBusMessageIter array_iter;
+      dbus_message_iter_open_container (&outer_iter, DBUS_TYPE_ARRAY,
+					"(si)", &array_iter);
+
+      void add (const char *subsystem)
+      {
+	DBusMessageIter struct_iter;
+	dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+					  NULL, &struct_iter);
+
+	int32_t level = debug_level_get (subsystem);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+					&subsystem);
+	dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_INT32,
+					&level);
+
+	dbus_message_iter_close_container (&array_iter, &struct_iter);
+      }
+
+      /* The default level first.  */
+      add ("");
+      int i;
+      for (i = 0; debug_subsystem_name (i); i ++)
+	add (debug_subsystem_name (i));
+
+      dbus_message_iter_close_container (&outer_iter, &array_iter);
+      ret = 0;
+    }
+  else if (interface == org_woodchuck_stats
+	   && strcmp (method, "SetDebugLevel") == 0)
+    {
+      /* In.  */
+      char *subsystem = NULL;
+      int32_t level = 0;
+
+      expected_sig = "si";
+      DBusError dbus_error;
+      dbus_error_init (&dbus_error);
+      if (strcmp (expected_sig, actual_sig) != 0
+	  || ! dbus_message_get_args (message, &dbus_error, 
+				      DBUS_TYPE_STRING, &subsystem,
+				      DBUS_TYPE_INT32, &level,
+				      DBUS_TYPE_INVALID))
+	{
+	  dbus_error_free (&dbus_error);
+	  goto bad_signature;
+	}
+
+      if (debug_level_set (subsystem, level))
+	{
+	  debug (0, "Set the %s debug level to %d.",
+		 *subsystem ? subsystem : "default", level);
+	  ret = 0;
+	}
+      else
+	{
+	  ret = WOODCHUCK_ERROR_INVALID_ARGS;
+	  error_message = g_strdup_printf ("No subsystem named '%s'",
+					   subsystem);
+	}
+    }
+  else if (interface == org_woodchuck_stats
+	   && strcmp (method, "Schedule") == 0)
+    {
+      expected_sig = "";
+      if (strcmp (expected_sig, actual_sig) != 0)
+	goto bad_signature;
+
+      ret = woodchuck_stats_schedule (&error);
+    }
   else
     {
     bad_method:
@@ -1349,6 +1570,15 @@ process_message (DBusConnection *connection, DBusMessage *message,
   dbus_connection_send (connection, reply, NULL);
   dbus_message_unref (reply);
 
+  char name[strlen (interface_str) + 1 + strlen (method) + 1];
+  sprintf (name, "%s.%s", interface_str, method);
+
+  char *describe (void)
+  {
+    return message_args_to_string (message);
+  }
+  stats_record (STATS_METHOD, name, start, describe);
+
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
@@ -23,6 +23,7 @@
 #include "woodchuck/woodchuck.h"
 
 #include <glib.h>
+#include <dbus/dbus.h>
 
 /* Initialize module.  */
 extern void murmeltier_dbus_server_init (void);
@@ -32,16 +33,17 @@ extern enum woodchuck_error woodchuck_manager_register
   (GHashTable *properties, gboolean only_if_cookie_unique,
    char **uuid, GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing four strings, the
-   uuid, the cookie, the human readable name and the parent manager's
-   UUID.  */
+/* Appends to ITER an array of structs each containing four strings,
+   the uuid, the cookie, the human readable name and the parent
+   manager's UUID.  */
 extern enum woodchuck_error woodchuck_list_managers
-  (gboolean recurse, GPtrArray **list, GError **error);
+  (gboolean recurse, DBusMessageIter *iter, GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing three strings, the
-   uuid, the human readable name and the parent manager's UUID.  */
+/* Appends to ITER an array of structs each containing three strings,
+   the uuid, the human readable name and the parent manager's UUID.  */
 extern enum woodchuck_error woodchuck_lookup_manager_by_cookie
-  (const char *cookie, gboolean recursive, GPtrArray **list, GError **error);
+  (const char *cookie, gboolean recursive, DBusMessageIter *iter,
+   GError **error);
 
 struct woodchuck_transfer_desirability_version
 {
@@ -64,31 +66,33 @@ extern enum woodchuck_error woodchuck_manager_manager_register
   (const char *manager, GHashTable *properties, gboolean only_if_cookie_unique,
    char **uuid, GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing four strings, the
-   uuid, the cookie, the human readable name and the parent manager's
-   UUID.  */
+/* Appends to ITER an array of structs each containing four strings,
+   the uuid, the cookie, the human readable name and the parent
+   manager's UUID.  */
 extern enum woodchuck_error woodchuck_manager_list_managers
-  (const char *manager, gboolean recurse, GPtrArray **list, GError **error);
+  (const char *manager, gboolean recurse, DBusMessageIter *iter,
+   GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing three strings, the
-   uuid, the human readable name and the parent manager's UUID.  */
+/* Appends to ITER an array of structs each containing three strings,
+   the uuid, the human readable name and the parent manager's UUID.  */
 extern enum woodchuck_error woodchuck_manager_lookup_manager_by_cookie
 (const char *manager, const char *cookie, gboolean recursive,
-   GPtrArray **list, GError **error);
+   DBusMessageIter *iter, GError **error);
 
 extern enum woodchuck_error woodchuck_manager_stream_register
   (const char *manager, GHashTable *properties, gboolean only_if_cookie_unique,
    char **uuid, GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing three strings, the
-   uuid, the cookie, and the human readable name.  */
+/* Appends to ITER an array of structs each containing three strings,
+   the uuid, the cookie, and the human readable name.  */
 extern enum woodchuck_error woodchuck_manager_list_streams
-  (const char *manager, GPtrArray **list, GError **error);
+  (const char *manager, DBusMessageIter *iter, GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing two strings, the
-   uuid and the human readable name.  */
+/* Appends to ITER an array of structs each containing two strings,
+   the uuid and the human readable name.  */
 extern enum woodchuck_error woodchuck_manager_lookup_stream_by_cookie
-  (const char *manager, const char *cookie, GPtrArray **list, GError **error);
+  (const char *manager, const char *cookie, DBusMessageIter *iter,
+   GError **error);
 
 extern enum woodchuck_error woodchuck_manager_feedback_subscribe
   (const char *sender, const char *manager, bool descendents_too, char **handle,
@@ -110,15 +114,16 @@ extern enum woodchuck_error woodchuck_stream_object_register
   (const char *stream, GHashTable *properties, gboolean only_if_cookie_unique,
    char **uuid, GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing three strings, the
-   uuid, the cookie and the human readable name.  */
+/* Appends to ITER an array of structs each containing three strings,
+   the uuid, the cookie and the human readable name.  */
 extern enum woodchuck_error woodchuck_stream_list_objects
-  (const char *stream, GPtrArray **list, GError **error);
+  (const char *stream, DBusMessageIter *iter, GError **error);
 
-/* Returns a GPtrArray of GPtrArray each containing two strings, the
-   uuid and the human readable name.  */
+/* Appends to ITER an array of structs each containing two strings,
+   the uuid and the human readable name.  */
 extern enum woodchuck_error woodchuck_stream_lookup_object_by_cookie
-  (const char *stream, const char *cookie, GPtrArray **list, GError **error);
+  (const char *stream, const char *cookie, DBusMessageIter *iter,
+   GError **error);
 
 extern enum woodchuck_error woodchuck_stream_update_status
   (const char *object, uint32_t status, uint32_t indicator,
@@ -156,6 +161,12 @@ extern enum woodchuck_error woodchuck_object_use
 extern enum woodchuck_error woodchuck_object_files_deleted
   (const char *object, uint32_t update, uint64_t arg, GError **error);
 
+/* org.woodchuck.stats callbacks.  */
+
+/* Start a scheduler pass now, ignoring the user's activity, the
+   network connection and how recently the scheduler last ran.  */
+extern enum woodchuck_error woodchuck_stats_schedule (GError **error);
+
 /* org.freedesktop.DBus.Properties.  */
 
 extern enum woodchuck_error woodchuck_property_get
@@ -31,6 +31,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <signal.h>
 
 #include "murmeltier-dbus-server.h"
 
@@ -39,6 +40,8 @@
 #include "debug.h"
 #include "util.h"
 #include "dotdir.h"
+#include "stats.h"
+#include "signal-handler.h"
 
 #define G_MURMELTIER_ERROR murmeltier_error_quark ()
 static GQuark
@@ -336,13 +339,27 @@ upcall_execute (struct upcall *i)
 	       i->stream_update.stream_uuid,
 	       i->stream_update.stream_cookie);
 
-	if (! (org_woodchuck_upcall_stream_update
-	       (proxy,
-		i->manager_uuid,
-		i->manager_cookie,
-		i->stream_update.stream_uuid,
-		i->stream_update.stream_cookie,
-		&error)))
+	char *describe (void)
+	{
+	  return g_strdup_printf ("%s, %s, %s, %s, %s",
+				  handle,
+				  i->manager_uuid,
+				  i->manager_cookie,
+				  i->stream_update.stream_uuid,
+				  i->stream_update.stream_cookie);
+	}
+
+	uint64_t start = stats_start ();
+	gboolean ok = org_woodchuck_upcall_stream_update
+	  (proxy,
+	   i->manager_uuid,
+	   i->manager_cookie,
+	   i->stream_update.stream_uuid,
+	   i->stream_update.stream_cookie,
+	   &error);
+	stats_record (STATS_UPCALL, "StreamUpdate", start, describe);
+
+	if (! ok)
 	  {
 	    debug (0, "Executing org_woodchuck_upcall_stream_update "
 		   "(%s, %s, %s, %s, %s) upcall failed: %s",
@@ -375,18 +392,36 @@ upcall_execute (struct upcall *i)
 	GValueArray *versions
 	  = g_value_array_copy (i->object_transfer.versions);
 
-	if (! (org_woodchuck_upcall_object_transfer
-	       (proxy,
-		i->manager_uuid,
-		i->manager_cookie,
-		i->object_transfer.stream_uuid,
-		i->object_transfer.stream_cookie,
-		i->object_transfer.object_uuid,
-		i->object_transfer.object_cookie,
-		versions,
-		i->object_transfer.filename,
-		i->object_transfer.quality,
-		&error)))
+	char *describe (void)
+	{
+	  return g_strdup_printf ("%s, %s, %s, %s, %s, %s, %s, %s, %d",
+				  handle,
+				  i->manager_uuid,
+				  i->manager_cookie,
+				  i->object_transfer.stream_uuid,
+				  i->object_transfer.stream_cookie,
+				  i->object_transfer.object_uuid,
+				  i->object_transfer.object_cookie,
+				  i->object_transfer.filename,
+				  i->object_transfer.quality);
+	}
+
+	uint64_t start = stats_start ();
+	gboolean ok = org_woodchuck_upcall_object_transfer
+	  (proxy,
+	   i->manager_uuid,
+	   i->manager_cookie,
+	   i->object_transfer.stream_uuid,
+	   i->object_transfer.stream_cookie,
+	   i->object_transfer.object_uuid,
+	   i->object_transfer.object_cookie,
+	   versions,
+	   i->object_transfer.filename,
+	   i->object_transfer.quality,
+	   &error);
+	stats_record (STATS_UPCALL, "ObjectTransfer", start, describe);
+
+	if (! ok)
 	  {
 	    debug (0, "Executing org_woodchuck_upcall_object_transfer "
 		   "(%s, %s, %s, %s, %s, %s, %s, [versions], %s, %d) "
@@ -576,6 +611,8 @@ do_schedule_worker (void *arg)
   /* Wait a while before timing out.  */
   sqlite3_busy_timeout (db, 5 * 60 * 1000);
 
+  stats_sqlite_profile (db);
+
   uint64_t n = now ();
 
   int streams_callback (void *cookie, int argc, char **argv, char **names)
@@ -860,6 +897,7 @@ do_schedule_worker (void *arg)
 
   uint64_t t = now () - n;
   debug (3, "Scheduling took "TIME_FMT, TIME_PRINTF(t));
+  stats_record_duration (STATS_SCHEDULER, "pass", t * 1000, NULL);
 
   if (upcall_list)
     {
@@ -882,6 +920,32 @@ do_schedule_worker (void *arg)
 
 static pthread_t do_schedule_worker_tid;
 
+/* Start a scheduler pass in a separate thread.  */
+static void
+scheduler_start (void)
+{
+  assert (! scheduler_running);
+  scheduler_running = true;
+
+  struct scheduler_args *args = calloc (1, sizeof (*args));
+
+  if (wc_battery_monitor_charging (mt->bm))
+    {
+      args->freshness_factor_numerator = 3;
+      args->freshness_factor_denominator = 4;
+    }
+  else
+    /* If the battery is discharging, wait up to twice as long to
+       update streams.  */
+    {
+      args->freshness_factor_numerator = 2;
+      args->freshness_factor_denominator = 1;
+    }
+
+  pthread_create (&do_schedule_worker_tid, NULL, do_schedule_worker, args);
+  pthread_detach (do_schedule_worker_tid);
+}
+
 static gboolean
 do_schedule (gpointer user_data)
 {
@@ -967,25 +1031,7 @@ do_schedule (gpointer user_data)
       goto out;
     }
 
-  scheduler_running = true;
-
-  struct scheduler_args *args = calloc (1, sizeof (*args));
-
-  if (wc_battery_monitor_charging (mt->bm))
-    {
-      args->freshness_factor_numerator = 3;
-      args->freshness_factor_denominator = 4;
-    }
-  else
-    /* If the battery is discharging, wait up to twice as long to
-       update streams.  */
-    {
-      args->freshness_factor_numerator = 2;
-      args->freshness_factor_denominator = 1;
-    }
-
-  pthread_create (&do_schedule_worker_tid, NULL, do_schedule_worker, args);
-  pthread_detach (do_schedule_worker_tid);
+  scheduler_start ();
 
  out:
   /* Don't call again.  */
@@ -1011,6 +1057,29 @@ schedule (void)
   schedule_id = g_timeout_add_seconds (delay, do_schedule, NULL);
 }
 
+enum woodchuck_error
+woodchuck_stats_schedule (GError **error)
+{
+  if (scheduler_running || upcall_list)
+    {
+      g_set_error (error, G_MURMELTIER_ERROR, 0,
+		   "Scheduler busy (%s; %d pending upcalls).",
+		   scheduler_running ? "running" : "idle",
+		   g_slist_length (upcall_list));
+      return WOODCHUCK_ERROR_GENERIC;
+    }
+
+  debug (3, "Forcing a scheduler pass.");
+
+  if (schedule_id)
+    g_source_remove (schedule_id);
+  schedule_id = 0;
+
+  scheduler_start ();
+
+  return 0;
+}
+
 /* When a client exits, clean up any feedback subscriptions it may
    have.  */
 static void
@@ -1386,6 +1455,43 @@ object_register (const char *parent, const char *parent_table,
     }
   abort_transaction = TRUE;
 
+  if (parent && *parent)
+    /* Don't add anything to a parent that does not exist (or was
+       unregistered and is being reaped: its rows would never be
+       deleted).  */
+    {
+      bool parent_exists = false;
+      int parent_callback (void *cookie, int argc, char **argv,
+			   char **names)
+      {
+	parent_exists = true;
+	return 0;
+      }
+
+      sqlite3_exec_printf (db, "select 1 from %s where uuid = %Q;",
+			   parent_callback, NULL, &errmsg,
+			   parent_table, parent);
+      if (errmsg)
+	{
+	  g_set_error (error, G_MURMELTIER_ERROR, 0,
+		       "Internal error at %s:%d: %s",
+		       __FILE__, __LINE__, errmsg);
+	  sqlite3_free (errmsg);
+	  errmsg = NULL;
+
+	  ret = WOODCHUCK_ERROR_INTERNAL_ERROR;
+	  goto out;
+	}
+
+      if (! parent_exists)
+	{
+	  g_set_error (error, G_MURMELTIER_ERROR, 0,
+		       "Parent '%s' does not exist", parent);
+	  ret = WOODCHUCK_ERROR_NO_SUCH_OBJECT;
+	  goto out;
+	}
+    }
+
   *uuid = NULL;
   int uuid_callback (void *cookie, int argc, char **argv, char **names)
   {
@@ -1523,29 +1629,113 @@ object_register (const char *parent, const char *parent_table,
   return ret;
 }
 
-static int
-list_callback (void *cookie, int argc, char **argv, char **names)
+/* Execute the SQL statement formed from SQL_FMT and append the
+   result to ITER as an array of structs.  Each column is returned as
+   a string (NULL values are returned as the empty string).  The
+   columns are read directly from the prepared statement and appended
+   to the message: no intermediate copies are made.  */
+static enum woodchuck_error
+list_append (DBusMessageIter *iter, GError **error, const char *sql_fmt, ...)
 {
-  GPtrArray *list = cookie;
+  va_list ap;
+  va_start (ap, sql_fmt);
+  char *sql = sqlite3_vmprintf (sql_fmt, ap);
+  va_end (ap);
 
-  GPtrArray *strct = g_ptr_array_new ();
+  sqlite3_stmt *stmt = NULL;
+  int err = sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL);
+  if (err != SQLITE_OK)
+    {
+      g_set_error (error, G_MURMELTIER_ERROR, 0,
+		   "Internal error at %s:%d: preparing '%s': %s",
+		   __FILE__, __LINE__, sql, sqlite3_errmsg (db));
+      sqlite3_free (sql);
+      return WOODCHUCK_ERROR_INTERNAL_ERROR;
+    }
 
-  debug (5, "Object %d: %d args", list->len, argc);
+  /* The signature is a struct with one string per column.  */
+  int columns = sqlite3_column_count (stmt);
+  char signature[columns + 3];
+  signature[0] = DBUS_STRUCT_BEGIN_CHAR;
+  memset (&signature[1], DBUS_TYPE_STRING, columns);
+  signature[columns + 1] = DBUS_STRUCT_END_CHAR;
+  signature[columns + 2] = 0;
 
-  int i;
-  for (i = 0; i < argc; i ++)
+  DBusMessageIter array_iter;
+  dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, signature,
+				    &array_iter);
+
+  int rows = 0;
+  while ((err = sqlite3_step (stmt)) == SQLITE_ROW)
     {
-      if (strcmp (names[i], "parent_uuid") == 0 && argv[i][0] == 0)
-	g_ptr_array_add (strct, NULL);
-      else
-	g_ptr_array_add (strct, g_strdup (argv[i]));
+      DBusMessageIter struct_iter;
+      dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT, NULL,
+					&struct_iter);
+
+      int i;
+      for (i = 0; i < columns; i ++)
+	{
+	  const char *value = (const char *) sqlite3_column_text (stmt, i);
+	  if (! value)
+	    value = "";
+
+	  debug (5, "Row %d: column %d: %s", rows, i, value);
+	  dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+					  &value);
+	}
 
-      debug (5, "Object %d: index %d: %s", list->len, i, argv[i]);
+      dbus_message_iter_close_container (&array_iter, &struct_iter);
+      rows ++;
     }
 
-  g_ptr_array_add (list, strct);
+  dbus_message_iter_close_container (iter, &array_iter);
 
-  return 0;
+  enum woodchuck_error ret = 0;
+  if (err != SQLITE_DONE)
+    {
+      g_set_error (error, G_MURMELTIER_ERROR, 0,
+		   "Internal error at %s:%d: executing '%s': %s",
+		   __FILE__, __LINE__, sql, sqlite3_errmsg (db));
+      ret = WOODCHUCK_ERROR_INTERNAL_ERROR;
+    }
+  else
+    debug (4, "%d rows matched.", rows);
+
+  sqlite3_finalize (stmt);
+  sqlite3_free (sql);
+
+  return ret;
+}
+
+/* An SQL condition that is false for objects whose stream is being
+   reaped (see reap_orphans).  Such objects are treated as if they had
+   already been deleted.  */
+#define NOT_ORPHANED \
+  " parent_uuid not in (select uuid from orphaned_parents)"
+
+/* Return whether OBJECT belongs to a stream that is being reaped.  */
+static bool
+object_orphaned (const char *object)
+{
+  bool orphaned = false;
+  int callback (void *cookie, int argc, char **argv, char **names)
+  {
+    orphaned = true;
+    return 0;
+  }
+
+  char *errmsg = NULL;
+  sqlite3_exec_printf
+    (db, "select 1 from objects where uuid = %Q and not"NOT_ORPHANED";",
+     callback, NULL, &errmsg, object);
+  if (errmsg)
+    {
+      debug (0, "%s", errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+
+  return orphaned;
 }
 
 static enum woodchuck_error
@@ -1553,53 +1743,151 @@ lookup_by (const char *table,
 	   const char *column, const char *value, const char *parent_uuid,
 	   gboolean recursive,
 	   const char *properties,
-	   GPtrArray **objects, GError **error)
+	   DBusMessageIter *iter, GError **error)
 {
-  *objects = g_ptr_array_new ();
-
-  char *errmsg = NULL;
   if (! recursive)
-    sqlite3_exec_printf
-      (db,
-       "select %s from %s where %s = %Q and parent_uuid = %Q;",
-       list_callback, *objects, &errmsg,
+    return list_append
+      (iter, error,
+       "select %s from %s where %s = %Q and parent_uuid = %Q"
+       " and"NOT_ORPHANED";",
        properties, table, column, value, parent_uuid ?: "");
   else if (! parent_uuid && recursive)
-    sqlite3_exec_printf
-      (db,
+    return list_append
+      (iter, error,
        "select %s from %s where %s = %Q;",
-       list_callback, *objects, &errmsg,
        properties, table, column, value);
   else
 #warning Implement lookup_by not recursive.
     return WOODCHUCK_ERROR_NOT_IMPLEMENTED;
+}
 
+static int
+abort_if_too_many_callback (void *cookie, int argc, char **argv, char **names)
+{
+  int *count = cookie;
+
+  if (*count == 0)
+    return 1;
+
+  -- *count;
+  return 0;
+}
+
+/* The tables (and the column naming the owner) whose rows belong to a
+   stream or a manager and which are deleted lazily when the owner is
+   unregistered.  Each column must be indexed.  */
+static const struct
+{
+  const char *table;
+  const char *column;
+} orphan_tables[] =
+  {
+    { "objects", "parent_uuid" },
+    { "object_versions", "parent_uuid" },
+    { "object_instance_status", "parent_uuid" },
+    { "object_instance_files", "parent_uuid" },
+    { "object_use", "parent_uuid" },
+    { "stream_updates", "uuid" },
+    { "stream_updates", "parent_uuid" },
+  };
+
+/* The maximum number of rows to delete from a table in a single
+   statement.  */
+#define REAP_ORPHANS_CHUNK 500
+
+static guint reap_orphans_id;
+
+/* Delete up to REAP_ORPHANS_CHUNK rows owned by an object in the
+   orphaned_parents table.  Once all of an orphan's rows are gone,
+   remove it from orphaned_parents.  Each invocation executes a single
+   bounded statement so that DBus traffic is not blocked for long.  */
+static gboolean
+reap_orphans (gpointer user_data)
+{
+  char *orphan = NULL;
+  int orphan_callback (void *cookie, int argc, char **argv, char **names)
+  {
+    orphan = g_strdup (argv[0]);
+    return 0;
+  }
+
+  char *errmsg = NULL;
+  sqlite3_exec (db, "select uuid from orphaned_parents limit 1;",
+		orphan_callback, NULL, &errmsg);
   if (errmsg)
     {
-      g_set_error (error, G_MURMELTIER_ERROR, 0,
-		   "Internal error at %s:%d: %s",
-		   __FILE__, __LINE__, errmsg);
+      debug (0, "Looking up orphans: %s", errmsg);
       sqlite3_free (errmsg);
       errmsg = NULL;
+    }
 
-      return WOODCHUCK_ERROR_INTERNAL_ERROR;
+  if (! orphan)
+    /* Nothing left to do.  */
+    {
+      debug (4, "No orphans left to reap.");
+      reap_orphans_id = 0;
+      return FALSE;
     }
 
-  debug (4, "%d objects matched.", (*objects)->len);
+  int i;
+  for (i = 0; i < sizeof (orphan_tables) / sizeof (orphan_tables[0]); i ++)
+    {
+      sqlite3_exec_printf
+	(db,
+	 "delete from %s where ROWID in"
+	 " (select ROWID from %s where %s = %Q limit %d);",
+	 NULL, NULL, &errmsg,
+	 orphan_tables[i].table, orphan_tables[i].table,
+	 orphan_tables[i].column, orphan, REAP_ORPHANS_CHUNK);
+      if (errmsg)
+	{
+	  debug (0, "Reaping %s's rows in %s: %s",
+		 orphan, orphan_tables[i].table, errmsg);
+	  sqlite3_free (errmsg);
+	  errmsg = NULL;
 
-  return 0;
+	  /* Try again later.  */
+	  g_free (orphan);
+	  reap_orphans_id = 0;
+	  return FALSE;
+	}
+
+      int changes = sqlite3_changes (db);
+      if (changes > 0)
+	{
+	  debug (4, "Reaped %d of %s's rows in %s.",
+		 changes, orphan, orphan_tables[i].table);
+	  g_free (orphan);
+	  return TRUE;
+	}
+    }
+
+  /* All of the orphan's rows are gone.  */
+  sqlite3_exec_printf (db, "delete from orphaned_parents where uuid = %Q;",
+		       NULL, NULL, &errmsg, orphan);
+  if (errmsg)
+    {
+      debug (0, "Removing %s from orphaned_parents: %s", orphan, errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+  else
+    debug (3, "Finished reaping %s.", orphan);
+
+  g_free (orphan);
+  return TRUE;
 }
 
-static int
-abort_if_too_many_callback (void *cookie, int argc, char **argv, char **names)
+static void
+reap_orphans_schedule (void)
 {
-  int *count = cookie;
-
-  if (*count == 0)
-    return 1;
+  if (reap_orphans_id)
+    return;
 
-  -- *count;
-  return 0;
+  /* Run at a low priority so that DBus messages are processed
+     first.  */
+  reap_orphans_id = g_idle_add_full (G_PRIORITY_LOW, reap_orphans,
+				     NULL, NULL);
 }
 
 static enum woodchuck_error
@@ -1733,38 +2021,54 @@ object_unregister (const char *uuid,
     }
   else
     {
-      if (strcmp (table, "managers") == 0)
-#warning Implement object_delete recursive for managers
-	return WOODCHUCK_ERROR_NOT_IMPLEMENTED;
-
-      /* Create the sql.  */
-      GString *sql = g_string_new ("begin transaction;");
-
-      char *escaped = sqlite3_mprintf ("%Q", uuid);
-
-      g_string_append_printf (sql, 
-			      "delete from %s where uuid = %s;",
-			      table, escaped);
-
-      int i;
-      for (i = 0; secondary_tables && secondary_tables[i]; i ++)
-	g_string_append_printf (sql, 
-				"delete from %s where uuid = %s;",
-				secondary_tables[i], escaped);
-      for (i = 0; child_tables && child_tables[i]; i ++)
-	g_string_append_printf (sql, 
-				"delete from %s where parent_uuid = %s;",
-				child_tables[i], escaped);
-
-      sqlite3_free (escaped);
+      /* Removing a manager or a stream can orphan tens of thousands
+	 of rows.  Deleting them all at once would hold the write lock
+	 for a long time and block the main loop.  Instead, we
+	 immediately remove the object and any descendent managers and
+	 streams, which are few, and record the removed UUIDs in the
+	 orphaned_parents table.  The rows that they own are then
+	 deleted in bounded chunks by reap_orphans.  Until then,
+	 their objects are treated as if they did not exist (see
+	 NOT_ORPHANED), and nothing new can be registered under them
+	 (see object_register).  */
+      int count = 0;
+      int count_callback (void *cookie, int argc, char **argv, char **names)
+      {
+	count = argv[0] ? atoi (argv[0]) : 0;
+	return 0;
+      }
 
-      g_string_append_printf (sql, "end transaction;");
+      bool is_manager = strcmp (table, "managers") == 0;
 
-      int total_changes = sqlite3_total_changes (db);
       char *errmsg = NULL;
-      sqlite3_exec_printf (db, sql->str, NULL, NULL, &errmsg);
-      g_string_free (sql, TRUE);
-
+      sqlite3_exec_printf
+	(db,
+	 "begin transaction;"
+	 "create temp table if not exists unregister_set (uuid PRIMARY KEY);"
+	 "delete from temp.unregister_set;"
+	 /* The object and, if it is a manager, any descendent
+	    managers.  */
+	 "insert into temp.unregister_set"
+	 " with recursive descendents (uuid) as"
+	 "  (select uuid from %s where uuid = %Q"
+	 "%s)"
+	 " select uuid from descendents;"
+	 "select count (*) from temp.unregister_set;"
+	 /* Any streams that they own.  */
+	 "insert or ignore into temp.unregister_set"
+	 " select uuid from streams"
+	 "  where parent_uuid in temp.unregister_set;"
+	 "insert or ignore into orphaned_parents (uuid)"
+	 " select uuid from temp.unregister_set;"
+	 "delete from streams where uuid in temp.unregister_set;"
+	 "delete from managers where uuid in temp.unregister_set;"
+	 "end transaction;",
+	 count_callback, NULL, &errmsg,
+	 table, uuid,
+	 is_manager
+	 ? "   union select managers.uuid from managers, descendents"
+	   "    where managers.parent_uuid = descendents.uuid"
+	 : "");
       if (errmsg)
 	{
 	  g_set_error (error, G_MURMELTIER_ERROR, 0,
@@ -1772,25 +2076,25 @@ object_unregister (const char *uuid,
 		       __FILE__, __LINE__, errmsg);
 	  sqlite3_free (errmsg);
 	  errmsg = NULL;
+
+	  sqlite3_exec (db, "rollback transaction;", NULL, NULL, NULL);
 	  return WOODCHUCK_ERROR_INTERNAL_ERROR;
 	}
 
-      assert (total_changes != -1);
-
-      int deleted_rows = sqlite3_total_changes (db) - total_changes;
-      debug (0, "Removing %s removed %d objects.",
-	     uuid, deleted_rows);
-      if (deleted_rows == 0)
+      debug (0, "Removing %s removed %d %s.", uuid, count, table);
+      if (count == 0)
 	{
 	  g_set_error (error, G_MURMELTIER_ERROR, 0,
 		       "Object '%s' does not exist", uuid);
 	  return WOODCHUCK_ERROR_GENERIC;
 	}
 
+      reap_orphans_schedule ();
+
       return 0;
     }
 }
-
+
 enum woodchuck_error
 woodchuck_manager_register (GHashTable *properties,
 			    gboolean only_if_cookie_unique,
@@ -1803,18 +2107,18 @@ woodchuck_manager_register (GHashTable *properties,
 
 enum woodchuck_error
 woodchuck_list_managers (gboolean recursive,
-			 GPtrArray **managers, GError **error)
+			 DBusMessageIter *iter, GError **error)
 {
-  return woodchuck_manager_list_managers (NULL, recursive, managers, error);
+  return woodchuck_manager_list_managers (NULL, recursive, iter, error);
 }
 
 enum woodchuck_error
 woodchuck_lookup_manager_by_cookie (const char *cookie, gboolean recursive,
-				    GPtrArray **managers, GError **error)
+				    DBusMessageIter *iter, GError **error)
 {
   return lookup_by ("managers", "Cookie", cookie, NULL, recursive,
 		    "uuid, HumanReadableName, parent_uuid",
-		    managers, error);
+		    iter, error);
 }
 
 enum woodchuck_error
@@ -1850,74 +2154,44 @@ woodchuck_manager_unregister (const char *manager, bool only_if_no_descendents,
 
 enum woodchuck_error
 woodchuck_manager_list_managers
- (const char *manager, gboolean recursive, GPtrArray **managers, GError **error)
+ (const char *manager, gboolean recursive, DBusMessageIter *iter,
+  GError **error)
 {
-  *managers = g_ptr_array_new ();
-
   debug (0, "manager: %s, recursive: %d", manager, recursive);
 
-  char *errmsg = NULL;
   if (recursive && ! manager)
     /* List everything.  */
-    sqlite3_exec
-      (db,
-       "select uuid, Cookie, HumanReadableName, parent_uuid from managers;",
-       list_callback, *managers, &errmsg);
+    return list_append
+      (iter, error,
+       "select uuid, Cookie, HumanReadableName, parent_uuid from managers;");
   else if (recursive)
     /* List only those that are descended from MANAGER.  */
-    {
-      int i = 0;
-      for (;;)
-	{
-	  sqlite3_exec_printf
-	    (db,
-	     "select uuid, Cookie, HumanReadableName, parent_uuid"
-	     " from managers where parent_uuid = %Q;",
-	     list_callback, *managers, &errmsg, manager);
-	  if (errmsg)
-	    break;
-
-	  debug (0, "Processed %d of %d managers", i, (*managers)->len);
-
-	  if (i >= (*managers)->len)
-	    break;
-	  GPtrArray *strct = g_ptr_array_index ((*managers), i);
-	  debug (0, "%d fields", strct->len);
-	  manager = g_ptr_array_index (strct, 0);
-	  i ++;
-	}
-    }
+    return list_append
+      (iter, error,
+       "with recursive descendents (uuid) as"
+       " (select uuid from managers where parent_uuid = %Q"
+       "  union select managers.uuid from managers, descendents"
+       "   where managers.parent_uuid = descendents.uuid)"
+       " select uuid, Cookie, HumanReadableName, parent_uuid"
+       " from managers where uuid in descendents;",
+       manager);
   else
     /* List only those that are an immediate descendent of MANAGER.  */
-    sqlite3_exec_printf
-      (db,
+    return list_append
+      (iter, error,
        "select uuid, Cookie, HumanReadableName, parent_uuid"
        " from managers where parent_uuid = %Q;",
-       list_callback, *managers, &errmsg,
        manager ?: "");
-
-  if (errmsg)
-    {
-      g_set_error (error, G_MURMELTIER_ERROR, 0,
-		   "Internal error at %s:%d: %s",
-		   __FILE__, __LINE__, errmsg);
-      sqlite3_free (errmsg);
-      errmsg = NULL;
-
-      return WOODCHUCK_ERROR_INTERNAL_ERROR;
-    }
-
-  return 0;
 }
 
 enum woodchuck_error
 woodchuck_manager_lookup_manager_by_cookie
   (const char *manager, const char *cookie, gboolean recursive,
-   GPtrArray **managers, GError **error)
+   DBusMessageIter *iter, GError **error)
 {
   return lookup_by ("managers", "Cookie", cookie, manager, recursive,
 		    "uuid, HumanReadableName, parent_uuid",
-		    managers, error);
+		    iter, error);
 }
 
 enum woodchuck_error
@@ -1933,37 +2207,23 @@ woodchuck_manager_stream_register (const char *manager, GHashTable *properties,
 
 enum woodchuck_error
 woodchuck_manager_list_streams
-  (const char *manager, GPtrArray **list, GError **error)
+  (const char *manager, DBusMessageIter *iter, GError **error)
 {
-  *list = g_ptr_array_new ();
-
-  char *errmsg = NULL;
-  sqlite3_exec_printf
-    (db,
+  return list_append
+    (iter, error,
      "select uuid, Cookie, HumanReadablename from streams"
      " where parent_uuid=%Q;",
-     list_callback, *list, &errmsg, manager);
-  if (errmsg)
-    {
-      g_set_error (error, G_MURMELTIER_ERROR, 0,
-		   "Internal error at %s:%d: %s",
-		   __FILE__, __LINE__, errmsg);
-      sqlite3_free (errmsg);
-      errmsg = NULL;
-
-      return WOODCHUCK_ERROR_INTERNAL_ERROR;
-    }
-
-  return 0;
+     manager);
 }
 
 enum woodchuck_error
 woodchuck_manager_lookup_stream_by_cookie
-  (const char *manager, const char *cookie, GPtrArray **list, GError **error)
+  (const char *manager, const char *cookie, DBusMessageIter *iter,
+   GError **error)
 {
   return lookup_by ("streams", "Cookie", cookie, manager, FALSE,
 		    "uuid, HumanReadableName",
-		    list, error);
+		    iter, error);
 }
 
 
@@ -2122,28 +2382,13 @@ woodchuck_stream_object_register (const char *stream, GHashTable *properties,
 
 enum woodchuck_error
 woodchuck_stream_list_objects (const char *stream,
-			       GPtrArray **list, GError **error)
+			       DBusMessageIter *iter, GError **error)
 {
-  *list = g_ptr_array_new ();
-
-  char *errmsg = NULL;
-  sqlite3_exec_printf
-    (db,
+  return list_append
+    (iter, error,
      "select uuid, Cookie, HumanReadableName from objects"
-     " where parent_uuid=%Q;",
-     list_callback, *list, &errmsg, stream);
-  if (errmsg)
-    {
-      g_set_error (error, G_MURMELTIER_ERROR, 0,
-		   "Internal error at %s:%d: %s",
-		   __FILE__, __LINE__, errmsg);
-      sqlite3_free (errmsg);
-      errmsg = NULL;
-
-      return WOODCHUCK_ERROR_INTERNAL_ERROR;
-    }
-
-  return 0;
+     " where parent_uuid=%Q and"NOT_ORPHANED";",
+     stream);
 }
 
 enum woodchuck_error
@@ -2251,6 +2496,13 @@ woodchuck_stream_update_status
 enum woodchuck_error
 woodchuck_object_unregister (const char *object, GError **error)
 {
+  if (object_orphaned (object))
+    {
+      g_set_error (error, G_MURMELTIER_ERROR, 0,
+		   "Object '%s' does not exist", object);
+      return WOODCHUCK_ERROR_NO_SUCH_OBJECT;
+    }
+
   const char *secondary_tables[] = { "object_versions",
 				     "object_instance_status",
 				     "object_instance_files",
@@ -2270,11 +2522,12 @@ woodchuck_object_transfer (const char *object, uint32_t request_type,
 
 enum woodchuck_error
 woodchuck_stream_lookup_object_by_cookie
-  (const char *stream, const char *cookie, GPtrArray **list, GError **error)
+  (const char *stream, const char *cookie, DBusMessageIter *iter,
+   GError **error)
 {
   return lookup_by ("objects", "Cookie", cookie, stream, FALSE,
 		    "uuid, HumanReadableName",
-		    list, error);
+		    iter, error);
 }
 
 enum woodchuck_error
@@ -2306,7 +2559,8 @@ woodchuck_object_transfer_status
 
   char *errmsg = NULL;
   sqlite3_exec_printf
-    (db, "select instance, parent_uuid from objects where uuid = %s;",
+    (db, "select instance, parent_uuid from objects where uuid = %s"
+     " and"NOT_ORPHANED";",
      callback, NULL, &errmsg, object);
   if (errmsg)
     {
@@ -2409,7 +2663,8 @@ woodchuck_object_use (const char *object_raw, uint64_t start, uint64_t duration,
 
   char *errmsg = NULL;
   sqlite3_exec_printf
-    (db, "select instance, parent_uuid from objects where uuid = %s;",
+    (db, "select instance, parent_uuid from objects where uuid = %s"
+     " and"NOT_ORPHANED";",
      callback, NULL, &errmsg, object);
   if (errmsg)
     {
@@ -2478,7 +2733,8 @@ woodchuck_object_files_deleted (const char *object_raw,
 
   char *errmsg = NULL;
   sqlite3_exec_printf
-    (db, "select instance, parent_uuid from objects where uuid = %s;",
+    (db, "select instance, parent_uuid from objects where uuid = %s"
+     " and"NOT_ORPHANED";",
      callback, NULL, &errmsg, object);
   if (errmsg)
     {
@@ -2853,6 +3109,13 @@ woodchuck_object_property_get (const char *object, const char *interface_name,
 			       const char *property_name,
 			       GValue *value, GError **error)
 {
+  if (object_orphaned (object))
+    {
+      g_set_error (error, G_MURMELTIER_ERROR, 0,
+		   "Object '%s' does not exist", object);
+      return WOODCHUCK_ERROR_NO_SUCH_OBJECT;
+    }
+
   char *sql = NULL;
   GType type;
   const char *default_value;
@@ -2911,17 +3174,49 @@ woodchuck_object_property_set (const char *object, const char *interface_name,
 			       const char *property_name,
 			       GValue *value, GError **error)
 {
+  if (object_orphaned (object))
+    {
+      g_set_error (error, G_MURMELTIER_ERROR, 0,
+		   "Object '%s' does not exist", object);
+      return WOODCHUCK_ERROR_NO_SUCH_OBJECT;
+    }
+
   return property_set (object, "objects", object_properties,
 		       "org.woodchuck.object", interface_name, property_name,
 		       value, error);
 }
 
+static void
+unix_signal_handler (WCSignalHandler *sh, struct signalfd_siginfo *si,
+		     gpointer user_data)
+{
+  if (si->ssi_signo == SIGUSR1 || si->ssi_signo == SIGUSR2)
+    /* If the signal was sent using sigqueue, the value selects the
+       subsystem.  */
+    debug_level_signal (si->ssi_signo, si->ssi_int);
+}
+
 int
 main (int argc, char *argv[])
 {
   g_thread_init (NULL);
   g_type_init ();
 
+  /* Like smart-storage-logger, change the debug levels on SIGUSR1
+     and SIGUSR2.  (The debug levels can also be set using
+     org.woodchuck.stats.SetDebugLevel.)  Do this before we start any
+     threads so that they inherit the signal mask.  */
+  {
+    sigset_t signal_mask;
+    sigemptyset (&signal_mask);
+    sigaddset (&signal_mask, SIGUSR1);
+    sigaddset (&signal_mask, SIGUSR2);
+
+    WCSignalHandler *sh = wc_signal_handler_new (&signal_mask);
+    g_signal_connect (G_OBJECT (sh), "unix-signal",
+		      G_CALLBACK (unix_signal_handler), NULL);
+  }
+
   int err = dotdir_init ("murmeltier");
   if (err)
     {
@@ -2942,6 +3237,8 @@ main (int argc, char *argv[])
   /* Wait a while before timing out.  */
   sqlite3_busy_timeout (db, 5 * 60 * 1000);
 
+  stats_sqlite_profile (db);
+
   char *errmsg = NULL;
   sqlite3_exec
     (db,
@@ -3014,7 +3311,11 @@ main (int argc, char *argv[])
      " (uuid NOT NULL, instance NOT NULL, parent_uuid NOT NULL,"
      "  reported, start, duration, use_mask);"
      "create index if not exists object_use_parent_uuid_index"
-     " on object_use (parent_uuid);",
+     " on object_use (parent_uuid);"
+
+     /* Unregistered streams and managers whose rows in the above
+	tables have not yet been deleted.  See reap_orphans.  */
+     "create table if not exists orphaned_parents (uuid PRIMARY KEY);",
      NULL, NULL, &errmsg);
   if (errmsg)
     {
@@ -3039,6 +3340,11 @@ main (int argc, char *argv[])
   properties_init ();
   murmeltier_dbus_server_init ();
 
+  /* Finish any reaping that was interrupted.  */
+  reap_orphans_schedule ();
+
+  stats_init ();
+
   mt = MURMELTIER (g_object_new (MURMELTIER_TYPE, NULL));
   if (! mt)
     {
@@ -0,0 +1,1121 @@
+/* process-monitor-fanotify.c - Process monitor using fanotify.
+   Copyright 2011 Neal H. Walfield <neal@walfield.org>
+
+   This file is part of Woodchuck.
+
+   Woodchuck is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "config.h"
+
+#define DEBUG_SUBSYSTEM PTRACE
+
+#include "debug.h"
+
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <glib.h>
+#ifdef HAVE_SYS_FANOTIFY_H
+# include <sys/fanotify.h>
+#endif
+#ifdef HAVE_LINUX_CN_PROC_H
+# include <linux/netlink.h>
+# include <linux/connector.h>
+# include <linux/cn_proc.h>
+#endif
+
+#include "process-monitor-ptrace.h"
+#include "process-monitor-fanotify.h"
+#include "util.h"
+
+#ifdef HAVE_SYS_FANOTIFY_H
+
+/* A process that is being traced, either because the user asked us
+   to trace it or because it is a descendant of such a process.  */
+struct pcb
+{
+  pid_t pid;
+
+  /* The parent process, if it is also being traced.  */
+  struct pcb *parent;
+
+  /* Whether the user explicitly asked us to trace this process.  */
+  bool top_level;
+
+  /* The executable, arg0 and arg1.  ARG0 and ARG1 are allocated out
+     of the same memory as EXE.  */
+  char *exe;
+  char *arg0;
+  char *arg1;
+};
+
+#define PCB_FMT "%d (%s)"
+#define PCB_PRINTF(pcb) (pcb)->pid, (pcb)->exe
+
+/* The monitor thread.  */
+static pthread_t process_monitor_tid;
+
+/* Maps pids to struct pcb *'s.  Only accessed by the monitor
+   thread.  */
+static GHashTable *pcbs;
+
+/* The set of pids that are not descendants of a traced process.
+   Without it, we would have to walk the ancestry of every process
+   that accesses a file on a monitored mount each time it does so.
+   The entries are removed when the process exits; if the process
+   events connector is not available, we can't tell when that
+   happens and the set is flushed every UNTRACED_FLUSH_PERIOD ms.  */
+static GHashTable *untraced;
+static uint64_t untraced_flushed;
+#define UNTRACED_FLUSH_PERIOD 1000
+
+static int fanotify_fd = -1;
+static int proc_connector_fd = -1;
+/* /proc/self/mountinfo.  Becomes readable with POLLPRI when the
+   mounts change.  */
+static int mountinfo_fd = -1;
+
+/* Non-zero if we are trying to quit.  */
+static uint64_t quit;
+
+/* Events occur in the process monitor thread, which need to be
+   forwarded to the user.  We need to make callbacks in the main
+   thread.  We do this by using an idle handler (g_idle_add is thread
+   safe).  */
+static guint callback_id;
+
+static pthread_mutex_t pending_callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+static GSList *pending_callbacks;
+
+static gboolean
+callback_manager (gpointer user_data)
+{
+  /* Executed in the context of the main thread.  */
+  assert (! pthread_equal (pthread_self (), process_monitor_tid));
+
+  GSList *cbs;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&pending_callbacks_lock);
+
+      cbs = pending_callbacks;
+      pending_callbacks = NULL;
+
+      if (! cbs)
+	/* Only clear the signal id once we are done processing
+	   everything.  */
+	callback_id = 0;
+
+      pthread_mutex_unlock (&pending_callbacks_lock);
+
+      if (! cbs)
+	/* Don't call again.  */
+	return false;
+
+      /* Make the callbacks in order.  */
+      cbs = g_slist_reverse (cbs);
+      while (cbs)
+	{
+	  struct wc_process_monitor_cb *cb = cbs->data;
+
+	  debug (4, "Executing %p (%s)",
+		 cb, wc_process_monitor_cb_str (cb->cb));
+
+	  cbs = g_slist_delete_link (cbs, cbs);
+
+	  process_monitor_callback (cb);
+
+	  g_free (cb);
+	}
+    }
+}
+
+/* Return PCB's top-level process or NULL, if it doesn't have one.  */
+static struct pcb *
+pcb_top_level (struct pcb *pcb)
+{
+  while (pcb && ! pcb->top_level)
+    pcb = pcb->parent;
+  return pcb;
+}
+
+/* Enqueue a callback of type OP on behalf of PCB.  Unlike the ptrace
+   backend, the strings are copied into the callback and so a process
+   that execs or exits need not wait for its pending callbacks to be
+   delivered before freeing them.  */
+static void
+callback_enqueue (struct pcb *pcb, int op, const char *filename,
+		  int flags, struct stat *stat_buf)
+{
+  struct pcb *tl = pcb_top_level (pcb);
+  assert (tl);
+
+  const char *strings[] = { filename, tl->exe, tl->arg0, tl->arg1,
+			    pcb->exe, pcb->arg0, pcb->arg1 };
+  int lens[sizeof (strings) / sizeof (strings[0])];
+  int total = 0;
+  int i;
+  for (i = 0; i < sizeof (strings) / sizeof (strings[0]); i ++)
+    {
+      lens[i] = strings[i] ? strlen (strings[i]) + 1 : 0;
+      total += lens[i];
+    }
+
+  struct wc_process_monitor_cb *cb
+    = g_malloc0 (sizeof (struct wc_process_monitor_cb) + total);
+
+  char *copies[sizeof (strings) / sizeof (strings[0])];
+  char *end = (void *) cb + sizeof (struct wc_process_monitor_cb);
+  for (i = 0; i < sizeof (strings) / sizeof (strings[0]); i ++)
+    if (strings[i])
+      {
+	copies[i] = end;
+	end = mempcpy (end, strings[i], lens[i]);
+      }
+    else
+      copies[i] = NULL;
+
+  cb->cb = op;
+  cb->timestamp = cb->last_timestamp = now ();
+  cb->count = 1;
+
+  cb->top_levels_pid = tl->pid;
+  cb->top_levels_exe = copies[1];
+  cb->top_levels_arg0 = copies[2];
+  cb->top_levels_arg1 = copies[3];
+
+  cb->actor_pid = pcb->pid;
+  cb->actor_exe = copies[4];
+  cb->actor_arg0 = copies[5];
+  cb->actor_arg1 = copies[6];
+
+  struct stat zero;
+  if (! stat_buf)
+    /* STAT_BUF may be NULL.  Don't seg fault.  */
+    {
+      memset (&zero, 0, sizeof (zero));
+      stat_buf = &zero;
+    }
+
+  switch (op)
+    {
+    case WC_PROCESS_OPEN_CB:
+      cb->open.filename = copies[0];
+      cb->open.flags = flags;
+      cb->open.stat = *stat_buf;
+      break;
+    case WC_PROCESS_CLOSE_CB:
+      cb->close.filename = copies[0];
+      cb->close.stat = *stat_buf;
+      break;
+    case WC_PROCESS_EXIT_CB:
+      break;
+    case WC_PROCESS_TRACING_CB:
+      cb->tracing.added = flags;
+      break;
+    default:
+      debug (0, "Unexpected callback: %d", op);
+      assert (0 == 1);
+    }
+
+  debug (4, "Enqueuing %p: %d: %s(%d) (%s)",
+	 cb, cb->top_levels_pid,
+	 wc_process_monitor_cb_str (cb->cb), cb->cb, copies[0]);
+
+  pthread_mutex_lock (&pending_callbacks_lock);
+  pending_callbacks = g_slist_prepend (pending_callbacks, cb);
+  if (! callback_id)
+    callback_id = g_idle_add (callback_manager, NULL);
+  pthread_mutex_unlock (&pending_callbacks_lock);
+}
+
+/* Read PCB's executable and its first two arguments.  */
+static void
+pcb_read_exe (struct pcb *pcb)
+{
+  g_free (pcb->exe);
+  pcb->exe = pcb->arg0 = pcb->arg1 = NULL;
+
+  char exe_link[32];
+  snprintf (exe_link, sizeof (exe_link), "/proc/%d/exe", pcb->pid);
+  char exe[256];
+  int exe_len = readlink (exe_link, exe, sizeof (exe) - 1);
+  if (exe_len < 0)
+    {
+      debug (0, "Failed to read link %s: %m", exe_link);
+      exe_len = 0;
+    }
+  exe[exe_len] = 0;
+
+  char cmdline[32];
+  snprintf (cmdline, sizeof (cmdline), "/proc/%d/cmdline", pcb->pid);
+  /* Arguments are separated by NUL terminators.  Make sure the
+     buffer is terminated even if the command line is truncated.  */
+  char buffer[513];
+  int length = 0;
+  int fd = open (cmdline, O_RDONLY);
+  if (fd < 0)
+    debug (0, "Error opening %s: %m", cmdline);
+  else
+    {
+      length = read (fd, buffer, sizeof (buffer) - 1);
+      close (fd);
+      if (length < 0)
+	length = 0;
+    }
+  buffer[length] = 0;
+
+  const char *arg0 = length > 0 ? buffer : NULL;
+  int arg0len = arg0 ? strlen (arg0) + 1 : 0;
+  const char *arg1 = arg0len < length ? buffer + arg0len : NULL;
+  int arg1len = arg1 ? strlen (arg1) + 1 : 0;
+
+  pcb->exe = g_malloc (exe_len + 1 + arg0len + arg1len);
+  char *end = mempcpy (pcb->exe, exe, exe_len + 1);
+  if (arg0)
+    {
+      pcb->arg0 = end;
+      end = mempcpy (end, arg0, arg0len);
+    }
+  if (arg1)
+    {
+      pcb->arg1 = end;
+      end = mempcpy (end, arg1, arg1len);
+    }
+}
+
+static struct pcb *
+pcb_new (pid_t pid, struct pcb *parent)
+{
+  struct pcb *pcb = g_malloc0 (sizeof (*pcb));
+  pcb->pid = pid;
+  pcb->parent = parent;
+  pcb_read_exe (pcb);
+
+  g_hash_table_insert (pcbs, (gpointer) (uintptr_t) pid, pcb);
+  g_hash_table_remove (untraced, (gpointer) (uintptr_t) pid);
+
+  debug (4, "Now tracing "PCB_FMT" (parent: %d)",
+	 PCB_PRINTF (pcb), parent ? parent->pid : 0);
+
+  return pcb;
+}
+
+/* Stop tracing PCB.  Any children are reparented to PCB's parent.
+   If PCB is a top-level process and NOTIFY is true, the user is told
+   that the process exited.  */
+static void
+pcb_free (struct pcb *pcb, bool notify)
+{
+  if (! g_hash_table_remove (pcbs, (gpointer) (uintptr_t) pcb->pid))
+    {
+      debug (0, "Failed to remove pcb "PCB_FMT" from hash table?!?",
+	     PCB_PRINTF (pcb));
+      assert (0 == 1);
+    }
+
+  if (pcb->top_level && notify)
+    callback_enqueue (pcb, WC_PROCESS_EXIT_CB, NULL, 0, NULL);
+
+  void iter (gpointer key, gpointer value, gpointer user_data)
+  {
+    struct pcb *p = value;
+    if (p->parent == pcb)
+      p->parent = pcb->parent;
+  }
+  g_hash_table_foreach (pcbs, iter, NULL);
+
+  debug (4, "No longer tracing "PCB_FMT, PCB_PRINTF (pcb));
+
+  g_free (pcb->exe);
+  g_free (pcb);
+}
+
+/* Stop tracing TL, which is a top-level process, and any of its
+   descendants that are not themselves top-level processes.  */
+static void
+pcb_free_tree (struct pcb *tl, bool notify)
+{
+  assert (tl->top_level);
+
+  GSList *dofree = NULL;
+  void iter (gpointer key, gpointer value, gpointer user_data)
+  {
+    struct pcb *p = value;
+    if (p != tl && pcb_top_level (p) == tl)
+      dofree = g_slist_prepend (dofree, p);
+  }
+  g_hash_table_foreach (pcbs, iter, NULL);
+
+  while (dofree)
+    {
+      struct pcb *p = dofree->data;
+      dofree = g_slist_delete_link (dofree, dofree);
+
+      /* Don't leave dangling pointers to the tree in the
+	 set.  */
+      p->parent = NULL;
+      pcb_free (p, false);
+    }
+
+  pcb_free (tl, notify);
+}
+
+/* Return the parent of process PID or 0 if it can't be
+   determined.  */
+static pid_t
+pid_to_ppid (pid_t pid)
+{
+  char filename[32];
+  snprintf (filename, sizeof (filename), "/proc/%d/stat", pid);
+
+  char buffer[512];
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  int length = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  if (length <= 0)
+    return 0;
+  buffer[length] = 0;
+
+  /* The format is: "pid (comm) state ppid ...".  COMM may contain
+     spaces and parentheses so look for the last closing
+     parenthesis.  */
+  char *p = strrchr (buffer, ')');
+  pid_t ppid;
+  char state;
+  if (! p || sscanf (p + 1, " %c %d", &state, &ppid) != 2)
+    return 0;
+  return ppid;
+}
+
+/* Return the PCB for process PID, or NULL if PID is not a
+   descendant of a traced process.  If we don't know about PID yet
+   (because we haven't yet seen the fork event or the process events
+   connector is not available), look up its ancestry.  */
+static struct pcb *
+pcb_find (pid_t pid)
+{
+  struct pcb *pcb = g_hash_table_lookup (pcbs, (gpointer) (uintptr_t) pid);
+  if (pcb)
+    return pcb;
+
+  if (proc_connector_fd == -1
+      && now () - untraced_flushed > UNTRACED_FLUSH_PERIOD)
+    {
+      g_hash_table_remove_all (untraced);
+      untraced_flushed = now ();
+    }
+
+  if (g_hash_table_lookup (untraced, (gpointer) (uintptr_t) pid))
+    return NULL;
+
+  /* Walk up the ancestry until we find a traced process, an
+     untraced process or init.  */
+  pid_t chain[32];
+  int n = 0;
+  pid_t p = pid;
+  while (p > 1 && n < sizeof (chain) / sizeof (chain[0]))
+    {
+      chain[n ++] = p;
+
+      p = pid_to_ppid (p);
+      if (p <= 1)
+	break;
+
+      pcb = g_hash_table_lookup (pcbs, (gpointer) (uintptr_t) p);
+      if (pcb)
+	break;
+
+      if (g_hash_table_lookup (untraced, (gpointer) (uintptr_t) p))
+	break;
+    }
+
+  if (! pcb)
+    {
+      int i;
+      for (i = 0; i < n; i ++)
+	g_hash_table_insert (untraced, (gpointer) (uintptr_t) chain[i],
+			     (gpointer) (uintptr_t) 1);
+      return NULL;
+    }
+
+  /* Add the intermediate processes.  */
+  int i;
+  for (i = n - 1; i >= 0; i --)
+    pcb = pcb_new (chain[i], pcb);
+
+  return pcb;
+}
+
+/* Mark the mount containing PATH.  */
+static void
+mount_mark (const char *path)
+{
+  if (fanotify_mark (fanotify_fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+		     FAN_OPEN | FAN_CLOSE, AT_FDCWD, path) < 0)
+    debug (0, "fanotify_mark (%s): %m", path);
+  else
+    debug (3, "Monitoring the mount containing %s", path);
+}
+
+/* Mark the mounts that may contain whitelisted files: those whose
+   mount point is whitelisted and those that contain a whitelisted
+   top-level directory (e.g., if /home is not a separate file system,
+   the root file system).  Marking a mount twice is harmless.  */
+static void
+mounts_mark (void)
+{
+  DIR *dir = opendir ("/");
+  if (dir)
+    {
+      struct dirent *dirent;
+      while ((dirent = readdir (dir)))
+	{
+	  if (strcmp (dirent->d_name, ".") == 0
+	      || strcmp (dirent->d_name, "..") == 0)
+	    continue;
+
+	  char path[strlen (dirent->d_name) + 2];
+	  sprintf (path, "/%s", dirent->d_name);
+	  if (process_monitor_filename_whitelisted (path))
+	    mount_mark (path);
+	}
+      closedir (dir);
+    }
+
+  FILE *f = fopen ("/proc/self/mountinfo", "r");
+  if (! f)
+    {
+      debug (0, "Opening /proc/self/mountinfo: %m");
+      return;
+    }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  while (getline (&line, &line_size, f) > 0)
+    {
+      /* The format is: "id parent major:minor root mount-point ...".
+	 Spaces, etc. in the mount point are escaped as \ooo.  */
+      char *mount_point = NULL;
+      if (sscanf (line, "%*s %*s %*s %*s %ms", &mount_point) != 1)
+	continue;
+
+      char *s = mount_point;
+      char *d = mount_point;
+      while (*s)
+	if (s[0] == '\\' && s[1] && s[2] && s[3])
+	  {
+	    *d ++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+	    s += 4;
+	  }
+	else
+	  *d ++ = *s ++;
+      *d = 0;
+
+      if (process_monitor_filename_whitelisted (mount_point))
+	mount_mark (mount_point);
+
+      free (mount_point);
+    }
+  free (line);
+  fclose (f);
+}
+
+static void
+fanotify_process (void)
+{
+  char buffer[4096]
+    __attribute__ ((aligned (__alignof__ (struct fanotify_event_metadata))));
+
+  for (;;)
+    {
+      int len = read (fanotify_fd, buffer, sizeof (buffer));
+      if (len < 0)
+	{
+	  if (errno != EAGAIN && errno != EINTR)
+	    debug (0, "Reading fanotify events: %m");
+	  return;
+	}
+
+      struct fanotify_event_metadata *m = (void *) buffer;
+      for (; FAN_EVENT_OK (m, len); m = FAN_EVENT_NEXT (m, len))
+	{
+	  if (m->vers != FANOTIFY_METADATA_VERSION)
+	    {
+	      debug (0, "Unsupported fanotify metadata version (%d)",
+		     m->vers);
+	      return;
+	    }
+
+	  if ((m->mask & FAN_Q_OVERFLOW))
+	    debug (0, "fanotify queue overflowed: events lost");
+
+	  if (m->fd < 0)
+	    continue;
+
+	  struct pcb *pcb = pcb_find (m->pid);
+	  if (! pcb)
+	    {
+	      close (m->fd);
+	      continue;
+	    }
+
+	  char fd_link[32];
+	  snprintf (fd_link, sizeof (fd_link), "/proc/self/fd/%d", m->fd);
+	  char filename[PATH_MAX];
+	  int filename_len = readlink (fd_link, filename,
+				       sizeof (filename) - 1);
+	  if (filename_len < 0)
+	    {
+	      debug (0, "Failed to read link %s: %m", fd_link);
+	      close (m->fd);
+	      continue;
+	    }
+	  filename[filename_len] = 0;
+
+	  if (process_monitor_filename_whitelisted (filename))
+	    {
+	      struct stat stat_buf;
+	      if (fstat (m->fd, &stat_buf) < 0)
+		memset (&stat_buf, 0, sizeof (stat_buf));
+
+	      /* The kernel merges events for the same file and process
+		 that are still queued.  If both an open and a close
+		 are reported, the open happened first.  */
+	      if ((m->mask & FAN_OPEN))
+		callback_enqueue (pcb, WC_PROCESS_OPEN_CB, filename,
+				  O_RDONLY, &stat_buf);
+	      if ((m->mask & FAN_CLOSE))
+		callback_enqueue (pcb, WC_PROCESS_CLOSE_CB, filename,
+				  0, &stat_buf);
+	    }
+
+	  close (m->fd);
+	}
+    }
+}
+
+#ifdef HAVE_LINUX_CN_PROC_H
+/* Connect to the process events connector.  Returns -1 on
+   failure.  */
+static int
+proc_connector_open (void)
+{
+  int fd = socket (PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		   NETLINK_CONNECTOR);
+  if (fd < 0)
+    {
+      debug (0, "Creating process events connector socket: %m");
+      return -1;
+    }
+
+  struct sockaddr_nl addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  addr.nl_pid = 0;
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      debug (0, "Binding process events connector socket: %m");
+      close (fd);
+      return -1;
+    }
+
+  struct
+  {
+    struct nlmsghdr nl_hdr;
+    struct __attribute__ ((__packed__))
+    {
+      struct cn_msg cn_msg;
+      enum proc_cn_mcast_op op;
+    };
+  } msg;
+  memset (&msg, 0, sizeof (msg));
+  msg.nl_hdr.nlmsg_len = sizeof (msg);
+  msg.nl_hdr.nlmsg_pid = getpid ();
+  msg.nl_hdr.nlmsg_type = NLMSG_DONE;
+  msg.cn_msg.id.idx = CN_IDX_PROC;
+  msg.cn_msg.id.val = CN_VAL_PROC;
+  msg.cn_msg.len = sizeof (enum proc_cn_mcast_op);
+  msg.op = PROC_CN_MCAST_LISTEN;
+  if (send (fd, &msg, sizeof (msg), 0) < 0)
+    {
+      debug (0, "Subscribing to process events: %m");
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+static void
+proc_connector_process (void)
+{
+  char buffer[4096]
+    __attribute__ ((aligned (NLMSG_ALIGNTO)));
+
+  for (;;)
+    {
+      int len = recv (proc_connector_fd, buffer, sizeof (buffer), 0);
+      if (len < 0)
+	{
+	  if (errno == ENOBUFS)
+	    /* We lost some events.  pcb_find will recover new
+	       processes.  Exits, however, are lost.  */
+	    {
+	      debug (0, "Process events connector overflowed");
+	      g_hash_table_remove_all (untraced);
+	      continue;
+	    }
+	  if (errno != EAGAIN && errno != EINTR)
+	    debug (0, "Reading process events: %m");
+	  return;
+	}
+
+      struct nlmsghdr *nl_hdr = (void *) buffer;
+      for (; NLMSG_OK (nl_hdr, len); nl_hdr = NLMSG_NEXT (nl_hdr, len))
+	{
+	  if (nl_hdr->nlmsg_type == NLMSG_NOOP
+	      || nl_hdr->nlmsg_type == NLMSG_ERROR)
+	    continue;
+
+	  struct cn_msg *cn_msg = NLMSG_DATA (nl_hdr);
+	  if (cn_msg->id.idx != CN_IDX_PROC || cn_msg->id.val != CN_VAL_PROC)
+	    continue;
+
+	  struct proc_event *ev = (void *) cn_msg->data;
+	  struct pcb *pcb;
+	  switch (ev->what)
+	    {
+	    case PROC_EVENT_FORK:
+	      if (ev->event_data.fork.child_pid
+		  != ev->event_data.fork.child_tgid)
+		/* A new thread.  */
+		break;
+
+	      pcb = g_hash_table_lookup
+		(pcbs,
+		 (gpointer) (uintptr_t) ev->event_data.fork.parent_tgid);
+	      if (pcb)
+		pcb_new (ev->event_data.fork.child_tgid, pcb);
+	      else if (g_hash_table_lookup
+		       (untraced,
+			(gpointer) (uintptr_t) ev->event_data.fork.parent_tgid))
+		g_hash_table_insert
+		  (untraced,
+		   (gpointer) (uintptr_t) ev->event_data.fork.child_tgid,
+		   (gpointer) (uintptr_t) 1);
+	      break;
+
+	    case PROC_EVENT_EXEC:
+	      pcb = g_hash_table_lookup
+		(pcbs,
+		 (gpointer) (uintptr_t) ev->event_data.exec.process_tgid);
+	      if (pcb)
+		{
+		  pcb_read_exe (pcb);
+		  debug (4, "%d exec'd %s", pcb->pid, pcb->exe);
+		}
+	      break;
+
+	    case PROC_EVENT_EXIT:
+	      if (ev->event_data.exit.process_pid
+		  != ev->event_data.exit.process_tgid)
+		/* A thread exited.  */
+		break;
+
+	      g_hash_table_remove
+		(untraced,
+		 (gpointer) (uintptr_t) ev->event_data.exit.process_tgid);
+
+	      pcb = g_hash_table_lookup
+		(pcbs,
+		 (gpointer) (uintptr_t) ev->event_data.exit.process_tgid);
+	      if (pcb)
+		{
+		  if (pcb->top_level)
+		    pcb_free_tree (pcb, true);
+		  else
+		    pcb_free (pcb, true);
+		}
+	      break;
+
+	    default:
+	      break;
+	    }
+	}
+    }
+}
+#endif
+
+/* Without the process events connector, we don't find out when a
+   process exits.  Periodically check whether the processes that we
+   are tracing still exist.  */
+static void
+pcbs_reap (void)
+{
+  GSList *dead = NULL;
+  void iter (gpointer key, gpointer value, gpointer user_data)
+  {
+    struct pcb *pcb = value;
+    char filename[32];
+    snprintf (filename, sizeof (filename), "/proc/%d", pcb->pid);
+    if (access (filename, F_OK) < 0)
+      dead = g_slist_prepend (dead, key);
+  }
+  g_hash_table_foreach (pcbs, iter, NULL);
+
+  struct pcb *pcb;
+  while (dead)
+    {
+      /* Freeing a tree may free other dead processes.  Look the pid
+	 up again.  */
+      pcb = g_hash_table_lookup (pcbs, dead->data);
+      dead = g_slist_delete_link (dead, dead);
+
+      if (! pcb)
+	continue;
+
+      debug (4, PCB_FMT" exited", PCB_PRINTF (pcb));
+      if (pcb->top_level)
+	pcb_free_tree (pcb, true);
+      else
+	pcb_free (pcb, true);
+    }
+}
+
+static void
+process_trace (pid_t pid)
+{
+  /* PID or one of its descendants may be in the untraced set.  */
+  g_hash_table_remove_all (untraced);
+
+  char filename[32];
+  snprintf (filename, sizeof (filename), "/proc/%d", pid);
+  bool exists = access (filename, F_OK) == 0;
+
+  struct pcb *pcb = g_hash_table_lookup (pcbs, (gpointer) (uintptr_t) pid);
+  if (pcb && pcb->top_level)
+    {
+      debug (0, "Already tracing "PCB_FMT, PCB_PRINTF (pcb));
+      return;
+    }
+  if (! pcb)
+    pcb = pcb_new (pid, NULL);
+
+  /* The user is explicitly adding this process.  Make it a top-level
+     process.  */
+  pcb->top_level = true;
+
+  if (! exists)
+    {
+      debug (0, "Failed to trace process %d: %m", pid);
+      callback_enqueue (pcb, WC_PROCESS_TRACING_CB, NULL, false, NULL);
+      pcb_free_tree (pcb, false);
+      return;
+    }
+
+  debug (3, "Now tracing "PCB_FMT, PCB_PRINTF (pcb));
+  callback_enqueue (pcb, WC_PROCESS_TRACING_CB, NULL, true, NULL);
+}
+
+static void
+process_untrace (pid_t pid)
+{
+  struct pcb *pcb = g_hash_table_lookup (pcbs, (gpointer) (uintptr_t) pid);
+  if (! pcb || ! pcb->top_level)
+    {
+      debug (0, "Can't untrace %d: not a top-level process", pid);
+      return;
+    }
+
+  pcb_free_tree (pcb, false);
+}
+
+enum process_monitor_commands
+  {
+    PROCESS_MONITOR_QUIT = 1,
+    PROCESS_MONITOR_TRACE,
+    PROCESS_MONITOR_UNTRACE,
+  };
+
+struct process_monitor_command
+{
+  enum process_monitor_commands command;
+  /* Only valid for PROCESS_MONITOR_TRACE and PROCESS_MONITOR_UNTRACE.  */
+  int pid;
+};
+
+static pthread_mutex_t process_monitor_commands_lock
+  = PTHREAD_MUTEX_INITIALIZER;
+static GSList *process_monitor_commands;
+/* Written to when a command is queued to wake the monitor
+   thread.  */
+static int process_monitor_commands_pipe[2] = { -1, -1 };
+
+static void
+process_monitor_command (enum process_monitor_commands command, pid_t pid)
+{
+  assert (! pthread_equal (pthread_self (), process_monitor_tid));
+
+  if (quit)
+    {
+      debug (0, "Not queuing command: monitor already quit.");
+      return;
+    }
+
+  struct process_monitor_command *cmd = g_malloc (sizeof (*cmd));
+  cmd->command = command;
+  cmd->pid = pid;
+
+  pthread_mutex_lock (&process_monitor_commands_lock);
+  process_monitor_commands = g_slist_prepend (process_monitor_commands, cmd);
+  if (! process_monitor_commands->next)
+    /* This is the only event.  Wake the monitor.  */
+    {
+      char c = 0;
+      if (write (process_monitor_commands_pipe[1], &c, 1) < 0)
+	debug (0, "Waking process monitor: %m");
+    }
+  pthread_mutex_unlock (&process_monitor_commands_lock);
+}
+
+static void *
+process_monitor (void *arg)
+{
+  debug (1, "Process monitor (fanotify) running%s.",
+	 proc_connector_fd == -1 ? " (without process events)" : "");
+
+  uint64_t last_reap = now ();
+
+  while (! quit)
+    {
+      struct pollfd fds[4];
+      int nfds = 0;
+      fds[nfds].fd = process_monitor_commands_pipe[0];
+      fds[nfds ++].events = POLLIN;
+      fds[nfds].fd = fanotify_fd;
+      fds[nfds ++].events = POLLIN;
+      fds[nfds].fd = mountinfo_fd;
+      fds[nfds ++].events = POLLPRI;
+      fds[nfds].fd = proc_connector_fd;
+      fds[nfds ++].events = POLLIN;
+
+      int ret = poll (fds, nfds,
+		      proc_connector_fd == -1 ? UNTRACED_FLUSH_PERIOD : -1);
+      if (ret < 0)
+	{
+	  if (errno != EINTR)
+	    debug (0, "poll: %m");
+	  continue;
+	}
+
+#ifdef HAVE_LINUX_CN_PROC_H
+      /* Process the connector's events first so that we know about
+	 new processes before seeing their file accesses.  */
+      if ((fds[3].revents & POLLIN))
+	proc_connector_process ();
+#endif
+
+      if ((fds[1].revents & POLLIN))
+	fanotify_process ();
+
+      if ((fds[2].revents & (POLLPRI | POLLERR)))
+	{
+	  debug (3, "Mounts changed.");
+	  mounts_mark ();
+	  lseek (mountinfo_fd, 0, SEEK_SET);
+	  /* Reading resets the event.  */
+	  char buffer[4096];
+	  while (read (mountinfo_fd, buffer, sizeof (buffer)) > 0)
+	    ;
+	}
+
+      if (proc_connector_fd == -1 && now () - last_reap > 1000)
+	{
+	  pcbs_reap ();
+	  last_reap = now ();
+	}
+
+      if ((fds[0].revents & POLLIN))
+	{
+	  char buffer[16];
+	  if (read (process_monitor_commands_pipe[0],
+		    buffer, sizeof (buffer)) < 0)
+	    debug (0, "Reading command pipe: %m");
+
+	  pthread_mutex_lock (&process_monitor_commands_lock);
+	  GSList *commands = g_slist_reverse (process_monitor_commands);
+	  process_monitor_commands = NULL;
+	  pthread_mutex_unlock (&process_monitor_commands_lock);
+
+	  while (commands)
+	    {
+	      struct process_monitor_command *cmd = commands->data;
+	      commands = g_slist_delete_link (commands, commands);
+
+	      switch (cmd->command)
+		{
+		case PROCESS_MONITOR_QUIT:
+		  quit = now ();
+		  break;
+
+		case PROCESS_MONITOR_TRACE:
+		  if (quit)
+		    debug (0, "Not tracing %d: shutting down", cmd->pid);
+		  else
+		    process_trace (cmd->pid);
+		  break;
+
+		case PROCESS_MONITOR_UNTRACE:
+		  process_untrace (cmd->pid);
+		  break;
+
+		default:
+		  debug (0, "Bad process monitor command %d: "
+			 "memory corruption?",
+			 cmd->command);
+		  break;
+		}
+
+	      g_free (cmd);
+	    }
+	}
+    }
+
+  close (fanotify_fd);
+  fanotify_fd = -1;
+  if (proc_connector_fd != -1)
+    {
+      close (proc_connector_fd);
+      proc_connector_fd = -1;
+    }
+  if (mountinfo_fd != -1)
+    {
+      close (mountinfo_fd);
+      mountinfo_fd = -1;
+    }
+
+  debug (0, DEBUG_BOLD ("Process monitor exited."));
+  return NULL;
+}
+
+bool
+wc_process_monitor_fanotify_init (void)
+{
+  assert (! pthread_equal (pthread_self (), process_monitor_tid));
+
+  fanotify_fd = fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK,
+			       O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+  if (fanotify_fd < 0)
+    {
+      debug (0, "fanotify_init: %m");
+      return false;
+    }
+
+  pcbs = g_hash_table_new (g_direct_hash, g_direct_equal);
+  untraced = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  mounts_mark ();
+  mountinfo_fd = open ("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+  if (mountinfo_fd < 0)
+    debug (0, "Opening /proc/self/mountinfo: %m");
+
+#ifdef HAVE_LINUX_CN_PROC_H
+  proc_connector_fd = proc_connector_open ();
+#endif
+
+  if (pipe (process_monitor_commands_pipe) < 0)
+    {
+      debug (0, "pipe: %m");
+      close (fanotify_fd);
+      fanotify_fd = -1;
+      return false;
+    }
+  fcntl (process_monitor_commands_pipe[0], F_SETFL, O_NONBLOCK);
+
+  pthread_create (&process_monitor_tid, NULL, process_monitor, NULL);
+
+  return true;
+}
+
+bool
+wc_process_monitor_fanotify_trace (pid_t pid)
+{
+  process_monitor_command (PROCESS_MONITOR_TRACE, pid);
+  return true;
+}
+
+void
+wc_process_monitor_fanotify_untrace (pid_t pid)
+{
+  process_monitor_command (PROCESS_MONITOR_UNTRACE, pid);
+}
+
+void
+wc_process_monitor_fanotify_quit (void)
+{
+  process_monitor_command (PROCESS_MONITOR_QUIT, 0);
+
+  int err = pthread_join (process_monitor_tid, NULL);
+  if (err)
+    {
+      errno = err;
+      debug (0, "joining monitor thread: %m");
+    }
+}
+
+#else /* ! HAVE_SYS_FANOTIFY_H */
+
+bool
+wc_process_monitor_fanotify_init (void)
+{
+  debug (0, "fanotify is not supported on this system.");
+  return false;
+}
+
+void
+wc_process_monitor_fanotify_quit (void)
+{
+}
+
+bool
+wc_process_monitor_fanotify_trace (pid_t pid)
+{
+  return false;
+}
+
+void
+wc_process_monitor_fanotify_untrace (pid_t pid)
+{
+}
+
+#endif
@@ -0,0 +1,59 @@
+/* process-monitor-fanotify.h - Process monitor using fanotify.
+   Copyright 2011 Neal H. Walfield <neal@walfield.org>
+
+   This file is part of Woodchuck.
+
+   Woodchuck is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef WOODCHUCK_PROCESS_MONITOR_FANOTIFY_H
+#define WOODCHUCK_PROCESS_MONITOR_FANOTIFY_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/* This backend has the same interface as the ptrace backend: it
+   reports events by way of process_monitor_callback and consults
+   process_monitor_filename_whitelisted (see process-monitor-ptrace.h).
+   Instead of stopping the traced processes on each system call, it
+   asks the kernel to report file accesses on the mounts that contain
+   whitelisted files (fanotify) and attributes each access to a traced
+   process tree based on the accessing process's ancestry.  The
+   process events connector is used to follow forks, execs and exits;
+   if it is not available, the ancestry is read from /proc.
+
+   The differences are: the open flags are not known (OPEN callbacks
+   always have FLAGS set to O_RDONLY), and unlinks and renames are not
+   reported.
+
+   fanotify requires CAP_SYS_ADMIN; the process events connector
+   requires CAP_NET_ADMIN.  */
+
+/* Start the process monitor.  Returns false if fanotify is not
+   available, in which case the other functions must not be
+   called.  */
+extern bool wc_process_monitor_fanotify_init (void);
+
+/* Stop monitoring and wait for the monitor thread to exit.  */
+extern void wc_process_monitor_fanotify_quit (void);
+
+/* Attribute any file accesses by process PID and its descendants to
+   PID.  PID must be the unix process id; it may not be a thread
+   id.  */
+extern bool wc_process_monitor_fanotify_trace (pid_t pid);
+
+/* Stop attributing file accesses to PID.  */
+extern void wc_process_monitor_fanotify_untrace (pid_t pid);
+
+#endif
@@ -19,6 +19,8 @@
 
 #include "config.h"
 
+#define DEBUG_SUBSYSTEM PTRACE
+
 #include "debug.h"
 
 #include <unistd.h>
@@ -44,10 +46,40 @@
 #include <sys/fcntl.h>
 #include <limits.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+#include <link.h>
+#include <elf.h>
 #include <sqlite3.h>
+#ifdef HAVE_LINUX_SECCOMP_H
+# include <stddef.h>
+# include <signal.h>
+# include <poll.h>
+# include <sys/prctl.h>
+# include <sys/socket.h>
+# include <sys/signalfd.h>
+# include <linux/audit.h>
+# include <linux/filter.h>
+# include <linux/seccomp.h>
+#endif
+
+#ifndef PTRACE_O_TRACESECCOMP
+# define PTRACE_O_TRACESECCOMP 0x80
+# define PTRACE_EVENT_SECCOMP 7
+#endif
+#ifndef PTRACE_SEIZE
+# define PTRACE_SEIZE 0x4206
+# define PTRACE_LISTEN 0x4208
+# define PTRACE_EVENT_STOP 128
+#endif
 
 #include "signal-handler.h"
 #include "process-monitor-ptrace.h"
+#include "filename-whitelist.h"
 #include "files.h"
 #include "util.h"
 
@@ -128,6 +160,37 @@ tid_state (pid_t tid, const char *key)
   return value;
 }
 
+/* Return the time at which thread TID started (in clock ticks after
+   boot) or 0 if TID does not exist.  Together with the tid, this
+   identifies a thread: tids are reused.  */
+static uint64_t
+tid_start_time (pid_t tid)
+{
+  char filename[32];
+  snprintf (filename, sizeof (filename), "/proc/%d/stat", tid);
+
+  char buffer[512];
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  int length = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  if (length <= 0)
+    return 0;
+  buffer[length] = 0;
+
+  /* The format is: "pid (comm) state ppid ...".  COMM may contain
+     spaces and parentheses so look for the last closing parenthesis.
+     The start time is the 22nd field.  */
+  char *p = strrchr (buffer, ')');
+  unsigned long long start_time;
+  if (! p
+      || sscanf (p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+		 " %*u %*u %*d %*d %*d %*d %*d %*d %llu", &start_time) != 1)
+    return 0;
+  return start_time;
+}
+
 /* Given a Linux thread id, return the thread id of its process's
    group leader.  */
 static pid_t
@@ -173,19 +236,37 @@ tid_to_ppid (pid_t tid)
    state: we need to emulate the instruction we replaced and advance
    the thread's IP beyond the break point instruction.  */
 
-/* The patches for each library.  */
+/* The patches for a library (or executable).  We register a library
+   the first time we see it mapped executable in a traced process
+   (see thread_apply_patches).  All processes that map the same file
+   share the same patches.  */
 struct library_patch
 {
-  /* A prefix of the library's filename, as it appears in
-     /proc/pid/maps.  Any trailing characters from the set
-     "1234567890-.so" are acceptable.  */
+  /* The library's filename, as it appears in /proc/pid/maps.  */
   char *filename;
-  /* An array of patches.  */
+  /* The file's device and inode ("major:minor:inode"), as they appear
+     in /proc/pid/maps.  This is the key in LIBRARIES.  */
+  char *id;
+  /* An array of patches.  If PATCH_COUNT is 0, we have not yet
+     scanned the library.  If it is -1, the library has no
+     interesting system calls (or we failed to scan it).  */
   struct patch *patches;
   int patch_count;
   /* The size of the binary's executable section.  We assume that each
      binary has at most one executable section.  */
   uintptr_t size;
+  /* Whether this is the dynamic loader.  */
+  bool loader;
+};
+
+/* A library that is mapped (and patched) in a process.  */
+struct pcb_library
+{
+  struct library_patch *lib;
+  /* The address of the library's executable section.  */
+  uintptr_t base;
+  /* Used by thread_apply_patches to find unmapped libraries.  */
+  bool seen;
 };
 
 /* The maximum instruction length, in bytes.  */
@@ -210,28 +291,30 @@ struct patch
   char ins[INSTRUCTION_LEN_MAX];
 };
 
-/* The libraries we are interested in.  This is a static list, because
-   there are very few libraries that actually make system calls.
-   Because we only instrument these libraries, we might have false
-   negatives, i.e., we'll miss some interesting system calls.  That's
-   okay.  There are very few such binaries.  */
-struct library_patch library_patches[] =
-  {
-#define LIBRARY_LD 0
-    { "/lib/ld-", },
-    { "/lib/libc-", },
-    { "/lib/libpthread-", },
-  };
-#define LIBRARY_COUNT (sizeof (library_patches) / sizeof (library_patches[0]))
+/* The libraries that we have encountered: a hash from
+   struct library_patch.id to struct library_patch *s.  Very few
+   libraries actually make system calls (typically, the loader, the C
+   library and libpthread, and statically linked executables), but
+   we don't know which in advance: we scan each executable mapping
+   the first time we see it.  Libraries without any interesting
+   system calls end up with a PATCH_COUNT of -1 and cost nothing
+   after that.  */
+static GHashTable *libraries;
+/* The tracer threads share the libraries.  Held while a tracer looks
+   up, scans and applies libraries (see thread_apply_patches).  */
+static pthread_mutex_t libraries_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* We save patches in this db.  If we crash
-   smart-storage-logger-recover reverts any binary patches.  */
+   smart-storage-logger-recover reverts any binary patches.  The
+   tracer threads share the connection (it is opened in serialized
+   mode).  */
 static sqlite3 *process_patches_db;
 
 /* Load management.  */
 
 /* We monitor the tracing overhead of each thread.  If the load
-   appears to be too high, we can suspend tracing the thread.  */
+   appears to be too high, we trace the noisiest processes less
+   closely (see load_shed_maybe).  */
 
 struct load
 {
@@ -287,6 +370,9 @@ struct tcb
      name of the full.  */
   char *saved_src;
   struct stat *saved_stat;
+  /* Whether the pending unlink or rename only concerns files that
+     are not whitelisted.  */
+  bool saved_unreported;
 
   /* Ptrace has a few helpful options.  This field indicates whether
      we have tried to set them yet.  0: unintialized.  1: successfully
@@ -298,32 +384,41 @@ struct tcb
      field to true and detach at the next opportunity.  */
   bool stop_tracing;
 
-  /* If non-zero, we've decided to suspend the thread (for load
-     shedding purposes).  If less then 0, then we need to suspend it
-     at the next oppotunity.  If greater than 0, then it has been
-     suspended.  The absolute value is the time we wanted to suspend
-     it. */
+  /* If non-zero, we've decided to detach from the thread, but keep
+     its TCB (because its process reached PCB_SHED_DETACHED, see
+     load_shed_maybe).  If less then 0, then we need to detach at the
+     next oppotunity.  If greater than 0, then we detached.  The
+     absolute value is the time we decided to detach.  */
   int64_t suspended;
-
-  /* A file descriptor for accessing the process's memory.  */
-  int memfd;
-  /* The last time the memfd was used.  */
-  uint64_t memfd_lastuse;
+  /* If SUSPENDED is greater than 0, the thread's start time (see
+     tid_start_time).  If the thread with TID has a different start
+     time, the thread exited and the tid was reused.  */
+  uint64_t start_time;
+
+  /* If non-zero, the thread is executing system calls on our behalf
+     to install the system call filter (see seccomp_mode).  This is
+     the step.  */
+  int seccomp_inject;
+  /* The thread's registers before we started making it execute
+     system calls on our behalf.  */
+  void *seccomp_saved_regs;
+  /* The scratch page that we allocated in the process.  */
+  uintptr_t seccomp_page;
+  /* Signals that arrived while the thread was executing system calls
+     on our behalf.  We deliver them when we are done.  */
+  uint64_t seccomp_signals;
+  /* Whether the current system call was reported by the filter.
+     Before Linux 4.8, the filter's stop is followed by a system call
+     entry stop, which we must ignore.  */
+  bool seccomp_syscall;
 };
 
-/* A hash from tids to struct tcb *s.  */
-static GHashTable *tcbs;
-static int tcb_count;
-
-/* List of currently suspended threads (those threads we suspended to
-   reduce the load).  */
-static GSList *suspended_tcbs;
-
 /* Forwards.  */
 static struct tcb *thread_trace (pid_t tid, struct pcb *parent,
 				 bool already_ptracing);
 static void thread_untrace (struct tcb *tcb, bool need_detach);
 static struct pcb *pcb_parent (struct pcb *pcb);
+static void pcb_libs_free (struct pcb *pcb);
 
 /* A process's control block.  All threads in the same process are
    mapped to the same pcb.  */
@@ -370,348 +465,935 @@ struct pcb
   char *arg0;
   char *arg1;
 
-  /* The fd used to open the various libraries.  */
-  int lib_fd[LIBRARY_COUNT];
-  /* Location of ld, libc and libpthread in the process's address space.  */
-  uintptr_t lib_base[LIBRARY_COUNT];
-};
+  /* The patched libraries mapped in the process's address space
+     (struct pcb_library *s).  */
+  GSList *libs;
+  /* Whether the process's dynamic loader could not be patched.  */
+  bool loader_unpatched;
 
-/* A hash from pids to PCBs.  */
-static GHashTable *pcbs;
-static int pcb_count;
+  /* A few recently read pages of the process's text (see
+     tcb_code_read).  */
+#define PCB_PAGE_CACHE_SIZE 8
+  struct pcb_page
+  {
+    /* The address of the page.  0 if the entry is unused.  */
+    uintptr_t addr;
+    char *data;
+  } page_cache[PCB_PAGE_CACHE_SIZE];
+  int page_cache_next;
+
+  /* Whether the process has our system call filter (see
+     seccomp_mode).  */
+  enum
+    {
+      PCB_SECCOMP_NONE = 0,
+      PCB_SECCOMP_INSTALLING,
+      PCB_SECCOMP_ACTIVE,
+      /* We failed to install the filter.  We patch the process's
+	 libraries instead.  */
+      PCB_SECCOMP_FAILED,
+    } seccomp;
+  /* The user is no longer interested in this process, but it has our
+     filter and we can't detach from it.  We resume it as quickly as
+     possible and don't generate any events.  */
+  bool passive;
+  /* We are quitting and have stopped the process to hand it over to
+     the keeper.  */
+  bool handover;
+
+  /* How much we currently reduce the overhead of tracing this
+     process (see load_shed_maybe).  */
+  enum
+    {
+      PCB_SHED_NONE = 0,
+      /* Only report about one in SHED_SAMPLE of the files that the
+	 process opens (see SHED_FDS).  */
+      PCB_SHED_SAMPLE,
+      /* Don't stop the process on system calls: its patches are
+	 reverted (see UNPATCHED), or we don't use PTRACE_SYSCALL.  We
+	 still follow forks, execs and exits.  */
+      PCB_SHED_QUIET,
+      /* We detached from the process's threads.  */
+      PCB_SHED_DETACHED,
+    } shed;
+  int shed_sample;
+  /* The file descriptors whose open we did not report because of
+     sampling.  We don't report their close either.  A hash from fd
+     + 1 to 1 (NULL if empty).  */
+  GHashTable *shed_fds;
+  /* When SHED last changed.  */
+  uint64_t shed_changed;
+  /* Whether we restored the instructions that we patched.  We keep
+     LIBS so that we can fix up threads that hit a break point before
+     we reverted it and so that we can patch the process again.  */
+  bool unpatched;
+};
 
-/* The number of open file descriptions to process' memory.  */
-static int memfd_count;
-
-/* The pthread id of the process monitor thread (the thread that does
-   the actually ptracing.  */
-static pthread_t process_monitor_tid;
-
-/* The PID of the signal process, used to get the process monitor out
-   of a wait.  */
-static pid_t signal_process_pid;
-
 /* Non-zero if we are trying to quit.  */
 static uint64_t quit;
 
-/* Events occur in the process monitor thread, which need to be
-   forwarded to the user.  We need to make callbacks in the main
-   thread.  We do this by using an idle handler (g_idle_add is thread
-   safe).  */
-static guint callback_id;
-
-static pthread_mutex_t pending_callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
-static GSList *pending_callbacks;
-
-static gboolean
-callback_manager (gpointer user_data)
+/* Events occur in the tracer threads, which need to be forwarded to
+   the user.  We need to make callbacks in the main thread.
+
+   Each tracer thread has its own ring.  The tracer (the only
+   producer) copies each event
+   into a fixed-size record in a ring and any strings into a
+   separate ring of bytes (the arena).  The main thread (the only
+   consumer) processes the records in order.  As there is exactly one
+   producer and one consumer, no lock is needed: the producer only
+   writes HEAD and ARENA_HEAD, the consumer only writes TAIL and
+   ARENA_TAIL, and each publishes its updates after a barrier.  The
+   indices increase monotonically and are reduced modulo the size
+   (which is a power of two) when used.
+
+   When the consumer runs out of records, it sets SLEEPING and waits
+   for the wake fd to become readable (an eventfd, or a pipe if
+   eventfds are not supported).  The producer only writes to it if
+   the consumer is sleeping, so a burst of events costs a single
+   wake up.
+
+   If the ring is full, we drop open, close, unlink and rename
+   events and count them; the consumer reports how many were
+   dropped.  The other records (exits, tracing notifications and
+   delayed frees) are never dropped: they are put on an overflow
+   queue and added to the ring, in order, when there is space.  */
+#define CALLBACK_RING_SIZE 1024
+#define CALLBACK_ARENA_SIZE (256 * 1024)
+
+struct callback_record
 {
-  /* Executed in the context of the main thread.  */
-  assert (! pthread_equal (pthread_self (), process_monitor_tid));
-
-  GSList *cbs;
-
-  for (;;)
-    {
-      pthread_mutex_lock (&pending_callbacks_lock);
-
-      cbs = pending_callbacks;
-      pending_callbacks = NULL;
+  struct wc_process_monitor_cb cb;
+  /* The value of ARENA_HEAD after this record's strings were
+     copied.  */
+  uint32_t arena_end;
+};
 
-      if (! cbs)
-	/* Only clear the signal id once we are done processing
-	   everything.  */
-	callback_id = 0;
+struct callback_ring
+{
+  struct callback_record records[CALLBACK_RING_SIZE];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+
+  char arena[CALLBACK_ARENA_SIZE];
+  uint32_t arena_head;
+  volatile uint32_t arena_tail;
+
+  /* Whether the consumer is waiting for the wake fd.  */
+  volatile int sleeping;
+  /* The number of events that were dropped and not yet reported.  */
+  volatile uint32_t dropped;
+  /* Whether the producer has records on its overflow queue.  */
+  volatile int overflowed;
+
+  int wake_fd[2];
+};
 
-      pthread_mutex_unlock (&pending_callbacks_lock);
+/* Tracer threads.
+
+   All ptrace requests for a tracee must be made by the thread that
+   attached to it, and children that a tracee forks are automatically
+   traced by the same thread.  We run several tracer threads and
+   shard the work by process tree: when the user asks us to trace a
+   process, we pick a tracer (see tracer_for) and that tracer traces
+   the process and all of its descendants.  A busy process tree then
+   only delays the processes in its own shard.
+
+   Each tracer has its own wait loop (it only waits for its own
+   tracees, see process_monitor), its own signal process, command
+   queue and callback ring, and its own load statistics.  The TCBs
+   and PCBs belong to the tracer that traces them and are only
+   accessed by it.  The library registry (LIBRARIES, protected by
+   LIBRARIES_LOCK) and the keeper (see seccomp_keeper_start) are
+   shared.  */
+struct tracer
+{
+  /* The tracer's index in TRACERS.  */
+  int id;
+  /* The tracer's pthread and its kernel thread id.  */
+  pthread_t thread;
+  pid_t ktid;
+
+  /* A hash from tids to struct tcb *s.  */
+  GHashTable *tcbs;
+  int tcb_count;
+
+  /* A hash from pids to PCBs.  */
+  GHashTable *pcbs;
+  int pcb_count;
+
+  /* Threads that we could not patch (see thread_apply_patches).  */
+  GSList *pending_thread_apply_patches;
+
+  /* The PID of the signal process, used to get the tracer out of a
+     wait.  */
+  pid_t signal_process_pid;
+
+  /* Commands from the main thread (struct process_monitor_command
+     *s, most recent first).  Protected by COMMANDS_LOCK.  */
+  pthread_mutex_t commands_lock;
+  pthread_cond_t signaler_init_cond;
+  GSList *commands;
+
+  struct callback_ring ring;
+  /* Records that could not be added to the ring because it was full
+     (struct wc_process_monitor_cb *s, in order).  Only accessed by
+     the tracer.  */
+  GQueue callback_overflow;
+
+  /* The load of all of the threads traced by this tracer.  */
+  struct load load;
+  uint64_t load_check;
+  /* The CPU time that the tracer thread had used (in ns) at
+     LOAD_CHECK, and the share of a CPU that it used since the
+     previous check (in thousandths).  */
+  uint64_t cpu_time;
+  volatile int cpu_usage;
+  /* The number of processes whose tracing we have scaled back (see
+     load_shed_maybe).  Read by the main thread.  */
+  volatile int shedding;
+  /* For choosing which opens to report when sampling.  */
+  unsigned int shed_seed;
+
+  /* Statistics: the number of wait statuses and commands that the
+     tracer processed.  */
+  uint64_t stops;
+  uint64_t commands_processed;
+
+  /* The number of process trees that the user asked us to trace
+     that were assigned to this tracer.  Only accessed by the main
+     thread.  */
+  int trees;
+};
 
-      if (! cbs)
-	/* Don't call again.  */
-	return false;
+/* The default number of tracer threads is the number of CPUs, but at
+   most TRACERS_MAX.  */
+#define TRACERS_MAX 4
+static int tracer_count;
+static struct tracer *tracers;
 
-      /* Make the callbacks in order.  */
-      cbs = g_slist_reverse (cbs);
-      while (cbs)
-	{
-	  struct wc_process_monitor_cb *cb = cbs->data;
+/* The tracer that the current thread runs, or NULL if it is not a
+   tracer thread.  */
+static __thread struct tracer *tracer;
 
-	  debug (4, "Executing %p (%s)",
-		 cb, wc_process_monitor_cb_str (cb->cb));
+/* The number of tracer threads that have not yet exited.  */
+static int tracers_running;
 
-	  cbs = g_slist_delete_link (cbs, cbs);
+/* A hash from the pids that the user asked us to trace to the
+   struct tracer * tracing them.  Only accessed by the main
+   thread.  */
+static GHashTable *tracer_trees;
 
-	  if (cb->cb == -1)
-	    /* Delayed free.  */
-	    g_free (cb->open.filename);
-	  else
-	    process_monitor_callback (cb);
+/* Forget that PID's process tree is assigned to a tracer.  */
+static void
+tracer_tree_remove (pid_t pid)
+{
+  assert (! tracer);
 
-	  g_free (cb);
-	}
+  struct tracer *t
+    = g_hash_table_lookup (tracer_trees, (gpointer) (uintptr_t) pid);
+  if (t)
+    {
+      g_hash_table_remove (tracer_trees, (gpointer) (uintptr_t) pid);
+      t->trees --;
     }
 }
 
+/* Copy CB to CB_COPY, which has room for CB and its strings.  */
 static void
-callback_enqueue (struct tcb *tcb, int op,
-		  const char *src,
-		  const char *dest,
-		  int flags,
-		  struct stat *stat_buf)
+callback_copy (struct wc_process_monitor_cb *cb_copy,
+	       const struct wc_process_monitor_cb *cb)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
-
-  char *src_copy = NULL;
+  *cb_copy = *cb;
+  if (cb->cb == -1)
+    /* A delayed free.  */
+    return;
 
-  struct pcb *tl = NULL;
-  if (tcb)
+  char *end = (char *) cb_copy + sizeof (*cb_copy);
+  if (cb->open.filename)
     {
-      /* Find the top-level process.  */
-      tl = tcb->pcb;
-      while (! tl->top_level)
-	{
-	  struct pcb *parent = pcb_parent (tl);
-
-	  if (! parent)
-	    /* It is possible that we have a process that doesn't have
-	       a parent and is not a top-level process.  How?  It is
-	       possible that we find out about a process because we
-	       get a signal from it, but we have not yet received the
-	       PTRACE_EVENT_CLONE event.  */
-	    {
-	      tl = NULL;
-	      break;
-	    }
-
-	  tl = parent;
-	}
+      cb_copy->open.filename = end;
+      end = stpcpy (end, cb->open.filename) + 1;
+    }
+  if (cb->cb == WC_PROCESS_RENAME_CB && cb->rename.dest)
+    {
+      cb_copy->rename.dest = end;
+      end = stpcpy (end, cb->rename.dest) + 1;
     }
+}
 
-  struct wc_process_monitor_cb *cb;
-  if (op == -1)
-    /* Free.  Stash stat_buf in open.filename.  */
+/* Return a copy of CB (and its strings) allocated on the heap.  */
+static struct wc_process_monitor_cb *
+callback_dup (const struct wc_process_monitor_cb *cb)
+{
+  int len = 0;
+  if (cb->cb != -1)
     {
-      pthread_mutex_lock (&pending_callbacks_lock);
-      cb = g_malloc (sizeof (struct wc_process_monitor_cb));
-      cb->cb = op;
-      cb->open.filename = (void *) stat_buf;
-      src_copy = cb->open.filename;
-      goto enqueue_with_lock;
+      if (cb->open.filename)
+	len += strlen (cb->open.filename) + 1;
+      if (cb->cb == WC_PROCESS_RENAME_CB && cb->rename.dest)
+	len += strlen (cb->rename.dest) + 1;
     }
 
-  int s_len = src ? strlen (src) + 1 : 0;
-  int d_len = dest ? strlen (dest) + 1 : 0;
+  struct wc_process_monitor_cb *cb_copy = g_malloc (sizeof (*cb) + len);
+  callback_copy (cb_copy, cb);
+  return cb_copy;
+}
 
-  cb = g_malloc0 (sizeof (struct wc_process_monitor_cb) + s_len + d_len);
+/* Try to add CB to the ring.  Returns false if there is no space.  */
+static bool
+callback_ring_put (const struct wc_process_monitor_cb *cb)
+{
+  assert (tracer);
 
-  char *end = (void *) cb + sizeof (struct wc_process_monitor_cb);
+  uint32_t head = tracer->ring.head;
+  if (head - tracer->ring.tail == CALLBACK_RING_SIZE)
+    return false;
 
-  if (src)
+  char *strings[2] = { NULL, NULL };
+  if (cb->cb != -1)
     {
-      src_copy = end;
-      end = mempcpy (end, src, s_len);
+      strings[0] = cb->open.filename;
+      if (cb->cb == WC_PROCESS_RENAME_CB)
+	strings[1] = cb->rename.dest;
     }
 
-  char *dest_copy = NULL;
-  if (dest)
+  uint32_t len = 0;
+  int i;
+  for (i = 0; i < 2; i ++)
+    if (strings[i])
+      len += strlen (strings[i]) + 1;
+
+  uint32_t arena_head = tracer->ring.arena_head;
+  uint32_t offset = arena_head % CALLBACK_ARENA_SIZE;
+  if (offset + len > CALLBACK_ARENA_SIZE)
+    /* The strings must be contiguous.  Skip to the start.  */
+    arena_head += CALLBACK_ARENA_SIZE - offset;
+  if (arena_head + len - tracer->ring.arena_tail > CALLBACK_ARENA_SIZE)
+    return false;
+
+  struct callback_record *record
+    = &tracer->ring.records[head % CALLBACK_RING_SIZE];
+  record->cb = *cb;
+
+  char *p = &tracer->ring.arena[arena_head % CALLBACK_ARENA_SIZE];
+  for (i = 0; i < 2; i ++)
+    if (strings[i])
+      {
+	if (i == 0)
+	  record->cb.open.filename = p;
+	else
+	  record->cb.rename.dest = p;
+	p = stpcpy (p, strings[i]) + 1;
+      }
+  arena_head += len;
+  tracer->ring.arena_head = arena_head;
+  record->arena_end = arena_head;
+
+  /* Make sure the record is written before we publish it.  */
+  __sync_synchronize ();
+  tracer->ring.head = head + 1;
+
+  return true;
+}
+
+/* Wake the consumer, if it is sleeping.  */
+static void
+callback_ring_kick (void)
+{
+  __sync_synchronize ();
+  if (tracer->ring.sleeping
+      && __sync_bool_compare_and_swap (&tracer->ring.sleeping, 1, 0))
     {
-      dest_copy = end;
-      end = mempcpy (end, dest, d_len);
+      uint64_t one = 1;
+      if (write (tracer->ring.wake_fd[1], &one, sizeof (one)) < 0
+	  && errno != EAGAIN)
+	debug (0, "Waking main thread: %m");
     }
+}
 
-  cb->cb = op;
-  cb->timestamp = now ();
+/* Move as many records from the overflow queue to the ring as
+   possible.  Returns whether the overflow queue is now empty.  */
+static bool
+callback_overflow_flush (void)
+{
+  assert (tracer);
+
+  if (g_queue_is_empty (&tracer->callback_overflow))
+    return true;
 
-  if (tl)
+  struct wc_process_monitor_cb *cb;
+  while ((cb = g_queue_peek_head (&tracer->callback_overflow)))
     {
-      cb->top_levels_pid = tl->group_leader.tid;
-      cb->top_levels_exe = tl->exe;
-      cb->top_levels_arg0 = tl->arg0;
-      cb->top_levels_arg1 = tl->arg1;
-
-      cb->actor_pid = tcb->pcb->group_leader.tid;
-      cb->actor_exe = tcb->pcb->exe;
-      cb->actor_arg0 = tcb->pcb->arg0;
-      cb->actor_arg1 = tcb->pcb->arg1;
+      if (! callback_ring_put (cb))
+	break;
+      g_free (g_queue_pop_head (&tracer->callback_overflow));
     }
 
-  if (! stat_buf)
-    /* STAT_BUF may be NULL.  Don't seg fault.  */
+  tracer->ring.overflowed = ! g_queue_is_empty (&tracer->callback_overflow);
+  callback_ring_kick ();
+
+  return ! tracer->ring.overflowed;
+}
+
+/* Pass CB to the main thread.  The strings CB references are
+   copied.  */
+static void
+callback_push (const struct wc_process_monitor_cb *cb)
+{
+  assert (tracer);
+
+  if (callback_overflow_flush () && callback_ring_put (cb))
     {
-      stat_buf = alloca (sizeof (struct stat));
-      memset (stat_buf, 0, sizeof (*stat_buf));
+      callback_ring_kick ();
+      return;
     }
 
-  switch (op)
+  switch (cb->cb)
     {
     case WC_PROCESS_OPEN_CB:
-      cb->open.filename = src_copy;
-      cb->open.flags = flags;
-      cb->open.stat = *stat_buf;
-      break;
     case WC_PROCESS_CLOSE_CB:
-      cb->close.filename = src_copy;
-      cb->close.stat = *stat_buf;
-      break;
     case WC_PROCESS_UNLINK_CB:
-      cb->unlink.filename = src_copy;
-      cb->unlink.stat = *stat_buf;
-      break;
     case WC_PROCESS_RENAME_CB:
-      cb->rename.src = src_copy;
-      cb->rename.dest = dest_copy;
-      cb->rename.stat = *stat_buf;
-      break;
-    case WC_PROCESS_EXIT_CB:
+      __sync_fetch_and_add (&tracer->ring.dropped, 1);
       break;
-    case WC_PROCESS_TRACING_CB:
-      cb->tracing.added = flags;
+
+    default:
+      /* Don't lose it.  */
+      g_queue_push_tail (&tracer->callback_overflow, callback_dup (cb));
+      tracer->ring.overflowed = true;
       break;
     }
 
-  if (tcb)
-    tcb->load.event_count[tcb->load.callback_count_bucket] ++;
+  /* Make sure the consumer is running.  */
+  callback_ring_kick ();
+}
 
-  pthread_mutex_lock (&pending_callbacks_lock);
- enqueue_with_lock:
-  if (tcb && ! tl)
-    {
-      /* We have a TCB, but it doesn't have a top-level yet.  Enqueue
-	 the call back on the PCB.  It will be sent after the process
-	 gets a top-level.  */
+/* Coalescing.
+
+   Many programs open, read and close the same file over and over.
+   Reporting each access is expensive: each one results in a signal
+   and, typically, a database insert.  Instead, the main thread holds
+   on to open and close events for up to COALESCE_WINDOW ms.  Any
+   identical events (same process tree, same operation, same open
+   flags, same file) that occur in this window are folded into the
+   first one: its COUNT is incremented and its LAST_TIMESTAMP and
+   STAT are updated.
+
+   To preserve the order of events that matter, before we make any
+   other callback for a process tree (an unlink, a rename, an exit,
+   etc.), we first make that tree's delayed callbacks.  Likewise,
+   before freeing a process's strings (a delayed free), we make any
+   delayed callbacks that reference them.  */
+#define COALESCE_WINDOW 2000
+/* The maximum number of delayed events.  */
+#define COALESCE_MAX 256
+
+struct coalesced_event
+{
+  char *key;
+  struct wc_process_monitor_cb *cb;
+};
 
-      debug (4, "Delaying enqueue of callback %s on "TCB_FMT,
-	     wc_process_monitor_cb_str (cb->cb), TCB_PRINTF (tcb));
-      tcb->pcb->cb_queue = g_slist_prepend (tcb->pcb->cb_queue, cb);
-    }
-  else
-    {
-      /* Enqueue.  */
-      debug (4, "Enqueuing %p: %d: %s(%d) (%s)",
-	     cb, cb->top_levels_pid,
-	     wc_process_monitor_cb_str (cb->cb), cb->cb, src_copy);
+/* Maps keys to struct coalesced_event *s.  */
+static GHashTable *coalesced;
+/* The delayed events (struct coalesced_event *s), oldest first.  */
+static GQueue coalesced_queue;
+static guint coalesce_timer;
 
-      if (tcb && tcb->pcb->cb_queue)
-	{
-	  /* Fix up each queued callback.  */
-	  GSList *l;
-	  for (l = tcb->pcb->cb_queue; l; l = l->next)
-	    {
-	      struct wc_process_monitor_cb *cb = l->data;
+static void coalesce_timer_arm (void);
 
-	      cb->top_levels_pid = tl->group_leader.tid;
-	      cb->top_levels_exe = tl->exe;
-	      cb->top_levels_arg0 = tl->arg0;
-	      cb->top_levels_arg1 = tl->arg1;
+/* Make the callback for the delayed event LINK.  */
+static void
+coalesced_event_flush (GList *link)
+{
+  struct coalesced_event *ce = link->data;
+  g_queue_delete_link (&coalesced_queue, link);
+  g_hash_table_remove (coalesced, ce->key);
 
-	      /* We also need to set the process's strings as they may
-		 have been freed.  */
-	      cb->actor_pid = tcb->pcb->group_leader.tid;
-	      cb->actor_exe = tcb->pcb->exe;
-	      cb->actor_arg0 = tcb->pcb->arg0;
-	      cb->actor_arg1 = tcb->pcb->arg1;
-	    }
+  if (ce->cb->count > 1)
+    debug (4, "%d: %s (%s): coalesced %d events",
+	   ce->cb->top_levels_pid, wc_process_monitor_cb_str (ce->cb->cb),
+	   ce->cb->open.filename, ce->cb->count);
 
-	  pending_callbacks = g_slist_concat (tcb->pcb->cb_queue,
-					      pending_callbacks);
-	  tcb->pcb->cb_queue = NULL;
-	}
+  process_monitor_callback (ce->cb);
 
-      /* Add this to pending callbacks after adding TCB->PCB->CB_QUEUE
-	 as CB might be a free.  */
-      pending_callbacks = g_slist_prepend (pending_callbacks, cb);
+  g_free (ce->key);
+  g_free (ce->cb);
+  g_free (ce);
+}
 
-      if (callback_id == 0)
-	/* Kick the idle handler.  */
-	callback_id = g_idle_add (callback_manager, NULL);
+/* Make the delayed callbacks for the process tree PID (if not 0) and
+   those that reference the string STRING (if not NULL).  */
+static void
+coalesce_flush_matching (pid_t pid, const char *string)
+{
+  GList *l;
+  GList *next;
+  for (l = coalesced_queue.head; l; l = next)
+    {
+      next = l->next;
+
+      struct wc_process_monitor_cb *cb
+	= ((struct coalesced_event *) l->data)->cb;
+      if ((pid && cb->top_levels_pid == pid)
+	  || (string && (cb->top_levels_exe == string
+			 || cb->actor_exe == string)))
+	coalesced_event_flush (l);
     }
+}
 
-  pthread_mutex_unlock (&pending_callbacks_lock);
+void
+wc_process_monitor_ptrace_flush (void)
+{
+  while (coalesced_queue.head)
+    coalesced_event_flush (coalesced_queue.head);
 }
-
-/* Set PCB's parent to PARENT.  We sometimes have to do this after we
-   create a thread because the initial SIGSTOPs and, indeed, some
-   SIGTRAPs due to system calls can be delivered before the
-   PTRACE_EVENT_CLONE event.  */
-static void
-pcb_parent_set (struct pcb *pcb, struct pcb *parent)
+
+static gboolean
+coalesce_timeout (gpointer user_data)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  coalesce_timer = 0;
 
-  assert (parent);
-  if (pcb->parent)
+  uint64_t n = now ();
+  while (coalesced_queue.head)
     {
-      assert (parent == pcb->parent);
-      return;
+      struct coalesced_event *ce = coalesced_queue.head->data;
+      if (n < ce->cb->timestamp + COALESCE_WINDOW)
+	break;
+      coalesced_event_flush (coalesced_queue.head);
     }
 
-  pcb->parent = parent;
-  parent->children = g_slist_prepend (parent->children, pcb);
+  coalesce_timer_arm ();
+  return false;
 }
 
-/* Return the pcb corresponding to the TID's parent, or NULL if we
-   aren't tracing its parent.  */
-static struct pcb *
-pcb_find_parent_of (pid_t tid)
+static void
+coalesce_timer_arm (void)
 {
-  pid_t ppid = tid_to_ppid (tid);
-  if (! ppid)
-    return NULL;
-
-  struct pcb *parent = g_hash_table_lookup (pcbs, (gpointer) (uintptr_t) ppid);
-  if (! parent)
-    return NULL;
-
-  assertx (parent->group_leader.tid == ppid,
-	   "pcbs hash inconsistent: %d != %d!",
-	   parent->group_leader.tid, ppid);
+  if (coalesce_timer || ! coalesced_queue.head)
+    return;
 
-  return parent;
+  struct coalesced_event *ce = coalesced_queue.head->data;
+  uint64_t n = now ();
+  uint64_t expire = ce->cb->timestamp + COALESCE_WINDOW;
+  coalesce_timer = g_timeout_add (expire > n ? expire - n : 0,
+				  coalesce_timeout, NULL);
 }
 
-/* Return PCB's parent, or NULL if we aren't tracing its parent.  */
-static struct pcb *
-pcb_parent (struct pcb *pcb)
+/* CB is an open or a close callback.  Either fold it into an
+   identical delayed event or delay it.  */
+static void
+coalesce (struct wc_process_monitor_cb *cb)
 {
-  /* Note: If PCB->PARENT is set, it may not be the process's unix
-     parent.  Consider:
+  if (! coalesced)
+    coalesced = g_hash_table_new (g_str_hash, g_str_equal);
+
+  struct stat *stat = cb->cb == WC_PROCESS_OPEN_CB
+    ? &cb->open.stat : &cb->close.stat;
+  char *key = g_strdup_printf ("%d %d %x %"PRIx64" %"PRIx64" %s",
+			       cb->top_levels_pid, cb->cb,
+			       cb->cb == WC_PROCESS_OPEN_CB
+			       ? cb->open.flags : 0,
+			       (uint64_t) stat->st_dev,
+			       (uint64_t) stat->st_ino,
+			       cb->open.filename ?: "");
+
+  struct coalesced_event *ce = g_hash_table_lookup (coalesced, key);
+  if (ce)
+    {
+      g_free (key);
 
-      - Process A spawns process B
-      - Process B spawns process C
-      - Process B exits
-  
-    Since B is not a top-level, we don't want to keep it around as a
-    zombie so we have A inherit B's children.  Now, C->PARENT is A,
-    not B.  */
+      ce->cb->count += cb->count;
+      ce->cb->last_timestamp = cb->last_timestamp;
+      if (cb->cb == WC_PROCESS_OPEN_CB)
+	ce->cb->open.stat = *stat;
+      else
+	ce->cb->close.stat = *stat;
+      return;
+    }
 
-  if (pcb->parent)
-    return pcb->parent;
-  if (pcb->top_level)
-    /* It's a top-level and has no parent.  We are not tracing its
-       parent.  */
-    return NULL;
+  if (g_queue_get_length (&coalesced_queue) >= COALESCE_MAX)
+    coalesced_event_flush (coalesced_queue.head);
 
-  pid_t tid = pcb->group_leader.tid;
-  struct pcb *parent = pcb_find_parent_of (tid);
+  ce = g_malloc (sizeof (*ce));
+  ce->key = key;
+  ce->cb = callback_dup (cb);
+  g_hash_table_insert (coalesced, ce->key, ce);
+  g_queue_push_tail (&coalesced_queue, ce);
 
-  if (parent)
+  coalesce_timer_arm ();
+}
+
+/* Make the callback CB (called in the main thread).  */
+static void
+callback_deliver (struct wc_process_monitor_cb *cb)
+{
+  switch ((int) cb->cb)
     {
-      pcb_parent_set (pcb, parent);
+    case -1:
+      /* Delayed free.  */
+      coalesce_flush_matching (0, cb->open.filename);
+      g_free (cb->open.filename);
+      break;
 
-      debug (3, PCB_FMT": Found parent via /proc: "PCB_FMT,
-	     PCB_PRINTF (pcb), PCB_PRINTF (parent));
-    }
+    case WC_PROCESS_OPEN_CB:
+    case WC_PROCESS_CLOSE_CB:
+      coalesce (cb);
+      break;
 
-  return parent;
+    default:
+      coalesce_flush_matching (cb->top_levels_pid, NULL);
+      process_monitor_callback (cb);
+      break;
+    }
 }
 
-/* Remove a PCB from the PCBS hash and release the PCB data structure.
-   All the process's threads must be freed.  */
-static void
-pcb_free (struct pcb *pcb)
+static gboolean
+callback_manager (GIOChannel *source, GIOCondition condition,
+		  gpointer user_data)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  /* Executed in the context of the main thread.  */
+  assert (! tracer);
 
-  debug (4, "pcb_free (%d)", pcb->group_leader.tid);
+  struct tracer *t = user_data;
+
+  char buffer[64];
+  while (read (t->ring.wake_fd[0], buffer, sizeof (buffer)) > 0)
+    ;
+
+  for (;;)
+    {
+      uint32_t tail = t->ring.tail;
+      uint32_t head = t->ring.head;
+      if (tail == head)
+	{
+	  /* Tell the producer to wake us and then check again: it may
+	     have added a record before it saw SLEEPING.  */
+	  t->ring.sleeping = 1;
+	  __sync_synchronize ();
+	  if (t->ring.head == tail)
+	    break;
+	  t->ring.sleeping = 0;
+	  continue;
+	}
+
+      /* Make sure we see the records' contents.  */
+      __sync_synchronize ();
+
+      /* Make the callbacks in order.  */
+      for (; tail != head; tail ++)
+	{
+	  struct callback_record *record
+	    = &t->ring.records[tail % CALLBACK_RING_SIZE];
+	  struct wc_process_monitor_cb *cb = &record->cb;
+
+	  debug (4, "Executing %p (%s)",
+		 cb, wc_process_monitor_cb_str (cb->cb));
+
+	  if (cb->cb == WC_PROCESS_EXIT_CB
+	      && cb->actor_pid == cb->top_levels_pid)
+	    /* The process tree is gone.  */
+	    tracer_tree_remove (cb->top_levels_pid);
+
+	  callback_deliver (cb);
+
+	  uint32_t arena_end = record->arena_end;
+
+	  /* Release the record.  */
+	  __sync_synchronize ();
+	  t->ring.arena_tail = arena_end;
+	  t->ring.tail = tail + 1;
+	}
+    }
+
+  uint32_t dropped = __sync_fetch_and_and (&t->ring.dropped, 0);
+  if (dropped)
+    debug (0, "Overloaded: tracer %d dropped %d events.", t->id, dropped);
+
+  if (t->ring.overflowed)
+    /* The tracer has records that it could not add.  As we've made
+       space, get it to add them.  */
+    {
+      if (tkill (t->signal_process_pid, SIGUSR2) < 0)
+	debug (0, "killing signalling signal process (%d): %m",
+	       t->signal_process_pid);
+    }
+
+  return true;
+}
+
+/* Set up T's ring.  Called from the main thread before the tracer
+   thread is started.  */
+static void
+callback_ring_init (struct tracer *t)
+{
+  t->ring.sleeping = 1;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  t->ring.wake_fd[0] = t->ring.wake_fd[1]
+    = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (t->ring.wake_fd[0] < 0)
+#endif
+    {
+      if (pipe (t->ring.wake_fd) < 0)
+	{
+	  debug (0, "Failed to create pipe: %m");
+	  abort ();
+	}
+
+      int i;
+      for (i = 0; i < 2; i ++)
+	{
+	  fcntl (t->ring.wake_fd[i], F_SETFL,
+		 fcntl (t->ring.wake_fd[i], F_GETFL) | O_NONBLOCK);
+	  fcntl (t->ring.wake_fd[i], F_SETFD, FD_CLOEXEC);
+	}
+    }
+
+  GIOChannel *channel = g_io_channel_unix_new (t->ring.wake_fd[0]);
+  g_io_add_watch (channel, G_IO_IN, callback_manager, t);
+  g_io_channel_unref (channel);
+}
+
+static void
+callback_enqueue (struct tcb *tcb, int op,
+		  const char *src,
+		  const char *dest,
+		  int flags,
+		  struct stat *stat_buf)
+{
+  assert (tracer);
+
+  if (op != -1 && tcb && tcb->pcb->passive)
+    return;
+
+  struct pcb *tl = NULL;
+  if (tcb)
+    {
+      /* Find the top-level process.  */
+      tl = tcb->pcb;
+      while (! tl->top_level)
+	{
+	  struct pcb *parent = pcb_parent (tl);
+
+	  if (! parent)
+	    /* It is possible that we have a process that doesn't have
+	       a parent and is not a top-level process.  How?  It is
+	       possible that we find out about a process because we
+	       get a signal from it, but we have not yet received the
+	       PTRACE_EVENT_CLONE event.  */
+	    {
+	      tl = NULL;
+	      break;
+	    }
+
+	  tl = parent;
+	}
+    }
+
+  struct wc_process_monitor_cb cb;
+  memset (&cb, 0, sizeof (cb));
+  cb.cb = op;
+
+  if (op == -1)
+    /* Free.  Stash stat_buf in open.filename.  */
+    cb.open.filename = (void *) stat_buf;
+  else
+    {
+      cb.timestamp = cb.last_timestamp = now ();
+      cb.count = 1;
+
+      if (tl)
+	{
+	  cb.top_levels_pid = tl->group_leader.tid;
+	  cb.top_levels_exe = tl->exe;
+	  cb.top_levels_arg0 = tl->arg0;
+	  cb.top_levels_arg1 = tl->arg1;
+
+	  cb.actor_pid = tcb->pcb->group_leader.tid;
+	  cb.actor_exe = tcb->pcb->exe;
+	  cb.actor_arg0 = tcb->pcb->arg0;
+	  cb.actor_arg1 = tcb->pcb->arg1;
+	}
+
+      if (! stat_buf)
+	/* STAT_BUF may be NULL.  Don't seg fault.  */
+	{
+	  stat_buf = alloca (sizeof (struct stat));
+	  memset (stat_buf, 0, sizeof (*stat_buf));
+	}
+
+      /* The strings are copied when the callback is queued.  */
+      switch (op)
+	{
+	case WC_PROCESS_OPEN_CB:
+	  cb.open.filename = (char *) src;
+	  cb.open.flags = flags;
+	  cb.open.stat = *stat_buf;
+	  break;
+	case WC_PROCESS_CLOSE_CB:
+	  cb.close.filename = (char *) src;
+	  cb.close.stat = *stat_buf;
+	  break;
+	case WC_PROCESS_UNLINK_CB:
+	  cb.unlink.filename = (char *) src;
+	  cb.unlink.stat = *stat_buf;
+	  break;
+	case WC_PROCESS_RENAME_CB:
+	  cb.rename.src = (char *) src;
+	  cb.rename.dest = (char *) dest;
+	  cb.rename.stat = *stat_buf;
+	  break;
+	case WC_PROCESS_EXIT_CB:
+	  break;
+	case WC_PROCESS_TRACING_CB:
+	  cb.tracing.added = flags;
+	  break;
+	}
+
+      if (tcb)
+	tcb->load.event_count[tcb->load.callback_count_bucket] ++;
+    }
+
+  if (tcb && ! tl)
+    {
+      /* We have a TCB, but it doesn't have a top-level yet.  Enqueue
+	 the call back on the PCB.  It will be sent after the process
+	 gets a top-level.  */
+
+      debug (4, "Delaying enqueue of callback %s on "TCB_FMT,
+	     wc_process_monitor_cb_str (cb.cb), TCB_PRINTF (tcb));
+      tcb->pcb->cb_queue = g_slist_prepend (tcb->pcb->cb_queue,
+					    callback_dup (&cb));
+      return;
+    }
+
+  /* Enqueue.  */
+  debug (4, "Enqueuing: %d: %s(%d) (%s)",
+	 cb.top_levels_pid,
+	 wc_process_monitor_cb_str (cb.cb), cb.cb,
+	 op == -1 ? NULL : src);
+
+  if (tcb && tcb->pcb->cb_queue)
+    {
+      /* Fix up each queued callback and send it.  */
+      GSList *l = g_slist_reverse (tcb->pcb->cb_queue);
+      tcb->pcb->cb_queue = NULL;
+      while (l)
+	{
+	  struct wc_process_monitor_cb *cb = l->data;
+	  l = g_slist_delete_link (l, l);
+
+	  if (cb->cb != -1)
+	    {
+	      cb->top_levels_pid = tl->group_leader.tid;
+	      cb->top_levels_exe = tl->exe;
+	      cb->top_levels_arg0 = tl->arg0;
+	      cb->top_levels_arg1 = tl->arg1;
+
+	      /* We also need to set the process's strings as they may
+		 have been freed.  */
+	      cb->actor_pid = tcb->pcb->group_leader.tid;
+	      cb->actor_exe = tcb->pcb->exe;
+	      cb->actor_arg0 = tcb->pcb->arg0;
+	      cb->actor_arg1 = tcb->pcb->arg1;
+	    }
+
+	  callback_push (cb);
+	  g_free (cb);
+	}
+    }
+
+  /* Add this after the PCB's queued callbacks as CB might be a
+     free.  */
+  callback_push (&cb);
+}
+
+/* Set PCB's parent to PARENT.  We sometimes have to do this after we
+   create a thread because the initial SIGSTOPs and, indeed, some
+   SIGTRAPs due to system calls can be delivered before the
+   PTRACE_EVENT_CLONE event.  */
+static void
+pcb_parent_set (struct pcb *pcb, struct pcb *parent)
+{
+  assert (tracer);
+
+  assert (parent);
+  if (pcb->parent)
+    {
+      assert (parent == pcb->parent);
+      return;
+    }
+
+  pcb->parent = parent;
+  parent->children = g_slist_prepend (parent->children, pcb);
+}
+
+/* Return the pcb corresponding to the TID's parent, or NULL if we
+   aren't tracing its parent.  */
+static struct pcb *
+pcb_find_parent_of (pid_t tid)
+{
+  pid_t ppid = tid_to_ppid (tid);
+  if (! ppid)
+    return NULL;
+
+  struct pcb *parent
+    = g_hash_table_lookup (tracer->pcbs, (gpointer) (uintptr_t) ppid);
+  if (! parent)
+    return NULL;
+
+  assertx (parent->group_leader.tid == ppid,
+	   "tracer->pcbs hash inconsistent: %d != %d!",
+	   parent->group_leader.tid, ppid);
+
+  return parent;
+}
+
+/* Return PCB's parent, or NULL if we aren't tracing its parent.  */
+static struct pcb *
+pcb_parent (struct pcb *pcb)
+{
+  /* Note: If PCB->PARENT is set, it may not be the process's unix
+     parent.  Consider:
+
+      - Process A spawns process B
+      - Process B spawns process C
+      - Process B exits
+  
+    Since B is not a top-level, we don't want to keep it around as a
+    zombie so we have A inherit B's children.  Now, C->PARENT is A,
+    not B.  */
+
+  if (pcb->parent)
+    return pcb->parent;
+  if (pcb->top_level)
+    /* It's a top-level and has no parent.  We are not tracing its
+       parent.  */
+    return NULL;
+
+  pid_t tid = pcb->group_leader.tid;
+  struct pcb *parent = pcb_find_parent_of (tid);
+
+  if (parent)
+    {
+      pcb_parent_set (pcb, parent);
+
+      debug (3, PCB_FMT": Found parent via /proc: "PCB_FMT,
+	     PCB_PRINTF (pcb), PCB_PRINTF (parent));
+    }
+
+  return parent;
+}
+
+/* Remove a PCB from the PCBS hash and release the PCB data structure.
+   All the process's threads must be freed.  */
+static void
+pcb_free (struct pcb *pcb)
+{
+  assert (tracer);
+
+  debug (4, "pcb_free (%d)", pcb->group_leader.tid);
 
   /* We better have no threads.  */
   assert (! pcb->tcbs);
@@ -722,7 +1404,10 @@ pcb_free (struct pcb *pcb)
     assert (! pcb->children);
     assert (! pcb->tcbs);
 
-    if (! g_hash_table_remove (pcbs,
+    if (pcb->shed != PCB_SHED_NONE)
+      tracer->shedding --;
+
+    if (! g_hash_table_remove (tracer->pcbs,
 			       (gpointer) (uintptr_t) pcb->group_leader.tid))
       {
 	debug (0, "Failed to remove pcb "PCB_FMT" from hash table?!?",
@@ -787,8 +1472,14 @@ pcb_free (struct pcb *pcb)
 	  }
       }
 
+    pcb_libs_free (pcb);
+    if (pcb->shed_fds)
+      g_hash_table_destroy (pcb->shed_fds);
+    int i;
+    for (i = 0; i < PCB_PAGE_CACHE_SIZE; i ++)
+      g_free (pcb->page_cache[i].data);
     g_free (pcb);
-    pcb_count --;
+    tracer->pcb_count --;
 
     if (p)
       do_free (p);
@@ -863,8 +1554,8 @@ pcb_free (struct pcb *pcb)
   do_free (pcb);
 
   debug (4, "%d processes still being traced (%d threads)",
-	 pcb_count, tcb_count);
-  if (quit && tcb_count <= 4)
+	 tracer->pcb_count, tracer->tcb_count);
+  if (quit && tracer->tcb_count <= 4)
     {
       int count = 0;
       void iter (gpointer key, gpointer value, gpointer user_data)
@@ -880,9 +1571,9 @@ pcb_free (struct pcb *pcb)
 
 	count ++;
       }
-      g_hash_table_foreach (tcbs, iter, NULL);
+      g_hash_table_foreach (tracer->tcbs, iter, NULL);
 
-      assert (count == tcb_count);
+      assert (count == tracer->tcb_count);
     }
 }
 
@@ -891,7 +1582,7 @@ pcb_free (struct pcb *pcb)
 static void
 pcb_read_exe (struct pcb *pcb)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
   if (pcb->exe)
     /* Free it.  */
@@ -984,69 +1675,145 @@ pcb_read_exe (struct pcb *pcb)
     }
 }
 
-static void
-tcb_memfd_cleanup (void)
+/* Accessing a traced process's memory.
+
+   We use process_vm_readv: it reads directly from the process's
+   address space into our buffers and can gather several disjoint
+   regions in a single system call.  Unlike /proc/PID/mem, it
+   doesn't need a file descriptor, so there is nothing to open,
+   cache or reopen.  If the kernel doesn't support it (it was added
+   in 3.2), we fall back to PTRACE_PEEKDATA.  */
+
+static ssize_t
+vm_readv (pid_t pid, const struct iovec *local, const struct iovec *remote,
+	  unsigned long count)
 {
-  assert (memfd_count >= 0);
-  assert (memfd_count <= tcb_count);
+#ifdef HAVE_PROCESS_VM_READV
+  return process_vm_readv (pid, local, count, remote, count, 0);
+#elif defined (__NR_process_vm_readv)
+  return syscall (__NR_process_vm_readv, pid, local, count,
+		  remote, count, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
 
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+/* Whether process_vm_readv works.  */
+static bool have_process_vm_readv = true;
 
-  void iter (gpointer key, gpointer value, gpointer user_data)
-  {
-    struct tcb *tcb = value;
-    uintptr_t horizon = (uintptr_t) user_data;
+/* The system's page size.  */
+static uintptr_t page_size;
 
-    if (tcb->memfd != -1 && tcb->memfd_lastuse < horizon)
+/* Read a single region using PTRACE_PEEKDATA.  Returns the number of
+   bytes read.  */
+static size_t
+tcb_mem_peek (struct tcb *tcb, uintptr_t addr, char *buffer, size_t size)
+{
+  size_t done = 0;
+  while (done < size)
+    {
+      uintptr_t a = addr + done;
+      int offset = a & (sizeof (uintptr_t) - 1);
+      union
       {
-	close (tcb->memfd);
-	tcb->memfd = -1;
-	memfd_count --;
-      }
-  }
+	uintptr_t word;
+	char bytes[sizeof (uintptr_t)];
+      } value;
+
+      errno = 0;
+      value.word = ptrace (PTRACE_PEEKDATA, tcb->tid, a - offset);
+      if (errno)
+	break;
 
-  uintptr_t n = now ();
+      size_t w = sizeof (uintptr_t) - offset;
+      if (w > size - done)
+	w = size - done;
+      memcpy (buffer + done, &value.bytes[offset], w);
+      done += w;
+    }
 
-  if (memfd_count > 96)
-    /* Close any fd not used in the last 60 seconds.  */
-    g_hash_table_foreach (tcbs, iter, (gpointer) (uintptr_t) (n - 60*1000));
-  if (memfd_count > 128)
-    /* That apparently didn't close enough.  Try again.  Close any fd
-       not used in the last 5 seconds.  */
-    g_hash_table_foreach (tcbs, iter, (gpointer) (uintptr_t) (n - 5*1000));
+  return done;
 }
 
+/* Read COUNT regions of a process's memory: REMOTE[i] is copied to
+   LOCAL[i] (the lengths must be the same).  On return, LOCAL[i]'s
+   length is the number of bytes that were actually read into it.
+   Returns the number of regions that were read completely or
+   -errno, if no region could be read.  */
 static int
-tcb_memfd (struct tcb *tcb, bool reopen)
+tcb_mem_readv (struct tcb *tcb, struct iovec *local,
+	       const struct iovec *remote, int count)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
-  tcb->memfd_lastuse = now ();
-
-  if (tcb->memfd != -1 && reopen)
+  int complete = 0;
+  int err = 0;
+  int i = 0;
+  while (i < count)
     {
-      close (tcb->memfd);
-      tcb->memfd = -1;
-      memfd_count --;
-    }
+      ssize_t r = -1;
+      int n = count - i;
+      if (n > IOV_MAX)
+	n = IOV_MAX;
 
-  if (tcb->memfd == -1)
-    {
-      tcb_memfd_cleanup ();
+      if (have_process_vm_readv)
+	{
+	  r = vm_readv (tcb->tid, &local[i], &remote[i], n);
+	  if (r < 0 && errno == ENOSYS)
+	    {
+	      debug (0, "process_vm_readv not supported, "
+		     "falling back to PTRACE_PEEKDATA.");
+	      have_process_vm_readv = false;
+	    }
+	}
+
+      if (! have_process_vm_readv)
+	{
+	  local[i].iov_len = tcb_mem_peek (tcb, (uintptr_t) remote[i].iov_base,
+					   local[i].iov_base,
+					   remote[i].iov_len);
+	  if (local[i].iov_len == remote[i].iov_len)
+	    complete ++;
+	  else if (local[i].iov_len == 0)
+	    err = errno;
+	  i ++;
+	  continue;
+	}
+
+      if (r < 0)
+	/* The first region could not be read at all.  */
+	{
+	  err = errno;
+	  if (err == ESRCH)
+	    /* The process is gone.  Don't bother with the rest.  */
+	    {
+	      for (; i < count; i ++)
+		local[i].iov_len = 0;
+	      break;
+	    }
+	  local[i ++].iov_len = 0;
+	  continue;
+	}
 
-      char filename[32];
-      snprintf (filename, sizeof (filename), "/proc/%d/mem", (int) tcb->tid);
-      tcb->memfd = open (filename, O_RDONLY);
-      if (tcb->memfd < 0)
+      /* Figure out where the transfer stopped.  The kernel stops
+	 at the first fault.  */
+      int j;
+      for (j = i; j < i + n && r >= remote[j].iov_len; j ++)
 	{
-	  debug (0, "Failed to open %s: %m", filename);
-	  tcb->memfd = -1;
-	  return -1;
+	  r -= remote[j].iov_len;
+	  complete ++;
 	}
-      memfd_count ++;
+      if (j < i + n)
+	/* Region J is incomplete.  Skip it and continue with the
+	   next one.  */
+	local[j ++].iov_len = r;
+      i = j;
     }
 
-  return tcb->memfd;
+  if (complete == 0 && count > 0 && local[0].iov_len == 0)
+    return -(err ?: EFAULT);
+  return complete;
 }
 
 /* Read up to SIZE bytes from a process PCB's memory starting at
@@ -1060,39 +1827,31 @@ tcb_mem_read (struct tcb *tcb, uintptr_t addr, char *buffer, int size,
   if (size == 0)
     return buffer;
 
-  bool retry = false;
- do_retry:;
-  int memfd = tcb_memfd (tcb, retry);
-  if (memfd == -1)
-    return NULL;
-
-  if (lseek (memfd, addr, SEEK_SET) < 0)
-    {
-      debug (0, "Error seeking in process %d's memory: %m",
-	     tcb->pcb->group_leader.tid);
-      if (! retry)
-	{
-	  retry = true;
-	  goto do_retry;
-	}
-      return NULL;
-    }
-
   char *b = buffer;
   int s = size;
   while (s > 0)
     {
-      int r = read (memfd, b, s);
-      if (r < 0)
+      /* When reading a string, we don't know how long it is.  Don't
+	 read past the end of the page: the next page might not be
+	 mapped, and the string is typically short.  */
+      int len = s;
+      if (string)
 	{
-	  if (buffer == b && ! retry)
-	    {
-	      retry = true;
-	      goto do_retry;
-	    }
+	  uintptr_t page_end = ((addr + page_size) & ~(page_size - 1));
+	  if (len > page_end - addr)
+	    len = page_end - addr;
+	}
 
-	  debug (0, TCB_FMT": Error reading from process's memory: %m",
-		 TCB_PRINTF (tcb));
+      struct iovec local = { b, len };
+      struct iovec remote = { (void *) addr, len };
+      int r = tcb_mem_readv (tcb, &local, &remote, 1);
+      if (r < 0 || local.iov_len == 0)
+	{
+	  if (r < 0)
+	    errno = -r;
+	  debug (0, TCB_FMT": Error reading from process's memory "
+		 "at %"PRIxPTR": %m",
+		 TCB_PRINTF (tcb), addr);
 
 	  if (buffer == b)
 	    /* We didn't manage to read anything...  */
@@ -1104,53 +1863,217 @@ tcb_mem_read (struct tcb *tcb, uintptr_t addr, char *buffer, int size,
 
       if (string)
 	{
-	  char *end = memchr (b, 0, r);
+	  char *end = memchr (b, 0, local.iov_len);
 	  if (end)
 	    return end;
 	}
 
-      s -= r;
-      b += r;
+      s -= local.iov_len;
+      b += local.iov_len;
+      addr += local.iov_len;
+
+      if (local.iov_len < len)
+	/* A short read.  */
+	break;
     }
 
   /* B points at the next byte to write.  */
   return b - 1;
 }
-
+
+/* Read the filename at ADDR in TCB's memory into BUFFER, which is
+   SIZE bytes large, like tcb_mem_read.  As the filename is read, it
+   is checked against the whitelist (see filename-whitelist.h).  If
+   it is an absolute path that is not whitelisted, we stop reading
+   (BUFFER then only contains a prefix of the filename) and set
+   *WHITELISTED to WC_FILENAME_WHITELIST_NO.  Otherwise, *WHITELISTED
+   is set to WC_FILENAME_WHITELIST_YES or, if the filename is a
+   relative path, WC_FILENAME_WHITELIST_MAYBE.  (Note: the filename
+   is not canonicalized: a non-whitelisted path that refers to a
+   whitelisted file by way of a symbolic link or a ".." is
+   rejected.)  */
+static char *
+tcb_mem_read_filename (struct tcb *tcb, uintptr_t addr,
+		       char *buffer, int size, int *whitelisted)
+{
+  struct wc_filename_whitelist_match match;
+  wc_filename_whitelist_match_init (&match);
+  *whitelisted = WC_FILENAME_WHITELIST_MAYBE;
+
+  char *b = buffer;
+  while (b - buffer < size)
+    {
+      /* Read at most to the end of the page: most filenames are
+	 rejected in the first few bytes.  */
+      int len = size - (b - buffer);
+      if (len > page_size - (addr & (page_size - 1)))
+	len = page_size - (addr & (page_size - 1));
+
+      char *end = tcb_mem_read (tcb, addr, b, len, true);
+      if (! end)
+	return b == buffer ? NULL : b - 1;
+
+      int got = end - b + 1;
+      if (buffer[0] == '/')
+	*whitelisted = wc_filename_whitelist_match_feed (&match, b, got);
+      if (*end == 0 || got < len
+	  || *whitelisted == WC_FILENAME_WHITELIST_NO)
+	return end;
+
+      b += got;
+      addr += got;
+    }
+
+  return b - 1;
+}
+
+/* Forget any memory cached for PCB (e.g., because it exec'd or
+   changed its mappings).  */
+static void
+pcb_page_cache_flush (struct pcb *pcb)
+{
+  int i;
+  for (i = 0; i < PCB_PAGE_CACHE_SIZE; i ++)
+    pcb->page_cache[i].addr = 0;
+}
+
+/* Read SIZE bytes from the process's text at ADDR into BUFFER.  This
+   is for reading instructions (e.g., when checking our patches): the
+   pages are cached, which is only correct for memory that the
+   process does not modify.  Returns whether all SIZE bytes were
+   read.  */
+static bool
+tcb_code_read (struct tcb *tcb, uintptr_t addr, char *buffer, int size)
+{
+  struct pcb *pcb = tcb->pcb;
+
+  while (size > 0)
+    {
+      uintptr_t page = addr & ~(page_size - 1);
+      int offset = addr - page;
+      int len = size;
+      if (len > page_size - offset)
+	len = page_size - offset;
+
+      struct pcb_page *p = NULL;
+      int i;
+      for (i = 0; i < PCB_PAGE_CACHE_SIZE; i ++)
+	if (pcb->page_cache[i].addr == page)
+	  {
+	    p = &pcb->page_cache[i];
+	    break;
+	  }
+
+      if (! p)
+	{
+	  p = &pcb->page_cache[pcb->page_cache_next];
+	  pcb->page_cache_next
+	    = (pcb->page_cache_next + 1) % PCB_PAGE_CACHE_SIZE;
+
+	  if (! p->data)
+	    p->data = g_malloc (page_size);
+	  p->addr = 0;
+
+	  struct iovec local = { p->data, page_size };
+	  struct iovec remote = { (void *) page, page_size };
+	  int r = tcb_mem_readv (tcb, &local, &remote, 1);
+	  if (r != 1)
+	    /* Don't cache partial pages.  */
+	    {
+	      if (local.iov_len < offset + len)
+		{
+		  errno = r < 0 ? -r : EFAULT;
+		  return false;
+		}
+	      memcpy (buffer, p->data + offset, len);
+	    }
+	  else
+	    p->addr = page;
+	}
+      if (p->addr)
+	memcpy (buffer, p->data + offset, len);
+
+      buffer += len;
+      addr += len;
+      size -= len;
+    }
+
+  return true;
+}
+
+/* Update the cached copy of the process's memory after we wrote
+   BYTES bytes of NEW_VALUE to ADDR.  */
+static void
+pcb_page_cache_update (struct pcb *pcb, uintptr_t addr,
+		       const char *new_value, int bytes)
+{
+  int i;
+  for (i = 0; i < PCB_PAGE_CACHE_SIZE; i ++)
+    {
+      struct pcb_page *p = &pcb->page_cache[i];
+      if (! p->addr
+	  || addr + bytes <= p->addr || p->addr + page_size <= addr)
+	continue;
+
+      uintptr_t start = MAX (addr, p->addr);
+      uintptr_t end = MIN (addr + bytes, p->addr + page_size);
+      memcpy (p->data + (start - p->addr), new_value + (start - addr),
+	      end - start);
+    }
+}
+
 /* Returns whether the process has been patched.  */
 static bool
 pcb_patched (struct pcb *pcb)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
+
+  /* Whenever a new library is mapped, we parse it.  Until it is
+     mapped, no system calls from it can be made.  We learn about new
+     mappings by way of the loader's mmap, which is also patched.  A
+     process is thus patched once we have patched the loader (or, for
+     a statically linked executable, the executable).  If we reverted
+     the patches to shed load, it is no longer patched.  */
+  return pcb->libs && ! pcb->loader_unpatched && ! pcb->unpatched;
+}
+
+/* Forget about the libraries mapped in PCB.  */
+static void
+pcb_libs_free (struct pcb *pcb)
+{
+  g_slist_foreach (pcb->libs, (GFunc) g_free, NULL);
+  g_slist_free (pcb->libs);
+  pcb->libs = NULL;
+  pcb->loader_unpatched = false;
+  pcb->unpatched = false;
+}
+
+/* Copy the libraries mapped in FROM to TO (after a fork).  */
+static void
+pcb_libs_copy (struct pcb *to, struct pcb *from)
+{
+  assert (! to->libs);
 
-  /* Whenever a new relevant library is loaded, we parse it.  Until it
-     is loaded, no system calls from it can be made.  A process is
-     thus patched once we have at least patched the loader.  */
-  return pcb->lib_base[LIBRARY_LD] != 0
-    && library_patches[LIBRARY_LD].patch_count;
+  GSList *l;
+  for (l = from->libs; l; l = l->next)
+    to->libs = g_slist_prepend (to->libs,
+				g_memdup (l->data,
+					  sizeof (struct pcb_library)));
+  to->libs = g_slist_reverse (to->libs);
+  to->loader_unpatched = from->loader_unpatched;
 }
 
-/* Returns 0 if ADDR does not contain VALUE.  The index + 1 of VALUES
-   if it does.  -errno if an error occurs.  */
+/* REAL is the content of process TCB's memory at ADDR.  Returns 0 if
+   it does not match any of the COUNT VALUES, each of which is BYTES
+   long.  Otherwise, the index + 1 of the matching value.  */
 static int
-thread_check (struct tcb *tcb, uintptr_t addr, const char *values[],
-	      int count, int bytes)
+thread_check_value (struct tcb *tcb, uintptr_t addr, const char *real,
+		    const char *values[], int count, int bytes)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
-
-  errno = EFAULT;
-  char real[bytes];
-  if (! tcb_mem_read (tcb, addr, real, bytes, false))
-    {
-      debug (0, TCB_FMT": Failed to read from process's memory: %m",
-	     TCB_PRINTF (tcb));
-      return -errno;
-    }
-
   int i;
   for (i = 0; i < count; i ++)
     if (memcmp (real, values[i], bytes) == 0)
-      return 1;
+      return i + 1;
 
   GString *s = g_string_new ("");
   g_string_append_printf
@@ -1176,11 +2099,31 @@ thread_check (struct tcb *tcb, uintptr_t addr, const char *values[],
   return 0;
 }
 
+/* Returns 0 if ADDR does not contain VALUE.  The index + 1 of VALUES
+   if it does.  -errno if an error occurs.  */
+static int
+thread_check (struct tcb *tcb, uintptr_t addr, const char *values[],
+	      int count, int bytes)
+{
+  assert (tracer);
+
+  errno = EFAULT;
+  char real[bytes];
+  if (! tcb_code_read (tcb, addr, real, bytes))
+    {
+      debug (0, TCB_FMT": Failed to read from process's memory: %m",
+	     TCB_PRINTF (tcb));
+      return -errno;
+    }
+
+  return thread_check_value (tcb, addr, real, values, count, bytes);
+}
+
 static bool
 thread_mem_update (struct tcb *tcb, uintptr_t addr,
 		   const char *new_value, int bytes)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
   int offset = addr & (sizeof (uintptr_t) - 1);
   uintptr_t a = addr - offset;
@@ -1202,6 +2145,7 @@ thread_mem_update (struct tcb *tcb, uintptr_t addr,
 	      debug (0, TCB_FMT": Failed to read thread's memory, "
 		     "location %"PRIxPTR": %m",
 		     TCB_PRINTF (tcb), a);
+	      pcb_page_cache_flush (tcb->pcb);
 	      return false;
 	    }
 	}
@@ -1221,12 +2165,15 @@ thread_mem_update (struct tcb *tcb, uintptr_t addr,
 	  debug (0, TCB_FMT": Failed to write to thread's memory, "
 		 "location %"PRIxPTR": %m",
 		 TCB_PRINTF (tcb), a);
+	  pcb_page_cache_flush (tcb->pcb);
 	  return false;
 	}
 
       a += sizeof (uintptr_t);
     }
 
+  pcb_page_cache_update (tcb->pcb, addr, new_value, bytes);
+
   do_debug (4)
     {
       GString *s = g_string_new ("");
@@ -1245,6 +2192,12 @@ thread_mem_update (struct tcb *tcb, uintptr_t addr,
   return true;
 }
 
+#ifdef __NR_mmap2
+# define NR_MMAP __NR_mmap2
+#else
+# define NR_MMAP __NR_mmap
+#endif
+
 /* The list of system calls that we want to intercept.  */
 static long fixups[] =
   {
@@ -1256,6 +2209,12 @@ static long fixups[] =
     __NR_rmdir,
     __NR_rename,
     __NR_renameat,
+    /* So that we notice libraries that are loaded after the process
+       started (e.g., using dlopen) and patch them too.  We only patch
+       the dynamic loader's mmap (see scan): it maps all libraries.
+       Intercepting every mmap would mean two stops for each large
+       malloc and each thread stack.  */
+    NR_MMAP,
   };
 
 /* A list of instruction families, which we care about.  */
@@ -1505,14 +2464,13 @@ thread_instruction_is (struct tcb *tcb, uintptr_t addr, int instruction)
 {
   char ins[INSTRUCTION_LEN_MAX];
 
-  char *end = tcb_mem_read (tcb, addr, ins, sizeof (ins), false);
-  if (! end)
+  if (! tcb_code_read (tcb, addr, ins, sizeof (ins)))
     {
-      debug (0, "tcb_mem_read failed.");
+      debug (0, "tcb_code_read failed.");
       return ins_unknown; 
     }
 
-  int ins_len = (uintptr_t) end - (uintptr_t) ins + 1;
+  int ins_len = sizeof (ins);
 
   bool ret = instruction_is (ins, ins_len, instruction, NULL);
   if (! ret)
@@ -1532,184 +2490,483 @@ thread_instruction_is (struct tcb *tcb, uintptr_t addr, int instruction)
   return ret;
 }
 
-/* Revert any fixups applied to a process.  */
-static void
-thread_revert_patches (struct tcb *tcb)
+/* Restore the instructions that we patched in TCB's process, but
+   remember the patches.  Returns false if the process is dead.  */
+static bool
+thread_unpatch (struct tcb *tcb)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
-  int i;
-  for (i = 0; i < LIBRARY_COUNT; i ++)
-    if (tcb->pcb->lib_base[i])
-      {
-	uintptr_t base = tcb->pcb->lib_base[i];
-	struct library_patch *lib = &library_patches[i];
+  GSList *l;
+  for (l = tcb->pcb->libs; l; l = l->next)
+    {
+      struct pcb_library *pl = l->data;
+      uintptr_t base = pl->base;
+      struct library_patch *lib = pl->lib;
 
-	int bad = 0;
-	int j;
-	for (j = 0; j < lib->patch_count; j ++)
-	  {
-	    struct patch *p = &lib->patches[j];
+      int bad = 0;
+      int j;
+      for (j = 0; j < lib->patch_count; j ++)
+	{
+	  struct patch *p = &lib->patches[j];
 
-	    uintptr_t addr = base + p->base_offset;
+	  uintptr_t addr = base + p->base_offset;
 
-	    const char *values[] = { ins_breakpoint_bits.byte };
-	    switch (thread_check (tcb, addr, values, 1,
-				  ins_breakpoint_bits.len))
-	      {
-	      default:
-		bad ++;
-		break;
-	      case 1:
-		do_debug (4)
-		  {
-		    GString *s = g_string_new ("");
+	  const char *values[] = { ins_breakpoint_bits.byte };
+	  switch (thread_check (tcb, addr, values, 1,
+				ins_breakpoint_bits.len))
+	    {
+	    default:
+	      bad ++;
+	      break;
+	    case 1:
+	      do_debug (4)
+		{
+		  GString *s = g_string_new ("");
+		  g_string_append_printf
+		    (s, TCB_FMT": Reverting patch at %"PRIxPTR" to contain:",
+		     TCB_PRINTF (tcb), addr);
+
+		  int i;
+		  for (i = 0; i < p->ins_len; i ++)
 		    g_string_append_printf
-		      (s, TCB_FMT": Reverting patch at %"PRIxPTR" to contain:",
-		       TCB_PRINTF (tcb), addr);
-
-		    int i;
-		    for (i = 0; i < p->ins_len; i ++)
-		      g_string_append_printf
-			(s, " 0x%02x", (int) (unsigned char) p->ins[i]);
-		    debug (0, "%s", s->str);
-		    g_string_free (s, true);
-		  }
+		      (s, " 0x%02x", (int) (unsigned char) p->ins[i]);
+		  debug (0, "%s", s->str);
+		  g_string_free (s, true);
+		}
 		
-		thread_mem_update (tcb, addr, p->ins, p->ins_len);
-		break;
-	      case -ESRCH:
-		/* The process is dead.  */
-		return;
-	      }
-	  }
+	      thread_mem_update (tcb, addr, p->ins, p->ins_len);
+	      break;
+	    case -ESRCH:
+	      /* The process is dead.  */
+	      return false;
+	    }
+	}
 
-	if (bad)
-	  debug (0, TCB_FMT": Patched process missing "
-		 "%d of %d patches for %s.",
-		 TCB_PRINTF (tcb), bad, lib->patch_count, lib->filename);
+      if (bad)
+	debug (0, TCB_FMT": Patched process missing "
+	       "%d of %d patches for %s.",
+	       TCB_PRINTF (tcb), bad, lib->patch_count, lib->filename);
+    }
 
-	tcb->pcb->lib_base[i] = 0;
-      }
+  return true;
 }
 
-static GSList *pending_thread_apply_patches;
-
-/* Tries to patch the thread corresponding to TCB.  Returns true if
-   the thread may continue to run, false if it should be
-   suspended.  */
-static bool
-thread_apply_patches (struct tcb *tcb)
+/* Revert any fixups applied to a process.  */
+static void
+thread_revert_patches (struct tcb *tcb)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
-  bool fully_patched (void)
-  {
-    bool ret = true;
-    int bad = 0;
-    int total = 0;
-    int i;
-    for (i = 0; i < LIBRARY_COUNT; i ++)
-      {
-	uintptr_t base = tcb->pcb->lib_base[i];
-	if (base)
-	  {
-#ifndef NDEBUG
-	    struct library_patch *lib = &library_patches[i];
+  if (! tcb->pcb->unpatched && ! thread_unpatch (tcb))
+    return;
 
-	    int j;
-	    for (j = 0; j < lib->patch_count; j ++)
-	      {
-		struct patch *p = &lib->patches[j];
+  pcb_libs_free (tcb->pcb);
+}
 
-		uintptr_t addr = base + p->base_offset;
-		if (! thread_instruction_is (tcb, addr, ins_breakpoint))
-		  {
-		    debug (0, TCB_FMT": Bad patch at %"PRIxPTR" "
-			   "in lib %s, offset %"PRIxPTR,
-			   TCB_PRINTF (tcb),
-			   addr, lib->filename, p->base_offset);
-		    bad ++;
-		  }
-		total ++;
-	      }
-#endif
-	  }
-	else
-	  ret = false;
-      }
+/* The patch cache.
 
-    if (bad)
-      debug (0, TCB_FMT": %d of %d locations incorrectly patched",
-	     TCB_PRINTF (tcb), bad, total);
-    return ret;
-  }
+   Scanning a library for system call sites is expensive: we read its
+   whole executable section from the traced process and examine each
+   instruction.  To avoid doing this each time we start, we save the
+   patches in the process patches database, keyed by the library's
+   build-id or, if it doesn't have one, its device, inode, mtime and
+   size.  When we next encounter the library, we compute the key and
+   check that the size of the mapping matches.  This is cheap: it
+   only requires reading the ELF headers.
+
+   This also helps when a library was left patched by an instance
+   that crashed: the scanner can't recover the instructions that we
+   replaced, but the cache has them.  */
 
-  if (fully_patched ())
+/* Bump this if the scanner or FIXUPS changes.  */
+#define PATCH_CACHE_VERSION 3
+
+/* Return the cache key for the library at PATH (which is mapped from
+   the file with inode INODE) or NULL if it can't be determined.  The
+   caller must free the returned string.  */
+static char *
+patch_cache_key (const char *path, uint64_t inode)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
     {
-      debug (4, TCB_FMT": Process already fully patched.", TCB_PRINTF (tcb));
-      return true;
+      debug (0, "open (%s): %m", path);
+      return NULL;
     }
 
-  bool scan (struct tcb *tcb, struct library_patch *lib,
-	     uintptr_t map_start, uintptr_t map_end)
-  {
-    assert (lib->patch_count == 0);
-    assert (map_start < map_end);
+  char *key = NULL;
 
-    uintptr_t map_length = map_end - map_start;
+  struct stat st;
+  if (fstat (fd, &st) < 0 || st.st_ino != inode)
+    /* The library was replaced since it was mapped.  */
+    {
+      debug (3, "%s: inode mismatch, not using patch cache.", path);
+      goto out;
+    }
 
-    debug (4, "Scanning %s ("TCB_FMT"): "
-	   "%"PRIxPTR"-%"PRIxPTR" (0x%"PRIxPTR" bytes)",
-	   lib->filename, TCB_PRINTF (tcb),
-	   map_start, map_end, map_length);
+  ElfW(Ehdr) ehdr;
+  if (pread (fd, &ehdr, sizeof (ehdr), 0) == sizeof (ehdr)
+      && memcmp (ehdr.e_ident, ELFMAG, SELFMAG) == 0
+      && ehdr.e_phentsize == sizeof (ElfW(Phdr))
+      && ehdr.e_phnum <= 64)
+    {
+      ElfW(Phdr) phdrs[ehdr.e_phnum];
+      if (pread (fd, phdrs, sizeof (phdrs), ehdr.e_phoff) != sizeof (phdrs))
+	goto stat_key;
 
-    char *map = g_malloc (map_length);
-    char *end = tcb_mem_read (tcb, map_start, map, map_length, false);
-    if ((uintptr_t) end + 1 - (uintptr_t) map != map_length)
-      debug (0, TCB_FMT": Reading library %s: "
-	     "read %"PRIdPTR" bytes, expected %"PRIdPTR,
-	     TCB_PRINTF (tcb), lib->filename,
-	     (uintptr_t) end + 1 - (uintptr_t) map, map_length);
-    if (! end)
-      {
-	debug (0, TCB_FMT": tcb_mem_read failed.", TCB_PRINTF (tcb));
-	return false;
-      }
-    map_length = (uintptr_t) end - (uintptr_t) map + 1;
+      int i;
+      for (i = 0; i < ehdr.e_phnum && ! key; i ++)
+	{
+	  if (phdrs[i].p_type != PT_NOTE)
+	    continue;
 
-    /* We want to cache the real map length, not the truncated
-       one.  */
-    lib->size = map_length;
+	  char notes[1024];
+	  size_t len = MIN (phdrs[i].p_filesz, sizeof (notes));
+	  if (pread (fd, notes, len, phdrs[i].p_offset) != len)
+	    continue;
 
+	  size_t off = 0;
+	  while (off + sizeof (ElfW(Nhdr)) <= len)
+	    {
+	      ElfW(Nhdr) *n = (void *) &notes[off];
+	      size_t name = off + sizeof (*n);
+	      size_t desc = name + ((n->n_namesz + 3) & ~3);
+	      off = desc + ((n->n_descsz + 3) & ~3);
+	      if (off > len)
+		break;
 
-    GSList *patches = NULL;
+	      if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4
+		  && memcmp (&notes[name], "GNU", 4) == 0)
+		{
+		  GString *s = g_string_new ("");
+		  g_string_append_printf (s, "v%d:build-id:",
+					  PATCH_CACHE_VERSION);
+		  int j;
+		  for (j = 0; j < n->n_descsz; j ++)
+		    g_string_append_printf
+		      (s, "%02x", (int) (unsigned char) notes[desc + j]);
+		  key = g_string_free (s, false);
+		  break;
+		}
+	    }
+	}
+    }
 
-    int syscall_count = 0;
-    int sigs[syscall_num_load_horizon + 1][syscall_errno_check_horizon + 1][2];
-    memset (sigs, 0, sizeof (sigs));
+ stat_key:
+  if (! key)
+    key = g_strdup_printf ("v%d:stat:%"PRIx64":%"PRIx64":%"PRIx64":%"PRIx64,
+			   PATCH_CACHE_VERSION,
+			   (uint64_t) st.st_dev, (uint64_t) st.st_ino,
+			   (uint64_t) st.st_mtime, (uint64_t) st.st_size);
 
-    int already_patched_count = 0;
-    uintptr_t off;
-    for (off = INSTRUCTION_STEP; off < map_length; off += INSTRUCTION_STEP)
-      {
-	int mov = 0;
-	int errno_check = 0;
+ out:
+  close (fd);
+  return key;
+}
 
-	if (instruction_is (&map[off], map_length - off, ins_syscall, NULL))
-	  {
-	    syscall_count ++;
+/* Look up the patches for the library with key KEY, whose executable
+   section is SIZE bytes large.  If found, install them in LIB and
+   return true.  */
+static bool
+patch_cache_load (struct library_patch *lib, const char *key, uintptr_t size)
+{
+  if (! process_patches_db)
+    return false;
 
-	    struct instruction_info mov_info;
-	    int j;
-	    for (j = 1; j <= syscall_num_load_horizon; j ++)
-	      if (off > j * INSTRUCTION_STEP)
-		{
-		  if (instruction_is (&map[off - j * INSTRUCTION_STEP],
-				      map_length - (off - j * INSTRUCTION_STEP),
-				      ins_syscall_num_load,
-				      &mov_info))
-		    {
+  bool found = false;
+  uintptr_t cached_size = 0;
+  int count = 0;
+  int lib_cb (void *cookie, int argc, char **argv, char **names)
+  {
+    found = true;
+    cached_size = strtoull (argv[0], NULL, 16);
+    count = atoi (argv[1]);
+    return 0;
+  }
+
+  char *errmsg = NULL;
+  int err = sqlite3_exec_printf (process_patches_db,
+				 "select size, count from patch_cache_libs"
+				 " where key = %Q;",
+				 lib_cb, NULL, &errmsg, key);
+  if (errmsg)
+    {
+      debug (0, "Reading patch cache %d: %s", err, errmsg);
+      sqlite3_free (errmsg);
+      return false;
+    }
+
+  if (! found)
+    {
+      debug (3, "%s (%s) not in patch cache.", lib->filename, key);
+      return false;
+    }
+  if (cached_size != size)
+    {
+      debug (0, "%s (%s): cached size 0x%"PRIxPTR" != mapped size "
+	     "0x%"PRIxPTR".  Ignoring cache.",
+	     lib->filename, key, cached_size, size);
+      return false;
+    }
+
+  struct patch *patches = NULL;
+  int n = 0;
+  if (count > 0)
+    {
+      patches = g_malloc (sizeof (struct patch) * count);
+
+      int patch_cb (void *cookie, int argc, char **argv, char **names)
+      {
+	if (n == count || argc != 3 + INSTRUCTION_LEN_MAX)
+	  return 1;
+
+	struct patch *p = &patches[n];
+	p->base_offset = strtoull (argv[0], NULL, 16);
+	p->syscall = atol (argv[1]);
+	p->ins_len = atoi (argv[2]);
+	if (p->ins_len <= 0 || p->ins_len > INSTRUCTION_LEN_MAX)
+	  return 1;
+	int i;
+	for (i = 0; i < INSTRUCTION_LEN_MAX; i ++)
+	  p->ins[i] = argv[3 + i] ? atoi (argv[3 + i]) : 0;
+
+	n ++;
+	return 0;
+      }
+
+      GString *sql = g_string_new ("select offset, syscall, len");
+      int i;
+      for (i = 0; i < INSTRUCTION_LEN_MAX; i ++)
+	g_string_append_printf (sql, ", o%d", i + 1);
+      g_string_append (sql, " from patch_cache where key = %Q;");
+
+      err = sqlite3_exec_printf (process_patches_db, sql->str,
+				 patch_cb, NULL, &errmsg, key);
+      g_string_free (sql, true);
+      if (errmsg)
+	{
+	  debug (0, "Reading patch cache %d: %s", err, errmsg);
+	  sqlite3_free (errmsg);
+	}
+      if (n != count)
+	{
+	  debug (0, "%s (%s): patch cache corrupted (%d of %d patches).",
+		 lib->filename, key, n, count);
+	  g_free (patches);
+	  return false;
+	}
+    }
+
+  debug (3, "%s (%s): %d patches (cached).", lib->filename, key, count);
+
+  lib->patches = patches;
+  lib->patch_count = count;
+  lib->size = size;
+  return true;
+}
+
+/* Save LIB's patches under KEY.  Removes any patches saved for other
+   versions of LIB.  */
+static void
+patch_cache_save (struct library_patch *lib, const char *key)
+{
+  if (! process_patches_db)
+    return;
+
+  GString *sql = g_string_new ("begin transaction;\n");
+
+  char *s = sqlite3_mprintf
+    ("delete from patch_cache where key in"
+     " (select key from patch_cache_libs where lib = %Q or key = %Q);\n"
+     "delete from patch_cache_libs where lib = %Q or key = %Q;\n"
+     "insert into patch_cache_libs (lib, key, size, count)"
+     " values (%Q, %Q, '%"PRIxPTR"', %d);\n",
+     lib->filename, key, lib->filename, key,
+     lib->filename, key, lib->size, lib->patch_count);
+  g_string_append (sql, s);
+  sqlite3_free (s);
+
+  int i;
+  for (i = 0; i < lib->patch_count; i ++)
+    {
+      struct patch *p = &lib->patches[i];
+
+      s = sqlite3_mprintf ("insert into patch_cache"
+			   " values (%Q, '%"PRIxPTR"', %ld, %d",
+			   key, p->base_offset, p->syscall, p->ins_len);
+      g_string_append (sql, s);
+      sqlite3_free (s);
+
+      int j;
+      for (j = 0; j < INSTRUCTION_LEN_MAX; j ++)
+	g_string_append_printf (sql, ", %d", (int) (unsigned char) p->ins[j]);
+      for (; j < 8; j ++)
+	g_string_append (sql, ", NULL");
+      g_string_append (sql, ");\n");
+    }
+  g_string_append (sql, "end transaction;\n");
+
+  char *errmsg = NULL;
+  int err = sqlite3_exec (process_patches_db, sql->str, NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      debug (0, "Saving patch cache %d: %s", err, errmsg);
+      sqlite3_free (errmsg);
+      sqlite3_exec (process_patches_db, "rollback transaction;",
+		    NULL, NULL, NULL);
+    }
+  g_string_free (sql, true);
+}
+
+/* Record LIB's patches in the process patches database so that
+   smart-storage-logger-recover can revert them if we crash.  */
+static void
+library_record (struct library_patch *lib)
+{
+  if (lib->patch_count <= 0)
+    return;
+
+  GString *sql = g_string_new ("begin transaction;\n");
+  int i;
+  for (i = 0; i < lib->patch_count; i ++)
+    {
+      struct patch *p = &lib->patches[i];
+
+      g_string_append_printf (sql, "insert into patches (lib, offset, len");
+      int j;
+      for (j = 0; j < INSTRUCTION_LEN_MAX; j ++)
+	g_string_append_printf (sql, ", o%d", j + 1);
+      char *s = sqlite3_mprintf (") values (%Q, '%"PRIxPTR"', '%x'",
+				 lib->filename, p->base_offset, p->ins_len);
+      g_string_append (sql, s);
+      sqlite3_free (s);
+      for (j = 0; j < INSTRUCTION_LEN_MAX; j ++)
+	g_string_append_printf (sql, ", '0x%x'",
+				(int) (unsigned char) p->ins[j]);
+      g_string_append_printf (sql, ");\n");
+    }
+  g_string_append_printf (sql, "end transaction;\n");
+  debug (4, "%s", sql->str);
+
+  if (process_patches_db)
+    {
+      char *errmsg = NULL;
+      int err = sqlite3_exec (process_patches_db, sql->str,
+			      NULL, NULL, &errmsg);
+      if (errmsg)
+	{
+	  debug (0, "Saving patch %d: %s", err, errmsg);
+	  sqlite3_free (errmsg);
+	  errmsg = NULL;
+	}
+    }
+  g_string_free (sql, true);
+}
+
+/* Tries to patch the thread corresponding to TCB.  Returns true if
+   the thread may continue to run, false if it should be
+   suspended.  */
+static bool
+thread_apply_patches (struct tcb *tcb)
+{
+  assert (tracer);
+
+#ifndef NDEBUG
+  /* Check that the patches that we think we applied are in place.  */
+  void check_patches (void)
+  {
+    int bad = 0;
+    int total = 0;
+    GSList *l;
+    for (l = tcb->pcb->libs; l; l = l->next)
+      {
+	struct pcb_library *pl = l->data;
+	struct library_patch *lib = pl->lib;
+
+	int j;
+	for (j = 0; j < lib->patch_count; j ++)
+	  {
+	    struct patch *p = &lib->patches[j];
+
+	    uintptr_t addr = pl->base + p->base_offset;
+	    if (! thread_instruction_is (tcb, addr, ins_breakpoint))
+	      {
+		debug (0, TCB_FMT": Bad patch at %"PRIxPTR" "
+		       "in lib %s, offset %"PRIxPTR,
+		       TCB_PRINTF (tcb),
+		       addr, lib->filename, p->base_offset);
+		bad ++;
+	      }
+	    total ++;
+	  }
+      }
+
+    if (bad)
+      debug (0, TCB_FMT": %d of %d locations incorrectly patched",
+	     TCB_PRINTF (tcb), bad, total);
+  }
+#endif
+
+  bool scan (struct tcb *tcb, struct library_patch *lib,
+	     uintptr_t map_start, uintptr_t map_end)
+  {
+    assert (lib->patch_count == 0);
+    assert (map_start < map_end);
+
+    uintptr_t map_length = map_end - map_start;
+
+    debug (4, "Scanning %s ("TCB_FMT"): "
+	   "%"PRIxPTR"-%"PRIxPTR" (0x%"PRIxPTR" bytes)",
+	   lib->filename, TCB_PRINTF (tcb),
+	   map_start, map_end, map_length);
+
+    char *map = g_malloc (map_length);
+    char *end = tcb_mem_read (tcb, map_start, map, map_length, false);
+    if ((uintptr_t) end + 1 - (uintptr_t) map != map_length)
+      debug (0, TCB_FMT": Reading library %s: "
+	     "read %"PRIdPTR" bytes, expected %"PRIdPTR,
+	     TCB_PRINTF (tcb), lib->filename,
+	     (uintptr_t) end + 1 - (uintptr_t) map, map_length);
+    if (! end)
+      {
+	debug (0, TCB_FMT": tcb_mem_read failed.", TCB_PRINTF (tcb));
+	return false;
+      }
+    map_length = (uintptr_t) end - (uintptr_t) map + 1;
+
+    /* We want to cache the real map length, not the truncated
+       one.  */
+    lib->size = map_length;
+
+
+    GSList *patches = NULL;
+
+    int syscall_count = 0;
+    int sigs[syscall_num_load_horizon + 1][syscall_errno_check_horizon + 1][2];
+    memset (sigs, 0, sizeof (sigs));
+
+    int already_patched_count = 0;
+    uintptr_t off;
+    for (off = INSTRUCTION_STEP; off < map_length; off += INSTRUCTION_STEP)
+      {
+	int mov = 0;
+	int errno_check = 0;
+
+	if (instruction_is (&map[off], map_length - off, ins_syscall, NULL))
+	  {
+	    syscall_count ++;
+
+	    struct instruction_info mov_info;
+	    int j;
+	    for (j = 1; j <= syscall_num_load_horizon; j ++)
+	      if (off > j * INSTRUCTION_STEP)
+		{
+		  if (instruction_is (&map[off - j * INSTRUCTION_STEP],
+				      map_length - (off - j * INSTRUCTION_STEP),
+				      ins_syscall_num_load,
+				      &mov_info))
+		    {
 		      mov = j;
 		      break;
 		    }
@@ -1768,7 +3025,8 @@ thread_apply_patches (struct tcb *tcb)
 	      {
 		int j;
 		for (j = 0; j < sizeof (fixups) / sizeof (fixups[0]); j ++)
-		  if (mov_info.skipped_value == fixups[j])
+		  if (mov_info.skipped_value == fixups[j]
+		      && (fixups[j] != NR_MMAP || lib->loader))
 		    {
 		      sigs[mov][errno_check][1] ++;
 
@@ -1828,180 +3086,65 @@ thread_apply_patches (struct tcb *tcb)
 
     g_free (map);
 
-    if (! already_patched_count)
+    if (! already_patched_count && lib->patch_count > 0)
       lib->patches = g_malloc (sizeof (struct patch) * lib->patch_count);
 
-    GString *sql = NULL;
     for (i = 0; i < lib->patch_count; i ++)
       {
 	assert (patches);
-	struct patch *p = patches->data;
-
 	if (! already_patched_count)
-	  {
-	    lib->patches[i] = *p;
-
-	    if (! sql)
-	      sql = g_string_new ("begin transaction;\n");
-	    g_string_append_printf (sql,
-				    "insert into patches (lib, offset, len");
-	    int i;
-	    for (i = 0; i < INSTRUCTION_LEN_MAX; i ++)
-	      g_string_append_printf (sql, ", o%d", i + 1);
-	    g_string_append_printf (sql, ") values ('%s', '%"PRIxPTR"', '%x'",
-				    lib->filename, p->base_offset, p->ins_len);
-	    for (i = 0; i < INSTRUCTION_LEN_MAX; i ++)
-	      g_string_append_printf (sql, ", '0x%x'", p->ins[i]);
-	    g_string_append_printf (sql, ");\n");
-	  }
+	  lib->patches[i] = * (struct patch *) patches->data;
 
-	/* No need to free P.  It is stack allocated.  */
+	/* No need to free the patch.  It is stack allocated.  */
 	patches = g_slist_delete_link (patches, patches);
       }
-    if (sql)
-      {
-	g_string_append_printf (sql, "end transaction;\n");
-	debug (4, "%s", sql->str);
-
-	if (process_patches_db)
-	  {
-	    char *errmsg = NULL;
-	    int err = sqlite3_exec (process_patches_db, sql->str,
-				    NULL, NULL, &errmsg);
-	    if (errmsg)
-	      {
-		debug (0, "Saving patch %d: %s", err, errmsg);
-		sqlite3_free (errmsg);
-		errmsg = NULL;
-	      }
-	  }
-	g_string_free (sql, true);
-      }
 
     if (already_patched_count)
       lib->patch_count = 0;
+    else
+      library_record (lib);
 
     assert (! patches);
 
     return lib->patch_count != 0;
   }
 
-  /* 0 => Library not found.  1 => Good library found, MAP_START and
-     MAP_END valid.  -1 => Library found, but version mismatch or some
-     other error.  */
-  int grep_maps (struct tcb *tcb, const char *maps, struct library_patch *lib,
-		 uintptr_t *map_start, uintptr_t *map_end)
+  /* Parse a line of /proc/pid/maps.  Returns whether it describes an
+     executable mapping of a file.  If so, sets MAP_START, MAP_END,
+     ID (which the caller must free), INODE, PATH and PATH_LEN.  */
+  bool parse_maps_line (const char *line,
+			uintptr_t *map_start, uintptr_t *map_end,
+			char **id, uint64_t *inode,
+			const char **path, int *path_len)
   {
-    int filename_len = strlen (lib->filename);
-
-    int ret = 0;
-    const char *filename_loc = maps;
-    while ((filename_loc = strstr (filename_loc, lib->filename)))
-      {
-	/* We have, e.g., /lib/libc-, make sure it is something like
-	   /lib/libc-2.11.so and not /usr/lib/libc-other.so  */
-	if (filename_loc == maps || filename_loc[-1] != ' ')
-	  continue;
-	int suffix = strspn (filename_loc + filename_len,
-			     "1234567890-.so");
-	if (filename_loc[filename_len + suffix] != '\n')
-	  continue;
-
-	/* Find the start of the line.  */
-	const char *line
-	  = memrchr (maps, '\n', (uintptr_t) filename_loc - (uintptr_t) maps);
-	if (line)
-	  line ++;
-	else
-	  line = maps;
-
-	debug (4, "Considering '%.*s'",
-	       (int) ((uintptr_t) filename_loc - (uintptr_t) line
-		      + filename_len + suffix),
-	       line);
-
-	const char *p = line;
-
-	/* Advance by one so that the next strstr (if any) doesn't
-	   return the same location.  */
-	filename_loc ++;
-
-	char *tailp = NULL;
-	errno = 0;
-	*map_start = strtoull (p, &tailp, 16);
-	if (errno)
-	  {
-	    debug (0, "Overflow reading number: %.12s", p);
-	    return -1;
-	  }
-	debug (4, "map start: %"PRIxPTR, *map_start);
-	p = tailp;
-	if (*p != '-')
-	  {
-	    debug (0, "Expected '-'.  Have '%c'", *p);
-	    return -1;
-	  }
-	p ++;
-
-	errno = 0;
-	*map_end = strtoull (p, &tailp, 16);
-	if (errno)
-	  {
-	    debug (0, "Overflow reading number: %.12s", p);
-	    return -1;
-	  }
-	debug (4, "map end: %"PRIxPTR, *map_end);
-	p = tailp;
-
-	const char *perms = " r-xp ";
-	if (strncmp (p, perms, strlen (perms)) != 0)
-	  /* Right library, wrong section.  Skip it.  */
-	  {
-	    debug (5, "Expected '%s'.  Have '%.6s'", perms, p);
-	    continue;
-	  }
-
-	p += strlen (perms);
+    char perms[5];
+    uintptr_t file_offset;
+    unsigned int major, minor;
+    int n = 0;
+    if (sscanf (line, "%"SCNxPTR"-%"SCNxPTR" %4s %"SCNxPTR" %x:%x %"SCNu64" %n",
+		map_start, map_end, perms, &file_offset,
+		&major, &minor, inode, &n) < 7
+	|| n == 0)
+      return false;
 
-	errno = 0;
-	uintptr_t file_offset = strtoull (p, &tailp, 16);
-	if (errno)
-	  {
-	    debug (0, "Overflow reading number: %.12s", p);
-	    return -1;
-	  }
-	debug (4, "file offset: %"PRIxPTR, file_offset);
-	p = tailp;
-	if (*p != ' ')
-	  {
-	    debug (0, "Expected ' '.  Have '%.12s'", p);
-	    return -1;
-	  }
+    if (strcmp (perms, "r-xp") != 0)
+      return false;
 
-	if (lib->size)
-	  /* (Try to) make sure it is the same library.  */
-	  {
-	    if (*map_end - *map_start != lib->size)
-	      /* Wrong library.  */
-	      {
-		debug (0, TCB_FMT":Found library %s at "
-		       "0x%"PRIxPTR"-0x%"PRIxPTR", but wrong size "
-		       "(expected 0x%"PRIxPTR", got 0x%"PRIxPTR").",
-		       TCB_PRINTF (tcb), lib->filename, *map_start, *map_end,
-		       lib->size, *map_end - *map_start);
-		ret = -1;
-		continue;
-	      }
-	  }
+    *path = line + n;
+    if (**path != '/')
+      /* An anonymous mapping, the vdso, etc.  */
+      return false;
 
-	debug (3, TCB_FMT": Found library %s at "
-	       "0x%"PRIxPTR"-0x%"PRIxPTR" (0x%"PRIxPTR")",
-	       TCB_PRINTF (tcb), lib->filename,
-	       *map_start, *map_end, *map_end - *map_start);
+    const char *eol = strchrnul (*path, '\n');
+    *path_len = eol - *path;
+    const char *deleted = " (deleted)";
+    if (*path_len > strlen (deleted)
+	&& memcmp (eol - strlen (deleted), deleted, strlen (deleted)) == 0)
+      /* The file was replaced (e.g., the library was upgraded).  */
+      return false;
 
-	return 1;
-      }
-    return ret;
+    *id = g_strdup_printf ("%x:%x:%"PRIu64, major, minor, *inode);
+    return true;
   }
 
   /* Patch the thread TCB.  Returns true if the thread may be resumed,
@@ -2029,89 +3172,165 @@ thread_apply_patches (struct tcb *tcb)
   retry:;
     bool suspend = false;
     bool did_scan = false;
-    bool patch[LIBRARY_COUNT];
-    uintptr_t lib_base[LIBRARY_COUNT];
-    int i;
-    for (i = 0; i < LIBRARY_COUNT; i ++)
-      {
-	patch[i] = false;
-	if (! tcb->pcb->lib_base[i])
-	  {
-	    uintptr_t map_addr, map_end;
-	    switch (grep_maps (tcb, maps, &library_patches[i],
-			       &map_addr, &map_end))
-	      {
-	      case 1:
-		if (! library_patches[i].patch_count)
-		  /* We have not yet generated the patch list.  */
-		  {
-		    if (! scan (tcb, &library_patches[i], map_addr, map_end))
-		      /* It looks like the binary was already patched.
-			 That means we crashed and did not properly
-			 clean up (i.e., revert patched processes).
-			 Given a patched binary, we can't extract the
-			 syscall numbers.  These leaves us three
-			 options.
-
-			 - We can try scanning ourself.  If we've
-			   loaded the relevant libraries, then life is
-			   good.
+    bool loader_unpatched = false;
+    /* Newly mapped libraries (struct pcb_library *s).  */
+    GSList *new_libs = NULL;
 
-			 - We suspend the process until another binary
-			   that uses the relevant library is
-			   sucessfully scanned.
+    GSList *l;
+    for (l = tcb->pcb->libs; l; l = l->next)
+      ((struct pcb_library *) l->data)->seen = false;
 
-		         - We kill the process.
+    const char *line;
+    for (line = maps; line && *line && ! suspend;
+	 line = strchr (line, '\n'), line = line ? line + 1 : NULL)
+      {
+	uintptr_t map_addr, map_end;
+	char *id = NULL;
+	uint64_t inode = 0;
+	const char *path;
+	int path_len;
+	if (! parse_maps_line (line, &map_addr, &map_end, &id, &inode,
+			       &path, &path_len))
+	  continue;
 
-		        We try option one, then two.  */
-		      {
-			static bool scanned_self;
-			if (! scanned_self)
-			  {
-			    debug (3, "Library self scan");
-			    scanned_self = true;
-
-			    struct tcb *self
-			      = thread_trace (signal_process_pid, NULL, true);
-			    if (self)
-			      {
-				did_scan = do_patch (self, true);
-				thread_untrace (self, false);
-				if (did_scan)
-				  goto retry;
-			      }
-			  }
+	struct library_patch *lib = g_hash_table_lookup (libraries, id);
+	if (! lib)
+	  /* A new library.  */
+	  {
+	    lib = g_malloc0 (sizeof (*lib));
+	    lib->filename = g_strndup (path, path_len);
+	    lib->id = id;
+	    id = NULL;
 
-			suspend = true;
-			break;
-		      }
-		    else
-		      did_scan = true;
-		  }
-		lib_base[i] = map_addr;
-		patch[i] = true;
-		break;
+	    const char *base = strrchr (lib->filename, '/') + 1;
+	    lib->loader = (strncmp (base, "ld-", 3) == 0
+			   || strncmp (base, "ld.so", 5) == 0);
 
-	      case -1:
-		/* Library found, but a different version.  Don't
-		   patch anything.  */
-		{
-		  thread_revert_patches (tcb);
-		  g_free (maps);
-		  return true;
-		}
-	      }
+	    g_hash_table_insert (libraries, lib->id, lib);
 	  }
-      }
+	g_free (id);
 
-    g_free (maps);
+	if (lib->size && map_end - map_addr != lib->size)
+	  /* The file was modified in place.  */
+	  {
+	    debug (0, TCB_FMT": Found library %s at "
+		   "0x%"PRIxPTR"-0x%"PRIxPTR", but wrong size "
+		   "(expected 0x%"PRIxPTR", got 0x%"PRIxPTR").",
+		   TCB_PRINTF (tcb), lib->filename, map_addr, map_end,
+		   lib->size, map_end - map_addr);
+	    if (lib->loader)
+	      loader_unpatched = true;
+	    continue;
+	  }
+
+	/* Did we already patch it?  */
+	for (l = tcb->pcb->libs; l; l = l->next)
+	  {
+	    struct pcb_library *pl = l->data;
+	    if (pl->lib == lib && pl->base == map_addr)
+	      {
+		pl->seen = true;
+		break;
+	      }
+	  }
+	if (l)
+	  continue;
+
+	debug (3, TCB_FMT": Found library %s at "
+	       "0x%"PRIxPTR"-0x%"PRIxPTR" (0x%"PRIxPTR")",
+	       TCB_PRINTF (tcb), lib->filename,
+	       map_addr, map_end, map_end - map_addr);
+
+	if (! lib->patch_count)
+	  /* We have not yet generated the patch list.  */
+	  {
+	    char *key = NULL;
+	    if (process_patches_db)
+	      key = patch_cache_key (lib->filename, inode);
+
+	    if (key && patch_cache_load (lib, key, map_end - map_addr))
+	      {
+		library_record (lib);
+		did_scan = true;
+	      }
+	    else if (! scan (tcb, lib, map_addr, map_end))
+	      /* It looks like the binary was already patched.  That
+		 means we crashed and did not properly clean up (i.e.,
+		 revert patched processes).  Given a patched binary, we
+		 can't extract the syscall numbers.  These leaves us
+		 three options.
+
+		 - We can try scanning ourself.  If we've loaded the
+		   relevant libraries, then life is good.
+
+		 - We suspend the process until another binary that
+		   uses the relevant library is sucessfully scanned.
+
+		 - We kill the process.
+
+		 We try option one, then two.  */
+	      {
+		g_free (key);
+
+		static bool scanned_self;
+		if (! scanned_self)
+		  {
+		    debug (3, "Library self scan");
+		    scanned_self = true;
+
+		    struct tcb *self
+		      = thread_trace (tracer->signal_process_pid, NULL, true);
+		    if (self)
+		      {
+			did_scan = do_patch (self, true);
+			thread_untrace (self, false);
+			if (did_scan)
+			  {
+			    g_slist_foreach (new_libs, (GFunc) g_free, NULL);
+			    g_slist_free (new_libs);
+			    goto retry;
+			  }
+		      }
+		  }
+
+		suspend = true;
+		break;
+	      }
+	    else
+	      {
+		did_scan = true;
+		if (key)
+		  patch_cache_save (lib, key);
+	      }
+	    g_free (key);
+	  }
+
+	if (lib->patch_count < 0)
+	  /* No interesting system calls.  */
+	  {
+	    if (lib->loader)
+	      loader_unpatched = true;
+	    continue;
+	  }
+
+	struct pcb_library *pl = g_malloc (sizeof (*pl));
+	pl->lib = lib;
+	pl->base = map_addr;
+	pl->seen = true;
+	new_libs = g_slist_prepend (new_libs, pl);
+      }
+
+    g_free (maps);
 
     if (suspend)
       {
+	g_slist_foreach (new_libs, (GFunc) g_free, NULL);
+	g_slist_free (new_libs);
+
 	debug (0, "Suspending "TCB_FMT, TCB_PRINTF (tcb));
 
-	pending_thread_apply_patches
-	  = g_slist_prepend (pending_thread_apply_patches, tcb);
+	tracer->pending_thread_apply_patches
+	  = g_slist_prepend (tracer->pending_thread_apply_patches, tcb);
 	return false;
       }
 
@@ -2119,84 +3338,123 @@ thread_apply_patches (struct tcb *tcb)
     int already_patched = 0;
     int bad = 0;
     int total = 0;
-    for (i = 0; i < LIBRARY_COUNT; i ++)
-      if (patch[i])
-	{
-	  int j;
-	  for (j = 0; j < library_patches[i].patch_count; j ++)
-	    {
-	      struct patch *p = &library_patches[i].patches[j];
-	      char patched[p->ins_len];
-	      memcpy (patched, ins_breakpoint_bits.byte,
-		      ins_breakpoint_bits.len);
-	      memcpy (&patched[ins_breakpoint_bits.len],
-		      &p->ins[ins_breakpoint_bits.len],
-		      p->ins_len - ins_breakpoint_bits.len);
+    for (l = new_libs; l; l = l->next)
+      {
+	struct pcb_library *pl = l->data;
+	int count = pl->lib->patch_count;
 
-	      const char *values[] = { p->ins, patched };
+	/* Read all of the library's patch sites at once.  */
+	struct iovec *local = g_malloc (2 * count * sizeof (struct iovec));
+	struct iovec *remote = &local[count];
+	char *real = g_malloc (count * INSTRUCTION_LEN_MAX);
+	int j;
+	for (j = 0; j < count; j ++)
+	  {
+	    struct patch *p = &pl->lib->patches[j];
+	    local[j].iov_base = &real[j * INSTRUCTION_LEN_MAX];
+	    local[j].iov_len = p->ins_len;
+	    remote[j].iov_base = (void *) (pl->base + p->base_offset);
+	    remote[j].iov_len = p->ins_len;
+	  }
+	tcb_mem_readv (tcb, local, remote, count);
 
-	      switch (thread_check (tcb, lib_base[i] + p->base_offset,
-				    values, 2, p->ins_len))
-		{
-		case 0:
-		  /* Mismatch.  */
-		default:
-		  /* Error reading memory.  */
-		  bad ++;
-		  break;
-		case 1:
-		  /* Instruction.  */
-		  break;
-		case 2:
-		  /* Patched instruction.  */
-		  already_patched ++;
-		  debug (0, TCB_FMT" already patched at 0x%"PRIxPTR,
-			 TCB_PRINTF (tcb), lib_base[i] + p->base_offset);
-		}
-	    }
+	for (j = 0; j < count; j ++)
+	  {
+	    struct patch *p = &pl->lib->patches[j];
+	    char patched[p->ins_len];
+	    memcpy (patched, ins_breakpoint_bits.byte,
+		    ins_breakpoint_bits.len);
+	    memcpy (&patched[ins_breakpoint_bits.len],
+		    &p->ins[ins_breakpoint_bits.len],
+		    p->ins_len - ins_breakpoint_bits.len);
+
+	    const char *values[] = { p->ins, patched };
+
+	    int r = -EFAULT;
+	    if (local[j].iov_len == p->ins_len)
+	      r = thread_check_value (tcb, pl->base + p->base_offset,
+				      local[j].iov_base,
+				      values, 2, p->ins_len);
+	    switch (r)
+	      {
+	      case 0:
+		/* Mismatch.  */
+	      default:
+		/* Error reading memory.  */
+		bad ++;
+		break;
+	      case 1:
+		/* Instruction.  */
+		break;
+	      case 2:
+		/* Patched instruction.  */
+		already_patched ++;
+		debug (0, TCB_FMT" already patched at 0x%"PRIxPTR,
+		       TCB_PRINTF (tcb), pl->base + p->base_offset);
+	      }
+	  }
 
-	  total += j;
-	}
+	g_free (real);
+	g_free (local);
+
+	total += j;
+      }
 
     if (already_patched)
       debug (0, TCB_FMT": %d of %d locations already patched.",
 	     TCB_PRINTF (tcb), already_patched, total);
-    if (bad)
+    if (bad || fake)
       {
-	debug (0, TCB_FMT": %d of %d locations contain unexpected values.  "
-	       "Not patching.",
-	       TCB_PRINTF (tcb), bad, total);
+	if (bad)
+	  debug (0, TCB_FMT": %d of %d locations contain unexpected values.  "
+		 "Not patching.",
+		 TCB_PRINTF (tcb), bad, total);
+	g_slist_foreach (new_libs, (GFunc) g_free, NULL);
+	g_slist_free (new_libs);
 	return true;
       }
 
-    if (fake)
-      return true;
+    /* Forget any libraries that were unmapped.  */
+    GSList *next;
+    for (l = tcb->pcb->libs; l; l = next)
+      {
+	next = l->next;
+	struct pcb_library *pl = l->data;
+	if (! pl->seen)
+	  {
+	    debug (4, TCB_FMT": %s unmapped.",
+		   TCB_PRINTF (tcb), pl->lib->filename);
+	    g_free (pl);
+	    tcb->pcb->libs = g_slist_delete_link (tcb->pcb->libs, l);
+	  }
+      }
+    tcb->pcb->loader_unpatched = loader_unpatched;
 
     GString *sql = NULL;
     int count = 0;
-    for (i = 0; i < LIBRARY_COUNT; i ++)
+    while (new_libs)
       {
-	tcb->pcb->lib_base[i] = lib_base[i];
-	if (patch[i])
-	  {
-	    if (! sql)
-	      sql = g_string_new ("begin transaction;\n");
-	    g_string_append_printf
-	      (sql,
-	       "insert into processes (pid, lib, base)"
-	       " values (%d, '%s', '%"PRIxPTR"');\n",
-	       tcb->pcb->group_leader.tid, library_patches[i].filename,
-	       lib_base[i]);
+	struct pcb_library *pl = new_libs->data;
+	new_libs = g_slist_delete_link (new_libs, new_libs);
+	tcb->pcb->libs = g_slist_prepend (tcb->pcb->libs, pl);
+
+	if (! sql)
+	  sql = g_string_new ("begin transaction;\n");
+	char *s = sqlite3_mprintf ("insert into processes (pid, lib, base)"
+				   " values (%d, %Q, '%"PRIxPTR"');\n",
+				   tcb->pcb->group_leader.tid,
+				   pl->lib->filename, pl->base);
+	g_string_append (sql, s);
+	sqlite3_free (s);
 
-	    int j;
-	    for (j = 0; j < library_patches[i].patch_count; j ++)
-	      {
-		struct patch *p = &library_patches[i].patches[j];
-		if (thread_mem_update (tcb, lib_base[i] + p->base_offset,
-				       ins_breakpoint_bits.byte,
-				       ins_breakpoint_bits.len))
-		  count ++;
-	      }
+	int j;
+	for (j = 0; j < pl->lib->patch_count; j ++)
+	  {
+	    struct patch *p = &pl->lib->patches[j];
+	    if (thread_mem_update (tcb, pl->base + p->base_offset,
+				   ins_breakpoint_bits.byte,
+				   ins_breakpoint_bits.len))
+	      count ++;
 	  }
       }
 
@@ -2220,125 +3478,785 @@ thread_apply_patches (struct tcb *tcb)
 	g_string_free (sql, true);
       }
 
+    if (total)
+      debug (already_patched == 0 ? 3 : 0,
+	     "Patched "TCB_FMT": applied %d of %d (total: %d) patches",
+	     TCB_PRINTF (tcb), count, total - already_patched, total);
+
+    if (did_scan)
+      {
+	/* Try to patch any suspended processes.  */
+	int suspended = 0;
+	int still_suspended = 0;
+	GSList *l;
+	l = tracer->pending_thread_apply_patches;
+	tracer->pending_thread_apply_patches = NULL;
+	while (l)
+	  {
+	    suspended ++;
+
+	    struct tcb *tcb = l->data;
+	    if (! do_patch (tcb, false))
+	      still_suspended ++;
+	    l = g_slist_delete_link (l, l);
+	  }
+
+	if (suspended)
+	  debug (0, "Patched and resumed %d of %d suspended threads.",
+		 suspended - still_suspended, suspended);
+      }
+
+    return true;
+  }
+
+  pthread_mutex_lock (&libraries_lock);
+  bool ret = do_patch (tcb, false);
+  pthread_mutex_unlock (&libraries_lock);
+
+#ifndef NDEBUG
+  check_patches ();
+#endif
+
+  return ret;
+}
+
+#ifdef __x86_64__
+# define REGS_STRUCT struct user_regs_struct
+# define REGS_IP rip
+# define REGS_SYSCALL rax
+#elif __arm__
+# define REGS_STRUCT struct pt_regs
+# define REGS_IP ARM_pc
+# define REGS_SYSCALL ARM_r7
+#endif
+
+/* The thread hit a break point.  If it is a breakpoint we set, fix up
+   the thread's register state and return true.  Otherwise, return
+   false.  */
+static bool
+thread_fixup_and_advance (struct tcb *tcb, REGS_STRUCT *regs)
+{
+  if (! tcb->pcb->libs)
+    {
+      debug (4, "Thread "TCB_FMT" not patched, not fixing up.",
+	     TCB_PRINTF (tcb));
+      return false;
+    }
+
+  uintptr_t IP = regs->REGS_IP;
+  bool fixed = false;
+  GSList *l;
+  for (l = tcb->pcb->libs; l; l = l->next)
+    {
+      struct pcb_library *pl = l->data;
+      struct library_patch *lib = pl->lib;
+      if (! (pl->base <= IP && IP < pl->base + lib->size))
+	continue;
+
+      /* The address is coverd by this library.  */
+      debug (4, TCB_FMT": IP %"PRIxPTR" covered by library %s "
+	     "(=> offset: %"PRIxPTR")",
+	     TCB_PRINTF (tcb), IP, lib->filename, IP - pl->base);
+
+      int j;
+      for (j = 0; j < lib->patch_count; j ++)
+	{
+	  struct patch *p = &lib->patches[j];
+
+	  uintptr_t addr = pl->base + p->base_offset;
+	  if (addr == IP || addr + ins_breakpoint_bits.len == IP)
+	    {
+	      regs->REGS_IP = addr + p->ins_len;
+	      regs->REGS_SYSCALL = (uintptr_t) p->syscall;
+
+	      if (ptrace (PTRACE_SETREGS, tcb->tid, 0, (void *) regs) < 0)
+		debug (0, TCB_FMT": Failed to update thread's register "
+		       "set: %m",
+		       TCB_PRINTF (tcb));
+	      else
+		{
+		  fixed = true;
+		  debug (4, TCB_FMT": Fixed up thread "
+			 "(%s, syscall %s (%ld)).",
+			 TCB_PRINTF (tcb), lib->filename,
+			 syscall_str (p->syscall), p->syscall);
+		}
+
+	      break;
+	    }
+	}
+
+      /* As libraries don't overlap, we're done.  */
+      break;
+    }
+
+  if (! l)
+    debug (4, TCB_FMT": IP %"PRIxPTR" not covered by any library.",
+	   TCB_PRINTF (tcb), (uintptr_t) regs->REGS_IP);
+
+  if (! fixed)
+    debug (4, TCB_FMT": IP: %"PRIxPTR".  No fix up applied.",
+	   TCB_PRINTF (tcb), (uintptr_t) regs->REGS_IP);
+
+  return fixed;
+}
+
+/* System call filtering.
+
+   Patching the libraries (see thread_apply_patches) means that
+   uninteresting system calls don't stop the process.  But it is
+   fragile: it relies on finding the system call instructions by
+   scanning the libraries' text, and if we die without reverting the
+   patches, the processes crash the next time they execute one of
+   them (which is what smart-storage-logger-recover is for).
+
+   Newer kernels offer an alternative.  If a process has a seccomp
+   filter that returns SECCOMP_RET_TRACE for a system call and its
+   tracer set PTRACE_O_TRACESECCOMP, the kernel reports the system
+   call to the tracer as a PTRACE_EVENT_SECCOMP stop; other system
+   calls don't stop the process at all.  We install a filter that
+   matches the system calls in FIXUPS by making one of the process's
+   threads execute the required system calls (mmap a scratch page,
+   prctl (PR_SET_NO_NEW_PRIVS), seccomp (SECCOMP_SET_MODE_FILTER,
+   SECCOMP_FILTER_FLAG_TSYNC) and munmap) on our behalf (see
+   thread_seccomp_install).  No code is rewritten.  If this fails, we
+   fall back to patching.
+
+   There are two wrinkles.  First, a filter can't be removed and it
+   is inherited by children.  If the process has no tracer, the
+   kernel fails the filtered system calls with ENOSYS.  Thus, we
+   can't detach from a filtered process.  When the user untraces one,
+   we mark it as passive: we continue to trace it, but resume it
+   immediately and don't generate any events.  When we quit, we hand
+   the filtered processes over to a keeper process, which does
+   nothing but resume them (see seccomp_keeper).  If we and the
+   keeper are killed, the filtered processes can no longer open
+   files.  Second, PR_SET_NO_NEW_PRIVS is inherited: the process and
+   its children can no longer gain privileges by executing setuid
+   programs.
+
+   Requires Linux 3.17 (for SECCOMP_FILTER_FLAG_TSYNC).  */
+#ifdef HAVE_LINUX_SECCOMP_H
+static bool seccomp_mode;
+#else
+# define seccomp_mode false
+#endif
+
+void
+wc_process_monitor_ptrace_use_seccomp (bool use)
+{
+#ifdef HAVE_LINUX_SECCOMP_H
+  seccomp_mode = use;
+#else
+  if (use)
+    debug (0, "Not built with seccomp support, patching libraries instead.");
+#endif
+}
+
+/* Whether we patch PCB's libraries rather than rely on a system call
+   filter.  */
+static bool
+pcb_use_patches (struct pcb *pcb)
+{
+  if (pcb->shed >= PCB_SHED_QUIET)
+    /* We are not intercepting its system calls (see
+       load_shed_maybe).  */
+    return false;
+
+  if (pcb->seccomp == PCB_SECCOMP_NONE)
+    return ! seccomp_mode;
+  return pcb->seccomp == PCB_SECCOMP_FAILED;
+}
+
+/* Get TCB to stop so that we can detach from it.  */
+static bool
+thread_wake (struct tcb *tcb)
+{
+  if (quit && tcb->pcb->seccomp == PCB_SECCOMP_ACTIVE)
+    /* Stop the whole process: a thread that is detached while in a
+       group stop remains stopped.  This gives the keeper a chance to
+       attach to all of the threads before any of them executes a
+       filtered system call (see thread_seccomp_handover).  Don't
+       send a SIGCONT: that would end the group stop.  */
+    {
+      tcb->pcb->handover = true;
+      return kill (tcb->pcb->group_leader.tid, SIGSTOP) == 0;
+    }
+
+  return tkill (tcb->tid, SIGSTOP) == 0 && tkill (tcb->tid, SIGCONT) == 0;
+}
+
+#ifdef HAVE_LINUX_SECCOMP_H
+# ifndef __NR_seccomp
+#  ifdef __x86_64__
+#   define __NR_seccomp 317
+#  elif __arm__
+#   define __NR_seccomp 383
+#  endif
+# endif
+# ifndef SECCOMP_SET_MODE_FILTER
+#  define SECCOMP_SET_MODE_FILTER 1
+# endif
+# ifndef SECCOMP_FILTER_FLAG_TSYNC
+#  define SECCOMP_FILTER_FLAG_TSYNC 1
+# endif
+
+# ifdef __x86_64__
+#  define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#  define SECCOMP_NR_MMAP __NR_mmap
+# elif __arm__
+#  define SECCOMP_AUDIT_ARCH AUDIT_ARCH_ARM
+#  define SECCOMP_NR_MMAP __NR_mmap2
+# endif
+
+/* The steps to install the filter.  */
+enum
+  {
+    SECCOMP_INJECT_MMAP = 1,
+    SECCOMP_INJECT_NO_NEW_PRIVS,
+    SECCOMP_INJECT_FILTER,
+    SECCOMP_INJECT_MUNMAP,
+  };
+
+/* Build a filter that returns SECCOMP_RET_TRACE for the system calls
+   in FIXUPS (except mmap, which we only intercept to find libraries
+   to patch) and SECCOMP_RET_ALLOW for all others.  FILTER must have
+   room for SECCOMP_FILTER_LEN instructions.  */
+#define SECCOMP_FILTER_LEN (sizeof (fixups) / sizeof (fixups[0]) + 5)
+static int
+seccomp_filter_build (struct sock_filter *filter)
+{
+  long nrs[sizeof (fixups) / sizeof (fixups[0])];
+  int n = 0;
+  int j;
+  for (j = 0; j < sizeof (fixups) / sizeof (fixups[0]); j ++)
+    if (fixups[j] != NR_MMAP)
+      nrs[n ++] = fixups[j];
+
+  int i = 0;
+
+  /* Only filter native system calls: the system call numbers are
+     different for other ABIs.  */
+  filter[i ++] = (struct sock_filter)
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS,
+	      offsetof (struct seccomp_data, arch));
+  filter[i ++] = (struct sock_filter)
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0);
+  filter[i ++] = (struct sock_filter)
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+
+  filter[i ++] = (struct sock_filter)
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, offsetof (struct seccomp_data, nr));
+  for (j = 0; j < n; j ++)
+    /* On a match, jump to the SECCOMP_RET_TRACE.  */
+    filter[i ++] = (struct sock_filter)
+      BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, nrs[j], n - j, 0);
+  filter[i ++] = (struct sock_filter)
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+  filter[i ++] = (struct sock_filter)
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+
+  assert (i <= SECCOMP_FILTER_LEN);
+  return i;
+}
+
+/* Make TCB execute system call NR with the specified arguments when
+   it is resumed.  TCB must be stopped at a system call exit that
+   was made using the system call instruction immediately preceding
+   the IP in TCB->SECCOMP_SAVED_REGS.  The result is available at
+   the next system call exit.  */
+static bool
+thread_seccomp_call (struct tcb *tcb, int step, long nr,
+		     long a1, long a2, long a3, long a4, long a5, long a6)
+{
+  REGS_STRUCT regs = *(REGS_STRUCT *) tcb->seccomp_saved_regs;
+
+#ifdef __x86_64__
+  regs.rip -= 2;
+  regs.rax = nr;
+  regs.rdi = a1;
+  regs.rsi = a2;
+  regs.rdx = a3;
+  regs.r10 = a4;
+  regs.r8 = a5;
+  regs.r9 = a6;
+#elif __arm__
+  /* Thumb mode?  */
+  regs.ARM_pc -= (regs.ARM_cpsr & 0x20) ? 2 : 4;
+  regs.ARM_r7 = nr;
+  regs.ARM_ORIG_r0 = regs.ARM_r0 = a1;
+  regs.ARM_r1 = a2;
+  regs.ARM_r2 = a3;
+  regs.ARM_r3 = a4;
+  regs.ARM_r4 = a5;
+  regs.ARM_r5 = a6;
+#endif
+
+  if (ptrace (PTRACE_SETREGS, tcb->tid, 0, (void *) &regs) < 0)
+    {
+      debug (0, TCB_FMT": Failed to update thread's register set: %m",
+	     TCB_PRINTF (tcb));
+      return false;
+    }
+
+  tcb->seccomp_inject = step;
+  return true;
+}
+
+/* Restore TCB's registers to what they were before we started
+   installing the filter.  */
+static void
+thread_seccomp_restore (struct tcb *tcb)
+{
+  if (ptrace (PTRACE_SETREGS, tcb->tid, 0, tcb->seccomp_saved_regs) < 0)
+    debug (0, TCB_FMT": Failed to restore thread's register set: %m",
+	   TCB_PRINTF (tcb));
+
+  g_free (tcb->seccomp_saved_regs);
+  tcb->seccomp_saved_regs = NULL;
+  tcb->seccomp_inject = 0;
+
+  int sig;
+  for (sig = 1; tcb->seccomp_signals; sig ++)
+    if ((tcb->seccomp_signals & (1ULL << (sig - 1))))
+      {
+	tcb->seccomp_signals &= ~(1ULL << (sig - 1));
+	tkill (tcb->tid, sig);
+      }
+}
+
+/* Start installing the filter in TCB's process.  TCB must be stopped
+   at a system call exit; REGS are its registers.  Returns true if we
+   started, in which case the thread must be resumed with
+   PTRACE_SYSCALL and the following system call exits passed to
+   thread_seccomp_inject.  */
+static bool
+thread_seccomp_install (struct tcb *tcb, REGS_STRUCT *regs)
+{
+  struct pcb *pcb = tcb->pcb;
+  assert (pcb->seccomp == PCB_SECCOMP_NONE);
+
+  if (quit || tcb->stop_tracing || pcb->passive)
+    return false;
+
+  /* The filter is synchronized to all threads.  We need to be tracing
+     all of them with PTRACE_O_TRACESECCOMP; otherwise, their filtered
+     system calls fail.  */
+  if (! pcb->scanned_siblings)
+    return false;
+  GSList *l;
+  for (l = pcb->tcbs; l; l = l->next)
+    {
+      struct tcb *t = l->data;
+      if (t->trace_options != 1)
+	return false;
+    }
+
+  /* If the system call is restarted, the IP is rewound to the system
+     call instruction and the system call number is changed.  We
+     can't easily save that state.  Try again later.  */
+  long ret = (long) regs->
+#ifdef __x86_64__
+    rax
+#elif __arm__
+    ARM_r0
+#endif
+    ;
+  if (-516 <= ret && ret <= -512)
+    return false;
+
+  /* Make sure that the instruction preceding the IP is a system call
+     instruction: we reuse it to execute our system calls.  */
+  uintptr_t ip = regs->REGS_IP;
+  char buffer[4];
+#ifdef __x86_64__
+  if (! tcb_code_read (tcb, ip - 2, buffer, 2)
+      || buffer[0] != (char) 0x0f || buffer[1] != (char) 0x05)
+#elif __arm__
+  bool thumb = (regs->ARM_cpsr & 0x20);
+  uint32_t ins = 0;
+  if (thumb)
+    {
+      uint16_t i16;
+      if (tcb_code_read (tcb, ip - 2, buffer, 2))
+	{
+	  memcpy (&i16, buffer, 2);
+	  ins = i16;
+	}
+    }
+  else if (tcb_code_read (tcb, ip - 4, buffer, 4))
+    memcpy (&ins, buffer, 4);
+  if (thumb ? (ins & 0xff00) != 0xdf00 : (ins & 0x0f000000) != 0x0f000000)
+#endif
+    {
+      debug (4, TCB_FMT": IP %"PRIxPTR" does not follow a system call "
+	     "instruction.  Not installing filter.",
+	     TCB_PRINTF (tcb), ip);
+      return false;
+    }
+
+  tcb->seccomp_saved_regs = g_memdup (regs, sizeof (*regs));
+  if (! thread_seccomp_call (tcb, SECCOMP_INJECT_MMAP, SECCOMP_NR_MMAP,
+			     0, getpagesize (), PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+    {
+      g_free (tcb->seccomp_saved_regs);
+      tcb->seccomp_saved_regs = NULL;
+      pcb->seccomp = PCB_SECCOMP_FAILED;
+      return false;
+    }
+
+  debug (3, TCB_FMT": Installing system call filter.", TCB_PRINTF (tcb));
+  pcb->seccomp = PCB_SECCOMP_INSTALLING;
+  return true;
+}
+
+/* TCB is stopped at the exit of a system call that we made it
+   execute (see thread_seccomp_install); REGS are its registers.
+   Execute the next step.  Returns true if the thread may continue to
+   run, false if it should be suspended.  */
+static bool
+thread_seccomp_inject (struct tcb *tcb, REGS_STRUCT *regs)
+{
+  struct pcb *pcb = tcb->pcb;
+  assert (pcb->seccomp == PCB_SECCOMP_INSTALLING
+	  || tcb->seccomp_inject == SECCOMP_INJECT_MUNMAP);
+
+  long ret = (long) regs->
+#ifdef __x86_64__
+    rax
+#elif __arm__
+    ARM_r0
+#endif
+    ;
+
+  switch (tcb->seccomp_inject)
+    {
+    case SECCOMP_INJECT_MMAP:
+      if (-4096 < ret && ret < 0)
+	{
+	  debug (0, TCB_FMT": Allocating scratch page: %s",
+		 TCB_PRINTF (tcb), g_strerror (-ret));
+	  pcb->seccomp = PCB_SECCOMP_FAILED;
+	  thread_seccomp_restore (tcb);
+	  break;
+	}
+      tcb->seccomp_page = ret;
+
+      {
+	struct sock_filter filter[SECCOMP_FILTER_LEN];
+	struct sock_fprog prog;
+	prog.len = seccomp_filter_build (filter);
+	prog.filter = (void *) (tcb->seccomp_page + sizeof (uint64_t) * 2);
+	if (thread_mem_update (tcb, tcb->seccomp_page,
+			       (char *) &prog, sizeof (prog))
+	    && thread_mem_update (tcb, (uintptr_t) prog.filter,
+				  (char *) filter,
+				  prog.len * sizeof (filter[0]))
+	    && thread_seccomp_call (tcb, SECCOMP_INJECT_NO_NEW_PRIVS,
+				    __NR_prctl, PR_SET_NO_NEW_PRIVS, 1,
+				    0, 0, 0, 0))
+	  return true;
+      }
+      pcb->seccomp = PCB_SECCOMP_FAILED;
+      goto release;
+
+    case SECCOMP_INJECT_NO_NEW_PRIVS:
+      if (ret < 0)
+	debug (0, TCB_FMT": prctl (PR_SET_NO_NEW_PRIVS): %s",
+	       TCB_PRINTF (tcb), g_strerror (-ret));
+      else if (thread_seccomp_call (tcb, SECCOMP_INJECT_FILTER,
+				    __NR_seccomp, SECCOMP_SET_MODE_FILTER,
+				    SECCOMP_FILTER_FLAG_TSYNC,
+				    tcb->seccomp_page, 0, 0, 0))
+	return true;
+      pcb->seccomp = PCB_SECCOMP_FAILED;
+      goto release;
+
+    case SECCOMP_INJECT_FILTER:
+      if (ret < 0)
+	{
+	  debug (0, TCB_FMT": seccomp (SECCOMP_SET_MODE_FILTER): %s",
+		 TCB_PRINTF (tcb), g_strerror (-ret));
+	  pcb->seccomp = PCB_SECCOMP_FAILED;
+	}
+      else if (ret > 0)
+	/* RET is the id of a thread that could not be synchronized
+	   (because it has a different filter).  */
+	{
+	  debug (0, TCB_FMT": seccomp (SECCOMP_SET_MODE_FILTER): "
+		 "Failed to synchronize thread %ld",
+		 TCB_PRINTF (tcb), ret);
+	  pcb->seccomp = PCB_SECCOMP_FAILED;
+	}
+      else
+	/* The filter is installed.  There is no going back.  */
+	{
+	  debug (3, TCB_FMT": Installed system call filter.",
+		 TCB_PRINTF (tcb));
+	  pcb->seccomp = PCB_SECCOMP_ACTIVE;
+	}
+
+    release:
+      /* Release the scratch page.  */
+      if (thread_seccomp_call (tcb, SECCOMP_INJECT_MUNMAP, __NR_munmap,
+			       tcb->seccomp_page, getpagesize (),
+			       0, 0, 0, 0))
+	return true;
+      /* We leak the page.  */
+      thread_seccomp_restore (tcb);
+      break;
+
+    case SECCOMP_INJECT_MUNMAP:
+      thread_seccomp_restore (tcb);
+      break;
+
+    default:
+      assert (! "Bad seccomp_inject value");
+    }
+
+  assert (pcb->seccomp != PCB_SECCOMP_INSTALLING);
 
-    debug (already_patched == 0 ? 3 : 0,
-	   "Patched "TCB_FMT": applied %d of %d (total: %d) patches",
-	   TCB_PRINTF (tcb), count, total - already_patched, total);
+  GSList *l;
+  if (pcb->seccomp == PCB_SECCOMP_FAILED)
+    {
+      debug (0, TCB_FMT": Failed to install system call filter, "
+	     "patching libraries instead.",
+	     TCB_PRINTF (tcb));
 
-    if (did_scan)
-      {
-	/* Try to patch any suspended processes.  */
-	int suspended = 0;
-	int still_suspended = 0;
-	GSList *l;
-	l = pending_thread_apply_patches;
-	pending_thread_apply_patches = NULL;
-	while (l)
-	  {
-	    suspended ++;
+      if (pcb->passive)
+	/* The user untraced the process while we were installing the
+	   filter.  We can detach after all.  */
+	{
+	  pcb->passive = false;
+	  for (l = pcb->tcbs; l; l = l->next)
+	    {
+	      struct tcb *t = l->data;
+	      t->stop_tracing = true;
+	      if (t != tcb)
+		thread_wake (t);
+	    }
+	  return true;
+	}
+    }
 
-	    struct tcb *tcb = l->data;
-	    if (! do_patch (tcb, false))
-	      still_suspended ++;
-	    l = g_slist_delete_link (l, l);
-	  }
+  if (quit)
+    /* We couldn't detach from the process's other threads while we
+       were installing the filter.  Try again.  */
+    {
+      for (l = pcb->tcbs; l; l = l->next)
+	{
+	  struct tcb *t = l->data;
+	  if (t != tcb)
+	    thread_wake (t);
+	}
+      return true;
+    }
 
-	if (suspended)
-	  debug (0, "Patched and resumed %d of %d suspended threads.",
-		 suspended - still_suspended, suspended);
-      }
+  if (pcb->seccomp == PCB_SECCOMP_FAILED)
+    return thread_apply_patches (tcb);
+  return true;
+}
 
-    return true;
-  }
+/* When we quit, we hand filtered processes over to the keeper.  This
+   is the socket that we send struct seccomp_handover messages to.  */
+static int seccomp_keeper_fd = -1;
+/* The keeper is a child of the tracer that started it.  */
+static pid_t seccomp_keeper_pid;
+/* The tracers share the keeper.  Protects SECCOMP_KEEPER_FD while it
+   is started and closed.  */
+static pthread_mutex_t seccomp_keeper_lock = PTHREAD_MUTEX_INITIALIZER;
 
-  bool ret = do_patch (tcb, false);
+struct seccomp_handover
+{
+  pid_t tgid;
+  pid_t tid;
+  /* If true, this is the process's last thread.  */
+  bool last;
+};
 
-#ifndef NDEBUG
-  fully_patched ();
-#endif
+/* The keeper.  This runs in a child process of a tracer thread.
+   The process is a copy of a multi-threaded process; we only use
+   async-signal-safe functions.  Each message on FD identifies a
+   thread that is in a group stop and that we detached from.  The
+   keeper attaches to it and, after attaching to the process's last
+   thread, continues the process.  It resumes any filtered system
+   calls and stops without further ado.  When FD is closed and it no
+   longer has any tracees, it exits.  */
+static void __attribute__ ((noreturn))
+seccomp_keeper (int fd)
+{
+  sigset_t mask;
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGCHLD);
+  pthread_sigmask (SIG_BLOCK, &mask, NULL);
+  /* If signalfd is not available, we poll.  */
+  int sfd = signalfd (-1, &mask, SFD_NONBLOCK);
+
+  bool eof = false;
+  for (;;)
+    {
+      struct pollfd fds[2] = { { eof ? -1 : fd, POLLIN, 0 },
+			       { sfd, POLLIN, 0 } };
+      if (poll (fds, 2, sfd == -1 ? 100 : -1) < 0 && errno != EINTR)
+	_exit (1);
 
-  return ret;
-}
+      if (fds[0].revents)
+	{
+	  struct seccomp_handover h;
+	  ssize_t len = recv (fd, &h, sizeof (h), 0);
+	  if (len == sizeof (h))
+	    {
+	      ptrace (PTRACE_SEIZE, h.tid, 0,
+		      PTRACE_O_TRACESECCOMP | PTRACE_O_TRACECLONE
+		      | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+	      if (h.last)
+		kill (h.tgid, SIGCONT);
+	    }
+	  else if (len == 0 || (len < 0 && errno != EINTR))
+	    eof = true;
+	}
 
-#ifdef __x86_64__
-# define REGS_STRUCT struct user_regs_struct
-# define REGS_IP rip
-# define REGS_SYSCALL rax
-#elif __arm__
-# define REGS_STRUCT struct pt_regs
-# define REGS_IP ARM_pc
-# define REGS_SYSCALL ARM_r7
-#endif
+      if (sfd != -1)
+	{
+	  struct signalfd_siginfo si;
+	  while (read (sfd, &si, sizeof (si)) > 0)
+	    ;
+	}
 
-/* The thread hit a break point.  If it is a breakpoint we set, fix up
-   the thread's register state and return true.  Otherwise, return
-   false.  */
-static bool
-thread_fixup_and_advance (struct tcb *tcb, REGS_STRUCT *regs)
+      for (;;)
+	{
+	  int status;
+	  pid_t tid = waitpid (-1, &status, __WALL | WNOHANG);
+	  if (tid < 0 && errno == ECHILD && eof)
+	    _exit (0);
+	  if (tid <= 0)
+	    break;
+	  if (! WIFSTOPPED (status))
+	    continue;
+
+	  int sig = WSTOPSIG (status);
+	  int event = status >> 16;
+	  if (event == PTRACE_EVENT_STOP
+	      && (sig == SIGSTOP || sig == SIGTSTP
+		  || sig == SIGTTIN || sig == SIGTTOU))
+	    /* A group stop.  Don't resume the thread, but be notified
+	       when it is continued.  */
+	    ptrace (PTRACE_LISTEN, tid, 0, 0);
+	  else if (event || sig == SIGTRAP)
+	    ptrace (PTRACE_CONT, tid, 0, 0);
+	  else
+	    ptrace (PTRACE_CONT, tid, 0, sig);
+	}
+    }
+}
+
+/* Fork the keeper.  Called with SECCOMP_KEEPER_LOCK held.  */
+static void
+seccomp_keeper_fork (void)
 {
-  if (! pcb_patched (tcb->pcb))
+  int fds[2];
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
     {
-      debug (4, "Thread "TCB_FMT" not patched, not fixing up.",
-	     TCB_PRINTF (tcb));
-      return false;
+      debug (0, "socketpair: %m.  Filtered processes will fail "
+	     "to open files.");
+      return;
     }
 
-  uintptr_t IP = regs->REGS_IP;
-  bool fixed = false;
-  int i;
-  for (i = 0; i < LIBRARY_COUNT; i ++)
-    if (tcb->pcb->lib_base[i]
-	&& tcb->pcb->lib_base[i] <= IP
-	&& IP < tcb->pcb->lib_base[i] + library_patches[i].size)
-      /* The address is coverd by this library.  */
-      {
-	struct library_patch *lib = &library_patches[i];
-	debug (4, TCB_FMT": IP %"PRIxPTR" covered by library %s "
-	       "(=> offset: %"PRIxPTR")",
-	       TCB_PRINTF (tcb), IP, lib->filename, IP - tcb->pcb->lib_base[i]);
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      close (fds[0]);
+      seccomp_keeper (fds[1]);
+    }
+  close (fds[1]);
+  if (pid < 0)
+    {
+      debug (0, "fork: %m.  Filtered processes will fail to open files.");
+      close (fds[0]);
+      return;
+    }
 
-	int j;
-	for (j = 0; j < lib->patch_count; j ++)
-	  {
-	    struct patch *p = &lib->patches[j];
+  debug (3, "Started keeper (%d).", pid);
+  seccomp_keeper_fd = fds[0];
+  seccomp_keeper_pid = pid;
+}
 
-	    uintptr_t addr = tcb->pcb->lib_base[i] + p->base_offset;
-	    if (addr == IP || addr + ins_breakpoint_bits.len == IP)
-	      {
-		regs->REGS_IP = addr + p->ins_len;
-		regs->REGS_SYSCALL = (uintptr_t) p->syscall;
+/* If this tracer has any filtered processes, start the keeper (if
+   another tracer has not already started it).  */
+static void
+seccomp_keeper_start (void)
+{
+  assert (tracer);
 
-		if (ptrace (PTRACE_SETREGS, tcb->tid, 0, (void *) regs) < 0)
-		  debug (0, TCB_FMT": Failed to update thread's register "
-			 "set: %m",
-			 TCB_PRINTF (tcb));
-		else
-		  {
-		    fixed = true;
-		    debug (4, TCB_FMT": Fixed up thread "
-			   "(%s, syscall %s (%ld)).",
-			   TCB_PRINTF (tcb), lib->filename,
-			   syscall_str (p->syscall), p->syscall);
-		  }
+  bool filtered = false;
+  void check (gpointer key, gpointer value, gpointer user_data)
+  {
+    struct pcb *pcb = value;
+    if (pcb->seccomp == PCB_SECCOMP_ACTIVE
+	|| pcb->seccomp == PCB_SECCOMP_INSTALLING)
+      filtered = true;
+  }
+  g_hash_table_foreach (tracer->pcbs, check, NULL);
+  if (! filtered)
+    return;
 
-		break;
-	      }
-	  }
+  pthread_mutex_lock (&seccomp_keeper_lock);
+  if (seccomp_keeper_fd == -1)
+    seccomp_keeper_fork ();
+  pthread_mutex_unlock (&seccomp_keeper_lock);
+}
 
-	/* As libraries don't overlap, we're done.  */
-	break;
-      }
+/* We are quitting and TCB's process is filtered.  Hand TCB over to
+   the keeper once it is in a group stop.  STATUS is the thread's
+   wait status.  Returns the signal to resume the thread with, or -1
+   if we handed the thread over.  */
+static int
+thread_seccomp_handover (struct tcb *tcb, int status)
+{
+  int signo = WSTOPSIG (status);
+  if ((status >> 16) || signo == (0x80 | SIGTRAP))
+    /* A ptrace event or a system call stop.  */
+    signo = 0;
 
-  if (i == LIBRARY_COUNT)
-    debug (4, TCB_FMT": IP %"PRIxPTR" not covered by any library.",
-	   TCB_PRINTF (tcb), (uintptr_t) regs->REGS_IP);
+  if (! tcb->pcb->handover)
+    thread_wake (tcb);
 
-  if (! fixed)
-    debug (4, TCB_FMT": IP: %"PRIxPTR".  No fix up applied.",
-	   TCB_PRINTF (tcb), (uintptr_t) regs->REGS_IP);
+  if (signo == SIGSTOP)
+    {
+      siginfo_t si;
+      if (ptrace (PTRACE_GETSIGINFO, tcb->tid, 0, &si) == 0)
+	/* A signal delivery stop.  Deliver the signal to start the
+	   group stop.  */
+	return signo;
+
+      /* A group stop.  */
+      struct seccomp_handover h;
+      h.tgid = tcb->pcb->group_leader.tid;
+      h.tid = tcb->tid;
+      h.last = tcb->pcb->tcbs->next == NULL;
+
+      debug (4, TCB_FMT": Handing over to keeper.", TCB_PRINTF (tcb));
+
+      if (ptrace (PTRACE_DETACH, tcb->tid, 0, 0) < 0)
+	debug (0, TCB_FMT": ptrace_(DETACH) failed: %m", TCB_PRINTF (tcb));
+      else if (seccomp_keeper_fd == -1
+	       || send (seccomp_keeper_fd, &h, sizeof (h), MSG_NOSIGNAL) < 0)
+	{
+	  debug (0, TCB_FMT": Failed to hand over to keeper: %m.  "
+		 "The process will fail to open files.",
+		 TCB_PRINTF (tcb));
+	  if (h.last)
+	    kill (h.tgid, SIGCONT);
+	}
 
-  return fixed;
+      thread_untrace (tcb, false);
+      return -1;
+    }
+
+  return signo;
 }
+#endif
 
 /* Stop tracing a process.  Don't release its TCB.  */
 static void
@@ -2358,41 +4276,30 @@ thread_untrace (struct tcb *tcb, bool need_detach)
 {
   debug (3, "thread_untrace ("TCB_FMT")", TCB_PRINTF (tcb));
 
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
   assert (g_slist_find (tcb->pcb->tcbs, tcb));
   tcb->pcb->tcbs = g_slist_remove (tcb->pcb->tcbs, tcb);
 
-  if (! g_hash_table_remove (tcbs, (gpointer) (uintptr_t) tcb->tid))
+  if (! g_hash_table_remove (tracer->tcbs, (gpointer) (uintptr_t) tcb->tid))
     {
       debug (0, TCB_FMT": Failed to remove tcb from TCBS hash table?!?",
 	     TCB_PRINTF (tcb));
       assert (0 == 1);
     }
 
-  pending_thread_apply_patches
-    = g_slist_remove (pending_thread_apply_patches, tcb);
-
-  if (tcb->suspended)
-    {
-      assert (g_slist_find (suspended_tcbs, tcb));
-      suspended_tcbs = g_slist_remove (suspended_tcbs, tcb);
-    }
+  tracer->pending_thread_apply_patches
+    = g_slist_remove (tracer->pending_thread_apply_patches, tcb);
 
   g_free (tcb->saved_src);
   g_free (tcb->saved_stat);
-
-  if (tcb->memfd != -1)
-    {
-      close (tcb->memfd);
-      memfd_count --;
-    }
+  g_free (tcb->seccomp_saved_regs);
 
   /* After calling pcb_free, TCB may be freed.  Copy some data.  */
   pid_t tid = tcb->tid;
   bool need_free = (tcb != &tcb->pcb->group_leader);
 
-  tcb_count --;
+  tracer->tcb_count --;
 
   if (tcb->pcb->tcbs == NULL)
     /* We were the last thread in the process.  Free the PCB.  */
@@ -2425,7 +4332,7 @@ thread_untrace (struct tcb *tcb, bool need_detach)
     g_free (tcb);
 
   debug (4, "%d processes still being traced (%d threads)",
-	 pcb_count, tcb_count);
+	 tracer->pcb_count, tracer->tcb_count);
 }
 
 /* Start tracing thread TID.  PARENT is the process that stared the
@@ -2435,7 +4342,7 @@ thread_untrace (struct tcb *tcb, bool need_detach)
 static struct tcb *
 thread_trace (pid_t tid, struct pcb *parent, bool already_ptracing)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
   /* If PARENT is NULL, look up the parent's PCB using tid's ppid and
      fix up PARENT.  */
@@ -2446,7 +4353,8 @@ thread_trace (pid_t tid, struct pcb *parent, bool already_ptracing)
 	 (int) tid, parent ? parent->group_leader.tid : 0,
 	 already_ptracing ? "already" : "need to");
 
-  struct tcb *tcb = g_hash_table_lookup (tcbs, (gpointer) (uintptr_t) tid);
+  struct tcb *tcb
+    = g_hash_table_lookup (tracer->tcbs, (gpointer) (uintptr_t) tid);
   if (tcb)
     /* It's already being traced.  This happens in two cases: when we
        see the SIGSTOP before the PTRACE_EVENT_CLONE event; and, when
@@ -2478,7 +4386,8 @@ thread_trace (pid_t tid, struct pcb *parent, bool already_ptracing)
       return NULL;
     }
 
-  struct pcb *pcb = g_hash_table_lookup (pcbs, (gpointer) (uintptr_t) pgl);
+  struct pcb *pcb
+    = g_hash_table_lookup (tracer->pcbs, (gpointer) (uintptr_t) pgl);
   if (! pcb)
     /* This is the first thread in an as-yet unknown process.  */
     {
@@ -2486,17 +4395,25 @@ thread_trace (pid_t tid, struct pcb *parent, bool already_ptracing)
 
       pcb->group_leader.tid = pgl;
 
-      g_hash_table_insert (pcbs, (gpointer) (uintptr_t) pgl, pcb);
-      pcb_count ++;
+      g_hash_table_insert (tracer->pcbs, (gpointer) (uintptr_t) pgl, pcb);
+      tracer->pcb_count ++;
 
       pcb_read_exe (pcb);
 
-      int i;
-      for (i = 0; i < LIBRARY_COUNT; i ++)
-	pcb->lib_fd[i] = -1;
+      if (seccomp_mode && parent && parent->seccomp == PCB_SECCOMP_ACTIVE)
+	/* If the process was forked after we installed the filter in
+	   its parent, it inherited it.  We can't tell for sure, but
+	   if it has a filter, it is most likely ours.  */
+	{
+	  char *s = tid_state (pgl, "Seccomp");
+	  if (s && atoi (s) == 2)
+	    pcb->seccomp = PCB_SECCOMP_ACTIVE;
+	  g_free (s);
+	  pcb->passive = parent->passive;
+	}
 
       debug (4, "%d processes being traced (%d threads)",
-	     pcb_count, tcb_count);
+	     tracer->pcb_count, tracer->tcb_count);
 
       if (tid != pgl)
 	/* We've added a thread before we've added the group leader.
@@ -2535,11 +4452,10 @@ thread_trace (pid_t tid, struct pcb *parent, bool already_ptracing)
   tcb->tid = tid;
   tcb->pcb = pcb;
   tcb->current_syscall = -1;
-  tcb->memfd = -1;
-  g_hash_table_insert (tcbs, (gpointer) (uintptr_t) tid, tcb);
+  g_hash_table_insert (tracer->tcbs, (gpointer) (uintptr_t) tid, tcb);
   pcb->tcbs = g_slist_prepend (pcb->tcbs, tcb);
 
-  tcb_count ++;
+  tracer->tcb_count ++;
 
   /* NB: After tracing a process, we first receive two SIGSTOPs
      (signal 0x13) for that process.  Subsequently, we receive
@@ -2558,7 +4474,7 @@ thread_trace (pid_t tid, struct pcb *parent, bool already_ptracing)
   debug (3, "Now tracing "TCB_FMT, TCB_PRINTF (tcb));
 
   debug (4, "%d processes being traced (%d threads)",
-	 pcb_count, tcb_count);
+	 tracer->pcb_count, tracer->tcb_count);
 
   return tcb;
 }
@@ -2568,7 +4484,7 @@ thread_trace (pid_t tid, struct pcb *parent, bool already_ptracing)
 static struct pcb *
 process_trace (pid_t pid)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
   struct tcb *tcb = thread_trace (pid, NULL, false);
   if (! tcb)
@@ -2582,6 +4498,23 @@ process_trace (pid_t pid)
      process.  */
   tcb->pcb->top_level = true;
 
+  /* If the user previously untraced the process, we may not have been
+     able to detach from it (see seccomp_mode).  */
+  void activate (struct pcb *pcb)
+  {
+    pcb->passive = false;
+
+    GSList *l;
+    for (l = pcb->children; l; l = l->next)
+      {
+	struct pcb *child = l->data;
+	if (! child->top_level)
+	  activate (child);
+      }
+  }
+  if (tcb->pcb->passive)
+    activate (tcb->pcb);
+
   callback_enqueue (tcb, WC_PROCESS_TRACING_CB, NULL, NULL, true, NULL);
 
   return tcb->pcb;
@@ -2592,9 +4525,10 @@ process_trace (pid_t pid)
 static void
 process_untrace (pid_t pid)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  assert (tracer);
 
-  struct pcb *pcb = g_hash_table_lookup (pcbs, (gpointer) (uintptr_t) pid);
+  struct pcb *pcb
+    = g_hash_table_lookup (tracer->pcbs, (gpointer) (uintptr_t) pid);
   if (! pcb)
     /* A user can call untrace on a PID more than once.  */
     {
@@ -2610,7 +4544,7 @@ process_untrace (pid_t pid)
       return;
     }
 
-  if (pcb->group_leader.stop_tracing)
+  if (pcb->group_leader.stop_tracing || pcb->passive)
     {
       debug (0, "Already untracing %d.", pid);
       return;
@@ -2629,18 +4563,26 @@ process_untrace (pid_t pid)
   void stop (struct pcb *pcb)
   {
     GSList *t;
-    for (t = pcb->tcbs; t; t = t->next)
-      {
-	struct tcb *tcb = t->data;
-	if (tcb->suspended <= 0
-	    && (tkill (tcb->tid, SIGSTOP) < 0 || tkill (tcb->tid, SIGCONT) < 0))
-	  {
-	    debug (0, TCB_FMT": tkill (%d, SIGSTOP): %m",
-		   TCB_PRINTF (tcb), tcb->tid);
+    if (pcb->seccomp == PCB_SECCOMP_ACTIVE
+	|| pcb->seccomp == PCB_SECCOMP_INSTALLING)
+      /* We can't detach from a filtered process (see seccomp_mode).  */
+      pcb->passive = true;
+    else
+      for (t = pcb->tcbs; t; t = t->next)
+	{
+	  struct tcb *tcb = t->data;
+	  if (tcb->suspended > 0)
+	    /* We already detached from it (see load_shed_maybe).  */
 	    dofree = g_slist_prepend (dofree, tcb);
-	  }
-	tcb->stop_tracing = true;
-      }
+	  else if (tkill (tcb->tid, SIGSTOP) < 0
+		   || tkill (tcb->tid, SIGCONT) < 0)
+	    {
+	      debug (0, TCB_FMT": tkill (%d, SIGSTOP): %m",
+		     TCB_PRINTF (tcb), tcb->tid);
+	      dofree = g_slist_prepend (dofree, tcb);
+	    }
+	  tcb->stop_tracing = true;
+	}
 
     GSList *l;
     for (l = pcb->children; l; l = l->next)
@@ -2677,20 +4619,14 @@ struct process_monitor_command
   uint64_t issued;
 };
 
-static pthread_cond_t process_monitor_signaler_init_cond
-  = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t process_monitor_commands_lock
-  = PTHREAD_MUTEX_INITIALIZER;
-static GSList *process_monitor_commands;
-
 static void
 process_monitor_signaler_init (void)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
-  assert (! signal_process_pid);
+  assert (tracer);
+  assert (! tracer->signal_process_pid);
 
-  pthread_mutex_lock (&process_monitor_commands_lock);
-  switch ((signal_process_pid = fork ()))
+  pthread_mutex_lock (&tracer->commands_lock);
+  switch ((tracer->signal_process_pid = fork ()))
     {
     case -1:
       debug (0, "Failed to fork process signal thread.");
@@ -2705,67 +4641,326 @@ process_monitor_signaler_init (void)
       if (pthread_sigmask (SIG_UNBLOCK, &set, NULL) != 0)
 	debug (0, "Unblocking delivery of SIGUSR2: %m");
 
-      while (true)
-	sleep (INT_MAX);
+      while (true)
+	sleep (INT_MAX);
+    default:
+      /* Parent.  */
+      debug (3, "Tracer %d: signal process started, pid: %d",
+	     tracer->id, tracer->signal_process_pid);
+      if (ptrace (PTRACE_ATTACH, tracer->signal_process_pid) == -1)
+	debug (0, "Error attaching to %d: %m", tracer->signal_process_pid);
+
+      pthread_cond_signal (&tracer->signaler_init_cond);
+      pthread_mutex_unlock (&tracer->commands_lock);
+    }
+}
+
+/* Queue COMMAND for the tracer T.  */
+static void
+process_monitor_command (struct tracer *t,
+			 enum process_monitor_commands command, pid_t pid)
+{
+  assert (! tracer);
+
+  if (quit && command != PROCESS_MONITOR_QUIT)
+    {
+      debug (0, "Not queuing command: monitor already quit.");
+      return;
+    }
+
+  assert (command == PROCESS_MONITOR_QUIT
+	  || command == PROCESS_MONITOR_TRACE
+	  || command == PROCESS_MONITOR_UNTRACE);
+
+  struct process_monitor_command *cmd = g_malloc (sizeof (*cmd));
+  cmd->command = command;
+  cmd->pid = pid;
+  cmd->issued = now ();
+
+  pthread_mutex_lock (&t->commands_lock);
+
+  t->commands = g_slist_prepend (t->commands, cmd);
+  debug (4, "Queuing process monitor event for tracer %d.", t->id);
+  if (! t->commands->next)
+    /* This is the only event.  */
+    {
+      debug (4, "Only event.  Signalling signal process.");
+      if (tkill (t->signal_process_pid, SIGUSR2) < 0)
+	debug (0, "killing signalling signal process (%d): %m",
+	       t->signal_process_pid);
+    }
+  
+  pthread_mutex_unlock (&t->commands_lock);
+}
+
+/* If the tracers use more than CPU_BUDGET percent of a CPU, we scale
+   back how closely we trace the processes that cause the most stops.
+   Each step reduces the overhead further:
+
+     - PCB_SHED_SAMPLE: only report about one in SHED_SAMPLE of the
+       files that the process opens, starting with one in
+       SHED_SAMPLE_MIN and ending with one in SHED_SAMPLE_MAX.  The
+       opens are chosen at random so that a pattern in the process's
+       opens does not bias the sample.  We don't report the close of
+       a file whose open we skipped.  Unlinks and renames change the
+       file system and are always reported;
+     - PCB_SHED_QUIET: revert the process's patches and don't stop it
+       on system calls;
+     - PCB_SHED_DETACHED: detach from the process.
+
+   Each tracer measures the CPU time that it used every
+   LOAD_CHECK_INTERVAL ms.  If the tracers together exceed the budget,
+   a tracer that uses at least its share takes one step for its
+   noisiest process.  If they use less than half of the budget, it
+   takes one step back for the process that it changed longest ago,
+   but no sooner than SHED_HOLD ms after the last change.  */
+#define LOAD_CHECK_INTERVAL (2 * CALLBACK_COUNT_BUCKET_WIDTH)
+#define SHED_SAMPLE_MIN 4
+#define SHED_SAMPLE_MAX 64
+#define SHED_HOLD (5 * LOAD_CHECK_INTERVAL)
+
+/* In percent of a CPU.  0 means never shed load.  */
+static int cpu_budget = 25;
+
+static const char *
+pcb_shed_str (struct pcb *pcb)
+{
+  switch (pcb->shed)
+    {
+    case PCB_SHED_NONE:
+      return "none";
+    case PCB_SHED_SAMPLE:
+      return "sample";
+    case PCB_SHED_QUIET:
+      return "quiet";
+    case PCB_SHED_DETACHED:
+      return "detached";
+    }
+  return "unknown";
+}
+
+static void
+pcb_shed_set (struct pcb *pcb, int shed, int sample)
+{
+  if (pcb->shed == PCB_SHED_NONE && shed != PCB_SHED_NONE)
+    tracer->shedding ++;
+  else if (pcb->shed != PCB_SHED_NONE && shed == PCB_SHED_NONE)
+    tracer->shedding --;
+
+  pcb->shed = shed;
+  pcb->shed_sample = sample;
+  pcb->shed_changed = now ();
+
+  debug (1, PCB_FMT": Load shedding: %s (1 in %d)",
+	 PCB_PRINTF (pcb), pcb_shed_str (pcb), sample);
+}
+
+/* Reduce the overhead of tracing PCB by one step.  Returns false if
+   we can't (yet).  */
+static bool
+pcb_shed_more (struct pcb *pcb)
+{
+  switch (pcb->shed)
+    {
+    case PCB_SHED_NONE:
+      pcb_shed_set (pcb, PCB_SHED_SAMPLE, SHED_SAMPLE_MIN);
+      return true;
+
+    case PCB_SHED_SAMPLE:
+      if (pcb->shed_sample < SHED_SAMPLE_MAX)
+	pcb_shed_set (pcb, PCB_SHED_SAMPLE, pcb->shed_sample * 4);
+      else
+	/* We revert the patches the next time one of its threads
+	   stops (see process_monitor).  */
+	pcb_shed_set (pcb, PCB_SHED_QUIET, 0);
+      return true;
+
+    case PCB_SHED_QUIET:
+      if (pcb->seccomp == PCB_SECCOMP_ACTIVE
+	  || pcb->seccomp == PCB_SECCOMP_INSTALLING)
+	/* We can't detach from a process with our filter (see
+	   seccomp_mode).  */
+	return false;
+      if (pcb->libs && ! pcb->unpatched)
+	/* None of its threads stopped since we decided to revert the
+	   patches.  */
+	return false;
+
+      pcb_shed_set (pcb, PCB_SHED_DETACHED, 0);
+
+      /* Detach from each thread the next time it stops.  */
+      GSList *l;
+      for (l = pcb->tcbs; l; l = l->next)
+	{
+	  struct tcb *tcb = l->data;
+	  if (tcb->suspended)
+	    continue;
+
+	  tcb->suspended = - (int64_t) pcb->shed_changed;
+	  if (! thread_wake (tcb))
+	    debug (0, TCB_FMT": Failed to wake: %m", TCB_PRINTF (tcb));
+	}
+      return true;
+
+    default:
+      return false;
+    }
+}
+
+/* Undo one step of load shedding for PCB.  PCB may be freed.  */
+static void
+pcb_shed_less (struct pcb *pcb)
+{
+  switch (pcb->shed)
+    {
+    case PCB_SHED_DETACHED:
+      {
+	pcb_shed_set (pcb, PCB_SHED_QUIET, 0);
+
+	/* It may have started threads while we were detached.  (It
+	   may also have execed, in which case LIBS is stale.  That's
+	   fine: we free them before we patch it again.)  */
+	pcb->scanned_siblings = false;
+
+	GSList *dead = NULL;
+	GSList *l;
+	for (l = pcb->tcbs; l; l = l->next)
+	  {
+	    struct tcb *tcb = l->data;
+	    bool detached = tcb->suspended > 0;
+
+	    tcb->suspended = 0;
+	    if (! detached)
+	      /* We never got around to detaching.  */
+	      continue;
+
+	    tcb->trace_options = 0;
+	    if (tid_start_time (tcb->tid) != tcb->start_time)
+	      /* The thread exited.  Don't attach to an unrelated thread
+		 that reused its tid.  */
+	      {
+		debug (3, TCB_FMT": Exited while detached.",
+		       TCB_PRINTF (tcb));
+		dead = g_slist_prepend (dead, tcb);
+	      }
+	    else if (ptrace (PTRACE_ATTACH, tcb->tid, 0, 0) < 0)
+	      {
+		debug (3, TCB_FMT": Reattaching: %m", TCB_PRINTF (tcb));
+		dead = g_slist_prepend (dead, tcb);
+	      }
+	  }
+
+	/* This may free PCB.  */
+	for (l = dead; l; l = l->next)
+	  thread_untrace (l->data, false);
+	g_slist_free (dead);
+	break;
+      }
+
+    case PCB_SHED_QUIET:
+      pcb_shed_set (pcb, PCB_SHED_SAMPLE, SHED_SAMPLE_MAX);
+      if (pcb->tcbs)
+	/* Get a thread to stop so that we patch the process again (see
+	   process_monitor).  */
+	thread_wake (pcb->tcbs->data);
+      break;
+
+    case PCB_SHED_SAMPLE:
+      if (pcb->shed_sample > SHED_SAMPLE_MIN)
+	pcb_shed_set (pcb, PCB_SHED_SAMPLE, pcb->shed_sample / 4);
+      else
+	pcb_shed_set (pcb, PCB_SHED_NONE, 0);
+      break;
+
     default:
-      /* Parent.  */
-      debug (3, "Signal process started, pid: %d", signal_process_pid);
-      if (ptrace (PTRACE_ATTACH, signal_process_pid) == -1)
-	debug (0, "Error attaching to %d: %m", signal_process_pid);
-
-      pthread_cond_signal (&process_monitor_signaler_init_cond);
-      pthread_mutex_unlock (&process_monitor_commands_lock);
+      break;
     }
 }
 
 static void
-process_monitor_command (enum process_monitor_commands command, pid_t pid)
+load_shed_maybe (void)
 {
-  assert (! pthread_equal (pthread_self (), process_monitor_tid));
+  uint64_t n = now ();
 
-  if (quit)
-    {
-      debug (0, "Not queuing command: monitor already quit.");
-      return;
-    }
+  if (n - tracer->load_check < LOAD_CHECK_INTERVAL)
+    /* It's too soon.  */
+    return;
 
-  assert (command == PROCESS_MONITOR_QUIT
-	  || command == PROCESS_MONITOR_TRACE
-	  || command == PROCESS_MONITOR_UNTRACE);
+  struct timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  uint64_t cpu_time = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 
-  struct process_monitor_command *cmd = g_malloc (sizeof (*cmd));
-  cmd->command = command;
-  cmd->pid = pid;
-  cmd->issued = now ();
+  tracer->cpu_usage = (int) ((cpu_time - tracer->cpu_time) / 1000
+			     / (n - tracer->load_check));
+  tracer->cpu_time = cpu_time;
+  tracer->load_check = n;
 
-  pthread_mutex_lock (&process_monitor_commands_lock);
+  if (cpu_budget <= 0)
+    return;
 
-  process_monitor_commands = g_slist_prepend (process_monitor_commands, cmd);
-  debug (4, "Queuing process monitor event.");
-  if (! process_monitor_commands->next)
-    /* This is the only event.  */
+  int total = 0;
+  int i;
+  for (i = 0; i < tracer_count; i ++)
+    total += tracers[i].cpu_usage;
+
+  /* Forget about any threads of detached processes that exited.  We
+     don't see their exit.  */
+  GSList *dead = NULL;
+  void reap (gpointer key, gpointer value, gpointer user_data)
+  {
+    struct tcb *tcb = value;
+
+    if (tcb->suspended > 0
+	&& tid_start_time (tcb->tid) != tcb->start_time)
+      /* The thread exited (and perhaps its tid was reused).  */
+      dead = g_slist_prepend (dead, tcb);
+  }
+  g_hash_table_foreach (tracer->tcbs, reap, NULL);
+
+  GSList *l;
+  for (l = dead; l; l = l->next)
+    thread_untrace (l->data, false);
+  g_slist_free (dead);
+
+  if (total < cpu_budget * 10 / 2)
+    /* Relax.  */
     {
-      debug (4, "Only event.  Signalling signal process.");
-      if (tkill (signal_process_pid, SIGUSR2) < 0)
-	debug (0, "killing signalling signal process (%d): %m",
-	       signal_process_pid);
+      struct pcb *oldest = NULL;
+      void iter (gpointer key, gpointer value, gpointer user_data)
+      {
+	struct pcb *pcb = value;
+
+	if (pcb->shed == PCB_SHED_NONE
+	    || n - pcb->shed_changed < SHED_HOLD)
+	  return;
+
+	if (! oldest || pcb->shed_changed < oldest->shed_changed)
+	  oldest = pcb;
+      }
+      g_hash_table_foreach (tracer->pcbs, iter, NULL);
+
+      if (oldest)
+	{
+	  debug (1, "Tracer %d: load %d.%d%% of a CPU (all: %d.%d%%), "
+		 "budget %d%%.",
+		 tracer->id, tracer->cpu_usage / 10, tracer->cpu_usage % 10,
+		 total / 10, total % 10, cpu_budget);
+	  pcb_shed_less (oldest);
+	}
+      return;
     }
-  
-  pthread_mutex_unlock (&process_monitor_commands_lock);
-}
-
-static struct load global_load;
-static uint64_t global_load_check;
 
-static void
-load_shed_maybe (void)
-{
-  uint64_t n = now ();
+  if (total <= cpu_budget * 10)
+    return;
 
-  if (n - global_load_check < 2 * CALLBACK_COUNT_BUCKET_WIDTH)
-    /* It's too soon.  */
+  if (tracer->cpu_usage * tracer_count < total)
+    /* The other tracers use more than we do.  Let them shed first.  */
     return;
-  global_load_check = n;
+
+  debug (1, "Tracer %d: high load: %d.%d%% of a CPU (all: %d.%d%%), "
+	 "budget %d%%.",
+	 tracer->id, tracer->cpu_usage / 10, tracer->cpu_usage % 10,
+	 total / 10, total % 10, cpu_budget);
 
   struct summary
   {
@@ -2804,28 +4999,20 @@ load_shed_maybe (void)
     return summary;
   }
 
-  struct summary global = summarize (&global_load);
-  if (global.time > (CALLBACK_COUNT_BUCKET_WIDTH * CALLBACK_COUNT_BUCKETS
-		     + CALLBACK_COUNT_BUCKET_WIDTH / 2))
-    /* We've not being activated continuously in the recent past.
-       Don't do anything.  */
-    return;
-
-  if (global.callbacks_per_sec < 3000)
-    /* A load of less than 3k callbacks per second is fine.  */
-    return;
-
-  debug (1, "High load: %d callbacks/s.",
-	 (int) (global.callbacks / (global.time / 1000)));
-
   GSList *candidates = NULL;
   void iter (gpointer key, gpointer value, gpointer user_data)
   {
-    // pid_t pid = (int) (uintptr_t) key;
     struct tcb *tcb = value;
+    struct pcb *pcb = tcb->pcb;
+
+    if (tcb->suspended || pcb->passive || tcb->stop_tracing
+	|| pcb->shed == PCB_SHED_DETACHED
+	|| pcb->seccomp == PCB_SECCOMP_INSTALLING)
+      return;
 
-    if (tcb->suspended)
-      /* Already suspended.  */
+    if (pcb->shed != PCB_SHED_NONE
+	&& n - pcb->shed_changed < LOAD_CHECK_INTERVAL)
+      /* Give the last step a chance to take effect.  */
       return;
 
     if (n - tcb->load.callback_count_reset[tcb->load.callback_count_bucket]
@@ -2833,28 +5020,9 @@ load_shed_maybe (void)
       /* It hasn't run recently.  */
       return;
 
-    struct summary summary = summarize (&tcb->load);
-    if (summary.events)
-      /* It's producing interesting events...  */
-      return;
-
-    if (summary.time > (CALLBACK_COUNT_BUCKET_WIDTH * CALLBACK_COUNT_BUCKETS
-			+ CALLBACK_COUNT_BUCKET_WIDTH / 2))
-      /* It hasn't been doing much.  */
-      return;
-
-    if (summary.callbacks_per_sec > global.callbacks_per_sec / 5)
-      /* At least 20% of the callbacks are due to this task...  */
-      candidates = g_slist_prepend (candidates, tcb);
+    candidates = g_slist_prepend (candidates, tcb);
   }
-  g_hash_table_foreach (tcbs, iter, NULL);
-
-  if (! candidates)
-    /* Tja...  */
-    {
-      debug (0, "Nothing to suspend.");
-      return;
-    }
+  g_hash_table_foreach (tracer->tcbs, iter, NULL);
 
   gint compare (gconstpointer a, gconstpointer b)
   {
@@ -2864,7 +5032,8 @@ load_shed_maybe (void)
     struct summary summary_x = summarize (&x->load);
     struct summary summary_y = summarize (&y->load);
 
-    if (summary_x.callbacks_per_sec < summary_y.callbacks_per_sec)
+    /* Most callbacks first.  */
+    if (summary_x.callbacks_per_sec > summary_y.callbacks_per_sec)
       return -1;
     if (summary_x.callbacks_per_sec == summary_y.callbacks_per_sec)
       return 0;
@@ -2872,22 +5041,20 @@ load_shed_maybe (void)
   }
   candidates = g_slist_sort (candidates, compare);
 
-  GSList *l;
   for (l = candidates; l; l = l->next)
     {
       struct tcb *tcb = l->data;
       debug (1, TCB_FMT": Generating %d callbacks per second",
 	     TCB_PRINTF (tcb), summarize (&tcb->load).callbacks_per_sec);
+
+      if (pcb_shed_more (tcb->pcb))
+	break;
     }
 
-  /* Suspend the process generating the highest number of callbacks.  */
-  struct tcb *tcb = candidates->data;
-  // tcb->suspended = -n;
-  suspended_tcbs = g_slist_prepend (suspended_tcbs, tcb);
+  if (! l)
+    debug (0, "Tracer %d: Nothing to shed.", tracer->id);
 
   g_slist_free (candidates);
-
-  return;
 }
 
 static void
@@ -2913,20 +5080,29 @@ load_increment (struct tcb *tcb)
   }
 
   update (&tcb->load);
-  update (&global_load);
+  update (&tracer->load);
 }
 
-/* Here's where all the magic happens.  */
+/* Here's where all the magic happens.  This is the body of each
+   tracer thread; ARG is its struct tracer.  */
 static void *
 process_monitor (void *arg)
 {
-  assert (pthread_equal (pthread_self (), process_monitor_tid));
+  tracer = arg;
+  tracer->ktid = syscall (__NR_gettid);
+  tracer->shed_seed = tracer->ktid ^ (unsigned int) now ();
 
   process_monitor_signaler_init ();
 
-  const uintptr_t ptrace_options
+  uintptr_t ptrace_options
     = (PTRACE_O_TRACESYSGOOD|PTRACE_O_TRACECLONE|PTRACE_O_TRACEFORK
        |PTRACE_O_TRACEEXEC|PTRACE_O_TRACEEXIT);
+#ifdef HAVE_LINUX_SECCOMP_H
+  if (seccomp_mode)
+    /* We need to see vforks: the child shares the parent's filter
+       and posix_spawn uses vfork.  */
+    ptrace_options |= PTRACE_O_TRACESECCOMP|PTRACE_O_TRACEVFORK;
+#endif
 
   struct tcb *tcb = NULL;
   bool quit_raised_output_debug = false;
@@ -2936,7 +5112,7 @@ process_monitor (void *arg)
 #define DEBUG_PROBE_FREQ 10000
   int debug_probe = 0;
   int output_debug_saved = 0;
-  while (! (quit && tcb_count == 0))
+  while (! (quit && tracer->tcb_count == 0))
     {
       if (debug_probe == DEBUG_PROBE_FREQ)
 	{
@@ -2965,7 +5141,7 @@ process_monitor (void *arg)
 	    if (tcb->suspended > 0)
 	      /* Already suspended.  */
 	      thread_untrace (tcb, false);
-	    else if (tkill (tid, SIGSTOP) < 0 || tkill (tid, SIGCONT) < 0)
+	    else if (! thread_wake (tcb))
 	      /* Failed to send it a signal.  Assume it is dead.  */
 	      {
 		debug (0, TCB_FMT": tkill (%d, SIGSTOP): %m",
@@ -2973,7 +5149,7 @@ process_monitor (void *arg)
 		thread_untrace (tcb, false);
 	      }
 	  }
-	  g_hash_table_foreach (tcbs, iter, NULL);
+	  g_hash_table_foreach (tracer->tcbs, iter, NULL);
 	}
 
       /* SIGNO is the signal the child received and the signal to be
@@ -2989,9 +5165,17 @@ process_monitor (void *arg)
 	 trace.  As the lock is free, the command is added to the
 	 queued command list.  The process monitor now calls waitpid.
 	 Because adding the command also tickled the wait process, we
-	 will wake up immediately.  */
+	 will wake up immediately.
+
+	 We only wait for our own tracees (__WNOTHREAD): the other
+	 tracer threads' tracees are theirs.  */
       int status = 0;
-      pid_t tid = waitpid (-1, &status, __WALL|__WCLONE);
+      pid_t tid = waitpid (-1, &status, __WALL|__WCLONE|__WNOTHREAD);
+      tracer->stops ++;
+
+      /* If the main thread made space in the callback ring, add any
+	 events that didn't fit.  */
+      callback_overflow_flush ();
 
       if (++ debug_probe == DEBUG_PROBE_FREQ)
 	/* Enable a debug probe.  */
@@ -3000,14 +5184,14 @@ process_monitor (void *arg)
 	  output_debug = 5;
 	}
 
-      if (tid == signal_process_pid || process_monitor_commands)
+      if (tid == tracer->signal_process_pid || tracer->commands)
 	{
 	  debug (4, "signal from signal process");
 
-	  pthread_mutex_lock (&process_monitor_commands_lock);
-	  GSList *commands = process_monitor_commands;
-	  process_monitor_commands = NULL;
-	  pthread_mutex_unlock (&process_monitor_commands_lock);
+	  pthread_mutex_lock (&tracer->commands_lock);
+	  GSList *commands = tracer->commands;
+	  tracer->commands = NULL;
+	  pthread_mutex_unlock (&tracer->commands_lock);
 
 	  if (commands)
 	    /* Execute the commands in the order received.  */
@@ -3028,6 +5212,7 @@ process_monitor (void *arg)
 
 	      g_free (c);
 	      c = NULL;
+	      tracer->commands_processed ++;
 
 	      switch (command)
 		{
@@ -3040,7 +5225,13 @@ process_monitor (void *arg)
 		     or do we have to wait for a convenient moment?
 		     IT APPEARS that we can send a thread a SIGSTOP to
 		     (reliably) wake it up.  */
-		  debug (1, "Quitting.  Need to detach from:");
+		  debug (1, "Tracer %d quitting.  Need to detach from:",
+			 tracer->id);
+
+		  __sync_bool_compare_and_swap (&quit, 0, now ());
+#ifdef HAVE_LINUX_SECCOMP_H
+		  seccomp_keeper_start ();
+#endif
 
 		  void iter (gpointer key, gpointer value, gpointer user_data)
 		  {
@@ -3052,8 +5243,7 @@ process_monitor (void *arg)
 		    if (tcb->suspended > 0)
 		      /* Already suspended.  */
 		      thread_untrace (tcb, false);
-		    else if (tkill (tid, SIGSTOP) < 0
-			     || tkill (tid, SIGCONT) < 0)
+		    else if (! thread_wake (tcb))
 		      /* Failed to send a signal.  Assume it is
 			 dead.  */
 		      {
@@ -3062,10 +5252,8 @@ process_monitor (void *arg)
 			thread_untrace (tcb, false);
 		      }
 		  }
-		  g_hash_table_foreach (tcbs, iter, NULL);
+		  g_hash_table_foreach (tracer->tcbs, iter, NULL);
 		  tcb = NULL;
-
-		  quit = now ();
 		  break;
 
 		case PROCESS_MONITOR_TRACE:
@@ -3089,10 +5277,20 @@ process_monitor (void *arg)
 
 	  /* Resume the signal process so it can be signaled
 	     again.  */
-	  if (tid == signal_process_pid)
+	  if (tid == tracer->signal_process_pid)
 	    goto out;
 	}
 
+#ifdef HAVE_LINUX_SECCOMP_H
+      if (seccomp_keeper_pid && tid == seccomp_keeper_pid)
+	/* The keeper exited.  */
+	{
+	  debug (3, "Keeper exited (status: %x).", status);
+	  seccomp_keeper_pid = 0;
+	  continue;
+	}
+#endif
+
       int event = status >> 16;
 
       void signal_state (int level)
@@ -3117,7 +5315,7 @@ process_monitor (void *arg)
       /* Look up the thread.  */
       if (! (tcb && tcb->tid == tid))
 	{
-	  tcb = g_hash_table_lookup (tcbs, (gpointer) (uintptr_t) tid);
+	  tcb = g_hash_table_lookup (tracer->tcbs, (gpointer) (uintptr_t) tid);
 	  if (! tcb)
 	    /* We haven't yet registered this process, but we are
 	       clearly ptracing it...  There are a few possibilities.
@@ -3163,7 +5361,8 @@ process_monitor (void *arg)
 		{
 		  pid_t pgl = tid_to_process_group_leader (tid);
 		  struct tcb *leader
-		    = g_hash_table_lookup (tcbs, (gpointer) (uintptr_t) pgl);
+		    = g_hash_table_lookup (tracer->tcbs,
+					   (gpointer) (uintptr_t) pgl);
 		  debug (1, "Got signal for %d "
 			 "(group leader: %d;%s;%s;%s;trace options %sset; "
 			 "parent: %d), but not monitoring it!",
@@ -3188,7 +5387,7 @@ process_monitor (void *arg)
 		    }
 		}
 
-	      if (tcb)
+	      if (tcb && pcb_use_patches (tcb->pcb))
 		/* Patch the thread.  */
 		{
 		  if (! thread_apply_patches (tcb))
@@ -3200,9 +5399,12 @@ process_monitor (void *arg)
 	    }
 	}
 
-      /* If the process has been fixed up, then let it run.
-	 Otherwise, default to stopping it at the next signal/syscall.  */
-      ptrace_op = pcb_patched (tcb->pcb) ? PTRACE_CONT : PTRACE_SYSCALL;
+      /* If the process has been fixed up or filters its system calls,
+	 then let it run.  Otherwise, default to stopping it at the
+	 next signal/syscall.  */
+      ptrace_op = (pcb_patched (tcb->pcb)
+		   || tcb->pcb->seccomp == PCB_SECCOMP_ACTIVE)
+	? PTRACE_CONT : PTRACE_SYSCALL;
 
       /* See if the child exited.  */
       if (WIFEXITED (status))
@@ -3239,7 +5441,34 @@ process_monitor (void *arg)
 
       signo = WSTOPSIG (status);
 
-      if (quit || tcb->stop_tracing)
+#ifdef HAVE_LINUX_SECCOMP_H
+      if ((quit || tcb->stop_tracing) && ! tcb->seccomp_inject
+	  && (tcb->pcb->seccomp == PCB_SECCOMP_ACTIVE
+	      || tcb->pcb->seccomp == PCB_SECCOMP_INSTALLING))
+	/* We can't detach from a filtered process.  If we are
+	   installing the filter, wait until we are done (or have
+	   failed).  Otherwise, hand it over to the keeper.  */
+	{
+	  if (tcb->pcb->seccomp == PCB_SECCOMP_INSTALLING)
+	    {
+	      if (signo == SIGSTOP || signo == (0x80 | SIGTRAP) || event)
+		signo = 0;
+	      ptrace_op = PTRACE_SYSCALL;
+	      goto out;
+	    }
+
+	  signo = thread_seccomp_handover (tcb, status);
+	  if (signo == -1)
+	    {
+	      tcb = NULL;
+	      continue;
+	    }
+	  ptrace_op = PTRACE_CONT;
+	  goto out;
+	}
+#endif
+
+      if ((quit || tcb->stop_tracing) && ! tcb->seccomp_inject)
 	/* We are trying to exit or we want to detach from this
 	   process.  */
 	{
@@ -3257,11 +5486,46 @@ process_monitor (void *arg)
 	{
 	  debug (3, TCB_FMT": Detaching due to pending suspend.",
 		 TCB_PRINTF (tcb));
+	  tcb->start_time = tid_start_time (tid);
 	  thread_detach (tcb);
 	  tcb->suspended = -tcb->suspended;
+	  /* We may free it without it stopping again (see
+	     load_shed_maybe).  */
+	  tcb = NULL;
 	  continue;
 	}
 
+      if (! tcb->seccomp_inject && tcb->pcb->shed >= PCB_SHED_QUIET
+	  && tcb->pcb->libs && ! tcb->pcb->unpatched)
+	/* We are shedding load: stop intercepting the process's
+	   system calls (see load_shed_maybe).  */
+	{
+	  if (thread_unpatch (tcb))
+	    tcb->pcb->unpatched = true;
+	}
+      else if (! tcb->seccomp_inject && tcb->pcb->shed < PCB_SHED_QUIET
+	       && tcb->pcb->unpatched)
+	/* The load dropped.  Patch the process again.  */
+	{
+	  pcb_libs_free (tcb->pcb);
+	  if (pcb_use_patches (tcb->pcb) && ! thread_apply_patches (tcb))
+	    continue;
+	}
+
+#ifdef HAVE_LINUX_SECCOMP_H
+      if ((tcb->pcb->passive || tcb->pcb->shed >= PCB_SHED_QUIET)
+	  && tcb->pcb->seccomp == PCB_SECCOMP_ACTIVE
+	  && (event == PTRACE_EVENT_SECCOMP || signo == (0x80 | SIGTRAP)))
+	/* The user is no longer interested in this process or we are
+	   shedding load, but we can't detach from it.  Resume it as
+	   quickly as possible.  */
+	{
+	  signo = 0;
+	  ptrace_op = PTRACE_CONT;
+	  goto out;
+	}
+#endif
+
       void open_fds_iterate (int op)
       {
 	assert (op == WC_PROCESS_CLOSE_CB || op == WC_PROCESS_OPEN_CB);
@@ -3321,7 +5585,20 @@ process_monitor (void *arg)
 	   have captured this thread.  Set the options, scan for any
 	   siblings if necessary and patch the binary.  */
 	{
-	  if (ptrace (PTRACE_SETOPTIONS, tid, 0, ptrace_options) == -1)
+	  int err = ptrace (PTRACE_SETOPTIONS, tid, 0, ptrace_options);
+#ifdef HAVE_LINUX_SECCOMP_H
+	  if (err == -1 && errno == EINVAL
+	      && (ptrace_options & PTRACE_O_TRACESECCOMP))
+	    /* Linux < 3.5.  */
+	    {
+	      debug (0, "Kernel does not support PTRACE_O_TRACESECCOMP, "
+		     "patching libraries instead.");
+	      seccomp_mode = false;
+	      ptrace_options &= ~(PTRACE_O_TRACESECCOMP|PTRACE_O_TRACEVFORK);
+	      err = ptrace (PTRACE_SETOPTIONS, tid, 0, ptrace_options);
+	    }
+#endif
+	  if (err == -1)
 	    {
 	      debug (0, TCB_FMT": Failed to set trace options: %m",
 		     TCB_PRINTF (tcb));
@@ -3368,7 +5645,7 @@ process_monitor (void *arg)
 			  if (tid2)
 			    {
 			      struct tcb *tcb2 = g_hash_table_lookup
-				(tcbs, (gpointer) (uintptr_t) tid2);
+				(tracer->tcbs, (gpointer) (uintptr_t) tid2);
 			      if (! tcb2)
 				/* We are not monitoring it yet.  */
 				{
@@ -3393,7 +5670,7 @@ process_monitor (void *arg)
 		}
 	    }
 
-	  if (! thread_apply_patches (tcb))
+	  if (pcb_use_patches (tcb->pcb) && ! thread_apply_patches (tcb))
 	    continue;
 
 	  open_fds_iterate (WC_PROCESS_OPEN_CB);
@@ -3416,6 +5693,16 @@ process_monitor (void *arg)
 		 " (options: %d)",
 		 TCB_PRINTF (tcb), strsignal (signo), signo,
 		 tcb->trace_options);
+#ifdef HAVE_LINUX_SECCOMP_H
+	  if (tcb->seccomp_inject && signo <= 64)
+	    /* Don't run a signal handler while the thread is executing
+	       system calls on our behalf.  */
+	    {
+	      tcb->seccomp_signals |= 1ULL << (signo - 1);
+	      signo = 0;
+	      ptrace_op = PTRACE_SYSCALL;
+	    }
+#endif
 	  goto out;
 	}
 
@@ -3437,14 +5724,27 @@ process_monitor (void *arg)
 	      debug (4, TCB_FMT": exec'd", TCB_PRINTF (tcb));
 	      pcb_read_exe (tcb->pcb);
 
-	      /* It has a new memory image.  We need to fix it up.  */
-	      memset (&tcb->pcb->lib_base, 0, sizeof (tcb->pcb->lib_base));
-	      ptrace_op = PTRACE_SYSCALL;
+	      /* It has a new memory image.  We need to fix it up.
+		 The kernel has already mapped the executable and the
+		 loader (if any).  Patch them now: this way, static
+		 binaries are also patched and the libraries that the
+		 loader maps are noticed (see fixups).  */
+	      pcb_page_cache_flush (tcb->pcb);
+	      pcb_libs_free (tcb->pcb);
+	      if (pcb_use_patches (tcb->pcb) && ! thread_apply_patches (tcb))
+		continue;
+	      /* (If it has our filter, we're fine: filters survive
+		 exec.)  */
+	      if (tcb->pcb->seccomp != PCB_SECCOMP_ACTIVE
+		  && ! pcb_patched (tcb->pcb)
+		  && tcb->pcb->shed < PCB_SHED_QUIET)
+		ptrace_op = PTRACE_SYSCALL;
 
 	      break;
 
 	    case PTRACE_EVENT_CLONE:
 	    case PTRACE_EVENT_FORK:
+	    case PTRACE_EVENT_VFORK:
 	      {
 		/* Get the name of the new child.  */
 		pid_t child = (pid_t) msg;
@@ -3467,16 +5767,41 @@ process_monitor (void *arg)
 			/* It inherits the options set on its parent.  */
 			tcb2->trace_options = tcb->trace_options;
 
-			int i;
-			for (i = 0; i < LIBRARY_COUNT; i ++)
+			if (event != PTRACE_EVENT_CLONE)
 			  /* It has the same memory image.  If the parent
 			     is fixed up, so is the child.  */
 			  {
-			    if (event != PTRACE_EVENT_CLONE)
-			      tcb2->pcb->lib_base[i] = tcb->pcb->lib_base[i];
+			    pcb_libs_copy (tcb2->pcb, tcb->pcb);
+			    tcb2->pcb->unpatched = tcb->pcb->unpatched;
+			    if (tcb->pcb->shed != PCB_SHED_NONE)
+			      /* It is likely as busy as its parent.  */
+			      pcb_shed_set (tcb2->pcb, tcb->pcb->shed,
+					    tcb->pcb->shed_sample);
+			  }
+
+			if (event != PTRACE_EVENT_CLONE && tcb->pcb->shed_fds)
+			  /* It inherits the file descriptors.  */
+			  {
+			    void copy (gpointer key, gpointer value,
+				       gpointer user_data)
+			    {
+			      g_hash_table_insert (tcb2->pcb->shed_fds,
+						   key, value);
+			    }
+			    if (! tcb2->pcb->shed_fds)
+			      tcb2->pcb->shed_fds
+				= g_hash_table_new (g_direct_hash,
+						    g_direct_equal);
+			    g_hash_table_foreach (tcb->pcb->shed_fds, copy,
+						  NULL);
+			  }
 
-			    /* The same fds are open.  */
-			    tcb2->pcb->lib_fd[i] = tcb->pcb->lib_fd[i];
+			if (event != PTRACE_EVENT_CLONE
+			    && tcb->pcb->seccomp == PCB_SECCOMP_ACTIVE)
+			  /* The child inherits the filter.  */
+			  {
+			    tcb2->pcb->seccomp = PCB_SECCOMP_ACTIVE;
+			    tcb2->pcb->passive = tcb->pcb->passive;
 			  }
 		      }
 		  }
@@ -3492,6 +5817,13 @@ process_monitor (void *arg)
 		open_fds_iterate (WC_PROCESS_CLOSE_CB);
 	      break;
 
+#ifdef HAVE_LINUX_SECCOMP_H
+	    case PTRACE_EVENT_SECCOMP:
+	      /* A filtered system call (see seccomp_mode).  Process it
+		 like a system call entry.  */
+	      break;
+#endif
+
 	    default:
 	      debug (0, "Unknown event %d, ignoring.", event);
 	      break;
@@ -3499,7 +5831,8 @@ process_monitor (void *arg)
 
 	  /* Resume the process.  */
 	  signo = 0;
-	  goto out;
+	  if (event != PTRACE_EVENT_SECCOMP)
+	    goto out;
 	}
 
       /* It is either a breakpoint or a system call.  In both cases,
@@ -3602,6 +5935,37 @@ process_monitor (void *arg)
       syscall_entry = regs.ARM_ip == 0;
 #else
 # error syscall_entry handling
+#endif
+      if (event == PTRACE_EVENT_SECCOMP)
+	{
+	  syscall_entry = true;
+	  tcb->seccomp_syscall = true;
+	}
+      else if (tcb->seccomp_syscall)
+	{
+	  if (syscall_entry)
+	    /* Before Linux 4.8, the filter's stop is followed by a
+	       system call entry stop.  We already processed the
+	       entry.  */
+	    {
+	      ptrace_op = PTRACE_SYSCALL;
+	      goto out;
+	    }
+	  tcb->seccomp_syscall = false;
+	}
+
+#ifdef HAVE_LINUX_SECCOMP_H
+      if (tcb->seccomp_inject)
+	/* We are installing the filter.  The thread is executing a
+	   system call on our behalf.  */
+	{
+	  if (! syscall_entry && ! thread_seccomp_inject (tcb, &regs))
+	    continue;
+	  ptrace_op = tcb->seccomp_inject
+	    || tcb->pcb->seccomp != PCB_SECCOMP_ACTIVE
+	    ? PTRACE_SYSCALL : PTRACE_CONT;
+	  goto out;
+	}
 #endif
       long syscall;
       if (syscall_entry)
@@ -3687,6 +6051,27 @@ process_monitor (void *arg)
 	      }
 	    int fd = (int) RET;
 
+	    if (fd >= 0 && tcb->pcb->shed == PCB_SHED_SAMPLE
+		&& rand_r (&tracer->shed_seed) % tcb->pcb->shed_sample != 0)
+	      /* We are shedding load and this open is not part of the
+		 sample (see load_shed_maybe).  Remember the fd so that
+		 we also skip its close.  */
+	      {
+		if (! tcb->pcb->shed_fds)
+		  tcb->pcb->shed_fds = g_hash_table_new (g_direct_hash,
+							 g_direct_equal);
+		g_hash_table_insert (tcb->pcb->shed_fds,
+				     GINT_TO_POINTER (fd + 1),
+				     GINT_TO_POINTER (1));
+		break;
+	      }
+	    if (fd >= 0 && tcb->pcb->shed_fds)
+	      /* A previous file with this descriptor was closed without
+		 us noticing (e.g., on exec or while we were
+		 detached).  */
+	      g_hash_table_remove (tcb->pcb->shed_fds,
+				   GINT_TO_POINTER (fd + 1));
+
 	    int unhandled
 	      = flags & ~(O_RDONLY|O_WRONLY|O_RDWR|O_CREAT|O_EXCL|O_TRUNC
 			  |O_NONBLOCK|O_LARGEFILE|O_DIRECTORY);
@@ -3752,11 +6137,6 @@ process_monitor (void *arg)
 		    callback_enqueue (tcb, WC_PROCESS_OPEN_CB,
 				      buffer, NULL, flags, &s);
 		  }
-
-		int i;
-		for (i = 0; i < LIBRARY_COUNT; i ++)
-		  if (g_str_has_prefix (buffer, library_patches[i].filename))
-		    tcb->pcb->lib_fd[i] = fd;
 	      }
 	  }
 
@@ -3769,6 +6149,18 @@ process_monitor (void *arg)
 
 	    int fd = (int) ARG1;
 
+	    if (tcb->pcb->shed_fds
+		&& g_hash_table_remove (tcb->pcb->shed_fds,
+					GINT_TO_POINTER (fd + 1)))
+	      /* We did not report its open.  */
+	      {
+		if (pcb_patched (tcb->pcb)
+		    || tcb->pcb->seccomp == PCB_SECCOMP_ACTIVE)
+		  /* We don't need to see the exit.  */
+		  ptrace_op = PTRACE_CONT;
+		break;
+	      }
+
 	    char buffer[1024];
 	    if (lookup_fd (tid, fd, buffer, sizeof (buffer)))
 	      /* There is little reason to believe that a close on a
@@ -3780,15 +6172,6 @@ process_monitor (void *arg)
 		       /* fd.  */
 		       fd, buffer);
 
-		int i;
-		for (i = 0; i < LIBRARY_COUNT; i ++)
-		  if (fd == tcb->pcb->lib_fd[i])
-		    {
-		      debug (4, TCB_FMT": lib %s closed",
-			     TCB_PRINTF (tcb), library_patches[i].filename);
-		      tcb->pcb->lib_fd[i] = -1;
-		    }
-
 		if (process_monitor_filename_whitelisted (buffer))
 		  {
 		    struct stat s;
@@ -3808,12 +6191,17 @@ process_monitor (void *arg)
 
 	  break;
 
-#ifdef __NR_mmap2
-	case __NR_mmap2:
-#else
-	case __NR_mmap:
-#endif
-	  if (! syscall_entry)
+	case NR_MMAP:
+	  if (syscall_entry)
+	    {
+	      int prot = ARG3;
+	      int fd = ARG5;
+	      if ((fd == -1 || ! (prot & PROT_EXEC)) && pcb_patched (tcb->pcb))
+		/* It won't map a library (e.g., the loader is mapping
+		   data or the heap).  Don't stop on the exit.  */
+		ptrace_op = PTRACE_CONT;
+	    }
+	  else
 	    {
 	      uintptr_t addr = ARG1;
 	      size_t length = ARG2;
@@ -3823,27 +6211,24 @@ process_monitor (void *arg)
 	      uintptr_t file_offset = ARG6;
 	      uintptr_t map_addr = RET;
 
-	      struct library_patch *lib = NULL;
-	      if (fd != -1)
-		{
-		  int i;
-		  for (i = 0; i < LIBRARY_COUNT; i ++)
-		    if (fd == tcb->pcb->lib_fd[i])
-		      lib = &library_patches[i];
-		}
-
 	      debug (4, TCB_FMT": mmap (%"PRIxPTR", %x,%s%s%s (0x%x), 0x%x, "
-		     "%d (= %s), %"PRIxPTR") -> %"PRIxPTR,
+		     "%d, %"PRIxPTR") -> %"PRIxPTR,
 		     TCB_PRINTF (tcb),
 		     addr, (int) length,
 		     prot & PROT_READ ? " READ" : "",
 		     prot & PROT_WRITE ? " WRITE" : "",
 		     prot & PROT_EXEC ? " EXEC" : "",
 		     prot, flags, fd,
-		     lib ? lib->filename : "other",
 		     file_offset, map_addr);
 
-	      if (lib && (prot & PROT_EXEC))
+	      if (addr && (flags & MAP_FIXED))
+		/* It may have replaced something that we cached.  */
+		pcb_page_cache_flush (tcb->pcb);
+
+	      /* A file mapped executable is a library (or something
+		 similar).  Patch it.  */
+	      if (fd != -1 && (prot & PROT_EXEC) && map_addr < (uintptr_t) -4095
+		  && pcb_use_patches (tcb->pcb))
 		if (! thread_apply_patches (tcb))
 		  continue;
 	    }
@@ -3860,7 +6245,10 @@ process_monitor (void *arg)
 		     "(=> 0x%"PRIxPTR") => %"PRIdPTR,
 		     TCB_PRINTF (tcb), (uintptr_t) ARG1, (uintptr_t) ARG2,
 		     (uintptr_t) (ARG1 + ARG2), (uintptr_t) RET);
-	      if (RET == 0 && ! pcb_patched (tcb->pcb))
+	      if (RET == 0)
+		pcb_page_cache_flush (tcb->pcb);
+	      if (RET == 0 && ! pcb_patched (tcb->pcb)
+		  && pcb_use_patches (tcb->pcb))
 		if (! thread_apply_patches (tcb))
 		  continue;
 	    }
@@ -3881,8 +6269,39 @@ process_monitor (void *arg)
 
 	      char buffer[1024];
 	      char *end;
-	      if ((end = tcb_mem_read (tcb, filename,
-				       buffer, sizeof (buffer) - 1, true)))
+	      int whitelisted;
+	      tcb->saved_unreported = false;
+	      if ((end = tcb_mem_read_filename (tcb, filename,
+						buffer, sizeof (buffer) - 1,
+						&whitelisted))
+		  && whitelisted == WC_FILENAME_WHITELIST_NO
+		  && (syscall == __NR_rename || syscall == __NR_renameat))
+		/* The source is not whitelisted.  But if the file is
+		   moved into a whitelisted directory, we still report
+		   it.  */
+		{
+		  char dest[1024];
+		  if (tcb_mem_read_filename (tcb,
+					     syscall == __NR_renameat
+					     ? ARG4 : ARG2,
+					     dest, sizeof (dest) - 1,
+					     &whitelisted)
+		      && whitelisted == WC_FILENAME_WHITELIST_NO)
+		    tcb->saved_unreported = true;
+		  else
+		    /* Read all of the source.  */
+		    end = tcb_mem_read (tcb, filename,
+					buffer, sizeof (buffer) - 1, true);
+		}
+	      else if (end && whitelisted == WC_FILENAME_WHITELIST_NO)
+		tcb->saved_unreported = true;
+
+	      if (tcb->saved_unreported)
+		/* Don't bother canonicalizing the filename or stating
+		   the file: we won't report it.  */
+		debug (4, TCB_FMT": %s: not whitelisted",
+		       TCB_PRINTF (tcb), syscall_str (syscall));
+	      else if (end)
 		{
 		  end[1] = 0;
 
@@ -3914,6 +6333,8 @@ process_monitor (void *arg)
 	      debug (4, TCB_FMT": %s (%s)",
 		     TCB_PRINTF (tcb), syscall_str (syscall), tcb->saved_src);
 	    }
+	  else if (tcb->saved_unreported)
+	    tcb->saved_unreported = false;
 	  else if (syscall == __NR_unlink
 		   || syscall == __NR_unlinkat
 		   || syscall == __NR_rmdir)
@@ -3995,7 +6416,20 @@ process_monitor (void *arg)
 	  break;
 	}
 
+#ifdef HAVE_LINUX_SECCOMP_H
+      if (! syscall_entry && seccomp_mode
+	  && tcb->pcb->seccomp == PCB_SECCOMP_NONE
+	  && thread_seccomp_install (tcb, &regs))
+	ptrace_op = PTRACE_SYSCALL;
+#endif
+
     out:
+      if (tcb && tcb->tid == tid && tcb->pcb->shed >= PCB_SHED_QUIET
+	  && ptrace_op == PTRACE_SYSCALL && ! tcb->seccomp_inject
+	  && tcb->pcb->seccomp != PCB_SECCOMP_INSTALLING)
+	/* We are shedding load: don't stop on its next system call.  */
+	ptrace_op = PTRACE_CONT;
+
       load_shed_maybe ();
 
       debug (4, "ptrace(%s, %d, sig: %d)",
@@ -4015,20 +6449,91 @@ process_monitor (void *arg)
 	}
     }
 
-  debug (0, DEBUG_BOLD ("Process monitor exited ("TIME_FMT")."),
-	 TIME_PRINTF (now () - quit));
+  debug (0, DEBUG_BOLD ("Tracer %d exited ("TIME_FMT"): "
+			"%"PRIu64" stops, %"PRIu64" commands."),
+	 tracer->id, TIME_PRINTF (now () - quit),
+	 tracer->stops, tracer->commands_processed);
+
+#ifdef HAVE_LINUX_SECCOMP_H
+  pthread_mutex_lock (&seccomp_keeper_lock);
+  if (__sync_sub_and_fetch (&tracers_running, 1) == 0
+      && seccomp_keeper_fd != -1)
+    /* We are the last tracer.  Tell the keeper that it has all of
+       the processes.  */
+    {
+      close (seccomp_keeper_fd);
+      seccomp_keeper_fd = -1;
+    }
+  pthread_mutex_unlock (&seccomp_keeper_lock);
+#else
+  __sync_sub_and_fetch (&tracers_running, 1);
+#endif
 
   /* Kill the signal process.  */
-  kill (signal_process_pid, SIGKILL);
+  kill (tracer->signal_process_pid, SIGKILL);
   return NULL;
 }
 
+/* Return the tracer that is tracing PID, if any.  */
+static struct tracer *
+tracer_tracing (pid_t pid)
+{
+  assert (! tracer);
+
+  char *s = tid_state (pid, "TracerPid");
+  if (! s)
+    return NULL;
+  pid_t tracer_pid = atoi (s);
+  free (s);
+
+  int i;
+  for (i = 0; i < tracer_count; i ++)
+    if (tracers[i].ktid == tracer_pid)
+      return &tracers[i];
+  return NULL;
+}
+
+/* Return the tracer that should trace PID's process tree.  If PID
+   (or one of its ancestors) is already traced, it must be the same
+   tracer: a thread can only be traced by one thread.  Otherwise,
+   pick the tracer with the fewest process trees.  */
+static struct tracer *
+tracer_for (pid_t pid)
+{
+  assert (! tracer);
+
+  struct tracer *t = tracer_tracing (pid);
+  if (t)
+    return t;
+
+  t = g_hash_table_lookup (tracer_trees, (gpointer) (uintptr_t) pid);
+  if (t)
+    /* We are not tracing PID (anymore).  Perhaps we failed to
+       attach to it or it exited and the pid was reused.  */
+    tracer_tree_remove (pid);
+
+  t = &tracers[0];
+  int i;
+  for (i = 1; i < tracer_count; i ++)
+    if (tracers[i].trees < t->trees)
+      t = &tracers[i];
+  return t;
+}
+
 bool
 wc_process_monitor_ptrace_trace (pid_t pid)
 {
-  assert (! pthread_equal (pthread_self (), process_monitor_tid));
+  assert (! tracer);
+
+  struct tracer *t = tracer_for (pid);
+  if (! g_hash_table_lookup (tracer_trees, (gpointer) (uintptr_t) pid))
+    {
+      g_hash_table_insert (tracer_trees, (gpointer) (uintptr_t) pid, t);
+      t->trees ++;
+    }
+  debug (4, "Tracing %d in tracer %d (%d trees).", pid, t->id, t->trees);
 
-  process_monitor_command (PROCESS_MONITOR_TRACE, pid);
+  process_monitor_command (t, PROCESS_MONITOR_TRACE, pid);
 
   return true;
 }
@@ -4036,15 +6541,30 @@ wc_process_monitor_ptrace_trace (pid_t pid)
 void
 wc_process_monitor_ptrace_untrace (pid_t pid)
 {
-  assert (! pthread_equal (pthread_self (), process_monitor_tid));
-  process_monitor_command (PROCESS_MONITOR_UNTRACE, pid);
+  assert (! tracer);
+
+  struct tracer *t
+    = g_hash_table_lookup (tracer_trees, (gpointer) (uintptr_t) pid);
+  if (! t)
+    t = tracer_tracing (pid);
+  if (! t)
+    {
+      debug (0, "Can't untrace %d: not being traced.", pid);
+      return;
+    }
+
+  process_monitor_command (t, PROCESS_MONITOR_UNTRACE, pid);
 }
 
 void
 wc_process_monitor_ptrace_quit (void)
 {
-  assert (! pthread_equal (pthread_self (), process_monitor_tid));
-  process_monitor_command (PROCESS_MONITOR_QUIT, 0);
+  assert (! tracer);
+  wc_process_monitor_ptrace_flush ();
+
+  int i;
+  for (i = 0; i < tracer_count; i ++)
+    process_monitor_command (&tracers[i], PROCESS_MONITOR_QUIT, 0);
 }
 
 #ifdef PROCESS_TRACER_STANDALONE
@@ -4068,20 +6588,56 @@ unix_signal_handler (WCSignalHandler *sh, struct signalfd_siginfo *si,
       g_main_loop_quit (loop);
 #endif
 
-      /* Wait for the monitor to quiesce.  */
-      int err = pthread_join (process_monitor_tid, NULL);
-      if (err)
+      /* Wait for the tracers to quiesce.  */
+      int i;
+      for (i = 0; i < tracer_count; i ++)
 	{
-	  errno = err;
-	  debug (0, "joining monitor thread: %m");
+	  int err = pthread_join (tracers[i].thread, NULL);
+	  if (err)
+	    {
+	      errno = err;
+	      debug (0, "joining tracer thread %d: %m", i);
+	    }
 	}
     }
 }
 
+void
+wc_process_monitor_ptrace_threads (int threads)
+{
+  assert (! tracers);
+  tracer_count = MAX (0, threads);
+}
+
+void
+wc_process_monitor_ptrace_cpu_budget (int percent)
+{
+  assert (! tracers);
+  cpu_budget = percent;
+}
+
+/* A tracer only checks its load when one of its processes stops or
+   it gets a command.  If it scaled back tracing some process, it may
+   not be woken for a long time.  Poke it so that it notices when the
+   load drops (see load_shed_maybe).  */
+static gboolean
+load_shed_poke (gpointer user_data)
+{
+  if (quit)
+    return false;
+
+  int i;
+  for (i = 0; i < tracer_count; i ++)
+    if (tracers[i].shedding)
+      tkill (tracers[i].signal_process_pid, SIGUSR2);
+
+  return true;
+}
+
 void
 wc_process_monitor_ptrace_init (void)
 {
-  assert (! pthread_equal (pthread_self (), process_monitor_tid));
+  assert (! tracer);
 
   /* The signals we are iterested in.  */
   sigset_t signal_mask;
@@ -4099,13 +6655,16 @@ wc_process_monitor_ptrace_init (void)
 		    G_CALLBACK (unix_signal_handler), NULL);
 
   /* pid_t fits in a pointer.  */
-  pcbs = g_hash_table_new (g_direct_hash, g_direct_equal);
-  tcbs = g_hash_table_new (g_direct_hash, g_direct_equal);
+  tracer_trees = g_hash_table_new (g_direct_hash, g_direct_equal);
+  libraries = g_hash_table_new (g_str_hash, g_str_equal);
+  page_size = sysconf (_SC_PAGESIZE);
 
 
 #ifndef PROCESS_TRACER_STANDALONE
   char *db_filename = files_logfile ("process-patches");
-  int err = sqlite3_open (db_filename, &process_patches_db);
+  int err = sqlite3_open_v2 (db_filename, &process_patches_db,
+			     SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+			     | SQLITE_OPEN_FULLMUTEX, NULL);
   if (err)
     {
       debug (0, "sqlite3_open (%s): %s",
@@ -4123,7 +6682,14 @@ wc_process_monitor_ptrace_init (void)
 		      "create table patches"
 		      " (lib, offset, len, o1, o2, o3, o4, o5, o6, o7, o8);"
 		      "drop table if exists processes;"
-		      "create table processes (pid, lib, base);",
+		      "create table processes (pid, lib, base);"
+		      "create table if not exists patch_cache_libs"
+		      " (lib, key, size, count);"
+		      "create table if not exists patch_cache"
+		      " (key, offset, syscall, len,"
+		      "  o1, o2, o3, o4, o5, o6, o7, o8);"
+		      "create index if not exists patch_cache_key"
+		      " on patch_cache (key);",
   		      NULL, NULL, &errmsg);
   if (errmsg)
     {
@@ -4134,50 +6700,43 @@ wc_process_monitor_ptrace_init (void)
   g_free (db_filename);
 #endif
 
-  pthread_create (&process_monitor_tid, NULL, process_monitor, NULL);
-  pthread_mutex_lock (&process_monitor_commands_lock);
-  while (! signal_process_pid)
-    pthread_cond_wait (&process_monitor_signaler_init_cond,
-		       &process_monitor_commands_lock);
-  pthread_mutex_unlock (&process_monitor_commands_lock);
-}
-
-#ifdef PROCESS_TRACER_STANDALONE
-bool
-process_monitor_filename_whitelisted (const char *filename)
-{
-  if (! filename)
-    return false;
-
-  static const char *filename_whitelist[] =
+  if (! tracer_count)
     {
-      "/home",
-      "/media",
-      "/mnt"
-    };
-
-  if (! (filename[0] == '/' && (filename[1] == 'h' || filename[1] == 'm')))
-    /* Fast check.  */
-    goto out;
+      long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      tracer_count = MAX (1, MIN (cpus, TRACERS_MAX));
+    }
+  debug (3, "Starting %d tracer threads.", tracer_count);
 
+  tracers = g_malloc0 (tracer_count * sizeof (struct tracer));
+  tracers_running = tracer_count;
   int i;
-  for (i = 0;
-       i < sizeof (filename_whitelist) / sizeof (filename_whitelist[0]);
-       i ++)
+  for (i = 0; i < tracer_count; i ++)
     {
-      int len = strlen (filename_whitelist[i]);
-      if (strncmp (filename, filename_whitelist[i], len) == 0
-	  && (filename[len] == 0 || filename[len] == '/'))
-	{
-	  debug (3, "File %s is whitelisted.", filename);
-	  return true;
-	}
+      struct tracer *t = &tracers[i];
+      t->id = i;
+      t->pcbs = g_hash_table_new (g_direct_hash, g_direct_equal);
+      t->tcbs = g_hash_table_new (g_direct_hash, g_direct_equal);
+      pthread_mutex_init (&t->commands_lock, NULL);
+      pthread_cond_init (&t->signaler_init_cond, NULL);
+
+      callback_ring_init (t);
+
+      pthread_create (&t->thread, NULL, process_monitor, t);
+      pthread_mutex_lock (&t->commands_lock);
+      while (! t->signal_process_pid)
+	pthread_cond_wait (&t->signaler_init_cond, &t->commands_lock);
+      pthread_mutex_unlock (&t->commands_lock);
     }
 
- out:
-  debug (3, "File %s is "DEBUG_BOLD("blacklisted")".", filename);
-
-  return false;
+  if (cpu_budget > 0)
+    g_timeout_add (LOAD_CHECK_INTERVAL, load_shed_poke, NULL);
+}
+
+#ifdef PROCESS_TRACER_STANDALONE
+bool
+process_monitor_filename_whitelisted (const char *filename)
+{
+  return wc_filename_whitelisted (filename);
 }
 
 void
@@ -4216,12 +6775,12 @@ process_monitor_callback (struct wc_process_monitor_cb *cb)
       return;
     }
 
-  debug (0, "%d(%d): %s;%s;%s: %s (%s%s%s, "BYTES_FMT")",
+  debug (0, "%d(%d): %s;%s;%s: %s (%s%s%s, "BYTES_FMT") x %d",
 	 cb->top_levels_pid, cb->actor_pid,
 	 cb->top_levels_exe, cb->top_levels_arg0, cb->top_levels_arg1,
 	 wc_process_monitor_cb_str (cb->cb),
 	 src, dest ? " -> " : "", dest ?: "",
-	 BYTES_PRINTF (stat->st_size));
+	 BYTES_PRINTF (stat->st_size), cb->count);
 }
 
 static int input_count;
@@ -69,6 +69,14 @@ struct wc_process_monitor_cb
   /* The time at which the event occured (as returned by now()).  */
   uint64_t timestamp;
 
+  /* Repeated opens and closes of the same file by the same process
+     tree are coalesced (see wc_process_monitor_ptrace_flush).  The
+     number of events that this callback stands for (at least 1).
+     TIMESTAMP is the time of the first event and LAST_TIMESTAMP the
+     time of the last one.  */
+  int count;
+  uint64_t last_timestamp;
+
   /* The PID, executable, arg0 and arg1 of the thread that the user
      added explicitly via wc_process_monitor_ptrace_trace.  */
   int top_levels_pid;
@@ -122,17 +130,54 @@ struct wc_process_monitor_cb
 /* The user must implement this.  Called before the callback to
    determine whether a file is even required.  This will NOT be called
    from the main thread so be careful.  Becareful: FILENAME might be
-   NULL.  */
+   NULL.  The ptrace backend already skips unlinks and renames of
+   files that the filename whitelist (see filename-whitelist.h)
+   rejects; this should not accept any files that it rejects.  */
 extern bool process_monitor_filename_whitelisted (const char *filename);
 
 extern void process_monitor_callback (struct wc_process_monitor_cb *cb);
 
+/* Instead of patching the system call instructions in the traced
+   processes' libraries, install a seccomp filter in each traced
+   process so that the kernel only stops it on the system calls that
+   we are interested in.  If the kernel doesn't support this, we
+   fall back to patching.  Note: a filtered process can't gain
+   privileges by executing a setuid program and it will fail to open
+   files if it is not traced (e.g., we are killed).  Must be called
+   before wc_process_monitor_ptrace_init.  */
+extern void wc_process_monitor_ptrace_use_seccomp (bool use);
+
+/* Processes are traced by several threads.  Each process tree that
+   the user traces (see wc_process_monitor_ptrace_trace) is assigned
+   to one of them, which also traces the tree's descendants.  Set the
+   number of threads.  If 0 (the default), use one per CPU, but at
+   most a few.  Must be called before
+   wc_process_monitor_ptrace_init.  */
+extern void wc_process_monitor_ptrace_threads (int threads);
+
+/* The tracer threads may together use PERCENT percent of a CPU (the
+   default is 25).  If they use more, we trace the busiest processes
+   less closely: we first only report a random sample of the files
+   that they open (and the closes of just those files), then none of
+   their file accesses, and finally we detach from them.  While
+   sampling, unlinks and renames are still always reported.  When
+   the load drops, we trace them fully again.  If PERCENT is 0, we always
+   trace processes fully.  Must be called before
+   wc_process_monitor_ptrace_init.  */
+extern void wc_process_monitor_ptrace_cpu_budget (int percent);
+
 /* Start the process monitor.  */
 extern void wc_process_monitor_ptrace_init (void);
 
 /* Stop tracing all processes.  */
 extern void wc_process_monitor_ptrace_quit (void);
 
+/* Open and close callbacks are delayed for up to a few seconds so
+   that repeated accesses to the same file can be reported as a
+   single callback.  Make any delayed callbacks now.  Must be called
+   from the main thread.  */
+extern void wc_process_monitor_ptrace_flush (void);
+
 /* Trace process PID and any subsequent child processes.  PID must be
    the unix process id; it may not be a thread id.  (Actually, we
    don't just trace the process: we also trace any child processes,
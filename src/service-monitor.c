@@ -18,6 +18,8 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "config.h"
+
+#define DEBUG_SUBSYSTEM SERVICE
 #include "service-monitor.h"
 
 #include <stdio.h>
@@ -36,6 +38,8 @@
 #include "org.freedesktop.DBus.h"
 
 #include "process-monitor-ptrace.h"
+#include "process-monitor-fanotify.h"
+#include "filename-whitelist.h"
 
 #include "marshal.h"
 
@@ -62,6 +66,78 @@ static WCServiceMonitor *service_monitor;
 
 /* The implementation of the service monitor object.  */
 
+/* The process monitor backends.  If the backend is "auto", those
+   marked automatic are tried in this order.  The last one is the
+   fallback.  */
+struct process_monitor_backend
+{
+  const char *name;
+  /* Whether to try this backend if the backend is "auto".  */
+  bool automatic;
+  bool (*init) (void);
+  bool (*trace) (pid_t pid);
+  void (*untrace) (pid_t pid);
+};
+
+static bool
+ptrace_init (void)
+{
+  wc_process_monitor_ptrace_init ();
+  return true;
+}
+
+/* The seccomp backend is the ptrace backend with system call
+   filtering.  It is not tried automatically: filtered processes
+   can't execute setuid programs.  */
+static bool
+seccomp_init (void)
+{
+  wc_process_monitor_ptrace_use_seccomp (true);
+  wc_process_monitor_ptrace_init ();
+  return true;
+}
+
+static const struct process_monitor_backend backends[] =
+  {
+    { "fanotify", true, wc_process_monitor_fanotify_init,
+      wc_process_monitor_fanotify_trace,
+      wc_process_monitor_fanotify_untrace },
+    { "seccomp", false, seccomp_init,
+      wc_process_monitor_ptrace_trace,
+      wc_process_monitor_ptrace_untrace },
+    { "ptrace", true, ptrace_init,
+      wc_process_monitor_ptrace_trace,
+      wc_process_monitor_ptrace_untrace },
+  };
+#define BACKEND_COUNT (sizeof (backends) / sizeof (backends[0]))
+
+/* The backend that the user selected.  */
+static const char *backend_name = "ptrace";
+/* The backend that is in use.  */
+static const struct process_monitor_backend *backend;
+
+bool
+wc_service_monitor_backend_set (const char *name)
+{
+  assert (! backend);
+
+  if (strcmp (name, "auto") == 0)
+    {
+      backend_name = "auto";
+      return true;
+    }
+
+  int i;
+  for (i = 0; i < BACKEND_COUNT; i ++)
+    if (strcmp (backends[i].name, name) == 0)
+      {
+	backend_name = backends[i].name;
+	return true;
+      }
+
+  return false;
+}
+
 /* Maps pids to struct wc_process *'s.  */
 static GHashTable *pid_to_process;
 /* Maps dbus names to struct wc_process *'s.  */
@@ -183,7 +259,7 @@ service_new (WCServiceMonitor *m, pid_t pid, const char *dbus_name)
       g_hash_table_insert (pid_to_process,
 			   (gpointer) (uintptr_t) pid, process);
 
-      wc_process_monitor_ptrace_trace (process->pid);
+      backend->trace (process->pid);
     }
 
   GString *d = NULL;
@@ -284,7 +360,7 @@ service_free (WCServiceMonitor *m,
 	  assert (0 == 1);
 	}
 
-      wc_process_monitor_ptrace_untrace (process->pid);
+      backend->untrace (process->pid);
 
       g_free (process->exe);
       g_free (process->arg0);
@@ -507,41 +583,10 @@ wc_service_monitor_new (void)
   return service_monitor;
 }
 
-static const char *filename_whitelist[] =
-  {
-    "/home",
-    "/media",
-    "/mnt"
-  };
-
 bool
 process_monitor_filename_whitelisted (const char *filename)
 {
-  if (! filename)
-    return false;
-
-  if (! (filename[0] == '/' && (filename[1] == 'h' || filename[1] == 'm')))
-    /* Fast check.  */
-    goto out;
-
-  int i;
-  for (i = 0;
-       i < sizeof (filename_whitelist) / sizeof (filename_whitelist[0]);
-       i ++)
-    {
-      int len = strlen (filename_whitelist[i]);
-      if (strncmp (filename, filename_whitelist[i], len) == 0
-	  && (filename[len] == 0 || filename[len] == '/'))
-	{
-	  debug (5, "File %s is whitelisted.", filename);
-	  return true;
-	}
-    }
-
- out:
-  debug (4, "File %s is blacklisted.", filename);
-
-  return false;
+  return wc_filename_whitelisted (filename);
 }
 
 void
@@ -670,7 +715,24 @@ wc_service_monitor_init (WCServiceMonitor *m)
   dbus_name_to_process = g_hash_table_new (g_str_hash, g_str_equal);
 
   /* Start the process monitor.  */
-  wc_process_monitor_ptrace_init ();
+  bool try_all = strcmp (backend_name, "auto") == 0;
+  int i;
+  for (i = 0; i < BACKEND_COUNT; i ++)
+    if ((try_all ? backends[i].automatic
+	 : strcmp (backends[i].name, backend_name) == 0)
+	&& backends[i].init ())
+      {
+	backend = &backends[i];
+	break;
+      }
+  if (! backend)
+    {
+      backend = &backends[BACKEND_COUNT - 1];
+      debug (0, "Failed to start the %s process monitor, using %s.",
+	     backend_name, backend->name);
+      backend->init ();
+    }
+  debug (1, "Using the %s process monitor.", backend->name);
 
   /* Get the running services.  */
   char **names = NULL;
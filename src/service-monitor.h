@@ -80,6 +80,16 @@ struct _WCServiceMonitorClass
 };
 
 extern GType wc_service_monitor_get_type (void);
+
+/* Select the process monitor backend: "ptrace", "seccomp" (ptrace
+   with system call filtering, see
+   wc_process_monitor_ptrace_use_seccomp), "fanotify" (see
+   process-monitor-fanotify.h) or "auto", which uses fanotify if it is
+   available and ptrace otherwise.  If the selected backend can't be
+   started, ptrace is used.  The default is ptrace.  Must be called
+   before the service monitor is first instantiated.  Returns false if
+   BACKEND is not recognized.  */
+extern bool wc_service_monitor_backend_set (const char *backend);
 
 /* Instantiate a idle monitor.  After instantiating, immediately
    connect to the object's "idle" and "disconnected" signals: existing
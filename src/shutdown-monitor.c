@@ -18,6 +18,8 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "config.h"
+
+#define DEBUG_SUBSYSTEM MONITORS
 #include "shutdown-monitor.h"
 
 #include <stdio.h>
@@ -18,6 +18,8 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "config.h"
+
+#define DEBUG_SUBSYSTEM MONITORS
 #include "signal-handler.h"
 
 #include <stdio.h>
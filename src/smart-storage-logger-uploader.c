@@ -17,6 +17,8 @@
 
 #include "config.h"
 
+#define DEBUG_SUBSYSTEM UPLOADER
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -36,6 +38,7 @@
 #include "util.h"
 #include "sqlq.h"
 #include "files.h"
+#include "debug-ring.h"
 
 #include "network-monitor.h"
 #include "user-activity-monitor.h"
@@ -629,6 +632,10 @@ upload (void)
   struct db *d;
   for (d = dbs; d; d = d->next)
     {
+      /* Move any debug messages still in the database's ring into
+	 its log table.  */
+      debug_ring_convert_file (d->filename);
+
       char *dbname;
       if (strstr(d->filename, ".smart-storage"))
 	/* For compatibility, we just use the filename for databases
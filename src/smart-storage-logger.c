@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <error.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -41,6 +42,8 @@
 #include "user-activity-monitor.h"
 #include "battery-monitor.h"
 #include "service-monitor.h"
+#include "process-monitor-ptrace.h"
+#include "filename-whitelist.h"
 #include "shutdown-monitor.h"
 
 /* DB for logging events.  */
@@ -93,11 +96,11 @@ obfuscate (sqlite3_context* context, int argc, sqlite3_value **argv)
 		       SQLITE_TRANSIENT /* Have sqlite make a copy.  */);
 }
 
-static void
-db_init (void)
+/* Open a connection to the logging DB.  */
+static sqlite3 *
+db_open (void)
 {
-  /* Open the logging DB.  */
-  db_filename = files_logfile ("ssl.db");
+  sqlite3 *db;
   int err = sqlite3_open (db_filename, &db);
   if (err)
     error (1, 0, "sqlite3_open (%s): %s",
@@ -106,6 +109,22 @@ db_init (void)
   /* Sleep up to an hour if the database is busy...  */
   sqlite3_busy_timeout (db, 60 * 60 * 1000);
 
+  /* Add a custom SQL function, X.  (One parameter, any representation
+     (UTF-8, etc), no cookie, callback, no step function, no
+     destructor.)  */
+  sqlite3_create_function (db, "X", 1, SQLITE_ANY, NULL,
+			   obfuscate, NULL, NULL);
+
+  return db;
+}
+
+static void
+db_init (void)
+{
+  /* Open the logging DB.  */
+  db_filename = files_logfile ("ssl.db");
+  db = db_open ();
+
   md5_init_ctx (&salt);
 
   int salt_callback (void *cookie, int argc, char **argv, char **names)
@@ -115,12 +134,12 @@ db_init (void)
   }
 
   char *errmsg = NULL;
-  err = sqlite3_exec (db,
-		      "create table if not exists salt (salt);"
-		      "select salt from salt;"
-		      "insert into salt (salt) values (hex(randomblob(16)));"
-		      "select salt from salt;",
-		      salt_callback, NULL, &errmsg);
+  int err = sqlite3_exec (db,
+			  "create table if not exists salt (salt);"
+			  "select salt from salt;"
+			  "insert into salt (salt) values (hex(randomblob(16)));"
+			  "select salt from salt;",
+			  salt_callback, NULL, &errmsg);
   if (errmsg)
     {
       if (err != SQLITE_ABORT)
@@ -131,12 +150,6 @@ db_init (void)
   if (err != SQLITE_ABORT)
     debug (0, DEBUG_BOLD ("FAILED TO READ SECRET KEY"));
 
-  /* Add a custom SQL function, X.  (One parameter, any representation
-     (UTF-8, etc), no cookie, callback, no step function, no
-     destructor.)  */
-  sqlite3_create_function (db, "X", 1, SQLITE_ANY, NULL,
-			   obfuscate, NULL, NULL);
-
   
 #if 0
   int callback (void *cookie, int argc, char **argv, char **names)
@@ -997,6 +1010,10 @@ battery_status (WCBatteryMonitor *m,
 		      TM_PRINTF (now_tm ()), wc_battery_id (b),
 		      is_charging, wc_battery_charger_to_string (charger),
 		      is_discharging, mv, mah);
+
+  /* When on battery, commit less often.  */
+  sqlq_adaptive_on_battery (sqlq, wc_battery_monitor_discharging (m)
+			    && ! wc_battery_monitor_charging (m));
 }
 
 static void
@@ -1104,6 +1121,9 @@ service_stopped (WCServiceMonitor *m,
   service_start_stopped (dbus_name, process, "stopped");
 }
 
+/* The insert into file_access_log.  */
+static struct sqlq_template *file_access_log_template;
+
 static void
 service_fs_access (WCServiceMonitor *m,
 		   GSList *services,
@@ -1144,13 +1164,14 @@ service_fs_access (WCServiceMonitor *m,
   if (strncmp (prefix, src, strlen (prefix)) == 0)
     dotfile = true;
 
-  debug (4, "%d(%d): %s;%s;%s: %s ("DEBUG_BOLD("%s")"%s%s%s, "BYTES_FMT")",
+  debug (4, "%d(%d): %s;%s;%s: %s ("DEBUG_BOLD("%s")"%s%s%s, "BYTES_FMT")"
+	 " x %d",
 	 cb->top_levels_pid, cb->actor_pid,
 	 cb->top_levels_exe, cb->top_levels_arg0, cb->top_levels_arg1,
 	 wc_process_monitor_cb_str (cb->cb),
 	 dotfile ? "" : src,
 	 dotfile ? src : "", dest ? " -> " : "", dest ?: "",
-	 BYTES_PRINTF (stat->st_size));
+	 BYTES_PRINTF (stat->st_size), cb->count);
 
   GString *s = g_string_new ("");
   GSList *l = services;
@@ -1161,24 +1182,36 @@ service_fs_access (WCServiceMonitor *m,
 	g_string_append (s, ";");
     }
 
-  sqlq_append_printf (sqlq, false,
-		      "insert into file_access_log"
-		      " ("SQL_TIME_COLS","
-		      "  dbus_name, "
-		      "  service_pid, service_exe,"
-		      "  service_arg0, service_arg1,"
-		      "  actor_pid, actor_exe,"
-		      "  actor_arg0, actor_arg1,"
-		      "  action, src, dest, size)"
-		      " values ("TM_FMT",%Q,%d,%Q,%Q,%Q,"
-		      "  %d,%Q,%Q,%Q,%Q,%Q,%Q,%"PRId64");",
-		      TM_PRINTF (now_tm ()), s->str,
+  if (! file_access_log_template)
+    file_access_log_template = sqlq_template_new
+      (sqlq,
+       "insert into file_access_log"
+       " ("SQL_TIME_COLS","
+       "  dbus_name, "
+       "  service_pid, service_exe,"
+       "  service_arg0, service_arg1,"
+       "  actor_pid, actor_exe,"
+       "  actor_arg0, actor_arg1,"
+       "  action, src, dest, size, count, last_timestamp)"
+       " values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?,"
+       "  ?);",
+       /* SQL_TIME_COLS, dbus_name, service_*, actor_*, action, src,
+	  dest, size, count, last_timestamp.  */
+       "iiiii" "s" "isss" "isss" "sss" "l" "i" "l");
+
+  /* The time columns are those of the first access (the callback may
+     be delivered up to the process monitor's coalescing window
+     later).  */
+  struct tm tm = ms_tm (cb->timestamp);
+  sqlq_append_record (sqlq, false, file_access_log_template,
+		      TM_PRINTF (tm), s->str,
 		      cb->top_levels_pid, cb->top_levels_exe,
 		      cb->top_levels_arg0, cb->top_levels_arg1,
 		      cb->actor_pid, cb->actor_exe,
 		      cb->actor_arg0, cb->actor_arg1,
 		      wc_process_monitor_cb_str (cb->cb),
-		      src, dest, stat->st_size);
+		      src, dest, (int64_t) stat->st_size, cb->count,
+		      (int64_t) cb->last_timestamp);
 
   g_string_free (s, true);
 }
@@ -1202,7 +1235,7 @@ sm_init (void)
 			  "  service_arg0, service_arg1,"
 			  "  actor_pid, actor_exe,"
 			  "  actor_arg0, actor_arg1,"
-			  "  action, src, dest, size);",
+			  "  action, src, dest, size, count, last_timestamp);",
 			  NULL, NULL, &errmsg);
   if (errmsg)
     {
@@ -1211,6 +1244,35 @@ sm_init (void)
       errmsg = NULL;
     }
 
+  /* COUNT is the number of accesses that the row stands for (the
+     process monitor coalesces repeated accesses).  Older databases
+     don't have it.  */
+  sqlite3_exec (db,
+		"alter table file_access_log add column count default 1;",
+		NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      if (! strstr (errmsg, "duplicate column name"))
+	debug (0, "Adding column file_access_log.count: %s", errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+
+  /* LAST_TIMESTAMP is the time of the last of those accesses, in
+     milliseconds since the epoch (the time columns are those of the
+     first).  Older databases don't have it.  */
+  sqlite3_exec (db,
+		"alter table file_access_log add column last_timestamp;",
+		NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      if (! strstr (errmsg, "duplicate column name"))
+	debug (0, "Adding column file_access_log.last_timestamp: %s",
+	       errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+
   logger_uploader_table_register (db_filename, "service_log", true);
   logger_uploader_table_register (db_filename, "file_access_log", true);
 
@@ -1350,16 +1412,10 @@ unix_signal_handler (WCSignalHandler *sh, struct signalfd_siginfo *si,
 	g_main_loop_quit (loop);
     }
 
-  if (si->ssi_signo == SIGUSR1)
-    {
-      output_debug_global = MIN (5, output_debug_global + 1);
-      debug (0, "Got SIGUSR1.  Raised output_debug to %d", output_debug);
-    }
-  if (si->ssi_signo == SIGUSR2)
-    {
-      output_debug_global = MAX (0, output_debug_global - 1);
-      debug (0, "Got SIGUSR1.  Lowered output_debug to %d", output_debug);
-    }
+  if (si->ssi_signo == SIGUSR1 || si->ssi_signo == SIGUSR2)
+    /* If the signal was sent using sigqueue, the value selects the
+       subsystem.  */
+    debug_level_signal (si->ssi_signo, si->ssi_int);
 }
 
 static void
@@ -1485,13 +1541,47 @@ main (int argc, char *argv[])
 
   debug (0, "Daemonizing.  Further output will be sent to %s", log);
 
-  /* See if we should fork.  */
+  /* Parse the options.  */
   bool do_fork = true;
   {
     int i;
     for (i = 0; i < argc; i ++)
       if (strcmp (argv[i], "--no-fork") == 0)
 	do_fork = false;
+      else if (strncmp (argv[i], "--process-monitor=", 18) == 0)
+	{
+	  /* ptrace, seccomp, fanotify or auto.  */
+	  if (! wc_service_monitor_backend_set (&argv[i][18]))
+	    error (1, 0, "Unknown process monitor: %s", &argv[i][18]);
+	}
+      else if (strncmp (argv[i], "--whitelist=", 12) == 0)
+	{
+	  /* A colon-separated list of directories whose files are
+	     logged (default: WC_FILENAME_WHITELIST_DEFAULT).  */
+	  if (! wc_filename_whitelist_set (&argv[i][12]))
+	    error (1, 0, "Invalid whitelist: %s", &argv[i][12]);
+	}
+      else if (strncmp (argv[i], "--tracer-threads=", 17) == 0)
+	{
+	  /* The number of ptrace tracer threads (default: the number
+	     of CPUs, at most 4).  */
+	  int threads = atoi (&argv[i][17]);
+	  if (threads <= 0)
+	    error (1, 0, "Invalid number of tracer threads: %s",
+		   &argv[i][17]);
+	  wc_process_monitor_ptrace_threads (threads);
+	}
+      else if (strncmp (argv[i], "--tracer-cpu-budget=", 20) == 0)
+	{
+	  /* The share of a CPU (in percent) that the ptrace tracer
+	     threads may use before they trace the busiest processes
+	     less closely (default: 25; 0: no limit).  */
+	  char *end;
+	  long percent = strtol (&argv[i][20], &end, 10);
+	  if (end == &argv[i][20] || *end || percent < 0)
+	    error (1, 0, "Invalid tracer CPU budget: %s", &argv[i][20]);
+	  wc_process_monitor_ptrace_cpu_budget ((int) percent);
+	}
   }
   if (do_fork)
     {
@@ -1522,8 +1612,22 @@ main (int argc, char *argv[])
 
   db_init ();
 
-  /* Set up an sql queue.  Buffer data at most 20 seconds.  */
+  /* Set up an sql queue.  Buffer data at least 20 seconds.  Commit
+     from a separate thread so that a slow or busy database doesn't
+     stall the main loop.  If the writer falls behind, wait at most
+     100ms for it.  */
   sqlq = sqlq_new_static (db, sqlq_buffer, sizeof (sqlq_buffer), 20, NULL);
+  /* Journal the buffered statements so that they aren't lost if we
+     die.  This also replays anything that the last instance didn't
+     commit.  */
+  char *journal = files_logfile ("ssl.journal");
+  sqlq_journal_enable (sqlq, journal);
+  free (journal);
+  sqlq_async_enable (sqlq, db_open (), 100);
+  /* Adapt the flush delay to the load.  When on battery, it may be up
+     to 4 times as long (battery_status tells sqlq whether we are on
+     battery; adapt in sqlq.c applies the factor).  */
+  sqlq_adaptive_enable (sqlq, 20, 120);
 
   /* Initialize the unix signal catcher.  */
   signal_handler_init ();
@@ -1579,5 +1683,15 @@ main (int argc, char *argv[])
 
   sqlq_flush (sqlq);
 
+  struct sqlq_stats stats;
+  sqlq_stats_get (sqlq, &stats);
+  debug (1, "sqlq: %"PRIu64" commits, %"PRIu64" rows (%.1f per commit), "
+	 "%"PRIu64" bytes, %"PRIu64" ms committing, "
+	 "%"PRIu64" forced and %"PRIu64" delayed flushes, %"PRIu64" dropped",
+	 stats.commits, stats.rows,
+	 stats.commits ? (double) stats.rows / stats.commits : 0.,
+	 stats.bytes, stats.commit_time / 1000,
+	 stats.forced_flushes, stats.delayed_flushes, stats.dropped);
+
   return 0;
 }
@@ -14,6 +14,8 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
 
+#define DEBUG_SUBSYSTEM SQLQ
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,10 +23,20 @@
 #include <glib.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "sqlq.h"
 #undef sqlq_append
 #undef sqlq_append_printf
+#undef sqlq_append_record
 #include "debug.h"
 
 struct statement
@@ -32,6 +44,32 @@ struct statement
   const char *file;
   const char *func;
   int line;
+  /* The size of the statement including this header and any
+     padding.  */
+  int len;
+  /* If NULL, SQL is the nul-terminated SQL to execute.  Otherwise,
+     SQL contains the parameters for TEMPLATE encoded as described by
+     TEMPLATE->TYPES: ints and int64_ts are stored in native byte
+     order; strings are stored as an int32_t length (-1 for NULL)
+     followed by the string's bytes (without a terminating nul).  */
+  struct sqlq_template *template;
+  char sql[];
+};
+
+struct sqlq_template
+{
+  struct sqlq_template *next;
+  /* Prepared lazily.  */
+  sqlite3_stmt *stmt;
+  /* Set if preparing the statement failed.  We report the error
+     once and then drop any records.  */
+  bool broken;
+  /* Identifies the template in the journal.  */
+  uint32_t id;
+  /* The sequence number of the journal region in which the template
+     was last defined, per region.  */
+  uint64_t journal_seq[2];
+  char *types;
   char sql[];
 };
 
@@ -45,6 +83,15 @@ alignment_fixup (uintptr_t addr)
   return result;
 }
 
+/* A monotonic time stamp in microseconds.  */
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 static void
 default_error_handler (const char *file, const char *func, int line,
 		       const char *sql, const char *error_message)
@@ -53,12 +100,50 @@ default_error_handler (const char *file, const char *func, int line,
 	 file, func, line, sql, error_message);
 }
 
-#define ERROR_HANDLER(__eh_q, __eh_file, __eh_func, __eh_line,	 \
-		      __eh_sql, __eh_error_message)		 \
-  (((__eh_q)->error_handler ?: default_error_handler)		 \
+#define ERROR_HANDLER(__eh_handler, __eh_file, __eh_func, __eh_line, \
+		      __eh_sql, __eh_error_message)		     \
+  (((__eh_handler) ?: default_error_handler)			     \
    ((__eh_file), (__eh_func), (__eh_line),			 \
     (__eh_sql), (__eh_error_message)))
 
+/* Allocate a template for SQL with the parameter types TYPES.  */
+static struct sqlq_template *
+template_alloc (const char *sql, const char *types)
+{
+  const char *t;
+  for (t = types; *t; t ++)
+    assertx (*t == 'i' || *t == 'l' || *t == 's',
+	     "%s: Invalid type '%c' in '%s'", sql, *t, types);
+
+  int sql_len = strlen (sql) + 1;
+  struct sqlq_template *template = malloc (sizeof (*template) + sql_len);
+  static uint32_t next_id;
+
+  template->stmt = NULL;
+  template->broken = false;
+  template->id = __sync_fetch_and_add (&next_id, 1);
+  template->journal_seq[0] = template->journal_seq[1] = 0;
+  template->types = strdup (types);
+  memcpy (template->sql, sql, sql_len);
+
+  return template;
+}
+
+static void
+templates_free (struct sqlq_template *templates)
+{
+  while (templates)
+    {
+      struct sqlq_template *t = templates;
+      templates = t->next;
+
+      if (t->stmt)
+	sqlite3_finalize (t->stmt);
+      free (t->types);
+      free (t);
+    }
+}
+
 struct sqlq *
 sqlq_new_static (sqlite3 *db, void *buffer, int size, int flush_delay,
 		 sqlq_error_handler_t error_handler)
@@ -73,6 +158,13 @@ sqlq_new_static (sqlite3 *db, void *buffer, int size, int flush_delay,
   q->flush_delay = flush_delay;
   q->flush_source = 0;
   q->error_handler = error_handler;
+  q->templates = NULL;
+  q->async = NULL;
+  q->adaptive = NULL;
+  q->journal = NULL;
+  q->buffer = q->storage;
+  q->limit = q->size;
+  memset (&q->stats, 0, sizeof (q->stats));
 
   return q;
 }
@@ -90,13 +182,19 @@ sqlq_new (sqlite3 *db, int size, int flush_delay,
   return q;
 }
 
+static void async_stop (struct sqlq *q);
+static void journal_free (struct sqlq_journal *j);
+
 void
 sqlq_free (struct sqlq *q)
 {
+  if (q->async)
+    async_stop (q);
+
   if (q->used != 0)
     {
       q->buffer[q->used] = 0;
-      ERROR_HANDLER (q, NULL, NULL, 0, "",
+      ERROR_HANDLER (q->error_handler, NULL, NULL, 0, "",
 		     "sqlq_free called, but still have unflushed data!");
     }
 
@@ -106,6 +204,19 @@ sqlq_free (struct sqlq *q)
       q->flush_source = 0;
     }
 
+  templates_free (q->templates);
+  q->templates = NULL;
+
+  free (q->adaptive);
+  q->adaptive = NULL;
+
+  if (q->journal)
+    /* Any unflushed data remains in the journal.  */
+    {
+      journal_free (q->journal);
+      q->journal = NULL;
+    }
+
   /* Clear it (for debugging purposes).  */
   memset (q, 0, sizeof (*q) + q->size);
 
@@ -113,15 +224,432 @@ sqlq_free (struct sqlq *q)
     free (q);
 }
 
+struct sqlq_template *
+sqlq_template_new (struct sqlq *q, const char *sql, const char *types)
+{
+  struct sqlq_template *template = template_alloc (sql, types);
+
+  template->next = q->templates;
+  q->templates = template;
+
+  return template;
+}
+
+/* The journal is a file with a header followed by two regions, one
+   for each of the queue's buffers (in synchronous mode, only the
+   first is used).  Each region starts with a sequence number, which
+   is followed by the records that were appended to the corresponding
+   buffer since it was last committed.  When the buffer is committed,
+   the region is reset by assigning it a new sequence number: each
+   record contains the low 32 bits of its region's sequence number
+   and only those records that match are valid.  The records are
+   written to a shared mapping: once written, they survive the
+   process dying (but not a power failure).  On startup, the records
+   in any valid regions are replayed, the oldest region first.  */
+#define JOURNAL_MAGIC "SQLQJNL1"
+
+struct journal_header
+{
+  char magic[8];
+  uint32_t region_size;
+  uint32_t regions;
+};
+
+struct journal_record
+{
+  /* The size of the payload.  */
+  uint32_t len;
+  /* The low 32-bits of the region's sequence number.  */
+  uint32_t seq;
+  uint32_t checksum;
+  /* One of the JOURNAL_* values.  */
+  uint32_t kind;
+  char payload[];
+};
+
+enum
+  {
+    /* A command: the payload is the nul-terminated SQL.  */
+    JOURNAL_SQL = 1,
+    /* A template: the payload is its uint32_t id followed by its
+       nul-terminated types and its nul-terminated SQL.  */
+    JOURNAL_TEMPLATE,
+    /* A record: the payload is its template's uint32_t id followed by
+       the encoded parameters.  */
+    JOURNAL_RECORD,
+  };
+
+struct sqlq_journal
+{
+  char *filename;
+  int fd;
+  char *map;
+  size_t map_size;
+  /* The size of a region including its sequence number.  */
+  int region_size;
+  uint64_t next_seq;
+  struct
+  {
+    uint64_t seq;
+    /* The number of bytes of records in the region.  */
+    int used;
+  } regions[2];
+  /* The number of statements that did not fit.  */
+  uint64_t overflows;
+};
+
+static void
+journal_free (struct sqlq_journal *j)
+{
+  munmap (j->map, j->map_size);
+  close (j->fd);
+  free (j->filename);
+  free (j);
+}
+
+#define JOURNAL_HEADER_SIZE \
+  ((sizeof (struct journal_header) + 7) & ~7)
+#define JOURNAL_ALIGN(__ja_len) (((__ja_len) + 7) & ~7)
+
+/* Return the address of region R's sequence number.  */
+static uint64_t *
+journal_region (char *map, int region_size, int r)
+{
+  return (uint64_t *) (map + JOURNAL_HEADER_SIZE + r * region_size);
+}
+
+/* 32-bit FNV-1a.  */
+static uint32_t
+journal_checksum (const void *data, int len)
+{
+  const unsigned char *p = data;
+  uint32_t h = 2166136261U;
+  int i;
+  for (i = 0; i < len; i ++)
+    h = (h ^ p[i]) * 16777619U;
+  return h;
+}
+
+/* Discard the records in region R.  */
+static void
+journal_reset (struct sqlq_journal *j, int r)
+{
+  uint64_t seq = __sync_fetch_and_add (&j->next_seq, 1);
+  *journal_region (j->map, j->region_size, r) = seq;
+  j->regions[r].seq = seq;
+  j->regions[r].used = 0;
+}
+
+/* Write a record of kind KIND with the payload IOV to region R.
+   Returns false if there is not enough space.  */
+static bool
+journal_write (struct sqlq_journal *j, int r, int kind,
+	       struct iovec *iov, int iovcnt)
+{
+  int len = 0;
+  int i;
+  for (i = 0; i < iovcnt; i ++)
+    len += iov[i].iov_len;
+
+  int space = j->region_size - sizeof (uint64_t) - j->regions[r].used;
+  if (JOURNAL_ALIGN (sizeof (struct journal_record) + len) > space)
+    return false;
+
+  struct journal_record *rec
+    = (void *) ((char *) journal_region (j->map, j->region_size, r)
+		+ sizeof (uint64_t) + j->regions[r].used);
+  char *p = rec->payload;
+  for (i = 0; i < iovcnt; i ++)
+    p = mempcpy (p, iov[i].iov_base, iov[i].iov_len);
+
+  rec->len = len;
+  rec->seq = (uint32_t) j->regions[r].seq;
+  rec->kind = kind;
+  rec->checksum = journal_checksum (rec->payload, len);
+
+  j->regions[r].used += JOURNAL_ALIGN (sizeof (struct journal_record) + len);
+  return true;
+}
+
+/* Journal the statement S, which is about to be added to Q's current
+   buffer.  Returns false if the journal is full or nearly so, in which
+   case Q should be flushed.  */
+static bool
+journal_append (struct sqlq *q, struct statement *s)
+{
+  struct sqlq_journal *j = q->journal;
+  int r = q->buffer == q->storage ? 0 : 1;
+
+  bool ok;
+  if (! s->template)
+    {
+      struct iovec iov[] = { { s->sql, strlen (s->sql) + 1 } };
+      ok = journal_write (j, r, JOURNAL_SQL, iov, 1);
+    }
+  else
+    {
+      struct sqlq_template *t = s->template;
+      ok = true;
+      if (t->journal_seq[r] != j->regions[r].seq)
+	/* The template has not yet been defined in this region.  */
+	{
+	  struct iovec iov[] = { { &t->id, sizeof (t->id) },
+				 { t->types, strlen (t->types) + 1 },
+				 { t->sql, strlen (t->sql) + 1 } };
+	  ok = journal_write (j, r, JOURNAL_TEMPLATE, iov, 3);
+	  if (ok)
+	    t->journal_seq[r] = j->regions[r].seq;
+	}
+
+      if (ok)
+	{
+	  struct iovec iov[] = { { &t->id, sizeof (t->id) },
+				 { s->sql, s->len - sizeof (*s) } };
+	  ok = journal_write (j, r, JOURNAL_RECORD, iov, 2);
+	}
+    }
+
+  if (! ok)
+    {
+      j->overflows ++;
+      return false;
+    }
+
+  /* Flush before the region is full.  */
+  return j->regions[r].used < (j->region_size / 4) * 3;
+}
+
+/* Return the number of bytes needed to encode the parameters AP of
+   a record of the template T.  */
+static int
+record_len (struct sqlq_template *t, va_list ap)
+{
+  int data_len = 0;
+  const char *type;
+  for (type = t->types; *type; type ++)
+    switch (*type)
+      {
+      case 'i':
+	va_arg (ap, int);
+	data_len += sizeof (int);
+	break;
+      case 'l':
+	va_arg (ap, int64_t);
+	data_len += sizeof (int64_t);
+	break;
+      case 's':
+	{
+	  const char *str = va_arg (ap, const char *);
+	  data_len += sizeof (int32_t) + (str ? strlen (str) : 0);
+	  break;
+	}
+      }
+
+  return data_len;
+}
+
+/* Encode the parameters AP of a record of the template T in P.  */
+static void
+record_encode (struct sqlq_template *t, char *p, va_list ap)
+{
+  const char *type;
+  for (type = t->types; *type; type ++)
+    switch (*type)
+      {
+      case 'i':
+	{
+	  int v = va_arg (ap, int);
+	  p = mempcpy (p, &v, sizeof (v));
+	  break;
+	}
+      case 'l':
+	{
+	  int64_t v = va_arg (ap, int64_t);
+	  p = mempcpy (p, &v, sizeof (v));
+	  break;
+	}
+      case 's':
+	{
+	  const char *str = va_arg (ap, const char *);
+	  int32_t len = str ? strlen (str) : -1;
+	  p = mempcpy (p, &len, sizeof (len));
+	  if (str)
+	    p = mempcpy (p, str, len);
+	  break;
+	}
+      }
+}
+
+/* Bind the parameters encoded in DATA as described by TYPES to
+   STMT.  */
+static void
+bind_record (sqlite3_stmt *stmt, const char *types, const char *data)
+{
+  const char *p = data;
+  int i;
+  for (i = 0; types[i]; i ++)
+    switch (types[i])
+      {
+      case 'i':
+	{
+	  int v;
+	  memcpy (&v, p, sizeof (v));
+	  p += sizeof (v);
+	  sqlite3_bind_int (stmt, i + 1, v);
+	  break;
+	}
+      case 'l':
+	{
+	  int64_t v;
+	  memcpy (&v, p, sizeof (v));
+	  p += sizeof (v);
+	  sqlite3_bind_int64 (stmt, i + 1, v);
+	  break;
+	}
+      case 's':
+	{
+	  int32_t len;
+	  memcpy (&len, p, sizeof (len));
+	  p += sizeof (len);
+	  if (len < 0)
+	    sqlite3_bind_null (stmt, i + 1);
+	  else
+	    {
+	      /* The record remains valid until we reset the
+		 statement.  */
+	      sqlite3_bind_text (stmt, i + 1, p, len, SQLITE_STATIC);
+	      p += len;
+	    }
+	  break;
+	}
+      }
+}
+
+/* Bind the parameters of the record S to its template's statement
+   and execute it.  */
 static void
+execute_record (sqlite3 *db, sqlq_error_handler_t error_handler,
+		struct statement *s)
+{
+  struct sqlq_template *t = s->template;
+
+  if (! t->stmt && ! t->broken)
+    {
+      int err = sqlite3_prepare_v2 (db, t->sql, -1, &t->stmt, NULL);
+      if (err == SQLITE_OK
+	  && sqlite3_bind_parameter_count (t->stmt) != strlen (t->types))
+	{
+	  char *msg = NULL;
+	  asprintf (&msg, "Statement has %d parameters, but types ('%s') "
+		    "describes %zd",
+		    sqlite3_bind_parameter_count (t->stmt), t->types,
+		    strlen (t->types));
+	  ERROR_HANDLER (error_handler, s->file, s->func, s->line, t->sql,
+			 msg);
+	  free (msg);
+	  t->broken = true;
+	}
+      else if (err != SQLITE_OK)
+	{
+	  ERROR_HANDLER (error_handler, s->file, s->func, s->line, t->sql,
+			 sqlite3_errmsg (db));
+	  t->broken = true;
+	}
+
+      if (t->broken && t->stmt)
+	{
+	  sqlite3_finalize (t->stmt);
+	  t->stmt = NULL;
+	}
+    }
+  if (t->broken)
+    return;
+
+  bind_record (t->stmt, t->types, s->sql);
+
+  int err = sqlite3_step (t->stmt);
+  if (err != SQLITE_DONE && err != SQLITE_ROW)
+    ERROR_HANDLER (error_handler, s->file, s->func, s->line, t->sql,
+		   sqlite3_errmsg (db));
+
+  sqlite3_reset (t->stmt);
+  sqlite3_clear_bindings (t->stmt);
+}
+
+/* Execute the statement S on DB.  */
+static void
+execute (sqlite3 *db, sqlq_error_handler_t error_handler,
+	 struct statement *s)
+{
+  if (s->template)
+    {
+      execute_record (db, error_handler, s);
+      return;
+    }
+
+  char *errmsg = NULL;
+  sqlite3_exec (db, s->sql, NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      ERROR_HANDLER (error_handler, s->file, s->func, s->line, s->sql,
+		     errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+}
+
+/* Execute the LEN bytes of statements in BLOCK.  Returns the number
+   of statements.  */
+static int
+execute_block (sqlite3 *db, sqlq_error_handler_t error_handler,
+	       char *block, int len)
+{
+  int count = 0;
+  struct statement *s = (void *) block;
+  int remaining = len;
+  while (remaining > 0)
+    {
+      int len = s->len;
+      remaining -= len;
+      assert (remaining >= 0);
+
+      execute (db, error_handler, s);
+      count ++;
+
+      s = (void *) (uintptr_t) s + len;
+    }
+  assert (remaining == 0);
+
+  return count;
+}
+
+/* Account for a transaction that executed ROWS statements occupying
+   BYTES bytes and that started at START.  In asynchronous mode, must
+   be called with the writer's lock held.  */
+static void
+record_commit (struct sqlq *q, int rows, int bytes, uint64_t start)
+{
+  q->stats.commits ++;
+  q->stats.rows += rows;
+  q->stats.bytes += bytes;
+  q->stats.commit_time += now_us () - start;
+}
+
+/* Execute Q's buffered statements and then STATEMENT in a single
+   transaction.  Returns false if the transaction could not be
+   started or committed.  */
+static bool
 flush (struct sqlq *q, struct statement *statement)
 {
-  struct statement *statement_block = (void *) q->buffer;
   int statement_block_len = q->used;
 
   if (statement_block_len == 0 && ! statement)
     /* Nothing to do.  */
-    return;
+    return true;
+
+  uint64_t start = now_us ();
+  int rows = 0;
+  int bytes = 0;
 
   /* Wrap the command in a transaction.  */
   bool nested_transaction = false;
@@ -137,47 +665,29 @@ flush (struct sqlq *q, struct statement *statement)
       asprintf (&msg, "begin transaction;\n(%s: %s)",
 		statement ? statement->sql : "",
 		nested_transaction ? "" : "dropping");
-      ERROR_HANDLER (q, NULL, NULL, 0, msg, errmsg);
+      ERROR_HANDLER (q->error_handler, NULL, NULL, 0, msg, errmsg);
       free (msg);
 
       sqlite3_free (errmsg);
       errmsg = NULL;
 
       if (! nested_transaction)
-	return;
+	return false;
     }
 
-  /* Execute the commands.  */
-  void execute (struct sqlq *q, struct statement *s)
-  {
-    char *errmsg = NULL;
-    sqlite3_exec (q->db, s->sql, NULL, NULL, &errmsg);
-    if (errmsg)
-      {
-	ERROR_HANDLER (q, s->file, s->func, s->line, s->sql, errmsg);
-	sqlite3_free (errmsg);
-	errmsg = NULL;
-      }
-  }
+  if (statement && q->journal)
+    /* The statement is only journaled now that it will be executed
+       (see sqlq_append).  */
+    journal_append (q, statement);
 
   /* First iterate over the command block.  If we are in a nested
      transaction, we don't empty the buffer: we don't want to print
      the same messages multiple times.  */
-  if (! nested_transaction && statement_block)
+  if (! nested_transaction)
     {
-      struct statement *s = statement_block;
-      int remaining = statement_block_len;
-      while (remaining > 0)
-	{
-	  int len = alignment_fixup (sizeof (*s) + strlen (s->sql) + 1);
-	  remaining -= len;
-	  assert (remaining >= 0);
-
-	  execute (q, s);
-
-	  s = (void *) (uintptr_t) s + len;
-	}
-      assert (remaining == 0);
+      rows += execute_block (q->db, q->error_handler, q->buffer,
+			     statement_block_len);
+      bytes += statement_block_len;
 
       /* We could add something to the buffer while executing this
 	 code, e.g., if the ERROR_HANDLER callback uses an output
@@ -204,18 +714,761 @@ flush (struct sqlq *q, struct statement *statement)
 
   /* Then execute any "hanging command."  */
   if (statement)
-    execute (q, statement);
+    {
+      execute (q->db, q->error_handler, statement);
+      rows ++;
+      bytes += statement->len;
+    }
 
+  bool committed = true;
   if (! nested_transaction)
     {
       sqlite3_exec (q->db, "end transaction", NULL, NULL, &errmsg);
       if (errmsg)
 	{
-	  ERROR_HANDLER (q, NULL, NULL, 0, "end transaction", errmsg);
+	  ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+			 "end transaction", errmsg);
 	  sqlite3_free (errmsg);
 	  errmsg = NULL;
+	  committed = false;
+	}
+      else if (q->journal)
+	/* The data is safe.  */
+	{
+	  journal_reset (q->journal, 0);
+
+	  /* Journal anything that was appended while we were
+	     flushing.  */
+	  struct statement *s = (void *) q->buffer;
+	  int remaining = q->used;
+	  while (remaining > 0)
+	    {
+	      journal_append (q, s);
+	      remaining -= s->len;
+	      s = (void *) (uintptr_t) s + s->len;
+	    }
+	}
+
+      record_commit (q, rows, bytes, start);
+    }
+
+  return committed;
+}
+
+/* Execute the records in the journal region at REGION, which has
+   the sequence number SEQ and contains at most LEN bytes of records.
+   Returns the number of statements executed.  */
+static int
+journal_replay_region (struct sqlq *q, char *region, int len, uint64_t seq)
+{
+  /* Map from template ids to prepared statements.  */
+  struct replay_template
+  {
+    sqlite3_stmt *stmt;
+    char *types;
+  };
+  void free_template (gpointer data)
+  {
+    struct replay_template *t = data;
+    if (t->stmt)
+      sqlite3_finalize (t->stmt);
+    free (t);
+  }
+  GHashTable *templates
+    = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			     NULL, free_template);
+
+  int count = 0;
+  int offset = 0;
+  while (offset + (int) sizeof (struct journal_record) <= len)
+    {
+      struct journal_record *rec = (void *) (region + offset);
+      if (rec->seq != (uint32_t) seq
+	  || rec->len > len - offset - sizeof (*rec)
+	  || rec->checksum != journal_checksum (rec->payload, rec->len))
+	/* The end of the region (or a torn write).  */
+	break;
+      offset += JOURNAL_ALIGN (sizeof (*rec) + rec->len);
+
+      /* Ensure that the strings are terminated.  */
+      if (rec->kind != JOURNAL_RECORD
+	  && (rec->len == 0 || rec->payload[rec->len - 1] != 0))
+	continue;
+
+      uint32_t id = 0;
+      if (rec->kind != JOURNAL_SQL)
+	{
+	  if (rec->len < sizeof (id))
+	    continue;
+	  memcpy (&id, rec->payload, sizeof (id));
+	}
+
+      switch (rec->kind)
+	{
+	case JOURNAL_SQL:
+	  {
+	    char *errmsg = NULL;
+	    sqlite3_exec (q->db, rec->payload, NULL, NULL, &errmsg);
+	    if (errmsg)
+	      {
+		ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+			       rec->payload, errmsg);
+		sqlite3_free (errmsg);
+	      }
+	    count ++;
+	    break;
+	  }
+
+	case JOURNAL_TEMPLATE:
+	  {
+	    struct replay_template *t = calloc (1, sizeof (*t));
+	    t->types = rec->payload + sizeof (id);
+	    const char *sql = t->types + strlen (t->types) + 1;
+	    if (sqlite3_prepare_v2 (q->db, sql, -1, &t->stmt, NULL)
+		!= SQLITE_OK)
+	      {
+		ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+			       sql, sqlite3_errmsg (q->db));
+		if (t->stmt)
+		  sqlite3_finalize (t->stmt);
+		t->stmt = NULL;
+	      }
+	    g_hash_table_insert (templates, GUINT_TO_POINTER (id), t);
+	    break;
+	  }
+
+	case JOURNAL_RECORD:
+	  {
+	    struct replay_template *t
+	      = g_hash_table_lookup (templates, GUINT_TO_POINTER (id));
+	    if (! t || ! t->stmt)
+	      break;
+
+	    bind_record (t->stmt, t->types, rec->payload + sizeof (id));
+	    int err = sqlite3_step (t->stmt);
+	    if (err != SQLITE_DONE && err != SQLITE_ROW)
+	      ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+			     sqlite3_sql (t->stmt), sqlite3_errmsg (q->db));
+	    sqlite3_reset (t->stmt);
+	    sqlite3_clear_bindings (t->stmt);
+	    count ++;
+	    break;
+	  }
 	}
     }
+
+  g_hash_table_destroy (templates);
+
+  return count;
+}
+
+/* Replay the journal in the file FD, which has a size of SIZE.
+   Returns the largest sequence number found.  */
+static uint64_t
+journal_replay (struct sqlq *q, const char *filename, int fd, size_t size)
+{
+  if (size < JOURNAL_HEADER_SIZE)
+    return 0;
+
+  char *map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      debug (0, "mmap (%s): %m", filename);
+      return 0;
+    }
+
+  uint64_t max_seq = 0;
+  struct journal_header *h = (void *) map;
+  if (memcmp (h->magic, JOURNAL_MAGIC, sizeof (h->magic)) != 0
+      || h->regions > 2
+      || h->region_size < sizeof (uint64_t)
+      || JOURNAL_HEADER_SIZE + (size_t) h->regions * h->region_size > size)
+    {
+      debug (0, "%s: Not a journal or corrupted, ignoring.", filename);
+      munmap (map, size);
+      return 0;
+    }
+
+  /* Replay the regions in order.  */
+  int order[2] = { 0, 1 };
+  uint64_t seq[2] = { 0, 0 };
+  int r;
+  for (r = 0; r < h->regions; r ++)
+    seq[r] = *journal_region (map, h->region_size, r);
+  if (h->regions == 2 && seq[1] < seq[0])
+    {
+      order[0] = 1;
+      order[1] = 0;
+    }
+
+  char *errmsg = NULL;
+  sqlite3_exec (q->db, "begin transaction", NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+		     "begin transaction", errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+
+  int count = 0;
+  int i;
+  for (i = 0; i < h->regions; i ++)
+    {
+      r = order[i];
+      max_seq = MAX (max_seq, seq[r]);
+      count += journal_replay_region
+	(q, (char *) journal_region (map, h->region_size, r)
+	 + sizeof (uint64_t),
+	 h->region_size - sizeof (uint64_t), seq[r]);
+    }
+
+  sqlite3_exec (q->db, "end transaction", NULL, NULL, &errmsg);
+  if (errmsg)
+    {
+      ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+		     "end transaction", errmsg);
+      sqlite3_free (errmsg);
+      errmsg = NULL;
+    }
+
+  if (count)
+    debug (0, "Replayed %d statements from %s.", count, filename);
+
+  munmap (map, size);
+  return max_seq;
+}
+
+bool
+sqlq_journal_enable (struct sqlq *q, const char *filename)
+{
+  assert (! q->journal);
+  assert (! q->async);
+  assert (q->used == 0);
+
+  int fd = open (filename, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+    {
+      debug (0, "open (%s): %m", filename);
+      return false;
+    }
+
+  struct stat st;
+  if (fstat (fd, &st) < 0)
+    {
+      debug (0, "stat (%s): %m", filename);
+      close (fd);
+      return false;
+    }
+
+  uint64_t max_seq = journal_replay (q, filename, fd, st.st_size);
+
+  /* A record is smaller than the corresponding statement, except for
+     a template's definition, which is written once per region.  */
+  int region_size = JOURNAL_ALIGN (2 * q->size + 4096);
+  size_t map_size = JOURNAL_HEADER_SIZE + 2 * (size_t) region_size;
+  if (ftruncate (fd, map_size) < 0)
+    {
+      debug (0, "ftruncate (%s): %m", filename);
+      close (fd);
+      return false;
+    }
+
+  char *map = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+  if (map == MAP_FAILED)
+    {
+      debug (0, "mmap (%s): %m", filename);
+      close (fd);
+      return false;
+    }
+
+  struct sqlq_journal *j = calloc (1, sizeof (*j));
+  j->filename = strdup (filename);
+  j->fd = fd;
+  j->map = map;
+  j->map_size = map_size;
+  j->region_size = region_size;
+  j->next_seq = max_seq + 1;
+
+  journal_reset (j, 0);
+  journal_reset (j, 1);
+
+  struct journal_header *h = (void *) map;
+  memcpy (h->magic, JOURNAL_MAGIC, sizeof (h->magic));
+  h->region_size = region_size;
+  h->regions = 2;
+
+  q->journal = j;
+  return true;
+}
+
+struct sqlq_async
+{
+  /* The writer's connection.  */
+  sqlite3 *db;
+  pthread_t writer;
+  /* The number of milliseconds to wait for the writer if both
+     buffers are full.  */
+  int max_wait;
+
+  /* The second buffer (allocated using malloc).  */
+  char *extra;
+
+  /* LOCK protects the following fields.  COND is signalled when
+     PENDING is set, when the writer finishes a buffer and when STOP
+     is set.  */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* The buffer that the writer is committing, if any.  */
+  char *pending;
+  int pending_len;
+  /* A statement that did not fit in any buffer, which is executed
+     after PENDING (allocated using malloc).  */
+  struct statement *pending_hanging;
+  /* The buffer to use on the next swap (NULL while the writer is
+     busy).  */
+  char *spare;
+  /* The number of buffers handed to and committed by the writer.  */
+  unsigned long submitted;
+  unsigned long committed;
+  bool stop;
+
+  unsigned long dropped;
+};
+
+static void *
+async_writer (void *arg)
+{
+  struct sqlq *q = arg;
+  struct sqlq_async *a = q->async;
+
+  pthread_mutex_lock (&a->lock);
+  for (;;)
+    {
+      while (! a->pending && ! a->stop)
+	pthread_cond_wait (&a->cond, &a->lock);
+      if (! a->pending)
+	break;
+
+      char *buffer = a->pending;
+      int len = a->pending_len;
+      struct statement *hanging = a->pending_hanging;
+      pthread_mutex_unlock (&a->lock);
+
+      uint64_t start = now_us ();
+      int rows = 0;
+
+      char *errmsg = NULL;
+      sqlite3_exec (a->db, "begin transaction", NULL, NULL, &errmsg);
+      if (errmsg)
+	{
+	  /* Execute the statements anyway: it is slower, but nothing
+	     is lost.  */
+	  ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+			 "begin transaction", errmsg);
+	  sqlite3_free (errmsg);
+	  errmsg = NULL;
+	}
+
+      rows += execute_block (a->db, q->error_handler, buffer, len);
+      if (hanging)
+	{
+	  execute (a->db, q->error_handler, hanging);
+	  rows ++;
+	  len += hanging->len;
+	}
+
+      sqlite3_exec (a->db, "end transaction", NULL, NULL, &errmsg);
+      if (errmsg)
+	{
+	  ERROR_HANDLER (q->error_handler, NULL, NULL, 0,
+			 "end transaction", errmsg);
+	  sqlite3_free (errmsg);
+	  errmsg = NULL;
+	}
+      else if (q->journal)
+	/* The producer doesn't use this buffer's region until we
+	   return the buffer.  */
+	journal_reset (q->journal, buffer == q->storage ? 0 : 1);
+
+      free (hanging);
+
+      pthread_mutex_lock (&a->lock);
+      record_commit (q, rows, len, start);
+      a->spare = buffer;
+      a->pending = NULL;
+      a->pending_hanging = NULL;
+      a->committed ++;
+      pthread_cond_broadcast (&a->cond);
+    }
+  pthread_mutex_unlock (&a->lock);
+
+  return NULL;
+}
+
+/* Hand Q's buffer and HANGING to the writer and switch to the spare
+   buffer.  If WAIT is true, wait until they have been committed.
+   Otherwise, if the writer is still busy with the previous buffer,
+   wait at most A->MAX_WAIT milliseconds for it.  Returns false if the
+   buffers could not be swapped.  */
+static bool
+async_flush (struct sqlq *q, struct statement *hanging, bool wait)
+{
+  struct sqlq_async *a = q->async;
+
+  if (q->used == 0 && ! hanging && ! wait)
+    return true;
+
+  pthread_mutex_lock (&a->lock);
+
+  if (a->pending && ! wait)
+    /* Both buffers are full.  Apply some back pressure.  */
+    {
+      struct timespec ts;
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_sec += a->max_wait / 1000;
+      ts.tv_nsec += (a->max_wait % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000)
+	{
+	  ts.tv_sec ++;
+	  ts.tv_nsec -= 1000000000;
+	}
+
+      while (a->pending)
+	if (pthread_cond_timedwait (&a->cond, &a->lock, &ts) == ETIMEDOUT)
+	  break;
+    }
+  else
+    while (a->pending)
+      pthread_cond_wait (&a->cond, &a->lock);
+
+  if (a->pending)
+    /* The writer is still busy.  */
+    {
+      if (hanging)
+	a->dropped ++;
+      pthread_mutex_unlock (&a->lock);
+
+      if (hanging)
+	/* Report it now (the error handler may append to Q, so not
+	   while holding the lock).  It was not journaled (see
+	   sqlq_append), so it won't be replayed either.  */
+	ERROR_HANDLER (q->error_handler,
+		       hanging->file, hanging->func, hanging->line,
+		       hanging->template
+		       ? hanging->template->sql : hanging->sql,
+		       "Writer busy, dropping statement");
+      return false;
+    }
+
+  if (q->used || hanging)
+    {
+      if (hanging && q->journal)
+	/* The writer resets this buffer's region once the statement
+	   has been committed.  */
+	journal_append (q, hanging);
+
+      a->pending = q->buffer;
+      a->pending_len = q->used;
+      if (hanging)
+	{
+	  a->pending_hanging = malloc (hanging->len);
+	  memcpy (a->pending_hanging, hanging, hanging->len);
+	}
+
+      q->buffer = a->spare;
+      a->spare = NULL;
+      q->used = 0;
+
+      a->submitted ++;
+      pthread_cond_broadcast (&a->cond);
+    }
+
+  if (wait)
+    {
+      unsigned long target = a->submitted;
+      while ((long) (a->committed - target) < 0)
+	pthread_cond_wait (&a->cond, &a->lock);
+    }
+
+  pthread_mutex_unlock (&a->lock);
+
+  return true;
+}
+
+bool
+sqlq_async_enable (struct sqlq *q, sqlite3 *writer_db, int max_wait)
+{
+  assert (! q->async);
+
+  /* Flush anything that is buffered: all statements must be
+     executed by the same connection.  */
+  flush (q, NULL);
+
+  struct sqlq_async *a = calloc (1, sizeof (*a));
+  a->db = writer_db;
+  a->max_wait = max_wait;
+  a->extra = malloc (q->size);
+  a->spare = a->extra;
+  pthread_mutex_init (&a->lock, NULL);
+  pthread_cond_init (&a->cond, NULL);
+
+  /* Any statements prepared on the old connection can't be used by
+     the writer.  */
+  struct sqlq_template *t;
+  for (t = q->templates; t; t = t->next)
+    if (t->stmt)
+      {
+	sqlite3_finalize (t->stmt);
+	t->stmt = NULL;
+      }
+
+  q->async = a;
+  int err = pthread_create (&a->writer, NULL, async_writer, q);
+  if (err)
+    {
+      debug (0, "Failed to create writer thread: %s", strerror (err));
+      q->async = NULL;
+      pthread_mutex_destroy (&a->lock);
+      pthread_cond_destroy (&a->cond);
+      free (a->extra);
+      free (a);
+      return false;
+    }
+
+  return true;
+}
+
+unsigned long
+sqlq_async_dropped (struct sqlq *q)
+{
+  if (! q->async)
+    return 0;
+
+  pthread_mutex_lock (&q->async->lock);
+  unsigned long dropped = q->async->dropped;
+  pthread_mutex_unlock (&q->async->lock);
+
+  return dropped;
+}
+
+/* Stop Q's writer thread (after it has committed any buffer that it
+   is working on) and close its connection.  */
+static void
+async_stop (struct sqlq *q)
+{
+  struct sqlq_async *a = q->async;
+
+  pthread_mutex_lock (&a->lock);
+  a->stop = true;
+  pthread_cond_broadcast (&a->cond);
+  pthread_mutex_unlock (&a->lock);
+
+  pthread_join (a->writer, NULL);
+
+  /* The templates' statements were prepared on the writer's
+     connection.  */
+  templates_free (q->templates);
+  q->templates = NULL;
+  sqlite3_close (a->db);
+
+  /* Copy any unflushed data back to the primary buffer so that
+     sqlq_free can report it.  */
+  if (q->buffer != q->storage)
+    memcpy (q->storage, q->buffer, q->used);
+  q->buffer = q->storage;
+
+  pthread_mutex_destroy (&a->lock);
+  pthread_cond_destroy (&a->cond);
+  free (a->extra);
+  free (a);
+  q->async = NULL;
+}
+
+struct sqlq_adaptive
+{
+  /* The bounds for the flush delay (in seconds).  */
+  int min_delay;
+  int max_delay;
+  bool on_battery;
+
+  /* When the buffer was last flushed (see now_us).  */
+  uint64_t last_flush;
+  /* Exponentially weighted moving averages of the append rate (in
+     bytes per second) and of the time a commit takes (in
+     microseconds).  */
+  double rate;
+  double latency;
+  /* The number of commits and the total commit time that we have
+     already accounted for.  */
+  uint64_t commits;
+  uint64_t commit_time;
+};
+
+/* Update an exponentially weighted moving average.  */
+static double
+ewma (double average, double sample)
+{
+  if (average == 0)
+    return sample;
+  return (3 * average + sample) / 4;
+}
+
+/* The fraction of the time that we are willing to spend committing
+   (in percent).  */
+#define SQLQ_COMMIT_BUDGET 2
+
+/* Adjust Q's limit and flush delay after flushing BYTES bytes.  */
+static void
+adapt (struct sqlq *q, int bytes)
+{
+  struct sqlq_adaptive *p = q->adaptive;
+
+  uint64_t n = now_us ();
+  if (p->last_flush && n > p->last_flush)
+    p->rate = ewma (p->rate, (double) bytes * 1000000 / (n - p->last_flush));
+  p->last_flush = n;
+
+  /* In asynchronous mode, the writer may not yet have committed
+     BYTES; we'll account for that commit next time.  */
+  struct sqlq_stats stats;
+  sqlq_stats_get (q, &stats);
+  if (stats.commits > p->commits)
+    p->latency = ewma (p->latency,
+		       (double) (stats.commit_time - p->commit_time)
+		       / (stats.commits - p->commits));
+  p->commits = stats.commits;
+  p->commit_time = stats.commit_time;
+
+  /* Choose the delay so that committing takes at most
+     SQLQ_COMMIT_BUDGET percent of the time.  */
+  double delay = p->latency * (100 / SQLQ_COMMIT_BUDGET) / 1000000;
+  delay = MAX (delay, p->min_delay);
+  if (p->on_battery)
+    /* Fewer commits mean fewer disk wake ups.  */
+    delay *= 4;
+  delay = MIN (delay, p->max_delay);
+
+  /* Use enough of the buffer to hold one and a half delays' worth of
+     data so that flushes are normally triggered by the timer.  If
+     the buffer is too small for that, flush more often.  */
+  double limit = p->rate * delay * 3 / 2;
+  if (limit > q->size)
+    {
+      limit = q->size;
+      if (p->rate > 0)
+	delay = MAX ((double) q->size * 2 / 3 / p->rate, p->min_delay);
+    }
+  q->limit = MAX (limit, MIN (4096, q->size));
+
+  int flush_delay = MAX ((int) (delay + 0.5), 1);
+  if (flush_delay != q->flush_delay)
+    debug (4, "Flush delay: %d -> %d s (%.0f bytes/s, %.1f ms/commit%s); "
+	   "limit: %d bytes",
+	   q->flush_delay, flush_delay, p->rate, p->latency / 1000,
+	   p->on_battery ? ", on battery" : "", q->limit);
+  q->flush_delay = flush_delay;
+}
+
+void
+sqlq_adaptive_enable (struct sqlq *q, int min_delay, int max_delay)
+{
+  if (! q->adaptive)
+    q->adaptive = calloc (1, sizeof (*q->adaptive));
+
+  q->adaptive->min_delay = MAX (min_delay, 1);
+  q->adaptive->max_delay = MAX (max_delay, q->adaptive->min_delay);
+  q->adaptive->last_flush = now_us ();
+}
+
+void
+sqlq_adaptive_on_battery (struct sqlq *q, bool on_battery)
+{
+  if (q->adaptive)
+    q->adaptive->on_battery = on_battery;
+}
+
+void
+sqlq_stats_get (struct sqlq *q, struct sqlq_stats *stats)
+{
+  if (q->async)
+    pthread_mutex_lock (&q->async->lock);
+
+  *stats = q->stats;
+  if (q->async)
+    stats->dropped = q->async->dropped;
+  if (q->journal)
+    stats->journal_overflows = q->journal->overflows;
+
+  if (q->async)
+    pthread_mutex_unlock (&q->async->lock);
+}
+
+/* Flush Q (executing the statement HANGING, which did not fit in the
+   buffer, after the buffered statements).  In asynchronous mode, WAIT
+   indicates whether to wait until the data has been committed.
+   DELAYED indicates whether the flush delay expired.  */
+static void
+flush_now (struct sqlq *q, struct statement *hanging, bool wait,
+	   bool delayed)
+{
+  int bytes = q->used + (hanging ? hanging->len : 0);
+  if (bytes == 0 && ! wait)
+    return;
+
+  bool flushed;
+  if (q->async)
+    flushed = async_flush (q, hanging, wait);
+  else
+    flushed = flush (q, hanging);
+
+  if (q->flush_source)
+    {
+      g_source_remove (q->flush_source);
+      q->flush_source = 0;
+    }
+
+  if (bytes == 0 || ! flushed)
+    /* Nothing was flushed (the writer was still busy with the
+       previous batch or the transaction failed).  Don't count it.  */
+    return;
+
+  if (q->async)
+    pthread_mutex_lock (&q->async->lock);
+  if (delayed)
+    q->stats.delayed_flushes ++;
+  else
+    q->stats.forced_flushes ++;
+  if (q->async)
+    pthread_mutex_unlock (&q->async->lock);
+
+  if (q->adaptive)
+    adapt (q, bytes);
+}
+
+static gboolean do_delayed_flush (gpointer user_data);
+
+/* Flush Q if FORCE_FLUSH is true or arrange for a delayed flush.  See
+   flush_now for HANGING and WAIT.  */
+static bool
+finish (struct sqlq *q, struct statement *hanging, bool force_flush,
+	bool wait)
+{
+  if (force_flush)
+    /* Flush the pending commands: either the user explicitly
+       requested it, or we are out of space in our buffer.  */
+    flush_now (q, hanging, wait, false);
+  else
+    assert (! hanging);
+
+  if (q->used && ! q->flush_source)
+    /* Wait at most Q->FLUSH_DELAY seconds before flushing.  (In
+       asynchronous mode, this happens if the writer was busy.)  */
+    q->flush_source = g_timeout_add_seconds (q->flush_delay,
+					     do_delayed_flush, q);
+
+  return q->used != 0;
 }
 
 static gboolean
@@ -228,75 +1481,123 @@ do_delayed_flush (gpointer user_data)
 
   debug (5, "Delayed flush (have %d bytes)", q->used);
 
-  sqlq_flush (q);
+  /* Don't wait for the data to be committed.  */
+  flush_now (q, NULL, false, true);
+
+  /* If the writer was busy, try again later.  */
+  finish (q, NULL, false, false);
 
   return false;
 }
 
+/* Reserve S_LEN bytes in Q's buffer for a statement.  Returns NULL if
+   there is not enough space, in which case the caller must allocate
+   the statement on its stack and pass it to finish.  Sets
+   *FORCE_FLUSH if Q should be flushed.  */
+static struct statement *
+reserve (struct sqlq *q, int s_len, bool *force_flush)
+{
+  int free_space = q->size - q->used;
+  if (s_len > free_space)
+    {
+      *force_flush = true;
+      return NULL;
+    }
+
+  struct statement *s = (struct statement *) &q->buffer[q->used];
+  q->used += s_len;
+  free_space -= s_len;
+
+  if (q->used >= q->limit)
+    /* The adaptive policy wants a flush.  */
+    *force_flush = true;
+  if (free_space < sizeof (*s) + 30)
+    /* There is unlikely to be enough space for another command.
+       Flush now to avoid allocating on the stack later.  */
+    *force_flush = true;
+
+  return s;
+}
+
 bool
 sqlq_append (const char *file, const char *func, int line,
 	     struct sqlq *q, bool force_flush, const char *sql)
 {
   if (q->flush_delay == 0)
     force_flush = true;
+  /* Only wait for an explicit flush, not one due to a lack of
+     space.  */
+  bool wait = force_flush;
 
   /* Append the command.  */
-  struct statement *s = NULL;
+  struct statement *hanging = NULL;
   if (sql)
     {
-      int free_space = q->size - q->used;
-
-      struct statement *s = NULL;
       int sql_len = strlen (sql) + 1;
-      int s_len = alignment_fixup ((uintptr_t) sizeof (*s) + sql_len);
+      int s_len = alignment_fixup ((uintptr_t) sizeof (struct statement)
+				   + sql_len);
 
-      if (s_len <= free_space)
-	{
-	  s = (struct statement *) &q->buffer[q->used];
-	  q->used += s_len;
-	  free_space -= s_len;
-
-	  if (free_space < sizeof (*s) + 30)
-	    /* There is unlikely to be enough space for another
-	       command.  Flush now to avoid allocating on the stack
-	       later.  */
-	    force_flush = true;
-	}
-      else
-	{
-	  s = alloca (s_len);
-	  force_flush = true;
-	}
+      struct statement *s = reserve (q, s_len, &force_flush);
+      if (! s)
+	hanging = s = alloca (s_len);
 
       s->file = file;
       s->func = func;
       s->line = line;
+      s->len = s_len;
+      s->template = NULL;
       memcpy (s->sql, sql, sql_len);
+
+      /* A statement that doesn't fit in the buffer may still be
+	 dropped: it is journaled when it is handed to the writer (see
+	 flush and async_flush).  */
+      if (q->journal && ! hanging && ! journal_append (q, s))
+	force_flush = true;
     }
 
-  if (force_flush)
-    /* Flush the pending commands: either the user explicitly
-       requested it, or we are out of space in our buffer.  */
-    {
-      flush (q, s);
+  return finish (q, hanging, force_flush, wait);
+}
 
-      if (q->flush_source)
-	{
-	  g_source_remove (q->flush_source);
-	  q->flush_source = 0;
-	}
-    }
-  else
-    {
-      assert (! s);
+bool
+sqlq_append_record (const char *file, const char *func, int line,
+		    struct sqlq *q, bool force_flush,
+		    struct sqlq_template *t, ...)
+{
+  if (q->flush_delay == 0)
+    force_flush = true;
+  bool wait = force_flush;
 
-      if (! q->flush_source)
-	/* Wait at most Q->FLUSH_DELAY seconds before flushing.  */
-	q->flush_source = g_timeout_add_seconds (q->flush_delay,
-						 do_delayed_flush, q);
-    }
+  va_list ap;
 
-  return q->used != 0;
+  /* Determine the size of the encoded parameters.  */
+  va_start (ap, t);
+  int data_len = record_len (t, ap);
+  va_end (ap);
+
+  int s_len = alignment_fixup ((uintptr_t) sizeof (struct statement)
+			       + data_len);
+
+  struct statement *hanging = NULL;
+  struct statement *s = reserve (q, s_len, &force_flush);
+  if (! s)
+    hanging = s = alloca (s_len);
+
+  s->file = file;
+  s->func = func;
+  s->line = line;
+  s->len = s_len;
+  s->template = t;
+
+  /* Encode them.  */
+  va_start (ap, t);
+  record_encode (t, s->sql, ap);
+  va_end (ap);
+
+  /* See sqlq_append.  */
+  if (q->journal && ! hanging && ! journal_append (q, s))
+    force_flush = true;
+
+  return finish (q, hanging, force_flush, wait);
 }
 
 bool
@@ -328,6 +1629,10 @@ sqlq_flush (struct sqlq *q)
 void
 sqlq_flush_delay_set (struct sqlq *q, int flush_delay)
 {
+  free (q->adaptive);
+  q->adaptive = NULL;
+  q->limit = q->size;
+
   if (q->flush_delay == flush_delay)
     return;
 
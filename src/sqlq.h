@@ -20,21 +20,66 @@
 
 #include <sqlite3.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef void (*sqlq_error_handler_t) (const char *file, const char *func,
 				      int line, const char *sql,
 				      const char *error_message);
 
+struct sqlq_template;
+
+struct sqlq_stats
+{
+  /* The number of transactions committed.  */
+  uint64_t commits;
+  /* The number of commands and records executed.  */
+  uint64_t rows;
+  /* The number of bytes that the executed commands and records
+     occupied in the buffer.  */
+  uint64_t bytes;
+  /* The total time spent committing, in microseconds.  */
+  uint64_t commit_time;
+  /* The number of flushes that were requested explicitly or that
+     were due to a lack of space.  */
+  uint64_t forced_flushes;
+  /* The number of flushes due to the flush delay expiring.  */
+  uint64_t delayed_flushes;
+  /* The number of commands that were dropped (only in asynchronous
+     mode).  */
+  uint64_t dropped;
+  /* The number of commands that did not fit in the journal.  */
+  uint64_t journal_overflows;
+};
+
 struct sqlq
 {
   sqlite3 *db;
   int used;
   int size;
+  /* Flush once USED reaches LIMIT.  Normally, this is SIZE, but the
+     adaptive policy may lower it.  */
+  int limit;
   bool malloced;
   int flush_delay;
   int flush_source;
   sqlq_error_handler_t error_handler;
-  char buffer[0];
+  /* List of templates registered using sqlq_template_new.  */
+  struct sqlq_template *templates;
+  /* Set if the queue is flushed by a writer thread (see
+     sqlq_async_enable).  */
+  struct sqlq_async *async;
+  /* Set if the buffer's limit and flush delay are adjusted
+     automatically (see sqlq_adaptive_enable).  */
+  struct sqlq_adaptive *adaptive;
+  /* Set if commands are journaled (see sqlq_journal_enable).  */
+  struct sqlq_journal *journal;
+  /* Updated by whoever commits; see sqlq_stats_get.  */
+  struct sqlq_stats stats;
+  /* The buffer to which commands are appended.  Normally, this is
+     STORAGE.  In asynchronous mode, it alternates between STORAGE and
+     a second buffer of the same size.  */
+  char *buffer;
+  char storage[0];
 };
 
 /* Allocate a new SQL command queue with a size of SIZE.  FLUSH_DELAY
@@ -83,10 +128,104 @@ extern bool sqlq_append_printf (const char *file, const char *func, int line,
   sqlq_append_printf(__FILE__, __func__, __LINE__,			\
 		     _sa_sqlq, _sa_force_flush, _sa_command, ##__VA_ARGS__)
 
+/* Register the SQL statement SQL with the queue Q.  SQL must consist
+   of a single statement.  It is parameterized using '?'.  TYPES is a
+   string with one character per parameter describing the parameter's
+   type:
+
+     'i': int
+     'l': int64_t
+     's': const char * (NULL is bound as an SQL NULL)
+
+   The statement is prepared once (on the first flush that needs it)
+   and is reused thereafter.  The template is owned by Q and is
+   released when Q is freed.  */
+extern struct sqlq_template *sqlq_template_new (struct sqlq *q,
+						const char *sql,
+						const char *types);
+
+/* Append a record to the queue, i.e., an invocation of the template
+   TEMPLATE.  The parameters follow TEMPLATE and must match its TYPES.
+   They are copied into the queue.  When the queue is flushed, the
+   parameters are bound to the template's prepared statement, which is
+   then executed.  Unlike sqlq_append_printf, no SQL is formatted or
+   parsed per record.  Commands and records are executed in the order
+   they were appended.  May flush the queue if there is not enough
+   space.  If FORCE_FLUSH is true, always flushes the queue.  Returns
+   true if there is buffered data, false otherwise.
+
+   NOTE: You do not need to specify the FILE, FUNC AND LINE arguments,
+   this will be filled in automatically via macro expansion to the
+   correspond to the call site.  */
+extern bool sqlq_append_record (const char *file, const char *func, int line,
+				struct sqlq *sqlq, bool force_flush,
+				struct sqlq_template *template, ...);
+
+#define sqlq_append_record(_sa_sqlq, _sa_force_flush, _sa_template, ...) \
+  sqlq_append_record(__FILE__, __func__, __LINE__,			\
+		     _sa_sqlq, _sa_force_flush, _sa_template, ##__VA_ARGS__)
+
 /* Flushes the sql command queue.  */
 extern void sqlq_flush (struct sqlq *sqlq);
 
-/* Set the queue's flush delay to FLUSH_DELAY.  */
+/* Set the queue's flush delay to FLUSH_DELAY.  This disables the
+   adaptive policy, if enabled.  */
 extern void sqlq_flush_delay_set (struct sqlq *q, int flush_delay);
 
+/* Adjust Q's flush delay and the amount of its buffer that is used
+   based on the observed append rate and commit latency.  The flush
+   delay is chosen so that committing takes a small fraction of the
+   time, but lies between MIN_DELAY and MAX_DELAY seconds.  The buffer
+   is flushed once it holds about one and a half delays' worth of
+   data, or earlier if the buffer is too small (in which case the
+   delay is shortened).  */
+extern void sqlq_adaptive_enable (struct sqlq *q, int min_delay,
+				  int max_delay);
+
+/* Indicate whether the system is running on battery.  If so, the
+   adaptive policy trades latency for fewer commits (and thus fewer
+   disk wake ups) by using flush delays that are four times as long
+   (but at most the maximum delay).  */
+extern void sqlq_adaptive_on_battery (struct sqlq *q, bool on_battery);
+
+/* Return Q's statistics in *STATS.  */
+extern void sqlq_stats_get (struct sqlq *q, struct sqlq_stats *stats);
+
+/* Write each command appended to Q to the journal FILENAME before
+   returning to the caller.  The journal is a memory-mapped file, so a
+   command survives the process dying even if it was not yet committed
+   (but not a power failure).  Once the buffer is committed, the
+   corresponding journal entries are discarded.  If FILENAME exists,
+   any entries in it are first executed (in a single transaction) on
+   Q's database.  Thus, commits can be infrequent without risking data
+   loss.  Must be called before appending anything to Q and before
+   sqlq_async_enable.  If a command does not fit in the journal (the
+   journal is about twice the size of the buffer), Q is flushed.
+   Returns false if the journal could not be set up.  */
+extern bool sqlq_journal_enable (struct sqlq *q, const char *filename);
+
+/* Have a dedicated writer thread flush the queue Q.  This uses double
+   buffering: when Q's buffer needs to be flushed, it is handed to the
+   writer, which commits it using WRITER_DB, and appends continue in a
+   second buffer.  Thus, appending and delayed flushes don't block on
+   the database.  Q takes ownership of WRITER_DB, which must be a
+   separate connection to Q's database (with any custom functions that
+   the commands use); it is closed by sqlq_free.  Explicit flushes
+   (FORCE_FLUSH or sqlq_flush) still wait until the data has been
+   committed.
+
+   If both buffers are full, i.e., the writer is still committing the
+   previous buffer, the appender waits up to MAX_WAIT milliseconds for
+   the writer.  If the writer is still busy, the command is dropped:
+   it is reported to the error handler, counted (see
+   sqlq_async_dropped) and not journaled.  Returns false if the writer
+   thread could not be started, in which case Q remains
+   synchronous.  */
+extern bool sqlq_async_enable (struct sqlq *q, sqlite3 *writer_db,
+			       int max_wait);
+
+/* The number of commands that were dropped because both buffers were
+   full.  */
+extern unsigned long sqlq_async_dropped (struct sqlq *q);
+
 #endif
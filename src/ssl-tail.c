@@ -20,36 +20,41 @@
 #include <sys/time.h>
 #include <error.h>
 #include <stdio.h>
+#include <string.h>
 #include <sqlite3.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
 
 #include "debug.h"
 #include "files.h"
 #include "util.h"
+#include "debug-ring.h"
 
 int
 main (int argc, char *argv[])
 {
   files_init ();
 
-  char *last = NULL;
-  int callback (void *cookie, int argc, char **argv, char **names)
+  /* The ROWID of the last row that we displayed.  */
+  sqlite3_int64 last = 0;
+  bool all = false;
+
+  void print (sqlite3_stmt *stmt)
   {
     int i = 0;
-    const char *ROWID = argv[i ++];
-    const char *timestamp = argv[i ++];
-    const char *tz = argv[i ++];
-    const char *function = argv[i ++];
-    // const char *file = argv[i ++];
+    last = sqlite3_column_int64 (stmt, i ++);
+    sqlite3_int64 timestamp = sqlite3_column_int64 (stmt, i ++);
+    int tz = sqlite3_column_int (stmt, i ++);
+    const char *function = (const char *) sqlite3_column_text (stmt, i ++);
+    // const char *file = (const char *) sqlite3_column_text (stmt, i ++);
     i ++;
-    const char *line = argv[i ++];
-    const char *return_address = argv[i ++];
-    const char *msg = argv[i ++];
-
-    free (last);
-    last = strdup (ROWID);
+    const char *line = (const char *) sqlite3_column_text (stmt, i ++);
+    const char *return_address
+      = (const char *) sqlite3_column_text (stmt, i ++);
+    const char *msg = (const char *) sqlite3_column_text (stmt, i ++);
 
-    time_t t = (atoll (timestamp) / 1000) + atoi (tz) * 60;
+    time_t t = (timestamp / 1000) + tz * 60;
     struct tm tm;
     gmtime_r (&t, &tm);
 
@@ -57,28 +62,39 @@ main (int argc, char *argv[])
 	    1900 + tm.tm_year, tm.tm_mon + 1, tm.tm_mday,
 	    tm.tm_hour, tm.tm_min, tm.tm_sec,
 	    function, line, return_address, msg);
-
-    return 0;
   }
 
-  bool first = true;
   char *filter = NULL;
   bool follow = false;
-  last = strdup ("(select max (ROWID) - 10 from log)");
   char *filename = files_logfile (DEBUG_OUTPUT_FILENAME);
   char *table = NULL;
+  const char *since = NULL;
+  const char *until = NULL;
+  const char *grep = NULL;
+  int context = 0;
+  int limit = 20;
 
   void usage (int status)
   {
     fprintf
       (stderr,
-       "%s [--all] [--follow] [--file=LOG_FILE] [--table=TABLE] [FILTER]\n"
+       "%s [--all] [--follow] [--since=TIME] [--until=TIME]\n"
+       "  [--grep=QUERY [--context=N] [--limit=N]]\n"
+       "  [--file=LOG_FILE] [--table=TABLE] [FILTER]\n"
        "Dumps entries in %s.\n\n"
        "Filter is an SQL expression on level, timestamp (MS in UTC),\n"
        "function, file or line.\n"
        "\n"
+       "--grep searches the messages, functions and files using the\n"
+       "full-text index and shows the LIMIT (default: 20) best matches,\n"
+       "best first, each with N rows of context.  QUERY uses sqlite's FTS5\n"
+       "syntax, e.g., 'wlan0 AND timeout' or 'connect*'.\n"
+       "\n"
+       "TIME is either a local time ('2011-06-01 14:30') or relative to\n"
+       "now ('-2 hours', '-30 minutes', '-1 day').\n"
+       "\n"
        "To see all entries in the last hour, run:\n"
-       "  %s --all 'timestamp / 1000 > strftime (\"%%s\", \"now\") - 60 * 60'\n"
+       "  %s --since='-1 hour'\n"
        "\n"
        "To see all entries since the last start, run:\n"
        "  %s --all 'ROWID >= (select max (ROWID) from log where message like \"smart-storage-logger compiled on %%\")'\n",
@@ -89,10 +105,7 @@ main (int argc, char *argv[])
   int i;
   for (i = 1; i < argc; i ++)
     if (strcmp (argv[i], "--all") == 0)
-      {
-	free (last);
-	last = strdup ("0");
-      }
+      all = true;
     else if (strcmp (argv[i], "-f") == 0
 	     || strcmp (argv[i], "--follow") == 0)
       follow = true;
@@ -107,6 +120,16 @@ main (int argc, char *argv[])
       }
     else if (strncmp (argv[i], "--table=", 8) == 0)
       table = strdup (&argv[i][8]);
+    else if (strncmp (argv[i], "--since=", 8) == 0)
+      since = &argv[i][8];
+    else if (strncmp (argv[i], "--until=", 8) == 0)
+      until = &argv[i][8];
+    else if (strncmp (argv[i], "--grep=", 7) == 0)
+      grep = &argv[i][7];
+    else if (strncmp (argv[i], "--context=", 10) == 0)
+      context = MAX (0, atoi (&argv[i][10]));
+    else if (strncmp (argv[i], "--limit=", 8) == 0)
+      limit = MAX (1, atoi (&argv[i][8]));
     else if (argv[i][0] == '-')
       {
 	fprintf (stderr, "Unknown option: '%s'\n", argv[i]);
@@ -118,6 +141,21 @@ main (int argc, char *argv[])
     else
       filter = argv[i];
 
+  if (follow && until)
+    {
+      fprintf (stderr, "--follow and --until are mutually exclusive.\n");
+      usage (1);
+    }
+
+  bool is_log = ! table || strcmp (table, "log") == 0;
+
+  if (grep && (follow || ! is_log))
+    {
+      fprintf (stderr, "--grep only works on the log table and "
+	       "can't be combined with --follow.\n");
+      usage (1);
+    }
+
   sqlite3 *db;
   int err = sqlite3_open (filename, &db);
   if (err)
@@ -126,38 +164,303 @@ main (int argc, char *argv[])
 
   sqlite3_busy_timeout (db, 60 * 60 * 1000);
 
-  do
+  sqlite3_stmt *prepare (const char *sql)
+  {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK)
+      error (1, 0, "%s\nSQL: %s", sqlite3_errmsg (db), sql);
+    return stmt;
+  }
+
+  /* The most recent messages may still be in the ring.  We convert
+     them using a separate connection so that DB notices the change
+     (see data_version below).  */
+  struct debug_ring *ring = NULL;
+  sqlite3 *ring_db = NULL;
+  if (is_log)
     {
-      if (! first)
-	/* We could use inotify, but this is far from performance
-	   critical.  */
-	sleep (1);
+      if (sqlite3_open (filename, &ring_db) != SQLITE_OK)
+	error (1, 0, "sqlite3_open (%s): %s",
+	       filename, sqlite3_errmsg (ring_db));
+      sqlite3_busy_timeout (ring_db, 60 * 60 * 1000);
+      debug_ring_table_create (ring_db);
+    }
 
+  /* Returns the number of messages converted.  */
+  int ring_convert (void)
+  {
+    if (! ring_db)
+      return 0;
+
+    if (! ring)
+      {
+	char *ring_filename = debug_ring_filename (filename);
+	if (access (ring_filename, F_OK) == 0)
+	  ring = debug_ring_open (ring_filename, false, 0);
+	free (ring_filename);
+	if (! ring)
+	  return 0;
+      }
+
+    if (debug_ring_pending (ring) == 0)
+      return 0;
+    return debug_ring_convert (ring, ring_db);
+  }
+  ring_convert ();
+
+  /* Convert a time specification to ms since the epoch.  */
+  sqlite3_int64 time_parse (const char *spec)
+  {
+    sqlite3_stmt *stmt;
+    if (spec[0] == '-' || spec[0] == '+')
+      stmt = prepare ("select strftime ('%s', 'now', ?1) * 1000;");
+    else if (strcmp (spec, "now") == 0)
+      stmt = prepare ("select strftime ('%s', 'now') * 1000;");
+    else
+      stmt = prepare ("select strftime ('%s', ?1, 'utc') * 1000;");
+    sqlite3_bind_text (stmt, 1, spec, -1, SQLITE_STATIC);
+
+    if (sqlite3_step (stmt) != SQLITE_ROW
+	|| sqlite3_column_type (stmt, 0) == SQLITE_NULL)
+      error (1, 0, "Can't parse the time '%s'.", spec);
+    sqlite3_int64 t = sqlite3_column_int64 (stmt, 0);
+    sqlite3_finalize (stmt);
+    return t;
+  }
+  sqlite3_int64 since_ms = since ? time_parse (since) : 0;
+  sqlite3_int64 until_ms = until ? time_parse (until) : 0;
+
+  /* Return the result of SQL, which returns a single integer, or
+     DEFAULT_VALUE if it returns NULL.  */
+  sqlite3_int64 query_int (const char *sql, sqlite3_int64 default_value)
+  {
+    sqlite3_stmt *stmt = prepare (sql);
+    sqlite3_bind_int64 (stmt, 1, since_ms);
+
+    sqlite3_int64 value = default_value;
+    if (sqlite3_step (stmt) == SQLITE_ROW
+	&& sqlite3_column_type (stmt, 0) != SQLITE_NULL)
+      value = sqlite3_column_int64 (stmt, 0);
+    sqlite3_finalize (stmt);
+    return value;
+  }
+
+  if (grep)
+    /* Find the best matches using the full-text index and then show
+       each with its context.  */
+    {
+      /* LOG_FTS also has message, function and file columns.  Only
+	 expose its row id and rank so that FILTER's column names
+	 refer to LOG.  */
       char *sql = sqlite3_mprintf
-	("select ROWID, timestamp, tz, function, file, line,"
-	 " return_address, message from %s"
-	 " where (ROWID > %s) %s %s %s"
-	 " order by ROWID;",
-	 table ?: "log",
-	 last,
+	("select log.ROWID from log join"
+	 " (select rowid as fts_rowid,"
+	 /* Matches in the message are worth more than matches in the
+	    function name, which are worth more than matches in the
+	    file name.  */
+	 "   bm25 (log_fts, 4.0, 2.0, 1.0) as fts_rank"
+	 "  from log_fts where log_fts match ?1)"
+	 " on log.ROWID = fts_rowid"
+	 " where 1 %s %s %s %s %s"
+	 " order by fts_rank"
+	 " limit ?4;",
+	 since ? "and timestamp >= ?2" : "",
+	 until ? "and timestamp < ?3" : "",
 	 filter ? "and (" : "",
 	 filter ?: "",
 	 filter ? ")" : "");
+      sqlite3_stmt *matches = NULL;
+      if (sqlite3_prepare_v2 (db, sql, -1, &matches, NULL) != SQLITE_OK)
+	error (1, 0, "%s%s",
+	       sqlite3_errmsg (db),
+	       strstr (sqlite3_errmsg (db), "log_fts")
+	       ? " (sqlite does not support FTS5?)" : "");
+      sqlite3_free (sql);
 
-      char *errmsg = NULL;
-      sqlite3_exec (db, sql, callback, NULL, &errmsg);
-      if (errmsg)
+      sqlite3_bind_text (matches, 1, grep, -1, SQLITE_STATIC);
+      if (since)
+	sqlite3_bind_int64 (matches, 2, since_ms);
+      if (until)
+	sqlite3_bind_int64 (matches, 3, until_ms);
+      sqlite3_bind_int (matches, 4, limit);
+
+      sqlite3_stmt *rows = prepare
+	("select ROWID, timestamp, tz, function, file, line,"
+	 " return_address, message from log"
+	 " where ROWID between ?1 and ?2 order by ROWID;");
+
+      bool first = true;
+      while ((err = sqlite3_step (matches)) == SQLITE_ROW)
 	{
-	  fprintf (stderr, "%s\nSQL: %s\n", errmsg, sql);
-	  sqlite3_free (errmsg);
-	  errmsg = NULL;
-	  return 1;
+	  sqlite3_int64 match = sqlite3_column_int64 (matches, 0);
+
+	  if (context && ! first)
+	    printf ("--\n");
+	  first = false;
+
+	  sqlite3_bind_int64 (rows, 1, match - context);
+	  sqlite3_bind_int64 (rows, 2, match + context);
+	  while (sqlite3_step (rows) == SQLITE_ROW)
+	    {
+	      if (context)
+		/* Mark the match.  */
+		fputs (sqlite3_column_int64 (rows, 0) == match ? "> " : "  ",
+		       stdout);
+	      print (rows);
+	    }
+	  sqlite3_reset (rows);
+	}
+      if (err != SQLITE_DONE)
+	error (1, 0, "Searching for '%s': %s", grep, sqlite3_errmsg (db));
+
+      return 0;
+    }
+
+  const char *tbl = table ?: "log";
+  char *sql;
+  if (since)
+    /* Start at the first message at or after SINCE.  Using the index
+       on timestamp, this doesn't require a scan.  */
+    {
+      sql = sqlite3_mprintf ("select min (ROWID) - 1 from %s"
+			     " where timestamp >= ?1;", tbl);
+      last = query_int (sql, -1);
+      if (last == -1)
+	/* There are no such messages (yet).  */
+	{
+	  sqlite3_free (sql);
+	  sql = sqlite3_mprintf ("select max (ROWID) from %s;", tbl);
+	  last = query_int (sql, 0);
 	}
       sqlite3_free (sql);
-      
-      first = false;
     }
-  while (follow);
+  else if (! all)
+    {
+      sql = sqlite3_mprintf ("select max (ROWID) - 10 from %s;", tbl);
+      last = query_int (sql, 0);
+      sqlite3_free (sql);
+    }
+
+  /* Each query continues from the last row displayed.  Because the
+     range on ROWID uses the primary key, the filter is only evaluated
+     on new rows.  */
+  sql = sqlite3_mprintf
+    ("select ROWID, timestamp, tz, function, file, line,"
+     " return_address, message from %s"
+     " where (ROWID > ?1) %s %s %s %s %s"
+     " order by ROWID;",
+     tbl,
+     since ? "and timestamp >= ?2" : "",
+     until ? "and timestamp < ?3" : "",
+     filter ? "and (" : "",
+     filter ?: "",
+     filter ? ")" : "");
+  sqlite3_stmt *stmt = prepare (sql);
+  if (since)
+    sqlite3_bind_int64 (stmt, 2, since_ms);
+  if (until)
+    sqlite3_bind_int64 (stmt, 3, until_ms);
+
+  void run (void)
+  {
+    sqlite3_bind_int64 (stmt, 1, last);
+
+    while ((err = sqlite3_step (stmt)) == SQLITE_ROW)
+      print (stmt);
+    if (err != SQLITE_DONE)
+      error (1, 0, "%s\nSQL: %s", sqlite3_errmsg (db), sql);
+
+    sqlite3_reset (stmt);
+    fflush (stdout);
+  }
+  run ();
+
+  if (! follow)
+    return 0;
+
+  /* pragma data_version changes when another connection commits a
+     change.  (It is not supported by older versions of sqlite.  In
+     that case, we query whenever the database's files change.)  */
+  sqlite3_stmt *version_stmt = NULL;
+  sqlite3_prepare_v2 (db, "pragma data_version;", -1, &version_stmt, NULL);
+  sqlite3_int64 data_version (void)
+  {
+    if (! version_stmt)
+      return -1;
+
+    sqlite3_int64 version = -1;
+    if (sqlite3_step (version_stmt) == SQLITE_ROW)
+      version = sqlite3_column_int64 (version_stmt, 0);
+    sqlite3_reset (version_stmt);
+    return version;
+  }
+  sqlite3_int64 version = data_version ();
+
+  /* Watch the database's directory for changes to the database and
+     its journal or write-ahead log.  */
+  char *dir = strdup (filename);
+  char *base = strrchr (dir, '/');
+  if (base)
+    *base ++ = 0;
+  else
+    {
+      base = dir;
+      dir = ".";
+    }
+
+  int fd = inotify_init1 (IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch (fd, dir, IN_MODIFY | IN_CREATE
+				   | IN_MOVED_TO | IN_CLOSE_WRITE) < 0)
+    {
+      fprintf (stderr, "Watching %s: %m.  Polling.\n", dir);
+      if (fd >= 0)
+	close (fd);
+      fd = -1;
+    }
+
+  for (;;)
+    {
+      bool changed = false;
+      if (fd < 0)
+	{
+	  sleep (1);
+	  changed = true;
+	}
+      else
+	{
+	  /* Writes to the ring (which is mapped) don't generate
+	     events.  If there is a ring, check it every second.  */
+	  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	  if (poll (&pfd, 1, ring_db ? 1000 : -1) > 0)
+	    {
+	      char buffer[4096]
+		__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	      ssize_t len = read (fd, buffer, sizeof (buffer));
+	      char *p;
+	      for (p = buffer; len > 0 && p < buffer + len; )
+		{
+		  struct inotify_event *event = (void *) p;
+		  if (event->len
+		      && strncmp (event->name, base, strlen (base)) == 0)
+		    changed = true;
+		  p += sizeof (*event) + event->len;
+		}
+	    }
+	}
+
+      if (ring_convert () > 0)
+	changed = true;
+
+      if (! changed)
+	continue;
+
+      sqlite3_int64 v = data_version ();
+      if (v != -1 && v == version)
+	continue;
+      version = v;
+
+      run ();
+    }
 
   return 0;
 }
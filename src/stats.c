@@ -0,0 +1,423 @@
+/* stats.c - Latency statistics.
+   Copyright (C) 2011 Neal H. Walfield <neal@walfield.org>
+
+   Woodchuck is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3, or (at
+   your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "config.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "stats.h"
+#include "debug.h"
+#include "util.h"
+
+int stats_slow_threshold = 100;
+
+/* Latencies are stored in a histogram with logarithmic buckets: the
+   values 0-3 have their own bucket, after which each power of two is
+   divided into STATS_SUB_BUCKETS linear buckets.  This bounds the
+   relative error of a percentile to 25% and covers up to 2^40 us
+   (about 12 days).  */
+#define STATS_SUB_BUCKETS 4
+#define STATS_BUCKETS (40 * STATS_SUB_BUCKETS)
+
+struct histogram
+{
+  enum stats_kind kind;
+  char *name;
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint32_t buckets[STATS_BUCKETS];
+};
+
+/* The number of slow operations to remember.  */
+#define STATS_SLOW_CALLS 32
+
+struct slow_call
+{
+  enum stats_kind kind;
+  char *name;
+  uint64_t time;
+  uint64_t duration;
+  char *args;
+};
+
+/* Statistics are recorded by the main thread and by the scheduler
+   thread.  */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Map from names to struct histogram *, one per kind.  */
+static GHashTable *histograms[STATS_KINDS];
+
+static struct slow_call slow_calls[STATS_SLOW_CALLS];
+/* The index of the next slot to use.  */
+static int slow_calls_next;
+
+const char *
+stats_kind_string (enum stats_kind kind)
+{
+  switch (kind)
+    {
+    case STATS_METHOD:
+      return "method";
+    case STATS_SQL:
+      return "sql";
+    case STATS_UPCALL:
+      return "upcall";
+    case STATS_MAIN_LOOP:
+      return "main-loop";
+    case STATS_SCHEDULER:
+      return "scheduler";
+    default:
+      return "unknown";
+    }
+}
+
+static int
+bucket_of (uint64_t value)
+{
+  if (value < STATS_SUB_BUCKETS)
+    return value;
+
+  int msb = 63 - __builtin_clzll (value);
+  int sub = (value >> (msb - 2)) & (STATS_SUB_BUCKETS - 1);
+  int bucket = (msb - 1) * STATS_SUB_BUCKETS + sub;
+  if (bucket >= STATS_BUCKETS)
+    bucket = STATS_BUCKETS - 1;
+  return bucket;
+}
+
+/* The smallest value that falls in bucket BUCKET.  */
+static uint64_t
+bucket_floor (int bucket)
+{
+  if (bucket < STATS_SUB_BUCKETS)
+    return bucket;
+
+  int msb = bucket / STATS_SUB_BUCKETS + 1;
+  int sub = bucket % STATS_SUB_BUCKETS;
+  return (uint64_t) (STATS_SUB_BUCKETS + sub) << (msb - 2);
+}
+
+/* Return the value below which FRACTION (in percent) of the samples
+   fall.  We return the upper edge of the bucket, but never more than
+   the maximum observed value.  */
+static uint64_t
+percentile (struct histogram *h, int fraction)
+{
+  if (h->count == 0)
+    return 0;
+
+  uint64_t target = (h->count * fraction + 99) / 100;
+  uint64_t seen = 0;
+  int i;
+  for (i = 0; i < STATS_BUCKETS; i ++)
+    {
+      seen += h->buckets[i];
+      if (seen >= target)
+	break;
+    }
+
+  if (i >= STATS_BUCKETS - 1)
+    return h->max;
+  return MIN (bucket_floor (i + 1) - 1, h->max);
+}
+
+/* Called with LOCK held.  */
+static struct histogram *
+histogram_lookup (enum stats_kind kind, const char *name)
+{
+  if (! histograms[kind])
+    histograms[kind] = g_hash_table_new (g_str_hash, g_str_equal);
+
+  struct histogram *h = g_hash_table_lookup (histograms[kind], name);
+  if (! h)
+    {
+      h = g_malloc0 (sizeof (*h));
+      h->kind = kind;
+      h->name = g_strdup (name);
+      g_hash_table_insert (histograms[kind], h->name, h);
+    }
+
+  return h;
+}
+
+/* Add a sample.  Returns whether the operation was slow.  Called
+   with LOCK held.  */
+static bool
+record (enum stats_kind kind, const char *name, uint64_t duration)
+{
+  struct histogram *h = histogram_lookup (kind, name);
+  h->count ++;
+  h->total += duration;
+  if (duration > h->max)
+    h->max = duration;
+  h->buckets[bucket_of (duration)] ++;
+
+  return duration > (uint64_t) stats_slow_threshold * 1000;
+}
+
+/* Remember a slow call and log it.  Takes ownership of ARGS.  Called
+   with LOCK held.  */
+static void
+slow_call_add (enum stats_kind kind, const char *name, uint64_t duration,
+	       char *args)
+{
+  struct slow_call *c = &slow_calls[slow_calls_next];
+  slow_calls_next = (slow_calls_next + 1) % STATS_SLOW_CALLS;
+
+  g_free (c->name);
+  g_free (c->args);
+
+  c->kind = kind;
+  c->name = g_strdup (name);
+  c->time = now ();
+  c->duration = duration;
+  c->args = args;
+
+  debug (1, "Slow %s: %s took "TIME_FMT": %s",
+	 stats_kind_string (kind), name, TIME_PRINTF (duration / 1000),
+	 args ?: "");
+}
+
+uint64_t
+stats_record (enum stats_kind kind, const char *name,
+	      uint64_t start, char *(*describe) (void))
+{
+  uint64_t duration = stats_start () - start;
+
+  pthread_mutex_lock (&lock);
+  bool slow = record (kind, name, duration);
+  pthread_mutex_unlock (&lock);
+
+  if (slow)
+    {
+      /* Don't call DESCRIBE with the lock held: it might execute
+	 some SQL.  */
+      char *args = describe ? describe () : NULL;
+
+      pthread_mutex_lock (&lock);
+      slow_call_add (kind, name, duration, args);
+      pthread_mutex_unlock (&lock);
+    }
+
+  return duration;
+}
+
+void
+stats_record_duration (enum stats_kind kind, const char *name,
+		       uint64_t duration, const char *args)
+{
+  pthread_mutex_lock (&lock);
+  if (record (kind, name, duration))
+    slow_call_add (kind, name, duration, g_strdup (args));
+  pthread_mutex_unlock (&lock);
+}
+
+/* Replace the literals in SQL with '?' and collapse white space so
+   that invocations of the same statement with different arguments
+   share a histogram.  The result is truncated to LEN - 1 bytes.  */
+static void
+sql_template (const char *sql, char *buffer, int len)
+{
+  char *p = buffer;
+  char *end = buffer + len - 1;
+  bool space = false;
+
+  while (*sql && p < end)
+    {
+      if (*sql == '\'')
+	/* A string: skip to the closing quote (a quote is escaped by
+	   doubling it).  */
+	{
+	  sql ++;
+	  while (*sql)
+	    {
+	      if (*sql == '\'' && sql[1] != '\'')
+		break;
+	      if (*sql == '\'')
+		sql ++;
+	      sql ++;
+	    }
+	  if (*sql)
+	    sql ++;
+	  *p ++ = '?';
+	}
+      else if (isdigit (*sql)
+	       && (p == buffer
+		   || ! (isalnum (p[-1]) || p[-1] == '_')))
+	/* A number (but not a digit in an identifier).  */
+	{
+	  while (isalnum (*sql) || *sql == '.')
+	    sql ++;
+	  *p ++ = '?';
+	}
+      else if (isspace (*sql))
+	{
+	  if (! space && p != buffer)
+	    *p ++ = ' ';
+	  space = true;
+	  sql ++;
+	  continue;
+	}
+      else
+	*p ++ = *sql ++;
+
+      space = false;
+    }
+
+  *p = 0;
+}
+
+static void
+sqlite_profile_callback (void *cookie, const char *sql, sqlite3_uint64 ns)
+{
+  char name[256];
+  sql_template (sql, name, sizeof (name));
+
+  stats_record_duration (STATS_SQL, name, ns / 1000, sql);
+}
+
+void
+stats_sqlite_profile (sqlite3 *db)
+{
+  sqlite3_profile (db, sqlite_profile_callback, NULL);
+}
+
+/* How often to check whether the main loop is responsive (in ms).  */
+#define HEARTBEAT_PERIOD 1000
+
+static gboolean
+heartbeat (gpointer user_data)
+{
+  static uint64_t last;
+
+  uint64_t n = stats_start ();
+  if (last)
+    {
+      int64_t lag = (int64_t) (n - last) - HEARTBEAT_PERIOD * 1000;
+      if (lag < 0)
+	lag = 0;
+
+      stats_record_duration (STATS_MAIN_LOOP, "heartbeat", lag,
+			     "main loop stalled");
+    }
+  last = n;
+
+  return TRUE;
+}
+
+void
+stats_init (void)
+{
+  g_timeout_add (HEARTBEAT_PERIOD, heartbeat, NULL);
+}
+
+void
+stats_foreach (void (*cb) (const struct stats_summary *s))
+{
+  pthread_mutex_lock (&lock);
+
+  int kind;
+  for (kind = 0; kind < STATS_KINDS; kind ++)
+    {
+      if (! histograms[kind])
+	continue;
+
+      void iter (gpointer key, gpointer value, gpointer user_data)
+      {
+	struct histogram *h = value;
+
+	struct stats_summary s;
+	s.kind = h->kind;
+	s.name = h->name;
+	s.count = h->count;
+	s.total = h->total;
+	s.p50 = percentile (h, 50);
+	s.p95 = percentile (h, 95);
+	s.p99 = percentile (h, 99);
+	s.max = h->max;
+
+	cb (&s);
+      }
+      g_hash_table_foreach (histograms[kind], iter, NULL);
+    }
+
+  pthread_mutex_unlock (&lock);
+}
+
+void
+stats_slow_calls_foreach (void (*cb) (const struct stats_slow_call *c))
+{
+  pthread_mutex_lock (&lock);
+
+  int i;
+  for (i = 0; i < STATS_SLOW_CALLS; i ++)
+    {
+      struct slow_call *c
+	= &slow_calls[(slow_calls_next + i) % STATS_SLOW_CALLS];
+      if (! c->name)
+	continue;
+
+      struct stats_slow_call s;
+      s.kind = c->kind;
+      s.name = c->name;
+      s.time = c->time;
+      s.duration = c->duration;
+      s.args = c->args ?: "";
+
+      cb (&s);
+    }
+
+  pthread_mutex_unlock (&lock);
+}
+
+void
+stats_reset (void)
+{
+  pthread_mutex_lock (&lock);
+
+  int kind;
+  for (kind = 0; kind < STATS_KINDS; kind ++)
+    {
+      if (! histograms[kind])
+	continue;
+
+      void iter (gpointer key, gpointer value, gpointer user_data)
+      {
+	struct histogram *h = value;
+	g_free (h->name);
+	g_free (h);
+      }
+      g_hash_table_foreach (histograms[kind], iter, NULL);
+      g_hash_table_destroy (histograms[kind]);
+      histograms[kind] = NULL;
+    }
+
+  int i;
+  for (i = 0; i < STATS_SLOW_CALLS; i ++)
+    {
+      g_free (slow_calls[i].name);
+      g_free (slow_calls[i].args);
+      memset (&slow_calls[i], 0, sizeof (slow_calls[i]));
+    }
+  slow_calls_next = 0;
+
+  pthread_mutex_unlock (&lock);
+}
@@ -0,0 +1,116 @@
+/* stats.h - Latency statistics.
+   Copyright (C) 2011 Neal H. Walfield <neal@walfield.org>
+
+   Woodchuck is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3, or (at
+   your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sqlite3.h>
+
+/* The kinds of operations that we time.  */
+enum stats_kind
+  {
+    /* A DBus method invocation.  The name is INTERFACE.METHOD.  */
+    STATS_METHOD = 0,
+    /* An SQL statement.  The name is the statement with any literals
+       replaced by '?'.  */
+    STATS_SQL,
+    /* An upcall.  The name is the upcall's name.  */
+    STATS_UPCALL,
+    /* The main loop's lag, i.e., how late a periodic timer fires.  */
+    STATS_MAIN_LOOP,
+    /* A scheduler pass.  */
+    STATS_SCHEDULER,
+
+    STATS_KINDS
+  };
+
+/* Returns a string describing KIND.  */
+extern const char *stats_kind_string (enum stats_kind kind);
+
+/* Start monitoring the main loop for stalls.  */
+extern void stats_init (void);
+
+/* Operations that take longer than this number of milliseconds are
+   logged.  Defaults to 100.  */
+extern int stats_slow_threshold;
+
+/* Return a monotonic time stamp with microsecond resolution.  Pass
+   this to stats_record when the operation completes.  */
+static inline uint64_t
+stats_start (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Record that the operation NAME of kind KIND, which started at
+   START (as returned by stats_start), has completed.  If it took
+   longer than STATS_SLOW_THRESHOLD, DESCRIBE is called to obtain a
+   description of the operation's arguments, which is logged.
+   DESCRIBE may be NULL.  The returned string must be allocated using
+   g_malloc.  Returns the operation's duration in microseconds.  */
+extern uint64_t stats_record (enum stats_kind kind, const char *name,
+			      uint64_t start, char *(*describe) (void));
+
+/* Like stats_record, but the duration (in microseconds) is passed
+   explicitly and ARGS describes the operation's arguments.  */
+extern void stats_record_duration (enum stats_kind kind, const char *name,
+				   uint64_t duration, const char *args);
+
+/* Time every statement executed on DB.  */
+extern void stats_sqlite_profile (sqlite3 *db);
+
+struct stats_summary
+{
+  enum stats_kind kind;
+  const char *name;
+  uint64_t count;
+  /* All times are in microseconds.  */
+  uint64_t total;
+  uint64_t p50;
+  uint64_t p95;
+  uint64_t p99;
+  uint64_t max;
+};
+
+/* Call CB for each operation that has been recorded.  */
+extern void stats_foreach (void (*cb) (const struct stats_summary *s));
+
+struct stats_slow_call
+{
+  enum stats_kind kind;
+  const char *name;
+  /* When the operation completed (ms since the epoch).  */
+  uint64_t time;
+  /* In microseconds.  */
+  uint64_t duration;
+  const char *args;
+};
+
+/* Call CB for each of the most recent slow operations, oldest
+   first.  */
+extern void stats_slow_calls_foreach
+  (void (*cb) (const struct stats_slow_call *c));
+
+/* Clear all statistics.  */
+extern void stats_reset (void);
+
+#endif
@@ -72,6 +72,17 @@ now_tm (void)
   return tm;
 }
 
+/* Return the local time corresponding to MS, a time as returned by
+   now.  */
+static inline struct tm
+ms_tm (uint64_t ms)
+{
+  time_t t = ms / 1000;
+  struct tm tm;
+  localtime_r (&t, &tm);
+  return tm;
+}
+
 
 
 #define TIME_FMT "%"PRId64" %s"
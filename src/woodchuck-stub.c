@@ -0,0 +1,504 @@
+/* woodchuck-stub.c - A synthetic woodchuck client.
+   Copyright (C) 2011 Neal H. Walfield <neal@walfield.org>
+
+   Woodchuck is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 3, or (at
+   your option) any later version.
+
+   Woodchuck is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* This program registers a synthetic catalog (a manager with a number
+   of streams, each with a number of objects) and implements
+   org.woodchuck.upcall.  StreamUpdate and ObjectTransfer upcalls are
+   answered after a programmable delay and fail at a programmable rate;
+   the result is reported back to the server.  Nothing is transferred.
+   When the program exits, it prints statistics about the upcalls it
+   received as a JSON object: the upcall throughput, how fairly the
+   upcalls were distributed among the streams and objects, and how long
+   the server waited before retrying an item whose transfer failed.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <error.h>
+#include <limits.h>
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include "woodchuck/gwoodchuck.h"
+#include "util.h"
+
+static GWoodchuck *wc;
+static GMainLoop *loop;
+static GRand *rng;
+
+/* Configuration.  */
+static const char *service_name = "org.woodchuck.stub";
+static int streams = 8;
+static int objects = 32;
+static uint32_t freshness = GWOODCHUCK_STREAM_UPDATE_HOURLY;
+/* In milliseconds.  */
+static int update_latency = 100;
+static int transfer_latency = 500;
+/* The latency is uniformly distributed in [LATENCY - JITTER, LATENCY
+   + JITTER] (in percent of LATENCY).  */
+static int jitter = 50;
+/* In percent.  */
+static int update_failure_rate = 0;
+static int transfer_failure_rate = 0;
+
+/* The state of a stream or an object.  */
+struct item
+{
+  /* Number of upcalls received for this item.  */
+  int upcalls;
+  /* Number of upcalls that arrived while a previous one was still
+     being processed.  */
+  int duplicates;
+  bool in_progress;
+  /* When we last reported a failure (ms since the epoch), 0 if the
+     last report was a success.  */
+  uint64_t failed_at;
+};
+
+/* Map from "STREAM" and "STREAM/OBJECT" to struct item *.  */
+static GHashTable *items;
+
+/* Statistics.  */
+static uint64_t start_time;
+static uint64_t first_upcall;
+static uint64_t last_upcall;
+static int stream_updates;
+static int object_transfers;
+static int failures_reported;
+static int report_errors;
+/* The time between reporting a failure and the next upcall for the
+   same item (in ms).  */
+static GArray *retry_delays;
+
+static struct item *
+item_lookup (const char *stream, const char *object)
+{
+  char *key = object ? g_strdup_printf ("%s/%s", stream, object)
+    : g_strdup (stream);
+
+  struct item *item = g_hash_table_lookup (items, key);
+  if (! item)
+    {
+      item = g_malloc0 (sizeof (*item));
+      g_hash_table_insert (items, key, item);
+    }
+  else
+    g_free (key);
+
+  return item;
+}
+
+/* An upcall for ITEM arrived.  */
+static void
+item_upcall (struct item *item)
+{
+  uint64_t n = now ();
+  if (! first_upcall)
+    first_upcall = n;
+  last_upcall = n;
+
+  item->upcalls ++;
+  if (item->in_progress)
+    item->duplicates ++;
+  item->in_progress = true;
+
+  if (item->failed_at)
+    {
+      uint64_t delay = n - item->failed_at;
+      g_array_append_val (retry_delays, delay);
+      item->failed_at = 0;
+    }
+}
+
+static int
+latency (int base)
+{
+  int j = base * jitter / 100;
+  if (j == 0)
+    return base;
+  return MAX (0, base + g_rand_int_range (rng, -j, j + 1));
+}
+
+struct pending
+{
+  char *stream;
+  char *object;
+  struct item *item;
+  uint64_t start;
+  bool fail;
+};
+
+static gboolean
+complete (gpointer user_data)
+{
+  struct pending *p = user_data;
+  GError *gerror = NULL;
+  gboolean ok;
+
+  uint32_t duration = (now () - p->start) / 1000;
+
+  if (! p->object)
+    {
+      if (p->fail)
+	ok = gwoodchuck_stream_update_failed
+	  (wc, p->stream, WOODCHUCK_TRANSFER_TRANSIENT_NETWORK, 0, &gerror);
+      else
+	ok = gwoodchuck_stream_updated (wc, p->stream, 10 * 1024, duration,
+					0, 0, 0, &gerror);
+    }
+  else
+    {
+      if (p->fail)
+	ok = gwoodchuck_object_transfer_failed
+	  (wc, p->stream, p->object,
+	   WOODCHUCK_TRANSFER_TRANSIENT_NETWORK, 0, &gerror);
+      else
+	/* The file does not exist.  Mark it as precious so that the
+	   server never tries to delete it.  */
+	ok = gwoodchuck_object_transferred
+	  (wc, p->stream, p->object, 0, 100 * 1024, duration,
+	   "/dev/null", WOODCHUCK_DELETION_POLICY_PRECIOUS, &gerror);
+    }
+
+  if (! ok)
+    {
+      report_errors ++;
+      fprintf (stderr, "Reporting status of %s%s%s: %s\n",
+	       p->stream, p->object ? "/" : "", p->object ?: "",
+	       gerror->message);
+      g_error_free (gerror);
+    }
+
+  p->item->in_progress = false;
+  if (p->fail)
+    {
+      p->item->failed_at = now ();
+      failures_reported ++;
+    }
+
+  g_free (p->stream);
+  g_free (p->object);
+  g_free (p);
+
+  return FALSE;
+}
+
+static void
+pending_add (const char *stream, const char *object, struct item *item,
+	     int base_latency, int failure_rate)
+{
+  struct pending *p = g_malloc (sizeof (*p));
+  p->stream = g_strdup (stream);
+  p->object = object ? g_strdup (object) : NULL;
+  p->item = item;
+  p->start = now ();
+  p->fail = g_rand_int_range (rng, 0, 100) < failure_rate;
+
+  g_timeout_add (latency (base_latency), complete, p);
+}
+
+static uint32_t
+stream_update (const char *stream, gpointer user_data)
+{
+  stream_updates ++;
+
+  struct item *item = item_lookup (stream, NULL);
+  item_upcall (item);
+  pending_add (stream, NULL, item, update_latency, update_failure_rate);
+
+  return 0;
+}
+
+static uint32_t
+object_transfer (const char *stream, const char *object,
+		 uint32_t quality, gpointer user_data)
+{
+  object_transfers ++;
+
+  struct item *item = item_lookup (stream, object);
+  item_upcall (item);
+  pending_add (stream, object, item, transfer_latency,
+	       transfer_failure_rate);
+
+  return 0;
+}
+
+static int64_t
+object_delete (const char *stream, const char *object,
+	       const char *filenames[], gpointer user_data)
+{
+  /* Refuse: we don't have any files.  Ask again in a day.  */
+  return 24 * 60 * 60;
+}
+
+static struct gwoodchuck_vtable vtable =
+  {
+    .stream_update = stream_update,
+    .object_transfer = object_transfer,
+    .object_delete = object_delete,
+  };
+
+/* Ask the server to run the scheduler.  */
+static gboolean
+force_schedule (gpointer user_data)
+{
+  DBusConnection *connection = user_data;
+
+  DBusMessage *message
+    = dbus_message_new_method_call ("org.woodchuck", "/org/woodchuck",
+				    "org.woodchuck.stats", "Schedule");
+  /* We don't care about the reply: if the scheduler is busy, we try
+     again later.  */
+  dbus_message_set_no_reply (message, TRUE);
+  dbus_connection_send (connection, message, NULL);
+  dbus_message_unref (message);
+
+  return TRUE;
+}
+
+static gboolean
+quit (gpointer user_data)
+{
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+static int
+uint64_cmp (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Print the statistics about the items whose key does (OBJECTS is
+   true) or does not (OBJECTS is false) contain a '/'.  */
+static void
+report_items (const char *name, bool objects)
+{
+  int count = 0;
+  int min = INT_MAX;
+  int max = 0;
+  int duplicates = 0;
+  double sum = 0;
+  double sum_squares = 0;
+
+  void iter (gpointer key, gpointer value, gpointer user_data)
+  {
+    if ((strchr (key, '/') != NULL) != objects)
+      return;
+
+    struct item *item = value;
+    count ++;
+    min = MIN (min, item->upcalls);
+    max = MAX (max, item->upcalls);
+    duplicates += item->duplicates;
+    sum += item->upcalls;
+    sum_squares += (double) item->upcalls * item->upcalls;
+  }
+  g_hash_table_foreach (items, iter, NULL);
+
+  /* Jain's fairness index: 1 if all items received the same number of
+     upcalls, 1/COUNT if one item received all of them.  */
+  double fairness = sum_squares ? (sum * sum) / (count * sum_squares) : 0;
+
+  printf ("  \"%s\": { \"items\": %d, \"min_upcalls\": %d, "
+	  "\"max_upcalls\": %d, \"mean_upcalls\": %.2f, "
+	  "\"duplicates\": %d, \"fairness\": %.3f },\n",
+	  name, count, count ? min : 0, max, count ? sum / count : 0.0,
+	  duplicates, fairness);
+}
+
+static void
+usage (const char *program, int status)
+{
+  fprintf (status ? stderr : stdout,
+	   "Usage: %s [OPTION]...\n"
+	   "A synthetic woodchuck client for testing the scheduler.\n"
+	   "\n"
+	   "  --name=SERVICE              DBus service name "
+	   "(default: org.woodchuck.stub)\n"
+	   "  --streams=M                 Number of streams (default: 8)\n"
+	   "  --objects=K                 Objects per stream (default: 32)\n"
+	   "  --freshness=S               Stream freshness in seconds "
+	   "(default: 3600)\n"
+	   "  --update-latency=MS         Time to update a stream "
+	   "(default: 100)\n"
+	   "  --transfer-latency=MS       Time to transfer an object "
+	   "(default: 500)\n"
+	   "  --jitter=PERCENT            Latency variation (default: 50)\n"
+	   "  --update-failure-rate=PERCENT\n"
+	   "  --transfer-failure-rate=PERCENT\n"
+	   "                              Percentage of upcalls that fail "
+	   "(default: 0)\n"
+	   "  --schedule-interval=S       Force a scheduler pass every S "
+	   "seconds\n"
+	   "                              (default: 0, never)\n"
+	   "  --duration=S                Exit after S seconds "
+	   "(default: 60)\n",
+	   program);
+  exit (status);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int schedule_interval = 0;
+  int duration = 60;
+
+  int i;
+  for (i = 1; i < argc; i ++)
+    if (strncmp (argv[i], "--name=", 7) == 0)
+      service_name = &argv[i][7];
+    else if (strncmp (argv[i], "--streams=", 10) == 0)
+      streams = atoi (&argv[i][10]);
+    else if (strncmp (argv[i], "--objects=", 10) == 0)
+      objects = atoi (&argv[i][10]);
+    else if (strncmp (argv[i], "--freshness=", 12) == 0)
+      freshness = atoi (&argv[i][12]);
+    else if (strncmp (argv[i], "--update-latency=", 17) == 0)
+      update_latency = atoi (&argv[i][17]);
+    else if (strncmp (argv[i], "--transfer-latency=", 19) == 0)
+      transfer_latency = atoi (&argv[i][19]);
+    else if (strncmp (argv[i], "--jitter=", 9) == 0)
+      jitter = atoi (&argv[i][9]);
+    else if (strncmp (argv[i], "--update-failure-rate=", 22) == 0)
+      update_failure_rate = atoi (&argv[i][22]);
+    else if (strncmp (argv[i], "--transfer-failure-rate=", 24) == 0)
+      transfer_failure_rate = atoi (&argv[i][24]);
+    else if (strncmp (argv[i], "--schedule-interval=", 20) == 0)
+      schedule_interval = atoi (&argv[i][20]);
+    else if (strncmp (argv[i], "--duration=", 11) == 0)
+      duration = atoi (&argv[i][11]);
+    else if (strcmp (argv[i], "--help") == 0)
+      usage (argv[0], 0);
+    else
+      {
+	fprintf (stderr, "Unknown option: '%s'\n", argv[i]);
+	usage (argv[0], 1);
+      }
+
+  g_type_init ();
+
+  loop = g_main_loop_new (NULL, FALSE);
+  rng = g_rand_new ();
+  items = g_hash_table_new (g_str_hash, g_str_equal);
+  retry_delays = g_array_new (FALSE, FALSE, sizeof (uint64_t));
+
+  GError *gerror = NULL;
+  DBusGConnection *session_bus = dbus_g_bus_get (DBUS_BUS_SESSION, &gerror);
+  if (! session_bus)
+    error (1, 0, "Connecting to the session bus: %s", gerror->message);
+  DBusConnection *connection = dbus_g_connection_get_connection (session_bus);
+
+  /* Upcalls are sent to the manager's DBusServiceName.  */
+  DBusError dbus_error;
+  dbus_error_init (&dbus_error);
+  if (dbus_bus_request_name (connection, service_name,
+			     DBUS_NAME_FLAG_DO_NOT_QUEUE, &dbus_error)
+      != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    error (1, 0, "Acquiring %s: %s", service_name,
+	   dbus_error_is_set (&dbus_error) ? dbus_error.message : "in use");
+
+  char *name = g_strdup_printf ("Stub client %s", service_name);
+  wc = gwoodchuck_new (name, service_name, &vtable, NULL, &gerror);
+  g_free (name);
+  if (! wc)
+    error (1, 0, "gwoodchuck_new: %s", gerror->message);
+
+  /* Register the catalog.  */
+  int s;
+  for (s = 0; s < streams; s ++)
+    {
+      char stream[32];
+      snprintf (stream, sizeof (stream), "stream-%d", s);
+
+      if (! gwoodchuck_stream_register (wc, stream, stream, freshness,
+					&gerror))
+	{
+	  if (gerror->code != WOODCHUCK_ERROR_OBJECT_EXISTS)
+	    error (1, 0, "Registering %s: %s", stream, gerror->message);
+	  g_error_free (gerror);
+	  gerror = NULL;
+	}
+
+      int o;
+      for (o = 0; o < objects; o ++)
+	{
+	  char object[32];
+	  snprintf (object, sizeof (object), "object-%d", o);
+
+	  if (! gwoodchuck_object_register (wc, stream, object, object,
+					    100 * 1024, 0, 100 * 1024, 0,
+					    &gerror))
+	    {
+	      if (gerror->code != WOODCHUCK_ERROR_OBJECT_EXISTS)
+		error (1, 0, "Registering %s/%s: %s",
+		       stream, object, gerror->message);
+	      g_error_free (gerror);
+	      gerror = NULL;
+	    }
+	}
+    }
+
+  if (schedule_interval > 0)
+    {
+      force_schedule (connection);
+      g_timeout_add_seconds (schedule_interval, force_schedule, connection);
+    }
+  g_timeout_add_seconds (duration, quit, NULL);
+
+  start_time = now ();
+  g_main_loop_run (loop);
+  uint64_t elapsed = now () - start_time;
+
+  /* Report.  */
+  int upcalls = stream_updates + object_transfers;
+  uint64_t upcall_span = last_upcall - first_upcall;
+
+  printf ("{\n"
+	  "  \"service\": \"%s\", \"streams\": %d, \"objects\": %d,\n"
+	  "  \"elapsed_ms\": %"PRIu64",\n"
+	  "  \"stream_updates\": %d, \"object_transfers\": %d,\n"
+	  "  \"failures_reported\": %d, \"report_errors\": %d,\n"
+	  "  \"first_upcall_ms\": %"PRId64",\n"
+	  "  \"upcalls_per_sec\": %.2f,\n",
+	  service_name, streams, objects, elapsed,
+	  stream_updates, object_transfers, failures_reported, report_errors,
+	  first_upcall ? (int64_t) (first_upcall - start_time) : -1,
+	  upcall_span ? (double) upcalls * 1000 / upcall_span : 0.0);
+
+  report_items ("stream_fairness", false);
+  report_items ("object_fairness", true);
+
+  uint64_t *v = (uint64_t *) retry_delays->data;
+  int len = retry_delays->len;
+  qsort (v, len, sizeof (uint64_t), uint64_cmp);
+#define P(p) (len ? v[MIN (len - 1, (len * (p)) / 100)] : 0)
+  printf ("  \"retry_delay_ms\": { \"count\": %d, \"min\": %"PRIu64", "
+	  "\"p50\": %"PRIu64", \"p95\": %"PRIu64", \"max\": %"PRIu64" }\n"
+	  "}\n",
+	  len, P (0), P (50), P (95), len ? v[len - 1] : 0);
+#undef P
+
+  return 0;
+}